@@ -0,0 +1,93 @@
+#include "AdaptiveKeepAlive.h"
+#include <Preferences.h>
+
+// NVS keys are limited to 15 characters: store under a hash of the identity
+void AdaptiveKeepAlive::begin(const char* identity) {
+  uint32_t hash = 2166136261UL;
+  for (const char* c = identity; *c; c++) {
+    hash = (hash ^ (uint8_t)*c) * 16777619UL;
+  }
+  snprintf(key, sizeof(key), "s%08lx", (unsigned long)hash);
+
+  lower = KEEP_ALIVE_MIN_INTERVAL;
+  upper = KEEP_ALIVE_MAX_INTERVAL;
+
+  Preferences prefs;
+  SavedBounds saved;
+  if (prefs.begin(KEEP_ALIVE_NAMESPACE, true)) {
+    if (prefs.getBytes(key, &saved, sizeof(saved)) == sizeof(saved) &&
+        saved.lower >= KEEP_ALIVE_MIN_INTERVAL && saved.lower < saved.upper &&
+        saved.upper <= KEEP_ALIVE_MAX_INTERVAL) {
+      lower = saved.lower;
+      upper = saved.upper;
+    }
+    prefs.end();
+  }
+  brokerKeepAlive();
+
+  Serial.printf("Keep-alive for %s: idle %u..%u s, pinging after %u s\n",
+                identity, lower, upper, interval());
+}
+
+uint16_t AdaptiveKeepAlive::brokerKeepAlive() {
+  announced = min(2UL * upper, 65535UL);
+  return announced;
+}
+
+uint16_t AdaptiveKeepAlive::interval() const {
+  uint16_t probe = (lower + upper) / 2;
+  if (settled()) {
+    probe = max((uint16_t)KEEP_ALIVE_MIN_INTERVAL, (uint16_t)(lower - lower * KEEP_ALIVE_MARGIN / 100));
+  }
+
+  // MqttSim800 pings at three quarters of the announced keep-alive whatever this says
+  return min((unsigned long)probe, announced * 3UL / 4);
+}
+
+void AdaptiveKeepAlive::onPingAnswered(uint32_t idle_s) {
+  if (idle_s <= lower) {
+    return;
+  }
+
+  // Survived past the upper bound: that loss was not the NAT, search upwards again
+  if (idle_s >= upper) {
+    upper = KEEP_ALIVE_MAX_INTERVAL;
+  }
+  lower = min(idle_s, (uint32_t)upper - 1);
+
+  save();
+  report("answered", idle_s);
+}
+
+void AdaptiveKeepAlive::onConnectionLost(uint32_t idle_s) {
+  // Too short to be the NAT, or no tighter than what is already known
+  if (idle_s < KEEP_ALIVE_MIN_INTERVAL || idle_s >= upper) {
+    return;
+  }
+
+  if (idle_s <= lower) {
+    // An idle found safe before no longer is: the carrier changed its timeout
+    restart_count++;
+    lower = KEEP_ALIVE_MIN_INTERVAL;
+  }
+  upper = max(idle_s, (uint32_t)lower + 1);
+
+  save();
+  report("lost", idle_s);
+}
+
+void AdaptiveKeepAlive::save() {
+  Preferences prefs;
+  if (!prefs.begin(KEEP_ALIVE_NAMESPACE, false)) {
+    return;
+  }
+  SavedBounds saved = {lower, upper};
+  prefs.putBytes(key, &saved, sizeof(saved));
+  prefs.end();
+}
+
+void AdaptiveKeepAlive::report(const char* event, uint32_t idle_s) {
+  Serial.printf("Keep-alive: %s after %lu s idle, bounds %u..%u s, %s %u s\n",
+                event, (unsigned long)idle_s, lower, upper,
+                settled() ? "settled at" : "next probe", interval());
+}
@@ -0,0 +1,67 @@
+#ifndef ADAPTIVE_KEEP_ALIVE_H
+#define ADAPTIVE_KEEP_ALIVE_H
+
+#include <Arduino.h>
+
+#define KEEP_ALIVE_MIN_INTERVAL   45     // s; what a 60 s keep-alive pinged at before
+#define KEEP_ALIVE_MAX_INTERVAL   1800   // s; longest idle ever tried
+#define KEEP_ALIVE_RESOLUTION     30     // s; the search stops once the bounds are this close
+#define KEEP_ALIVE_MARGIN         10     // % taken off the longest idle that survived
+#define KEEP_ALIVE_NAMESPACE      "keepalive"
+
+// Finds how long the carrier lets a TCP connection idle before its NAT binding
+// expires, and pings just inside that.
+//
+// The search is a bisection between the longest idle a ping survived (lower) and
+// the shortest idle after which the session was lost (upper): the next ping goes
+// out half way between them, and its outcome moves one of the bounds. Once they
+// are KEEP_ALIVE_RESOLUTION apart the interval settles a margin below lower.
+// Both bounds are kept in NVS under a key derived from the SIM and operator, so a
+// reboot resumes the search, and a different SIM or network starts its own.
+//
+// A session lost after an idle the search had already found safe means the
+// carrier changed its timeout: the search starts over below that idle. Only a
+// probe ping left unanswered counts as a loss; a broker restart, a closed socket
+// or lost coverage says nothing about the NAT and must not be reported.
+//
+// Probes stay inside the keep-alive announced in the current CONNECT (the client
+// pings at three quarters of it anyway); a search range raised by an answered
+// ping is probed from the next CONNECT.
+class AdaptiveKeepAlive {
+  public:
+    // Load the bounds saved for this SIM/operator (e.g. ICCID and operator name)
+    void begin(const char* identity);
+
+    // Idle seconds before the next ping: the probe while searching, then the safe value
+    uint16_t interval() const;
+
+    // Keep-alive to announce in CONNECT: twice the upper bound, so the broker never
+    // times the session out ahead of a probe. Remembered as the limit for interval().
+    uint16_t brokerKeepAlive();
+
+    // Outcomes reported by the MQTT client, as idle seconds ahead of the probe ping
+    void onPingAnswered(uint32_t idle_s);
+    void onConnectionLost(uint32_t idle_s);
+
+    bool settled() const { return upper - lower <= KEEP_ALIVE_RESOLUTION; }
+    uint16_t lowerBound() const { return lower; }
+    uint16_t upperBound() const { return upper; }
+    uint32_t restarts() const { return restart_count; }
+
+  private:
+    struct SavedBounds {
+      uint16_t lower;
+      uint16_t upper;
+    };
+
+    char key[16] = "";
+    uint16_t lower = KEEP_ALIVE_MIN_INTERVAL;
+    uint16_t upper = KEEP_ALIVE_MAX_INTERVAL;
+    uint16_t announced = 2 * KEEP_ALIVE_MAX_INTERVAL;   // Keep-alive of the current CONNECT
+    uint32_t restart_count = 0;
+
+    void save();
+    void report(const char* event, uint32_t idle_s);
+};
+
+#endif // ADAPTIVE_KEEP_ALIVE_H
@@ -0,0 +1,371 @@
+#include "CoapTransport.h"
+
+// Header fields
+#define COAP_VERSION        1
+#define COAP_TYPE_CON       0
+#define COAP_TYPE_ACK       2
+#define COAP_TOKEN_LENGTH   2     // The message ID doubles as the token
+
+// Codes
+#define COAP_GET            0x01
+#define COAP_POST           0x02
+#define COAP_VALID          0x43  // 2.03
+#define COAP_CHANGED        0x44  // 2.04
+#define COAP_CONTENT        0x45  // 2.05
+
+// Options
+#define COAP_OPTION_ETAG      4
+#define COAP_OPTION_URI_PATH  11
+#define COAP_OPTION_CONTENT_FORMAT 12
+#define COAP_OPTION_URI_QUERY 15
+#define COAP_OPTION_BLOCK2    23
+
+#define COAP_PAYLOAD_MARKER 0xFF
+#define COAP_FORMAT_JSON    50
+
+CoapTransport::CoapTransport(ModemAT& modem, const char* host, int port, const char* device)
+  : modem(modem), server_host(host), server_port(port), device_id(device), message_id(esp_random()) {
+}
+
+bool CoapTransport::connect() {
+  if (modem.isUDPOpen()) {
+    return true;
+  }
+
+  return modem.udpOpen(server_host, server_port);
+}
+
+// Fixed header and token of a new confirmable GET (verify() makes it a POST)
+size_t CoapTransport::beginRequest() {
+  message_id++;
+  request[0] = (COAP_VERSION << 6) | (COAP_TYPE_CON << 4) | COAP_TOKEN_LENGTH;
+  request[1] = COAP_GET;
+  request[2] = request[4] = message_id >> 8;
+  request[3] = request[5] = message_id & 0xFF;
+  return 4 + COAP_TOKEN_LENGTH;
+}
+
+// Options go out in ascending order, each number as a delta from the previous one.
+// Deltas and lengths above 12 take one extension byte (13 + n), above 268 two.
+size_t CoapTransport::putOption(uint8_t* dest, uint16_t& previous, uint16_t number, const uint8_t* value, size_t length) {
+  uint16_t delta = number - previous;
+  size_t pos = 1;
+
+  auto nibble = [&](uint16_t n) -> uint8_t {
+    if (n < 13) {
+      return n;
+    }
+    if (n < 269) {
+      dest[pos++] = n - 13;
+      return 13;
+    }
+    dest[pos++] = (n - 269) >> 8;
+    dest[pos++] = (n - 269) & 0xFF;
+    return 14;
+  };
+
+  uint8_t delta_nibble = nibble(delta);
+  uint8_t length_nibble = nibble(length);
+  dest[0] = (delta_nibble << 4) | length_nibble;
+  memcpy(dest + pos, value, length);
+
+  previous = number;
+  return pos + length;
+}
+
+void CoapTransport::sampleRtt(unsigned long rtt_ms) {
+  if (!rtt_measured) {
+    srtt_ms = rtt_ms;
+    rttvar_ms = rtt_ms / 2;
+    rtt_measured = true;
+  } else {
+    unsigned long error = srtt_ms > rtt_ms ? srtt_ms - rtt_ms : rtt_ms - srtt_ms;
+    rttvar_ms = (3 * rttvar_ms + error) / 4;
+    srtt_ms = (7 * srtt_ms + rtt_ms) / 8;
+  }
+
+  rto_ms = constrain(srtt_ms + 4 * rttvar_ms, (unsigned long)COAP_TRANSPORT_MIN_RTO, (unsigned long)COAP_TRANSPORT_MAX_RTO);
+}
+
+// Send the request and wait for its ACK, retransmitting with exponential backoff
+bool CoapTransport::exchange(size_t length) {
+  exchange_count++;
+
+  for (int attempt = 0; attempt <= COAP_TRANSPORT_MAX_RETRANSMIT; attempt++) {
+    if (attempt > 0) {
+      retransmit_count++;
+      Serial.printf("CoAP retransmit %d/%d of message %u, RTO %lu ms\n", attempt,
+                    COAP_TRANSPORT_MAX_RETRANSMIT, message_id, rto_ms);
+    }
+
+    unsigned long sent = millis();
+    if (!modem.udpSend(request, length)) {
+      return false;
+    }
+
+    // Late answers to earlier messages are skipped until this attempt times out
+    unsigned long elapsed;
+    while ((elapsed = millis() - sent) < rto_ms) {
+      int received = modem.readDatagram(datagram, sizeof(datagram), rto_ms - elapsed);
+      if (received < 0) {
+        break;
+      }
+      if (parseResponse(received)) {
+        // Karn: an answer to a retransmitted request can't be matched to one send
+        if (attempt == 0) {
+          sampleRtt(millis() - sent);
+        }
+        return true;
+      }
+    }
+
+    // The doubled timer is kept until an exchange succeeds on its first try
+    rto_ms = min(rto_ms * 2, (unsigned long)COAP_TRANSPORT_MAX_RTO);
+  }
+
+  Serial.printf("CoAP message %u unanswered\n", message_id);
+  return false;
+}
+
+// Piggybacked response to the current request: header, then options up to the payload
+bool CoapTransport::parseResponse(size_t length) {
+  if (length < 4 + COAP_TOKEN_LENGTH || (datagram[0] >> 6) != COAP_VERSION ||
+      ((datagram[0] >> 4) & 0x03) != COAP_TYPE_ACK || (datagram[0] & 0x0F) != COAP_TOKEN_LENGTH ||
+      memcmp(datagram + 2, request + 2, 2) != 0 || memcmp(datagram + 4, request + 4, COAP_TOKEN_LENGTH) != 0) {
+    return false;
+  }
+
+  response_code = datagram[1];
+  response_has_block = false;
+  response_block = 0;
+  response_etag = nullptr;
+  response_etag_length = 0;
+  payload = nullptr;
+  payload_length = 0;
+
+  size_t pos = 4 + COAP_TOKEN_LENGTH;
+  uint16_t number = 0;
+  while (pos < length) {
+    if (datagram[pos] == COAP_PAYLOAD_MARKER) {
+      payload = datagram + pos + 1;
+      payload_length = length - pos - 1;
+      break;
+    }
+
+    uint16_t delta = datagram[pos] >> 4;
+    size_t option_length = datagram[pos] & 0x0F;
+    pos++;
+    if (delta == 13) {
+      delta = datagram[pos++] + 13;
+    } else if (delta == 14) {
+      delta = ((datagram[pos] << 8) | datagram[pos + 1]) + 269;
+      pos += 2;
+    }
+    if (option_length == 13) {
+      option_length = datagram[pos++] + 13;
+    } else if (option_length == 14) {
+      option_length = ((datagram[pos] << 8) | datagram[pos + 1]) + 269;
+      pos += 2;
+    }
+    if (pos + option_length > length) {
+      return false;
+    }
+
+    number += delta;
+    if (number == COAP_OPTION_ETAG) {
+      response_etag = datagram + pos;
+      response_etag_length = option_length;
+    } else if (number == COAP_OPTION_BLOCK2) {
+      response_has_block = true;
+      for (size_t i = 0; i < option_length; i++) {
+        response_block = (response_block << 8) | datagram[pos + i];
+      }
+    }
+    pos += option_length;
+  }
+
+  return true;
+}
+
+bool CoapTransport::etagIs(const String& etag) const {
+  return response_etag != nullptr && response_etag_length == etag.length() &&
+         memcmp(response_etag, etag.c_str(), response_etag_length) == 0;
+}
+
+bool CoapTransport::check(const char* current_version, FotaImage& image) {
+  if (!connect()) {
+    return false;
+  }
+
+  size_t pos = beginRequest();
+  uint16_t previous = 0;
+  if (image.token.length() > 0) {
+    pos += putOption(request + pos, previous, COAP_OPTION_ETAG, image.token.c_str());
+  }
+  pos += putOption(request + pos, previous, COAP_OPTION_URI_PATH, "fw");
+  pos += putOption(request + pos, previous, COAP_OPTION_URI_PATH, "check");
+  pos += putOption(request + pos, previous, COAP_OPTION_URI_QUERY, ("d=" + device_id).c_str());
+  pos += putOption(request + pos, previous, COAP_OPTION_URI_QUERY, ("v=" + String(current_version)).c_str());
+
+  bool ok = exchange(pos);
+  close();
+  if (!ok) {
+    return false;
+  }
+
+  // 2.03 Valid: the token we sent is still the current manifest
+  image.unchanged = response_code == COAP_VALID;
+  if (image.unchanged) {
+    return true;
+  }
+
+  if (response_code != COAP_CONTENT) {
+    Serial.printf("Check failed: CoAP %u.%02u\n", response_code >> 5, response_code & 0x1F);
+    return false;
+  }
+
+  DynamicJsonDocument response(1024);
+  DeserializationError error = deserializeJson(response, payload, payload_length);
+  if (error) {
+    Serial.print("JSON parse error: ");
+    Serial.println(error.c_str());
+    return false;
+  }
+
+  image.name = response["name"].as<String>();
+  image.version = response["version"].as<String>();
+  image.size = response["size"].as<size_t>();
+  image.md5 = response["md5"].as<String>();
+  image.sha256 = response["sha256"] | "";
+  image.token = response["token"] | "";
+
+  return true;
+}
+
+bool CoapTransport::open(const FotaImage& image) {
+  // Uri-Path and the query have to fit the request buffer next to the header
+  if (image.name.length() + device_id.length() > COAP_TRANSPORT_REQUEST - 32) {
+    Serial.println("Image name too long for a CoAP request");
+    return false;
+  }
+
+  image_name = image.name;
+  image_etag = image.md5.substring(0, 8);
+  block_szx = COAP_TRANSPORT_BLOCK_SZX;
+  return connect();
+}
+
+bool CoapTransport::requestRange(size_t offset, size_t length) {
+  uint32_t block = ((offset >> (block_szx + 4)) << 4) | block_szx;
+  uint8_t value[3] = { (uint8_t)(block >> 16), (uint8_t)(block >> 8), (uint8_t)block };
+  size_t skip = block > 0xFFFF ? 0 : (block > 0xFF ? 1 : (block > 0 ? 2 : 3));
+
+  size_t pos = beginRequest();
+  uint16_t previous = 0;
+  pos += putOption(request + pos, previous, COAP_OPTION_URI_PATH, "fw");
+  pos += putOption(request + pos, previous, COAP_OPTION_URI_PATH, image_name.c_str());
+  pos += putOption(request + pos, previous, COAP_OPTION_URI_QUERY, ("d=" + device_id).c_str());
+  pos += putOption(request + pos, previous, COAP_OPTION_BLOCK2, value + skip, 3 - skip);
+
+  if (!exchange(pos)) {
+    return false;
+  }
+
+  if (response_code != COAP_CONTENT || !response_has_block) {
+    Serial.printf("Block request failed: CoAP %u.%02u\n", response_code >> 5, response_code & 0x1F);
+    return false;
+  }
+
+  if (!etagIs(image_etag)) {
+    Serial.println("Image changed on the server");
+    return false;
+  }
+
+  // The server may answer with smaller blocks: use its size from now on
+  uint8_t szx = response_block & 0x07;
+  if (szx < block_szx) {
+    Serial.printf("Server block size %u bytes\n", 1 << (szx + 4));
+    block_szx = szx;
+  }
+
+  size_t start = (response_block >> 4) << (szx + 4);
+  if (offset < start || offset - start >= payload_length) {
+    Serial.println("Block offset mismatch");
+    return false;
+  }
+
+  payload += offset - start;
+  payload_length -= offset - start;
+  range_remaining = min(length, payload_length);
+  return true;
+}
+
+int CoapTransport::read(uint8_t* dest, size_t max_length, unsigned long timeout) {
+  if (range_remaining == 0) {
+    return 0;
+  }
+
+  // The whole block arrived in one datagram
+  size_t count = min(max_length, range_remaining);
+  memcpy(dest, payload, count);
+  payload += count;
+  range_remaining -= count;
+  return count;
+}
+
+// Same fields as the TCP and MQTT verify requests
+bool CoapTransport::verify(const FotaImage& image, unsigned long elapsed_ms) {
+  if (!connect()) {
+    return false;
+  }
+
+  DynamicJsonDocument report(256);
+  report["hash"] = image.md5;
+  report["hashType"] = "md5";
+  report["elapsed"] = elapsed_ms;
+  report["bytes"] = image.size;
+
+  size_t pos = beginRequest();
+  request[1] = COAP_POST;
+  uint16_t previous = 0;
+  uint8_t format = COAP_FORMAT_JSON;
+  pos += putOption(request + pos, previous, COAP_OPTION_URI_PATH, "fw");
+  pos += putOption(request + pos, previous, COAP_OPTION_URI_PATH, "verify");
+  pos += putOption(request + pos, previous, COAP_OPTION_CONTENT_FORMAT, &format, 1);
+  pos += putOption(request + pos, previous, COAP_OPTION_URI_QUERY, ("d=" + device_id).c_str());
+
+  if (pos + 1 + measureJson(report) > sizeof(request)) {
+    Serial.println("Verify report too long for a CoAP request");
+    close();
+    return false;
+  }
+  request[pos++] = COAP_PAYLOAD_MARKER;
+  pos += serializeJson(report, (char*)request + pos, sizeof(request) - pos);
+
+  bool ok = exchange(pos);
+  close();
+  if (!ok) {
+    return false;
+  }
+
+  if (response_code != COAP_CHANGED) {
+    Serial.printf("Verify failed: CoAP %u.%02u\n", response_code >> 5, response_code & 0x1F);
+    return false;
+  }
+
+  DynamicJsonDocument response(512);
+  if (deserializeJson(response, payload, payload_length)) {
+    return false;
+  }
+  return response["verified"] | false;
+}
+
+void CoapTransport::close() {
+  range_remaining = 0;
+
+  if (modem.isUDPOpen()) {
+    Serial.printf("CoAP: %lu exchanges, %lu retransmits, SRTT %lu ms, RTO %lu ms\n",
+                  (unsigned long)exchange_count, (unsigned long)retransmit_count, srtt_ms, rto_ms);
+  }
+  modem.udpClose();
+}
@@ -0,0 +1,88 @@
+#ifndef COAP_TRANSPORT_H
+#define COAP_TRANSPORT_H
+
+#include <ArduinoJson.h>
+#include "FotaTransport.h"
+
+#define COAP_TRANSPORT_BLOCK_SZX      6      // Block size asked for: 2^(6+4) = 1024 bytes
+#define COAP_TRANSPORT_DATAGRAM       1152   // Largest block plus header and options
+#define COAP_TRANSPORT_REQUEST        192    // Room for the verify JSON
+#define COAP_TRANSPORT_INITIAL_RTO    2000   // ms, RFC 7252 ACK_TIMEOUT until an RTT is measured
+#define COAP_TRANSPORT_MIN_RTO        500
+#define COAP_TRANSPORT_MAX_RTO        32000
+#define COAP_TRANSPORT_MAX_RETRANSMIT 4
+
+// CoAP (RFC 7252) over a SIM800L UDP socket, downloading with Block2 (RFC 7959)
+// from the server's port 5683:
+//   GET /fw/check?d=<device>&v=<version>  JSON manifest, ETag = manifest token
+//   GET /fw/<name>?d=<device>             one block per request
+//   POST /fw/verify?d=<device>            MD5 of the flashed image, completes the session
+// Every request is confirmable and the response rides on the ACK. The client asks
+// for 1024-byte blocks and adopts a smaller size if the server answers with one.
+// Retransmissions use the measured round trip instead of CoAP's fixed 2-3 s:
+// RTO = SRTT + 4 * RTTVAR (RFC 6298), sampled only from exchanges answered on the
+// first try (Karn), doubled on each retransmission and after a failed exchange.
+class CoapTransport : public FotaTransport {
+  private:
+    ModemAT& modem;
+    const char* server_host;
+    int server_port;
+    String device_id;
+    String image_name;
+    String image_etag;       // First 8 hex digits of the image MD5, as the server tags blocks
+
+    uint8_t request[COAP_TRANSPORT_REQUEST];     // Kept for retransmission
+    uint8_t datagram[COAP_TRANSPORT_DATAGRAM];   // Response; payload points into it
+    uint16_t message_id;
+    uint8_t block_szx = COAP_TRANSPORT_BLOCK_SZX;
+
+    // Response to the last exchange, parsed in place
+    uint8_t response_code = 0;
+    uint32_t response_block = 0;
+    bool response_has_block = false;
+    const uint8_t* response_etag = nullptr;
+    size_t response_etag_length = 0;
+    const uint8_t* payload = nullptr;
+    size_t payload_length = 0;
+    size_t range_remaining = 0;
+
+    // Round-trip estimator (ms)
+    bool rtt_measured = false;
+    unsigned long srtt_ms = 0;
+    unsigned long rttvar_ms = 0;
+    unsigned long rto_ms = COAP_TRANSPORT_INITIAL_RTO;
+
+    uint32_t exchange_count = 0;
+    uint32_t retransmit_count = 0;
+
+    bool connect();
+    size_t beginRequest();
+    static size_t putOption(uint8_t* dest, uint16_t& previous, uint16_t number, const uint8_t* value, size_t length);
+    static size_t putOption(uint8_t* dest, uint16_t& previous, uint16_t number, const char* value) {
+      return putOption(dest, previous, number, (const uint8_t*)value, strlen(value));
+    }
+    bool exchange(size_t length);
+    bool parseResponse(size_t length);
+    void sampleRtt(unsigned long rtt_ms);
+    bool etagIs(const String& etag) const;
+
+  public:
+    CoapTransport(ModemAT& modem, const char* host, int port, const char* device);
+
+    const char* name() const override { return "coap"; }
+    size_t maxRange() const override { return 1 << (block_szx + 4); }
+    bool check(const char* current_version, FotaImage& image) override;
+    bool open(const FotaImage& image) override;
+    bool requestRange(size_t offset, size_t length) override;
+    int read(uint8_t* dest, size_t max_length, unsigned long timeout) override;
+    void close() override;
+    bool verify(const FotaImage& image, unsigned long elapsed_ms) override;
+
+    // Retransmission state, for logs and benchmarks
+    unsigned long rto() const { return rto_ms; }
+    unsigned long srtt() const { return srtt_ms; }
+    uint32_t exchanges() const { return exchange_count; }
+    uint32_t retransmits() const { return retransmit_count; }
+};
+
+#endif // COAP_TRANSPORT_H
@@ -0,0 +1,200 @@
+#include "FotaEngine.h"
+
+bool FotaEngine::addTransport(FotaTransport* transport) {
+  if (transport == nullptr || transport_count >= FOTA_MAX_TRANSPORTS) {
+    return false;
+  }
+
+  transports[transport_count] = transport;
+  scores[transport_count] = FotaTransportScore();
+  scores[transport_count].transport = transport;
+  transport_count++;
+  return true;
+}
+
+bool FotaEngine::check(const char* current_version, FotaImage& image) {
+  for (size_t i = 0; i < transport_count; i++) {
+    if (transports[i]->check(current_version, image)) {
+      if (image.unchanged) {
+        Serial.printf("Manifest unchanged (token %s) via %s\n", image.token.c_str(), transports[i]->name());
+        return true;
+      }
+      Serial.printf("Manifest via %s: v%s, %u bytes, md5=%s\n", transports[i]->name(),
+                    image.version.c_str(), (unsigned)image.size, image.md5.c_str());
+      return true;
+    }
+    Serial.printf("Check over %s failed, trying next transport\n", transports[i]->name());
+  }
+
+  return false;
+}
+
+bool FotaEngine::fetchRange(FotaTransport* transport, size_t offset, size_t length, bool flash, size_t& received) {
+  received = 0;
+
+  if (!transport->requestRange(offset, length)) {
+    return false;
+  }
+
+  while (true) {
+    int count = transport->read(buffer, sizeof(buffer), FOTA_READ_TIMEOUT);
+    if (count == 0) {
+      break;
+    }
+    if (count < 0) {
+      return false;
+    }
+
+    if (flash && Update.write(buffer, count) != (size_t)count) {
+      Serial.println("Flash write failed");
+      return false;
+    }
+    received += count;
+  }
+
+  return received > 0;
+}
+
+bool FotaEngine::benchmark(FotaTransport* transport, const FotaImage& image, FotaTransportScore& score) {
+  score.available = false;
+
+  unsigned long start = millis();
+  if (!transport->open(image)) {
+    transport->close();
+    return false;
+  }
+  score.open_ms = millis() - start;
+
+  // Fetch the probe with the transport's own range size, as a download would
+  size_t probe = min((size_t)FOTA_PROBE_BYTES, image.size);
+  size_t offset = 0;
+  start = millis();
+  while (offset < probe) {
+    size_t received = 0;
+    if (!fetchRange(transport, offset, min(transport->maxRange(), probe - offset), false, received)) {
+      transport->close();
+      return false;
+    }
+    offset += received;
+  }
+  score.probe_ms = max(millis() - start, 1UL);
+  score.probe_bytes = offset;
+  transport->close();
+
+  // Session setup once, then the measured rate for the rest of the image
+  score.estimate_ms = score.open_ms + (unsigned long)((float)score.probe_ms * image.size / score.probe_bytes);
+  score.available = true;
+  return true;
+}
+
+FotaTransport* FotaEngine::selectTransport(const FotaImage& image) {
+  FotaTransportScore* best = nullptr;
+
+  Serial.println("Benchmarking transports...");
+  for (size_t i = 0; i < transport_count; i++) {
+    FotaTransportScore& score = scores[i];
+
+    if (!benchmark(transports[i], image, score)) {
+      Serial.printf("  %-5s unavailable\n", transports[i]->name());
+      continue;
+    }
+
+    Serial.printf("  %-5s open %lu ms, %u bytes in %lu ms (%.1f KB/s), estimate %lu s\n",
+                  transports[i]->name(), score.open_ms, (unsigned)score.probe_bytes, score.probe_ms,
+                  score.probe_bytes / (float)score.probe_ms * 1000.0 / 1024.0, score.estimate_ms / 1000);
+
+    if (best == nullptr || score.estimate_ms < best->estimate_ms) {
+      best = &score;
+    }
+  }
+
+  if (best == nullptr) {
+    Serial.println("No transport available");
+    return nullptr;
+  }
+
+  Serial.printf("Selected transport: %s\n", best->transport->name());
+  return best->transport;
+}
+
+bool FotaEngine::download(FotaTransport* transport, const FotaImage& image) {
+  if (transport == nullptr || image.size == 0) {
+    return false;
+  }
+
+  if (!Update.begin(image.size)) {
+    Serial.println("Not enough space for update");
+    return false;
+  }
+  Update.setMD5(image.md5.c_str());
+
+  if (!transport->open(image)) {
+    Update.abort();
+    return false;
+  }
+
+  unsigned long start = millis();
+  size_t offset = 0;
+  int retries = 0;
+
+  while (offset < image.size) {
+    size_t received = 0;
+    bool ok = fetchRange(transport, offset, min(transport->maxRange(), image.size - offset), true, received);
+
+    // Bytes that made it to flash are kept, the range resumes after them
+    offset += received;
+
+    if (!ok) {
+      if (Update.hasError() || ++retries > FOTA_RANGE_RETRIES) {
+        Serial.printf("Download over %s failed at %u\n", transport->name(), (unsigned)offset);
+        transport->close();
+        Update.abort();
+        return false;
+      }
+
+      Serial.printf("Retrying from %u (attempt %d/%d)\n", (unsigned)offset, retries, FOTA_RANGE_RETRIES);
+      transport->close();
+      if (!transport->open(image)) {
+        Update.abort();
+        return false;
+      }
+      continue;
+    }
+
+    retries = 0;
+    Serial.printf("Progress: %u%%\n", (unsigned)(offset * 100 / image.size));
+  }
+
+  transport->close();
+
+  unsigned long elapsed = max(millis() - start, 1UL);
+  Serial.printf("Downloaded %u bytes over %s in %lu ms (%.1f KB/s)\n", (unsigned)offset, transport->name(),
+                elapsed, offset / (float)elapsed * 1000.0 / 1024.0);
+
+  // Update.end() checks the MD5 set above
+  if (!Update.end()) {
+    Serial.print("Update failed: ");
+    Serial.println(Update.errorString());
+    return false;
+  }
+
+  // The image is flashed either way; the server only misses its completion
+  if (!transport->verify(image, elapsed)) {
+    Serial.printf("Verify not acknowledged over %s\n", transport->name());
+  }
+
+  return true;
+}
+
+int FotaEngine::compareVersions(const String& v1, const String& v2) {
+  int v1major = 0, v1minor = 0, v1patch = 0;
+  sscanf(v1.c_str(), "%d.%d.%d", &v1major, &v1minor, &v1patch);
+
+  int v2major = 0, v2minor = 0, v2patch = 0;
+  sscanf(v2.c_str(), "%d.%d.%d", &v2major, &v2minor, &v2patch);
+
+  if (v1major != v2major) return v1major > v2major ? 1 : -1;
+  if (v1minor != v2minor) return v1minor > v2minor ? 1 : -1;
+  if (v1patch != v2patch) return v1patch > v2patch ? 1 : -1;
+  return 0;
+}
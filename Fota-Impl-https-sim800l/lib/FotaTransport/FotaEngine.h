@@ -0,0 +1,55 @@
+#ifndef FOTA_ENGINE_H
+#define FOTA_ENGINE_H
+
+#include <Arduino.h>
+#include <Update.h>
+#include "FotaTransport.h"
+
+#define FOTA_MAX_TRANSPORTS   4
+#define FOTA_PROBE_BYTES      4096    // Bytes fetched per transport while benchmarking
+#define FOTA_ENGINE_BUFFER    1024
+#define FOTA_RANGE_RETRIES    3
+#define FOTA_READ_TIMEOUT     10000
+
+// Benchmark result for one transport
+struct FotaTransportScore {
+  FotaTransport* transport = nullptr;
+  bool available = false;
+  unsigned long open_ms = 0;       // open() cost, paid once per session
+  unsigned long probe_ms = 0;      // requestRange() + read() of the probe bytes
+  size_t probe_bytes = 0;
+  unsigned long estimate_ms = 0;   // Projected time for the whole image
+};
+
+// Single download/flash engine fed by any FotaTransport.
+class FotaEngine {
+  private:
+    FotaTransport* transports[FOTA_MAX_TRANSPORTS];
+    FotaTransportScore scores[FOTA_MAX_TRANSPORTS];
+    size_t transport_count = 0;
+    uint8_t buffer[FOTA_ENGINE_BUFFER];
+
+    bool fetchRange(FotaTransport* transport, size_t offset, size_t length, bool flash, size_t& received);
+    bool benchmark(FotaTransport* transport, const FotaImage& image, FotaTransportScore& score);
+
+  public:
+    // Transports are tried in the order they were added
+    bool addTransport(FotaTransport* transport);
+
+    // Latest manifest from the first transport that answers (image.token makes it conditional)
+    bool check(const char* current_version, FotaImage& image);
+
+    // Probe every transport briefly and return the fastest one for this image (nullptr if none work)
+    FotaTransport* selectTransport(const FotaImage& image);
+
+    // Download the image over the given transport and flash it
+    bool download(FotaTransport* transport, const FotaImage& image);
+
+    const FotaTransportScore& score(size_t index) const { return scores[index]; }
+    size_t transportCount() const { return transport_count; }
+
+    // 1 if v1 > v2, 0 if equal, -1 if v1 < v2 (major.minor.patch)
+    static int compareVersions(const String& v1, const String& v2);
+};
+
+#endif // FOTA_ENGINE_H
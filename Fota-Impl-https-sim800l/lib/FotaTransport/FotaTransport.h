@@ -0,0 +1,52 @@
+#ifndef FOTA_TRANSPORT_H
+#define FOTA_TRANSPORT_H
+
+#include <Arduino.h>
+#include "ModemAT.h"
+
+// Image manifest as announced by the server (same fields on every transport)
+struct FotaImage {
+  String name;
+  String version;
+  size_t size = 0;
+  String md5;
+  String sha256;
+  String token;            // Manifest token, sent back on the next check
+  bool unchanged = false;  // Server answered "not modified" to our token
+};
+
+// One way of pulling firmware bytes through the SIM800L.
+// The engine drives every transport the same way:
+//   open(image) -> { requestRange(offset, length) -> read()... } -> close()
+class FotaTransport {
+  public:
+    virtual ~FotaTransport() {}
+
+    // Short name for logs and benchmark results
+    virtual const char* name() const = 0;
+
+    // Largest range one requestRange() may ask for
+    virtual size_t maxRange() const = 0;
+
+    // Ask the server for the latest manifest (the connection is managed internally).
+    // If image.token is set the server may answer "not modified": image.unchanged is
+    // set and the other fields are left as they were.
+    virtual bool check(const char* current_version, FotaImage& image) = 0;
+
+    // Prepare to fetch the given image
+    virtual bool open(const FotaImage& image) = 0;
+
+    // Request image bytes [offset, offset + length)
+    virtual bool requestRange(size_t offset, size_t length) = 0;
+
+    // Stream bytes of the current range: > 0 bytes copied, 0 when the range is complete, -1 on error
+    virtual int read(uint8_t* dest, size_t max_length, unsigned long timeout) = 0;
+
+    virtual void close() = 0;
+
+    // Report an image that was flashed and passed its MD5 check, so the server can
+    // complete its download session. Transports without a verify request skip it.
+    virtual bool verify(const FotaImage& image, unsigned long elapsed_ms) { return true; }
+};
+
+#endif // FOTA_TRANSPORT_H
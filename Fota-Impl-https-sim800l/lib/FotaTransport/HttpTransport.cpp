@@ -0,0 +1,185 @@
+#include "HttpTransport.h"
+
+HttpTransport::HttpTransport(ModemAT& modem, const char* base_url, const char* device, const char* apn)
+  : modem(modem), base_url(base_url), device_id(device), apn(apn) {
+}
+
+bool HttpTransport::begin(const String& url) {
+  if (!modem.openBearer(apn)) {
+    return false;
+  }
+
+  modem.command("AT+HTTPTERM");
+  if (!modem.command("AT+HTTPINIT") ||
+      !modem.command("AT+HTTPPARA=\"CID\",1") ||
+      !modem.command("AT+HTTPPARA=\"URL\",\"" + url + "\"")) {
+    Serial.println("HTTP init failed");
+    return false;
+  }
+
+  session_open = true;
+  return true;
+}
+
+void HttpTransport::end() {
+  if (session_open) {
+    modem.command("AT+HTTPTERM");
+    session_open = false;
+  }
+}
+
+bool HttpTransport::get(int& status, size_t& length) {
+  if (!modem.command("AT+HTTPACTION=0")) {
+    return false;
+  }
+
+  // The result arrives later as +HTTPACTION: <method>,<status>,<length>
+  char line[64];
+  unsigned long start = millis();
+  while (millis() - start < HTTP_ACTION_TIMEOUT) {
+    if (!modem.readLine(line, sizeof(line), HTTP_ACTION_TIMEOUT - (millis() - start))) {
+      break;
+    }
+    if (strncmp(line, "+HTTPACTION:", 12) == 0) {
+      int method = 0;
+      unsigned long body_length = 0;
+      if (sscanf(line + 12, "%d,%d,%lu", &method, &status, &body_length) != 3) {
+        return false;
+      }
+      length = body_length;
+      return true;
+    }
+  }
+
+  Serial.println("HTTPACTION timeout");
+  return false;
+}
+
+int HttpTransport::readSlice(size_t start, uint8_t* dest, size_t length, unsigned long timeout) {
+  modem.flush();
+
+  Stream& serialAT = modem.stream();
+  serialAT.print("AT+HTTPREAD=");
+  serialAT.print(start);
+  serialAT.print(",");
+  serialAT.println(length);
+
+  // +HTTPREAD: <len>\r\n<len raw bytes>\r\nOK
+  char line[32];
+  int data_length = -1;
+  while (data_length < 0) {
+    if (!modem.readLine(line, sizeof(line), timeout)) {
+      return -1;
+    }
+    if (strncmp(line, "+HTTPREAD:", 10) == 0) {
+      data_length = atoi(line + 10);
+    } else if (strstr(line, "ERROR") != nullptr) {
+      return -1;
+    }
+  }
+
+  if ((size_t)data_length > length || modem.readRaw(dest, data_length, timeout) != (size_t)data_length) {
+    return -1;
+  }
+
+  return modem.waitFor("OK", timeout) ? data_length : -1;
+}
+
+bool HttpTransport::check(const char* current_version, FotaImage& image) {
+  String url = base_url + "/api/fota/sim800l/check?device=" + device_id + "&version=" + current_version;
+  if (image.token.length() > 0) {
+    url += "&token=" + image.token;
+  }
+  if (!begin(url)) {
+    return false;
+  }
+
+  int status = 0;
+  size_t length = 0;
+  char body[512];
+  bool ok = get(status, length);
+
+  // 304: manifest unchanged since our token
+  image.unchanged = ok && status == 304;
+  if (image.unchanged) {
+    end();
+    return true;
+  }
+
+  ok = ok && status == 200 && length < sizeof(body);
+  if (ok) {
+    int received = readSlice(0, (uint8_t*)body, length, HTTP_READ_TIMEOUT);
+    ok = received == (int)length;
+  }
+  end();
+
+  if (!ok) {
+    Serial.println("HTTP check failed");
+    return false;
+  }
+  body[length] = '\0';
+
+  StaticJsonDocument<512> doc;
+  if (deserializeJson(doc, body)) {
+    Serial.println("HTTP check: invalid JSON");
+    return false;
+  }
+
+  image.name = doc["name"].as<String>();
+  image.version = doc["version"].as<String>();
+  image.size = doc["size"].as<size_t>();
+  image.md5 = doc["md5"].as<String>();
+  image.sha256 = doc["sha256"] | "";
+  image.token = doc["token"] | "";
+
+  return image.size > 0;
+}
+
+bool HttpTransport::open(const FotaImage& image) {
+  return begin(base_url + "/api/fota/sim800l/download/" + image.name + "?device=" + device_id);
+}
+
+bool HttpTransport::requestRange(size_t offset, size_t length) {
+  length = min(length, (size_t)HTTP_TRANSPORT_MAX_RANGE);
+
+  String range = "AT+HTTPPARA=\"USERDATA\",\"Range: bytes=" +
+                 String(offset) + "-" + String(offset + length - 1) + "\"";
+  if (!modem.command(range)) {
+    return false;
+  }
+
+  int status = 0;
+  size_t body_length = 0;
+  if (!get(status, body_length)) {
+    return false;
+  }
+
+  if (status != 206 || body_length != length) {
+    Serial.printf("Range rejected: status %d, length %u\n", status, (unsigned)body_length);
+    return false;
+  }
+
+  range_length = length;
+  range_pos = 0;
+  return true;
+}
+
+int HttpTransport::read(uint8_t* dest, size_t max_length, unsigned long timeout) {
+  if (range_pos >= range_length) {
+    return 0;
+  }
+
+  int received = readSlice(range_pos, dest, min(max_length, range_length - range_pos), timeout);
+  if (received <= 0) {
+    return -1;
+  }
+
+  range_pos += received;
+  return received;
+}
+
+void HttpTransport::close() {
+  range_length = 0;
+  range_pos = 0;
+  end();
+}
@@ -0,0 +1,40 @@
+#ifndef HTTP_TRANSPORT_H
+#define HTTP_TRANSPORT_H
+
+#include <ArduinoJson.h>
+#include "FotaTransport.h"
+
+#define HTTP_TRANSPORT_MAX_RANGE  (32 * 1024)  // One Range window per HTTPACTION
+#define HTTP_ACTION_TIMEOUT       30000
+#define HTTP_READ_TIMEOUT         10000
+
+// SIM800L HTTP stack against the /api/fota/sim800l endpoints.
+// Each range is one GET with a Range header, drained with AT+HTTPREAD.
+class HttpTransport : public FotaTransport {
+  private:
+    ModemAT& modem;
+    String base_url;       // e.g. "http://fota.example.com:3000"
+    String device_id;
+    const char* apn;
+    bool session_open = false;
+    size_t range_length = 0;
+    size_t range_pos = 0;
+
+    bool begin(const String& url);
+    void end();
+    bool get(int& status, size_t& length);
+    int readSlice(size_t start, uint8_t* dest, size_t length, unsigned long timeout);
+
+  public:
+    HttpTransport(ModemAT& modem, const char* base_url, const char* device, const char* apn);
+
+    const char* name() const override { return "http"; }
+    size_t maxRange() const override { return HTTP_TRANSPORT_MAX_RANGE; }
+    bool check(const char* current_version, FotaImage& image) override;
+    bool open(const FotaImage& image) override;
+    bool requestRange(size_t offset, size_t length) override;
+    int read(uint8_t* dest, size_t max_length, unsigned long timeout) override;
+    void close() override;
+};
+
+#endif // HTTP_TRANSPORT_H
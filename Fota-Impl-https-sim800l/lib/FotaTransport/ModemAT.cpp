@@ -0,0 +1,343 @@
+#include "ModemAT.h"
+
+void ModemAT::flush() {
+  while (serialAT.available()) {
+    serialAT.read();
+  }
+}
+
+bool ModemAT::command(const String& cmd, const char* expected, unsigned long timeout) {
+  flush();
+
+  Serial.print(">> ");
+  Serial.println(cmd);
+
+  serialAT.println(cmd);
+
+  if (expected == nullptr || expected[0] == '\0') {
+    return true;
+  }
+
+  return waitFor(expected, timeout);
+}
+
+bool ModemAT::waitFor(const char* expected, unsigned long timeout) {
+  const char* tokens[] = { expected, "ERROR" };
+  return waitForAny(tokens, 2, timeout) == 0;
+}
+
+int ModemAT::waitForAny(const char* const* tokens, size_t count, unsigned long timeout) {
+  char window[MODEM_MATCH_WINDOW + 1];
+  size_t length = 0;
+  unsigned long start = millis();
+
+  while (millis() - start < timeout) {
+    if (!serialAT.available()) {
+      yield();
+      continue;
+    }
+
+    // Keep only the tail, tokens are short
+    if (length == MODEM_MATCH_WINDOW) {
+      memmove(window, window + 1, MODEM_MATCH_WINDOW - 1);
+      length--;
+    }
+    window[length++] = serialAT.read();
+    window[length] = '\0';
+
+    for (size_t i = 0; i < count; i++) {
+      if (strstr(window, tokens[i]) != nullptr) {
+        return i;
+      }
+    }
+  }
+
+  Serial.println("<< Timeout");
+  return -1;
+}
+
+bool ModemAT::readLine(char* line, size_t size, unsigned long timeout) {
+  size_t pos = 0;
+  unsigned long start = millis();
+
+  while (millis() - start < timeout) {
+    if (!serialAT.available()) {
+      yield();
+      continue;
+    }
+
+    char c = serialAT.read();
+    if (c == '\n') {
+      line[pos] = '\0';
+      if (pos > 0) {
+        return true;
+      }
+    } else if (c != '\r' && pos < size - 1) {
+      line[pos++] = c;
+    }
+  }
+
+  return false;
+}
+
+size_t ModemAT::readRaw(uint8_t* dest, size_t length, unsigned long timeout) {
+  size_t received = 0;
+  unsigned long start = millis();
+
+  while (received < length && millis() - start < timeout) {
+    int available = serialAT.available();
+    if (available > 0) {
+      size_t to_read = min((size_t)available, length - received);
+      received += serialAT.readBytes(dest + received, to_read);
+      start = millis();  // Timeout is an idle timeout
+    } else {
+      yield();
+    }
+  }
+
+  return received;
+}
+
+bool ModemAT::init() {
+  // Test AT communication
+  bool alive = false;
+  for (int i = 0; i < 3 && !alive; i++) {
+    alive = command("AT");
+    if (!alive) {
+      delay(1000);
+    }
+  }
+
+  if (!alive) {
+    Serial.println("SIM800L not responding");
+    return false;
+  }
+
+  // Disable echo
+  command("ATE0");
+
+  // Check SIM card
+  if (!command("AT+CPIN?", "READY", 5000)) {
+    Serial.println("SIM card not ready");
+    return false;
+  }
+
+  // Wait for network registration
+  Serial.println("Waiting for network registration...");
+  const char* registered[] = { "+CREG: 0,1", "+CREG: 0,5" };
+  for (int i = 0; i < 60; i++) {
+    command("AT+CREG?", "");
+    if (waitForAny(registered, 2, 1000) >= 0) {
+      Serial.println("Network registered");
+      return true;
+    }
+    delay(1000);
+  }
+
+  Serial.println("Network registration failed");
+  return false;
+}
+
+bool ModemAT::attachGPRS(const char* apn, const char* user, const char* pass) {
+  Serial.println("Setting up GPRS connection...");
+
+  for (int i = 0; i < 10; i++) {
+    if (command("AT+CGATT?", "+CGATT: 1")) {
+      break;
+    }
+    command("AT+CGATT=1");
+    delay(2000);
+  }
+
+  // Close any existing connections, single connection mode
+  command("AT+CIPSHUT", "SHUT OK", 10000);
+  if (!command("AT+CIPMUX=0")) {
+    Serial.println("Failed to set single connection mode");
+    return false;
+  }
+
+  String apnCmd = "AT+CSTT=\"" + String(apn) + "\"";
+  if (strlen(user) > 0) {
+    apnCmd += ",\"" + String(user) + "\",\"" + String(pass) + "\"";
+  }
+  if (!command(apnCmd)) {
+    Serial.println("Failed to set APN");
+    return false;
+  }
+
+  if (!command("AT+CIICR", "OK", MODEM_GPRS_TIMEOUT)) {
+    Serial.println("Failed to bring up GPRS");
+    return false;
+  }
+
+  // AT+CIFSR answers with the bare IP address, no OK
+  command("AT+CIFSR", "");
+  char ip[32];
+  if (!readLine(ip, sizeof(ip), 3000) || strstr(ip, "ERROR") != nullptr) {
+    Serial.println("Failed to get IP address");
+    return false;
+  }
+
+  Serial.print("IP Address: ");
+  Serial.println(ip);
+
+  gprs_up = true;
+  return true;
+}
+
+bool ModemAT::openBearer(const char* apn) {
+  if (bearer_up) {
+    return true;
+  }
+
+  // The HTTP stack runs on its own SAPBR bearer
+  command("AT+SAPBR=3,1,\"CONTYPE\",\"GPRS\"");
+  command("AT+SAPBR=3,1,\"APN\",\"" + String(apn) + "\"");
+  command("AT+SAPBR=1,1", "OK", MODEM_GPRS_TIMEOUT);
+
+  if (!command("AT+SAPBR=2,1", "+SAPBR: 1,1")) {
+    Serial.println("HTTP bearer not active");
+    return false;
+  }
+
+  bearer_up = true;
+  return true;
+}
+
+void ModemAT::closeBearer() {
+  if (bearer_up) {
+    command("AT+SAPBR=0,1", "OK", 5000);
+    bearer_up = false;
+  }
+}
+
+bool ModemAT::start(const char* protocol, const char* host, int port) {
+  Serial.printf("Connecting to %s server %s:%d\n", protocol, host, port);
+
+  command("AT+CIPSTART=\"" + String(protocol) + "\",\"" + String(host) + "\",\"" + String(port) + "\"", "");
+
+  // "CONNECT FAIL" has to be matched before the bare "CONNECT OK"
+  const char* tokens[] = { "CONNECT FAIL", "ERROR", "CONNECT OK", "ALREADY CONNECT" };
+  return waitForAny(tokens, 4, MODEM_CONNECT_TIMEOUT) >= 2;
+}
+
+bool ModemAT::send(const uint8_t* data, size_t length) {
+  serialAT.print("AT+CIPSEND=");
+  serialAT.println(length);
+
+  if (!waitFor(">", 5000)) {
+    Serial.println("No prompt received");
+    return false;
+  }
+
+  serialAT.write(data, length);
+
+  if (!waitFor("SEND OK", 10000)) {
+    Serial.println("Send failed");
+    return false;
+  }
+
+  return true;
+}
+
+bool ModemAT::tcpOpen(const char* host, int port) {
+  // One connection at a time (CIPMUX=0)
+  tcpClose();
+  udpClose();
+
+  tcp_open = start("TCP", host, port);
+  Serial.println(tcp_open ? "TCP connected successfully" : "TCP connection failed");
+  return tcp_open;
+}
+
+bool ModemAT::tcpSend(const uint8_t* data, size_t length) {
+  return tcp_open && send(data, length);
+}
+
+void ModemAT::tcpClose() {
+  if (tcp_open) {
+    command("AT+CIPCLOSE", "CLOSE OK", 2000);
+    tcp_open = false;
+  }
+}
+
+bool ModemAT::udpOpen(const char* host, int port) {
+  tcpClose();
+  udpClose();
+
+  if (!command("AT+CIPHEAD=1")) {
+    return false;
+  }
+  link.reset();
+
+  udp_open = start("UDP", host, port);
+  if (!udp_open) {
+    command("AT+CIPHEAD=0");
+  }
+  Serial.println(udp_open ? "UDP socket open" : "UDP socket failed");
+  return udp_open;
+}
+
+bool ModemAT::udpSend(const uint8_t* data, size_t length) {
+  return udp_open && link.send(data, length);
+}
+
+int ModemAT::readDatagram(uint8_t* dest, size_t size, unsigned long timeout) {
+  if (!udp_open) {
+    return -1;
+  }
+
+  datagram = dest;
+  datagram_size = size;
+  datagram_length = -1;
+
+  // One frame at a time, so a datagram right behind this one stays in the UART
+  unsigned long start = millis();
+  while (datagram_length < 0 && udp_open && millis() - start < timeout) {
+    if (!link.pumpFrame()) {
+      yield();
+    }
+  }
+
+  // The rest of a datagram cut off by the timeout is dropped
+  datagram = nullptr;
+  datagram_wanted = false;
+  return datagram_length;
+}
+
+void ModemAT::frameStart(size_t length) {
+  datagram_wanted = datagram != nullptr && datagram_length < 0;
+  datagram_kept = 0;
+}
+
+uint8_t* ModemAT::frameBuffer(size_t& length) {
+  if (!datagram_wanted || datagram_kept >= datagram_size) {
+    return nullptr;
+  }
+  length = min(length, datagram_size - datagram_kept);
+  return datagram + datagram_kept;
+}
+
+void ModemAT::frameWritten(size_t count, bool end) {
+  datagram_kept += count;
+  if (end) {
+    datagram_length = datagram_kept;
+    datagram_wanted = false;
+  }
+}
+
+// Bytes nobody reads: the tail of a datagram larger than the caller's buffer
+void ModemAT::frameByte(uint8_t c, bool end) {
+  if (end && datagram_wanted) {
+    datagram_length = datagram_kept;
+    datagram_wanted = false;
+  }
+}
+
+void ModemAT::udpClose() {
+  if (udp_open) {
+    command("AT+CIPCLOSE", "CLOSE OK", 2000);
+    command("AT+CIPHEAD=0");
+    udp_open = false;
+  }
+}
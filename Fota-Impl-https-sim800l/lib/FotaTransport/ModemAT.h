@@ -0,0 +1,81 @@
+#ifndef MODEM_AT_H
+#define MODEM_AT_H
+
+#include <Arduino.h>
+#include <Sim800Link.h>
+
+// AT Command Timeouts
+#define MODEM_AT_TIMEOUT        2000   // 2 seconds
+#define MODEM_CONNECT_TIMEOUT   10000  // 10 seconds
+#define MODEM_GPRS_TIMEOUT      30000  // 30 seconds
+#define MODEM_MATCH_WINDOW      32     // Tail kept while scanning for a response token
+
+// Shared SIM800L AT layer used by every FOTA transport.
+// Responses are matched on the fly and return as soon as the token arrives.
+// TCP and HTTP data arrive unframed and are read raw; the UDP socket is framed and
+// goes through the same Sim800Link demultiplexer as the MQTT clients.
+class ModemAT : private Sim800Link::Receiver {
+  private:
+    Stream& serialAT;
+    Sim800Link link;
+    bool gprs_up = false;
+    bool bearer_up = false;
+    bool tcp_open = false;
+    bool udp_open = false;
+
+    // readDatagram() destination. Datagrams that start while nobody reads (during
+    // udpSend, or after a timeout) are dropped.
+    uint8_t* datagram = nullptr;
+    size_t datagram_size = 0;
+    size_t datagram_kept = 0;
+    int datagram_length = -1;
+    bool datagram_wanted = false;
+
+    bool start(const char* protocol, const char* host, int port);
+    bool send(const uint8_t* data, size_t length);
+
+    // Sim800Link::Receiver: one datagram per +IPD frame
+    void frameStart(size_t length) override;
+    uint8_t* frameBuffer(size_t& length) override;
+    void frameWritten(size_t count, bool end) override;
+    void frameByte(uint8_t c, bool end) override;
+    void closed() override { udp_open = false; }
+
+  public:
+    explicit ModemAT(Stream& serial) : serialAT(serial), link(serial, *this) {}
+
+    Stream& stream() { return serialAT; }
+
+    // Basic AT traffic
+    void flush();
+    bool command(const String& cmd, const char* expected = "OK", unsigned long timeout = MODEM_AT_TIMEOUT);
+    bool waitFor(const char* expected, unsigned long timeout);
+    int waitForAny(const char* const* tokens, size_t count, unsigned long timeout);
+    bool readLine(char* line, size_t size, unsigned long timeout);
+    size_t readRaw(uint8_t* dest, size_t length, unsigned long timeout);
+
+    // Modem and data bearers
+    bool init();
+    bool attachGPRS(const char* apn, const char* user = "", const char* pass = "");
+    bool openBearer(const char* apn);
+    void closeBearer();
+    bool isGPRSUp() const { return gprs_up; }
+
+    // Single TCP connection (AT+CIPSTART / CIPSEND / CIPCLOSE)
+    bool tcpOpen(const char* host, int port);
+    bool tcpSend(const uint8_t* data, size_t length);
+    bool tcpSend(const String& data) { return tcpSend((const uint8_t*)data.c_str(), data.length()); }
+    void tcpClose();
+    bool isTCPOpen() const { return tcp_open; }
+
+    // UDP socket on the same single connection. Incoming datagrams are framed
+    // with AT+CIPHEAD=1 ("+IPD,<len>:") while it is open, so their boundaries survive.
+    bool udpOpen(const char* host, int port);
+    bool udpSend(const uint8_t* data, size_t length);
+    // Next datagram: its length (truncated to size), or -1 on timeout
+    int readDatagram(uint8_t* dest, size_t size, unsigned long timeout);
+    void udpClose();
+    bool isUDPOpen() const { return udp_open; }
+};
+
+#endif // MODEM_AT_H
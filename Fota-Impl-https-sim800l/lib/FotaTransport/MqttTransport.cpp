@@ -0,0 +1,362 @@
+#include "MqttTransport.h"
+
+// MQTT Packet Types
+#define MQTT_CONNECT      0x10
+#define MQTT_CONNACK      0x20
+#define MQTT_PUBLISH      0x30
+#define MQTT_SUBSCRIBE    0x82
+#define MQTT_SUBACK       0x90
+#define MQTT_DISCONNECT   0xE0
+
+MqttTransport::MqttTransport(ModemAT& modem, const char* host, int port, const char* client, const char* device)
+  : modem(modem), broker_host(host), broker_port(port), client_id(client), device_id(device),
+    data_topic(String(MQTT_TOPIC_DATA_PREFIX) + device) {
+}
+
+size_t MqttTransport::encodeLength(uint8_t* dest, size_t length) {
+  size_t count = 0;
+  do {
+    uint8_t digit = length % 128;
+    length /= 128;
+    if (length > 0) {
+      digit |= 0x80;
+    }
+    dest[count++] = digit;
+  } while (length > 0);
+  return count;
+}
+
+size_t MqttTransport::writeString(uint8_t* dest, const char* str) {
+  size_t length = strlen(str);
+  dest[0] = length >> 8;
+  dest[1] = length & 0xFF;
+  memcpy(dest + 2, str, length);
+  return length + 2;
+}
+
+bool MqttTransport::readPacketHeader(uint8_t& type, size_t& length, unsigned long timeout) {
+  if (modem.readRaw(&type, 1, timeout) != 1) {
+    return false;
+  }
+
+  // Remaining length: up to four 7-bit digits
+  length = 0;
+  size_t multiplier = 1;
+  for (int i = 0; i < 4; i++) {
+    uint8_t digit;
+    if (modem.readRaw(&digit, 1, timeout) != 1) {
+      return false;
+    }
+    length += (digit & 0x7F) * multiplier;
+    if ((digit & 0x80) == 0) {
+      return true;
+    }
+    multiplier *= 128;
+  }
+
+  return false;
+}
+
+bool MqttTransport::skip(size_t length, unsigned long timeout) {
+  uint8_t scratch[64];
+  while (length > 0) {
+    size_t step = min(length, sizeof(scratch));
+    if (modem.readRaw(scratch, step, timeout) != step) {
+      return false;
+    }
+    length -= step;
+  }
+  return true;
+}
+
+bool MqttTransport::waitForPublish(const char* topic, size_t& payload_length, unsigned long timeout) {
+  unsigned long start = millis();
+
+  while (millis() - start < timeout) {
+    uint8_t type;
+    size_t length;
+    if (!readPacketHeader(type, length, timeout)) {
+      return false;
+    }
+
+    if ((type & 0xF0) != MQTT_PUBLISH) {
+      if (!skip(length, timeout)) {
+        return false;
+      }
+      continue;
+    }
+
+    uint8_t topic_header[2];
+    if (modem.readRaw(topic_header, 2, timeout) != 2) {
+      return false;
+    }
+    size_t topic_length = (topic_header[0] << 8) | topic_header[1];
+
+    char received_topic[64];
+    if (topic_length >= sizeof(received_topic) ||
+        modem.readRaw((uint8_t*)received_topic, topic_length, timeout) != topic_length) {
+      return false;
+    }
+    received_topic[topic_length] = '\0';
+
+    // We subscribe with QoS 0, but skip a packet identifier if the broker sends one
+    size_t header_length = 2 + topic_length;
+    if (type & 0x06) {
+      if (!skip(2, timeout)) {
+        return false;
+      }
+      header_length += 2;
+    }
+
+    payload_length = length - header_length;
+    if (strcmp(received_topic, topic) == 0) {
+      return true;
+    }
+
+    if (!skip(payload_length, timeout)) {
+      return false;
+    }
+  }
+
+  return false;
+}
+
+bool MqttTransport::connect() {
+  if (modem.isTCPOpen()) {
+    return true;
+  }
+
+  if (!modem.tcpOpen(broker_host, broker_port)) {
+    return false;
+  }
+
+  // CONNECT: protocol "MQTT" level 4, clean session
+  uint8_t body[MQTT_PACKET_SIZE];
+  size_t body_length = writeString(body, "MQTT");
+  body[body_length++] = 0x04;
+  body[body_length++] = 0x02;
+  body[body_length++] = MQTT_TRANSPORT_KEEPALIVE >> 8;
+  body[body_length++] = MQTT_TRANSPORT_KEEPALIVE & 0xFF;
+  body_length += writeString(body + body_length, client_id.c_str());
+
+  size_t length = 0;
+  packet[length++] = MQTT_CONNECT;
+  length += encodeLength(packet + length, body_length);
+  memcpy(packet + length, body, body_length);
+  length += body_length;
+
+  uint8_t type;
+  size_t remaining;
+  uint8_t connack[2];
+  if (!modem.tcpSend(packet, length) ||
+      !readPacketHeader(type, remaining, MQTT_TRANSPORT_TIMEOUT) || type != MQTT_CONNACK ||
+      remaining != 2 || modem.readRaw(connack, 2, MQTT_TRANSPORT_TIMEOUT) != 2 || connack[1] != 0) {
+    Serial.println("MQTT connect failed");
+    modem.tcpClose();
+    return false;
+  }
+
+  // SUBSCRIBE to info and data, QoS 0
+  const char* topics[] = { MQTT_TOPIC_INFO, data_topic.c_str() };
+  body_length = 0;
+  body[body_length++] = 0x00;  // Packet identifier
+  body[body_length++] = 0x01;
+  for (int i = 0; i < 2; i++) {
+    body_length += writeString(body + body_length, topics[i]);
+    body[body_length++] = 0x00;
+  }
+
+  length = 0;
+  packet[length++] = MQTT_SUBSCRIBE;
+  length += encodeLength(packet + length, body_length);
+  memcpy(packet + length, body, body_length);
+  length += body_length;
+
+  if (!modem.tcpSend(packet, length) ||
+      !readPacketHeader(type, remaining, MQTT_TRANSPORT_TIMEOUT) || type != MQTT_SUBACK ||
+      !skip(remaining, MQTT_TRANSPORT_TIMEOUT)) {
+    Serial.println("MQTT subscribe failed");
+    modem.tcpClose();
+    return false;
+  }
+
+  return true;
+}
+
+bool MqttTransport::publish(const char* topic, const String& payload) {
+  size_t topic_length = strlen(topic);
+  size_t body_length = 2 + topic_length + payload.length();
+
+  size_t length = 0;
+  packet[length++] = MQTT_PUBLISH;
+  length += encodeLength(packet + length, body_length);
+  if (length + body_length > sizeof(packet)) {
+    return false;
+  }
+
+  length += writeString(packet + length, topic);
+  memcpy(packet + length, payload.c_str(), payload.length());
+  length += payload.length();
+
+  return modem.tcpSend(packet, length);
+}
+
+bool MqttTransport::check(const char* current_version, FotaImage& image) {
+  if (!connect()) {
+    return false;
+  }
+
+  StaticJsonDocument<200> request;
+  request["device"] = device_id;
+  request["action"] = "check";
+  request["version"] = current_version;
+  if (image.token.length() > 0) {
+    request["token"] = image.token;
+  }
+
+  String payload;
+  serializeJson(request, payload);
+
+  // Every device's reply comes on the info topic: skip the ones naming another device
+  char body[512];
+  StaticJsonDocument<512> doc;
+  bool ok = publish(MQTT_TOPIC_REQUEST, payload);
+  unsigned long start = millis();
+  while (ok) {
+    size_t payload_length = 0;
+    unsigned long elapsed = millis() - start;
+    ok = elapsed < MQTT_TRANSPORT_TIMEOUT &&
+         waitForPublish(MQTT_TOPIC_INFO, payload_length, MQTT_TRANSPORT_TIMEOUT - elapsed);
+    if (!ok) {
+      break;
+    }
+    if (payload_length >= sizeof(body)) {
+      ok = skip(payload_length, MQTT_TRANSPORT_TIMEOUT);
+      continue;
+    }
+    ok = modem.readRaw((uint8_t*)body, payload_length, MQTT_TRANSPORT_TIMEOUT) == payload_length;
+    if (!ok) {
+      break;
+    }
+    body[payload_length] = '\0';
+
+    if (deserializeJson(doc, body)) {
+      Serial.println("MQTT check: invalid JSON");
+      continue;
+    }
+    const char* device = doc["device"] | "";
+    if (device[0] == '\0' || device_id == device) {
+      break;
+    }
+  }
+  close();
+
+  if (!ok) {
+    Serial.println("MQTT check failed");
+    return false;
+  }
+
+  // {"nm":1}: manifest unchanged since our token
+  image.unchanged = doc["nm"].as<int>() == 1;
+  if (image.unchanged) {
+    return true;
+  }
+
+  image.name = doc["name"].as<String>();
+  image.version = doc["version"].as<String>();
+  image.size = doc["size"].as<size_t>();
+  image.md5 = doc["md5"].as<String>();
+  image.sha256 = doc["sha256"] | "";
+  image.token = doc["token"] | "";
+
+  return image.size > 0;
+}
+
+bool MqttTransport::open(const FotaImage& image) {
+  return connect();
+}
+
+bool MqttTransport::requestRange(size_t offset, size_t length) {
+  StaticJsonDocument<200> request;
+  request["device"] = device_id;
+  request["action"] = "download";
+  request["offset"] = offset;
+  request["size"] = min(length, (size_t)MQTT_TRANSPORT_MAX_RANGE);
+
+  String payload;
+  serializeJson(request, payload);
+
+  if (!publish(MQTT_TOPIC_REQUEST, payload)) {
+    return false;
+  }
+
+  // A chunk for another device, or a late answer to an earlier request of ours, is
+  // skipped rather than failing the range
+  unsigned long start = millis();
+  while (true) {
+    size_t payload_length = 0;
+    unsigned long elapsed = millis() - start;
+    if (elapsed >= MQTT_TRANSPORT_TIMEOUT ||
+        !waitForPublish(data_topic.c_str(), payload_length, MQTT_TRANSPORT_TIMEOUT - elapsed)) {
+      return false;
+    }
+
+    // Chunk header line, then the raw bytes
+    char header[128];
+    size_t header_length = 0;
+    while (true) {
+      if (header_length >= sizeof(header) - 1 || header_length >= payload_length ||
+          modem.readRaw((uint8_t*)header + header_length, 1, MQTT_TRANSPORT_TIMEOUT) != 1) {
+        return false;
+      }
+      if (header[header_length] == '\n') {
+        break;
+      }
+      header_length++;
+    }
+    header[header_length] = '\0';
+    size_t data_length = payload_length - header_length - 1;
+
+    StaticJsonDocument<128> doc;
+    if (deserializeJson(doc, header)) {
+      Serial.println("MQTT chunk header invalid");
+      return false;
+    }
+
+    const char* device = doc["device"] | "";
+    if ((device[0] != '\0' && device_id != device) || doc["offset"].as<size_t>() != offset) {
+      Serial.println("MQTT chunk for another request, skipped");
+      if (!skip(data_length, MQTT_TRANSPORT_TIMEOUT)) {
+        return false;
+      }
+      continue;
+    }
+
+    range_remaining = doc["size"].as<size_t>();
+    return range_remaining > 0 && range_remaining == data_length;
+  }
+}
+
+int MqttTransport::read(uint8_t* dest, size_t max_length, unsigned long timeout) {
+  if (range_remaining == 0) {
+    return 0;
+  }
+
+  size_t received = modem.readRaw(dest, min(max_length, range_remaining), timeout);
+  if (received == 0) {
+    return -1;
+  }
+
+  range_remaining -= received;
+  return received;
+}
+
+void MqttTransport::close() {
+  range_remaining = 0;
+
+  if (modem.isTCPOpen()) {
+    uint8_t disconnect[2] = { MQTT_DISCONNECT, 0x00 };
+    modem.tcpSend(disconnect, sizeof(disconnect));
+    modem.tcpClose();
+  }
+}
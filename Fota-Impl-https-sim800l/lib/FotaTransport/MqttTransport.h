@@ -0,0 +1,51 @@
+#ifndef MQTT_TRANSPORT_H
+#define MQTT_TRANSPORT_H
+
+#include <ArduinoJson.h>
+#include "FotaTransport.h"
+
+#define MQTT_TRANSPORT_MAX_RANGE  1024
+#define MQTT_TRANSPORT_TIMEOUT    10000
+#define MQTT_TRANSPORT_KEEPALIVE  60     // seconds
+#define MQTT_PACKET_SIZE          256    // Outgoing packets (CONNECT/SUBSCRIBE/PUBLISH requests)
+
+// Same topics as the MQTT client in src_temp_2
+#define MQTT_TOPIC_REQUEST        "device/firmware/request"
+#define MQTT_TOPIC_INFO           "device/firmware/info"
+#define MQTT_TOPIC_DATA_PREFIX    "device/firmware/data/"  // + device ID
+
+// MQTT 3.1.1 over the SIM800L TCP socket. Chunks arrive as PUBLISH on
+// device/firmware/data/<device> with payload
+// {"device":..,"offset":..,"size":..,"total":..}\n<size bytes>.
+class MqttTransport : public FotaTransport {
+  private:
+    ModemAT& modem;
+    const char* broker_host;
+    int broker_port;
+    String client_id;
+    String device_id;
+    String data_topic;
+    uint8_t packet[MQTT_PACKET_SIZE];
+    size_t range_remaining = 0;
+
+    bool connect();
+    bool publish(const char* topic, const String& payload);
+    bool readPacketHeader(uint8_t& type, size_t& length, unsigned long timeout);
+    bool skip(size_t length, unsigned long timeout);
+    bool waitForPublish(const char* topic, size_t& payload_length, unsigned long timeout);
+    static size_t encodeLength(uint8_t* dest, size_t length);
+    static size_t writeString(uint8_t* dest, const char* str);
+
+  public:
+    MqttTransport(ModemAT& modem, const char* host, int port, const char* client, const char* device);
+
+    const char* name() const override { return "mqtt"; }
+    size_t maxRange() const override { return MQTT_TRANSPORT_MAX_RANGE; }
+    bool check(const char* current_version, FotaImage& image) override;
+    bool open(const FotaImage& image) override;
+    bool requestRange(size_t offset, size_t length) override;
+    int read(uint8_t* dest, size_t max_length, unsigned long timeout) override;
+    void close() override;
+};
+
+#endif // MQTT_TRANSPORT_H
@@ -0,0 +1,151 @@
+#include "TcpTransport.h"
+
+TcpTransport::TcpTransport(ModemAT& modem, const char* host, int port, const char* device, const char* version)
+  : modem(modem), server_host(host), server_port(port), device_id(device), current_version(version) {
+}
+
+bool TcpTransport::connect() {
+  if (modem.isTCPOpen()) {
+    return true;
+  }
+
+  return modem.tcpOpen(server_host, server_port);
+}
+
+bool TcpTransport::sendRequest(const JsonDocument& doc) {
+  String request;
+  serializeJson(doc, request);
+  request += "\n";
+
+  return modem.tcpSend(request);
+}
+
+bool TcpTransport::readHeader(JsonDocument& doc) {
+  char line[512];
+  if (!modem.readLine(line, sizeof(line), TCP_TRANSPORT_TIMEOUT)) {
+    Serial.println("No response received");
+    return false;
+  }
+
+  DeserializationError error = deserializeJson(doc, line);
+  if (error) {
+    Serial.print("JSON parse error: ");
+    Serial.println(error.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool TcpTransport::startSession(FotaImage& image, const String& token) {
+  if (!connect()) {
+    return false;
+  }
+
+  StaticJsonDocument<256> request;
+  request["device"] = device_id;
+  request["action"] = "check";
+  request["version"] = current_version;
+  if (token.length() > 0) {
+    request["token"] = token;
+  }
+
+  DynamicJsonDocument response(1024);
+  if (!sendRequest(request) || !readHeader(response)) {
+    return false;
+  }
+
+  // {"nm":1}: manifest unchanged since our token, no session created
+  image.unchanged = response["nm"].as<int>() == 1;
+  if (image.unchanged) {
+    return true;
+  }
+
+  if (response["status"] != "success") {
+    Serial.print("Check failed: ");
+    Serial.println(response["message"].as<String>());
+    return false;
+  }
+
+  image.name = response["name"].as<String>();
+  image.version = response["version"].as<String>();
+  image.size = response["size"].as<size_t>();
+  image.md5 = response["md5"].as<String>();
+  image.sha256 = response["sha256"] | "";
+  image.token = response["token"] | "";
+  session_id = response["sessionId"].as<String>();
+
+  return true;
+}
+
+bool TcpTransport::check(const char* current_version, FotaImage& image) {
+  this->current_version = current_version;
+
+  bool ok = startSession(image, image.token);
+  close();
+  return ok;
+}
+
+bool TcpTransport::open(const FotaImage& image) {
+  // Downloads are tied to a server session, which a check creates (or resumes)
+  FotaImage announced;
+  if (!startSession(announced) || announced.unchanged) {
+    return false;
+  }
+
+  if (announced.md5 != image.md5) {
+    Serial.println("Server announced a different image");
+    return false;
+  }
+
+  return true;
+}
+
+bool TcpTransport::requestRange(size_t offset, size_t length) {
+  StaticJsonDocument<256> request;
+  request["device"] = device_id;
+  request["action"] = "download";
+  request["sessionId"] = session_id;
+  request["offset"] = offset;
+  request["size"] = min(length, (size_t)TCP_TRANSPORT_MAX_RANGE);
+  request["encoding"] = "identity";
+
+  StaticJsonDocument<256> header;
+  if (!sendRequest(request) || !readHeader(header)) {
+    return false;
+  }
+
+  // Error responses carry a status key, chunks only the compact header
+  if (!header["status"].isNull()) {
+    Serial.print("Download error: ");
+    Serial.println(header["message"].as<String>());
+    return false;
+  }
+
+  if (header["o"].as<size_t>() != offset) {
+    Serial.println("Chunk offset mismatch");
+    return false;
+  }
+
+  range_remaining = header["s"].as<size_t>();
+  return range_remaining > 0;
+}
+
+int TcpTransport::read(uint8_t* dest, size_t max_length, unsigned long timeout) {
+  if (range_remaining == 0) {
+    return 0;
+  }
+
+  size_t received = modem.readRaw(dest, min(max_length, range_remaining), timeout);
+  if (received == 0) {
+    return -1;
+  }
+
+  range_remaining -= received;
+  return received;
+}
+
+void TcpTransport::close() {
+  range_remaining = 0;
+  modem.tcpClose();
+}
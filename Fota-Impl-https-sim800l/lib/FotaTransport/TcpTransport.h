@@ -0,0 +1,39 @@
+#ifndef TCP_TRANSPORT_H
+#define TCP_TRANSPORT_H
+
+#include <ArduinoJson.h>
+#include "FotaTransport.h"
+
+#define TCP_TRANSPORT_MAX_RANGE  1024   // Server caps a chunk at MAX_CHUNK_SIZE
+#define TCP_TRANSPORT_TIMEOUT    5000
+
+// Raw TCP FOTA protocol (server port 8266): newline-delimited JSON requests,
+// length-prefixed chunks {"s":<size>,"o":<offset>,...}\n<size bytes>.
+class TcpTransport : public FotaTransport {
+  private:
+    ModemAT& modem;
+    const char* server_host;
+    int server_port;
+    String device_id;
+    String current_version;
+    String session_id;
+    size_t range_remaining = 0;
+
+    bool connect();
+    bool sendRequest(const JsonDocument& doc);
+    bool readHeader(JsonDocument& doc);
+    bool startSession(FotaImage& image, const String& token = "");
+
+  public:
+    TcpTransport(ModemAT& modem, const char* host, int port, const char* device, const char* version);
+
+    const char* name() const override { return "tcp"; }
+    size_t maxRange() const override { return TCP_TRANSPORT_MAX_RANGE; }
+    bool check(const char* current_version, FotaImage& image) override;
+    bool open(const FotaImage& image) override;
+    bool requestRange(size_t offset, size_t length) override;
+    int read(uint8_t* dest, size_t max_length, unsigned long timeout) override;
+    void close() override;
+};
+
+#endif // TCP_TRANSPORT_H
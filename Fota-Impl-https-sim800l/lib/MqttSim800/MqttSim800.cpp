@@ -0,0 +1,679 @@
+#include "MqttSim800.h"
+
+// MQTT Packet Types
+#define MQTT_CONNECT          0x10
+#define MQTT_CONNACK          0x20
+#define MQTT_PUBLISH          0x30
+#define MQTT_PUBACK           0x40
+#define MQTT_SUBSCRIBE        0x82
+#define MQTT_SUBACK           0x90
+#define MQTT_PINGREQ          0xC0
+#define MQTT_PINGRESP         0xD0
+#define MQTT_DISCONNECT       0xE0
+
+// FNV-1a, 32 bit
+#define TOPIC_HASH_OFFSET     2166136261UL
+#define TOPIC_HASH_PRIME      16777619UL
+
+uint8_t MqttSim800::tx_buffer[MQTT_SIM800_MAX_PACKET];
+uint8_t MqttSim800::rx_buffer[MQTT_SIM800_MAX_PACKET];
+uint8_t MqttSim800::held_buffer[MQTT_SIM800_MAX_PACKET];
+
+MqttSim800::MqttSim800(Stream& serial) : link(serial, *this) {
+  lock = xSemaphoreCreateRecursiveMutex();
+}
+
+// ==================== TCP stream from the link ====================
+
+void MqttSim800::frameStart(size_t length) {
+  bytes_received += length;
+  last_alive_ms = millis();
+}
+
+// Payload bytes go straight from the UART into their destination
+uint8_t* MqttSim800::frameBuffer(size_t& length) {
+  if (rx_state != RX_PAYLOAD) {
+    return nullptr;
+  }
+  length = min(length, rx_length - rx_pos);
+  return rx_payload + (rx_pos - rx_payload_start);
+}
+
+void MqttSim800::frameWritten(size_t count, bool end) {
+  rx_pos += count;
+  if (rx_pos == rx_length) {
+    finishPublish();
+  }
+}
+
+void MqttSim800::closed() {
+  // A broker restart or a dropped bearer, not the carrier's idle timeout
+  Serial.println("MQTT connection closed by peer");
+  loss_idle_ms = 0;
+  is_connected = false;
+}
+
+// ==================== MQTT packet parser ====================
+
+// PUBLISH is decoded field by field (topic length, topic, packet id, payload) so the
+// topic is hashed as it arrives and the payload lands directly where its route wants it.
+// Every other packet is small and goes through rx_buffer.
+void MqttSim800::parseByte(uint8_t c) {
+  switch (rx_state) {
+    case RX_TYPE:
+      rx_type = c;
+      rx_length = 0;
+      rx_multiplier = 1;
+      rx_state = RX_LENGTH;
+      break;
+
+    case RX_LENGTH:
+      rx_length += (c & 0x7F) * rx_multiplier;
+      rx_multiplier *= 128;
+      if (c & 0x80) {
+        break;
+      }
+      rx_pos = 0;
+      if ((rx_type & 0xF0) == MQTT_PUBLISH && rx_length >= 2) {
+        rx_topic_length = 0;
+        rx_hash = TOPIC_HASH_OFFSET;
+        rx_state = RX_TOPIC_LENGTH;
+      } else if (rx_length == 0) {
+        handlePacket();
+        rx_state = RX_TYPE;
+      } else {
+        rx_state = RX_BODY;
+      }
+      break;
+
+    case RX_BODY:
+      if (rx_pos < MQTT_SIM800_MAX_PACKET) {
+        rx_buffer[rx_pos] = c;
+      }
+      rx_pos++;
+      if (rx_pos == rx_length) {
+        rx_state = RX_TYPE;
+        if (rx_length <= MQTT_SIM800_MAX_PACKET) {
+          handlePacket();
+        } else {
+          Serial.println("MQTT packet too large, dropped");
+        }
+      }
+      break;
+
+    case RX_TOPIC_LENGTH:
+      rx_topic_length = (rx_topic_length << 8) | c;
+      rx_pos++;
+      if (rx_pos == 2) {
+        rx_state = RX_TOPIC;
+        if (2 + rx_topic_length > rx_length) {
+          rx_state = RX_SKIP;
+        } else if (rx_topic_length == 0) {
+          endTopic();
+        }
+      }
+      break;
+
+    case RX_TOPIC: {
+      size_t index = rx_pos - 2;
+      if (index < MQTT_SIM800_MAX_TOPIC - 1) {
+        rx_topic[index] = c;
+      }
+      rx_hash = (rx_hash ^ c) * TOPIC_HASH_PRIME;
+      rx_pos++;
+      if (index + 1 == rx_topic_length) {
+        endTopic();
+      }
+      break;
+    }
+
+    case RX_PACKET_ID:
+      rx_packet_id = (rx_packet_id << 8) | c;
+      rx_pos++;
+      if (rx_pos == 2 + rx_topic_length + 2) {
+        beginPayload();
+      }
+      break;
+
+    case RX_PAYLOAD:
+      rx_payload[rx_pos - rx_payload_start] = c;
+      rx_pos++;
+      if (rx_pos == rx_length) {
+        finishPublish();
+      }
+      break;
+
+    case RX_SKIP:
+      rx_pos++;
+      if (rx_pos >= rx_length) {
+        rx_state = RX_TYPE;
+      }
+      break;
+  }
+}
+
+void MqttSim800::endTopic() {
+  rx_topic[min(rx_topic_length, (size_t)MQTT_SIM800_MAX_TOPIC - 1)] = '\0';
+
+  size_t header = 2 + rx_topic_length + (((rx_type >> 1) & 0x03) ? 2 : 0);
+  if (header > rx_length) {
+    rx_state = RX_SKIP;
+    return;
+  }
+
+  if (header > rx_pos) {
+    rx_packet_id = 0;
+    rx_state = RX_PACKET_ID;
+    return;
+  }
+
+  beginPayload();
+}
+
+void MqttSim800::beginPayload() {
+  size_t length = rx_length - rx_pos;
+
+  rx_route = findRoute(rx_hash, rx_topic_length);
+  rx_payload_start = rx_pos;
+
+  if (rx_route >= 0 && routes[rx_route].sink != nullptr) {
+    // Streamed topic: the route owns the destination buffer
+    rx_payload = routes[rx_route].sink(length, routes[rx_route].context);
+  } else if (length <= MQTT_SIM800_MAX_PACKET) {
+    rx_payload = rx_buffer;
+  } else {
+    Serial.println("MQTT message too large, dropped");
+    rx_payload = nullptr;
+  }
+
+  // Skipped QoS 1 messages are not acknowledged, so the broker sends them again
+  if (rx_payload == nullptr) {
+    rx_state = length > 0 ? RX_SKIP : RX_TYPE;
+    return;
+  }
+
+  rx_state = RX_PAYLOAD;
+  if (length == 0) {
+    finishPublish();
+  }
+}
+
+void MqttSim800::finishPublish() {
+  size_t length = rx_length - rx_payload_start;
+  rx_state = RX_TYPE;
+
+  if (!dispatch_ready) {
+    // Outside loop() (mid-send or mid-ack) the handler could not publish, so hold it.
+    // Streamed payloads already sit in their own sink buffers, so several can wait.
+    HeldMessage* held = &held_message;
+    if (rx_payload != rx_buffer) {
+      for (size_t i = 0; i < MQTT_SIM800_HELD_STREAMS; i++) {
+        held = &held_streams[i];
+        if (!held->pending) {
+          break;
+        }
+      }
+    }
+
+    if (held->pending) {
+      Serial.println("MQTT message dropped, too many held");
+      return;
+    }
+    held->route = rx_route;
+    held->length = length;
+    held->data = rx_payload;
+    if (rx_payload == rx_buffer) {
+      memcpy(held_buffer, rx_buffer, length);
+      held->data = held_buffer;
+      strcpy(held_topic, rx_topic);
+    }
+    held->pending = true;
+  }
+
+  if (((rx_type >> 1) & 0x03) && puback_count < MQTT_SIM800_PUBACK_QUEUE) {
+    puback_queue[puback_count++] = rx_packet_id;
+  }
+
+  if (dispatch_ready) {
+    dispatchPublish(rx_route, rx_topic, rx_payload, length);
+  }
+}
+
+int MqttSim800::findRoute(uint32_t hash, size_t topic_length) const {
+  for (size_t i = 0; i < route_count; i++) {
+    if (routes[i].hash == hash && routes[i].length == topic_length) {
+      // Confirm on a hash hit when the topic fit in rx_topic
+      if (topic_length < MQTT_SIM800_MAX_TOPIC && memcmp(routes[i].topic, rx_topic, topic_length) != 0) {
+        continue;
+      }
+      return i;
+    }
+  }
+  return -1;
+}
+
+uint32_t MqttSim800::topicHash(const char* topic, size_t length) {
+  uint32_t hash = TOPIC_HASH_OFFSET;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)topic[i]) * TOPIC_HASH_PRIME;
+  }
+  return hash;
+}
+
+void MqttSim800::handlePacket() {
+  uint8_t type = rx_type & 0xF0;
+  uint16_t packet_id = rx_length >= 2 ? (rx_buffer[0] << 8) | rx_buffer[1] : 0;
+
+  switch (type) {
+    case MQTT_CONNACK:
+      connack_code = rx_length >= 2 ? rx_buffer[1] : 0xFF;
+      connack_received = true;
+      break;
+
+    case MQTT_PUBACK:
+    case MQTT_SUBACK:
+      if (type == awaiting_type && packet_id == awaiting_id) {
+        ack_code = type == MQTT_SUBACK && rx_length >= 3 ? rx_buffer[2] : 0;
+        ack_received = true;
+      }
+      break;
+
+    case MQTT_PINGRESP:
+      last_pingresp = millis();
+      if (ping_outstanding) {
+        ping_outstanding = false;
+        answered_idle_ms = ping_idle_ms;
+        ping_responses++;
+      }
+      break;
+  }
+}
+
+void MqttSim800::dispatchPublish(int route, const char* topic, uint8_t* payload, size_t length) {
+  bool ready = dispatch_ready;
+  dispatch_ready = false;
+
+  if (route >= 0) {
+    routes[route].handler(payload, length, routes[route].context);
+  } else if (message_callback != nullptr) {
+    message_callback(topic, payload, length, callback_context);
+  }
+
+  dispatch_ready = ready;
+}
+
+// ==================== Packet building and sending ====================
+
+// Packets are built after whatever is already batched; the returned length covers the batch
+size_t MqttSim800::beginPacket(uint8_t header, size_t remaining_length) {
+  // Header is at most 5 bytes; send the batch first if this packet would not fit behind it.
+  // A batch that cannot go out is given up rather than overrun tx_buffer.
+  if (batch_length > 0 && batch_length + 5 + remaining_length > MQTT_SIM800_MAX_SEND && !flush()) {
+    dropped_packets += batch_packets;
+    batch_length = 0;
+    batch_packets = 0;
+    batch_failures = 0;
+  }
+
+  size_t length = batch_length;
+  tx_buffer[length++] = header;
+
+  // Variable-length remaining length, 7 bits per byte
+  do {
+    uint8_t digit = remaining_length % 128;
+    remaining_length /= 128;
+    if (remaining_length > 0) {
+      digit |= 0x80;
+    }
+    tx_buffer[length++] = digit;
+  } while (remaining_length > 0);
+
+  return length;
+}
+
+size_t MqttSim800::writeString(uint8_t* dest, const char* str) {
+  size_t length = strlen(str);
+  dest[0] = length >> 8;
+  dest[1] = length & 0xFF;
+  memcpy(dest + 2, str, length);
+  return length + 2;
+}
+
+// Adds the packet just built to the batch. Unless it waits for a reply, it stays there
+// until the batch is full or loop() finds its deadline passed.
+bool MqttSim800::sendPacket(size_t length, bool immediate) {
+  if (batch_packets == 0) {
+    batch_started = millis();
+  }
+  batch_length = length;
+  batch_packets++;
+
+  if (immediate || batch_limit == 0 || batch_length >= batch_limit) {
+    return flush();
+  }
+  return true;
+}
+
+bool MqttSim800::flush() {
+  lockClient();
+
+  if (batch_length == 0) {
+    unlockClient();
+    return true;
+  }
+
+  // A steady flow of batches keeps the keep-alive ping from ever being due, so ask
+  // for a PINGRESP along the way to know the connection is still alive
+  if (batch_limit > 0 && is_connected && batch_length + 2 <= MQTT_SIM800_MAX_SEND &&
+      millis() - last_pingreq > keep_alive_s * 500UL) {
+    tx_buffer[batch_length++] = MQTT_PINGREQ;
+    tx_buffer[batch_length++] = 0;
+    batch_packets++;
+    last_pingreq = millis();
+    // Rides along with traffic, so it says nothing about how long the link may idle
+    ping_outstanding = true;
+    ping_idle_ms = 0;
+  }
+
+  size_t length = batch_length;
+  size_t packets = batch_packets;
+
+  unsigned long start = millis();
+
+  if (!link.send(tx_buffer, length)) {
+    Serial.printf("MQTT send failed (%u packets)\n", (unsigned)packets);
+    bool ok = failBatch();
+    unlockClient();
+    return ok;
+  }
+
+  batch_length = 0;
+  batch_packets = 0;
+  batch_failures = 0;
+
+  uint32_t elapsed = millis() - start;
+  uint32_t latency = millis() - batch_started;
+  send_count++;
+  send_total_ms += elapsed;
+  send_max_ms = max(send_max_ms, elapsed);
+  bytes_sent += length;
+  packet_count += packets;
+  batch_latency_total_ms += latency;
+  batch_latency_max_ms = max(batch_latency_max_ms, latency);
+  last_send_ms = millis();
+  last_alive_ms = last_send_ms;
+
+  unlockClient();
+  return true;
+}
+
+// The batch stays in tx_buffer for the next flush (packets built meanwhile go behind
+// it) until it has failed MQTT_SIM800_FLUSH_RETRIES times. Always false: the caller
+// reports it, and QoS 1 senders may retry (duplicates are within QoS 1).
+bool MqttSim800::failBatch() {
+  if (++batch_failures >= MQTT_SIM800_FLUSH_RETRIES) {
+    Serial.printf("MQTT batch dropped after %u failed sends (%u packets)\n",
+                  (unsigned)batch_failures, (unsigned)batch_packets);
+    dropped_packets += batch_packets;
+    batch_length = 0;
+    batch_packets = 0;
+    batch_failures = 0;
+  }
+  return false;
+}
+
+bool MqttSim800::sendAck(uint8_t type, uint16_t packet_id) {
+  size_t length = beginPacket(type, 2);
+  tx_buffer[length++] = packet_id >> 8;
+  tx_buffer[length++] = packet_id & 0xFF;
+  return sendPacket(length, false);
+}
+
+// Armed before the send: the acknowledgement can arrive ahead of SEND OK
+void MqttSim800::expectAck(uint8_t type, uint16_t packet_id) {
+  awaiting_type = type;
+  awaiting_id = packet_id;
+  ack_received = false;
+}
+
+bool MqttSim800::waitForAck() {
+  bool acked = link.waitFor(ack_received, MQTT_SIM800_ACK_TIMEOUT);
+  awaiting_type = 0;
+  return acked;
+}
+
+uint16_t MqttSim800::packetId() {
+  if (next_packet_id == 0) {
+    next_packet_id = 1;
+  }
+  return next_packet_id++;
+}
+
+// ==================== Public API ====================
+
+bool MqttSim800::connect(const char* host, int port, const char* client_id, uint16_t keep_alive) {
+  lockClient();
+
+  is_connected = false;
+  keep_alive_s = keep_alive;
+  loss_idle_ms = 0;
+  link.reset();
+  rx_state = RX_TYPE;
+  puback_count = 0;
+  held_message.pending = false;
+  for (size_t i = 0; i < MQTT_SIM800_HELD_STREAMS; i++) {
+    held_streams[i].pending = false;
+  }
+  batch_length = 0;
+  batch_packets = 0;
+  batch_failures = 0;
+
+  // Frame incoming data as +IPD,<len>: so it can be told apart from AT responses
+  link.command("AT+CIPHEAD=1", "OK");
+
+  String cmd = "AT+CIPSTART=\"TCP\",\"" + String(host) + "\",\"" + String(port) + "\"";
+  if (!link.command(cmd, "CONNECT", MQTT_SIM800_CONNECT_TIMEOUT)) {
+    Serial.println("TCP connection to broker failed");
+    unlockClient();
+    return false;
+  }
+
+  // CONNECT: protocol "MQTT" level 4, clean session
+  size_t client_length = strlen(client_id);
+  size_t length = beginPacket(MQTT_CONNECT, 10 + 2 + client_length);
+  length += writeString(tx_buffer + length, "MQTT");
+  tx_buffer[length++] = 0x04;
+  tx_buffer[length++] = 0x02;
+  tx_buffer[length++] = keep_alive >> 8;
+  tx_buffer[length++] = keep_alive & 0xFF;
+  length += writeString(tx_buffer + length, client_id);
+
+  connack_received = false;
+  if (!sendPacket(length) || !link.waitFor(connack_received, MQTT_SIM800_ACK_TIMEOUT) || connack_code != 0) {
+    Serial.printf("MQTT CONNECT failed (code %d)\n", connack_received ? connack_code : -1);
+    unlockClient();
+    return false;
+  }
+
+  Serial.println(">> MQTT connected");
+  is_connected = true;
+  last_pingresp = millis();
+  last_pingreq = millis();
+  ping_outstanding = false;
+  unlockClient();
+  return true;
+}
+
+void MqttSim800::disconnect() {
+  lockClient();
+
+  if (is_connected) {
+    size_t length = beginPacket(MQTT_DISCONNECT, 0);
+    sendPacket(length);
+    is_connected = false;
+  }
+  link.command("AT+CIPCLOSE", "CLOSE OK");
+
+  unlockClient();
+}
+
+bool MqttSim800::subscribe(const char* topic, uint8_t qos) {
+  lockClient();
+
+  uint16_t id = packetId();
+  size_t length = beginPacket(MQTT_SUBSCRIBE, 2 + 2 + strlen(topic) + 1);
+  tx_buffer[length++] = id >> 8;
+  tx_buffer[length++] = id & 0xFF;
+  length += writeString(tx_buffer + length, topic);
+  tx_buffer[length++] = qos;
+
+  expectAck(MQTT_SUBACK, id);
+  bool ok = sendPacket(length) && waitForAck() && ack_code != 0x80;
+  Serial.printf(">> MQTT SUBSCRIBE %s (QoS %d): %s\n", topic, qos, ok ? "granted" : "failed");
+
+  unlockClient();
+  return ok;
+}
+
+bool MqttSim800::publish(const char* topic, const uint8_t* payload, size_t length, uint8_t qos, bool retain) {
+  size_t topic_length = strlen(topic);
+  size_t remaining = 2 + topic_length + (qos > 0 ? 2 : 0) + length;
+
+  // Header is at most 5 bytes; a packet has to fit in one CIPSEND
+  if (remaining + 5 > MQTT_SIM800_MAX_SEND) {
+    Serial.println("MQTT publish too large");
+    return false;
+  }
+
+  lockClient();
+
+  uint8_t header = MQTT_PUBLISH | (qos > 0 ? 0x02 : 0x00) | (retain ? 0x01 : 0x00);
+  size_t packet_length = beginPacket(header, remaining);
+  packet_length += writeString(tx_buffer + packet_length, topic);
+
+  uint16_t id = 0;
+  if (qos > 0) {
+    id = packetId();
+    tx_buffer[packet_length++] = id >> 8;
+    tx_buffer[packet_length++] = id & 0xFF;
+  }
+
+  memcpy(tx_buffer + packet_length, payload, length);
+  packet_length += length;
+
+  // QoS 0 may wait in the batch; QoS 1 goes out now to be acknowledged
+  if (qos > 0) {
+    expectAck(MQTT_PUBACK, id);
+  }
+  bool ok = sendPacket(packet_length, qos > 0) && (qos == 0 || waitForAck());
+
+  unlockClient();
+  return ok;
+}
+
+bool MqttSim800::route(const char* topic, PayloadHandler handler, PayloadSink sink, void* context) {
+  if (handler == nullptr || route_count >= MQTT_SIM800_MAX_ROUTES) {
+    return false;
+  }
+
+  lockClient();
+  TopicRoute& entry = routes[route_count];
+  entry.topic = topic;
+  entry.length = strlen(topic);
+  entry.hash = topicHash(topic, entry.length);
+  entry.handler = handler;
+  entry.sink = sink;
+  entry.context = context;
+  route_count++;
+  unlockClient();
+  return true;
+}
+
+bool MqttSim800::ping() {
+  lockClient();
+  size_t length = beginPacket(MQTT_PINGREQ, 0);
+  last_pingreq = millis();
+  ping_outstanding = true;
+  ping_idle_ms = idleMs();
+  bool ok = sendPacket(length);
+  unlockClient();
+  return ok;
+}
+
+bool MqttSim800::query(const char* cmd, const char* expected, char* response, size_t size, unsigned long timeout) {
+  lockClient();
+  bool ok = link.command(cmd, expected, timeout, response, size);
+  unlockClient();
+  return ok;
+}
+
+void MqttSim800::setBatching(size_t max_bytes, uint16_t max_delay_ms) {
+  lockClient();
+  flush();
+  batch_limit = min(max_bytes, (size_t)MQTT_SIM800_MAX_SEND);
+  batch_delay_ms = max_delay_ms;
+  unlockClient();
+}
+
+bool MqttSim800::holdsBuffer(const uint8_t* buffer) {
+  lockClient();
+  bool held = rx_state == RX_PAYLOAD && rx_payload == buffer;
+  for (size_t i = 0; i < MQTT_SIM800_HELD_STREAMS && !held; i++) {
+    held = held_streams[i].pending && held_streams[i].data == buffer;
+  }
+  unlockClient();
+  return held;
+}
+
+void MqttSim800::loop() {
+  lockClient();
+
+  dispatch_ready = true;
+  link.pump();
+  dispatch_ready = false;
+
+  // Messages that arrived while a send was in progress
+  for (size_t i = 0; i < MQTT_SIM800_HELD_STREAMS; i++) {
+    HeldMessage& held = held_streams[i];
+    if (held.pending) {
+      held.pending = false;
+      dispatchPublish(held.route, nullptr, held.data, held.length);
+    }
+  }
+  if (held_message.pending) {
+    held_message.pending = false;
+    dispatchPublish(held_message.route, held_topic, held_message.data, held_message.length);
+  }
+
+  // Acknowledge QoS 1 messages handled by the callback (more may arrive while we send).
+  // The acks of one pass share a CIPSEND but never wait for the batch deadline: the
+  // broker holds its next messages until they arrive.
+  uint16_t pending[MQTT_SIM800_PUBACK_QUEUE];
+  size_t pending_count = puback_count;
+  memcpy(pending, puback_queue, pending_count * sizeof(uint16_t));
+  puback_count = 0;
+  for (size_t i = 0; i < pending_count; i++) {
+    sendAck(MQTT_PUBACK, pending[i]);
+  }
+
+  if (batch_length > 0 && (pending_count > 0 || millis() - batch_started >= batch_delay_ms)) {
+    flush();
+  }
+
+  // Keep-alive: ping after three quarters of the interval without sending, or once
+  // the link has idled for the ping interval (the carrier's NAT binding may expire first)
+  if (is_connected && !ping_outstanding &&
+      (millis() - last_send_ms > keep_alive_s * 750UL ||
+       (ping_interval_s > 0 && idleMs() >= ping_interval_s * 1000UL))) {
+    ping();
+  }
+
+  if (is_connected && ping_outstanding && millis() - last_pingreq > MQTT_SIM800_PING_TIMEOUT) {
+    Serial.printf("MQTT ping unanswered after %lu s idle\n", ping_idle_ms / 1000);
+    loss_idle_ms = ping_idle_ms;
+    ping_outstanding = false;
+    is_connected = false;
+  }
+
+  unlockClient();
+}
@@ -0,0 +1,247 @@
+#ifndef MQTT_SIM800_H
+#define MQTT_SIM800_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <Sim800Link.h>
+
+#define MQTT_SIM800_MAX_PACKET     1536   // One static buffer each way
+#define MQTT_SIM800_MAX_SEND       1460   // Largest single AT+CIPSEND
+#define MQTT_SIM800_MAX_TOPIC      128
+#define MQTT_SIM800_PUBACK_QUEUE   8      // QoS 1 messages received but not yet acknowledged
+#define MQTT_SIM800_MAX_ROUTES     4
+#define MQTT_SIM800_HELD_STREAMS   4      // Streamed messages held while a send is in progress
+#define MQTT_SIM800_FLUSH_RETRIES  3      // Failed CIPSENDs of one batch before it is dropped
+
+// Timeouts
+#define MQTT_SIM800_AT_TIMEOUT     2000
+#define MQTT_SIM800_CONNECT_TIMEOUT 10000
+#define MQTT_SIM800_ACK_TIMEOUT    10000
+#define MQTT_SIM800_PING_TIMEOUT   15000  // No PINGRESP: the session is treated as lost
+
+// MQTT 3.1.1 client over the SIM800L TCP stack (AT+CIPSTART / AT+CIPSEND=<len>).
+//
+// Incoming TCP data is framed with AT+CIPHEAD=1 ("+IPD,<len>:"), so AT responses
+// and MQTT bytes can share the UART (see Sim800Link): sends wait for the '>' prompt
+// and SEND OK instead of fixed delays, and CONNACK/SUBACK/PUBACK/PINGRESP are tracked.
+// All calls are serialised by a recursive mutex, so a publish from another task
+// or from inside the message callback is safe. The callback only runs from
+// loop(); a message that arrives while waiting on a send or an ack is held there.
+//
+// With batching enabled, QoS 0 publishes and PINGREQs are appended to tx_buffer
+// and go out together in one CIPSEND once the batch is full or its deadline passes
+// (checked by loop()). PUBACKs are batched only with each other and whatever is
+// already waiting: loop() flushes them before it returns, since the broker's
+// inflight window waits on them. Packets that wait for a reply (CONNECT, SUBSCRIBE,
+// QoS 1 PUBLISH) flush the batch along with themselves. A batch whose CIPSEND fails
+// stays queued for the next flush, and is dropped (and counted) after
+// MQTT_SIM800_FLUSH_RETRIES attempts.
+class MqttSim800 : private Sim800Link::Receiver {
+  public:
+    // Payload points into the shared receive buffer: it is valid until the callback
+    // returns or calls back into the client.
+    typedef void (*MessageCallback)(const char* topic, const uint8_t* payload, size_t length, void* context);
+
+    // Routed topics: the sink returns where the parser should write a payload of
+    // `length` bytes (nullptr skips the message), the handler runs once it is complete.
+    typedef uint8_t* (*PayloadSink)(size_t length, void* context);
+    typedef void (*PayloadHandler)(uint8_t* payload, size_t length, void* context);
+
+    explicit MqttSim800(Stream& serial);
+
+    bool connect(const char* host, int port, const char* client_id, uint16_t keep_alive = 60);
+    void disconnect();
+    bool connected() const { return is_connected; }
+
+    bool subscribe(const char* topic, uint8_t qos = 0);
+    // QoS 0 returns once the packet is batched; QoS 1 once the PUBACK arrives
+    bool publish(const char* topic, const uint8_t* payload, size_t length, uint8_t qos = 0, bool retain = false);
+    bool publish(const char* topic, const char* message, uint8_t qos = 0) {
+      return publish(topic, (const uint8_t*)message, strlen(message), qos);
+    }
+    bool ping();
+
+    // Idle time after which loop() pings, independent of the keep-alive announced in
+    // CONNECT (which stays the broker's limit). 0: three quarters of the keep-alive.
+    void setPingInterval(uint16_t seconds) { ping_interval_s = seconds; }
+
+    // Time since the link last proved alive: a SEND OK or data from the broker
+    unsigned long idleMs() const { return millis() - last_alive_ms; }
+
+    // Idle time ahead of the latest answered ping, and ahead of the idle probe ping
+    // left unanswered that lost the session. 0 when the session ended any other way
+    // (the peer closing, or a ping sent along with traffic).
+    uint32_t pingResponses() const { return ping_responses; }
+    unsigned long pingIdleMs() const { return answered_idle_ms; }
+    unsigned long lossIdleMs() const { return loss_idle_ms; }
+    // AT command between MQTT packets (e.g. signal quality); the response line
+    // containing `expected` is copied into `response`
+    bool query(const char* cmd, const char* expected, char* response, size_t size,
+               unsigned long timeout = MQTT_SIM800_AT_TIMEOUT);
+
+    // Coalesce packets into CIPSENDs of up to max_bytes, held at most max_delay_ms.
+    // 0 bytes (the default) sends every packet on its own.
+    void setBatching(size_t max_bytes, uint16_t max_delay_ms);
+
+    // Send whatever is batched now; false if it did not go out (it is kept for a retry)
+    bool flush();
+
+    // Drain the UART, dispatch messages, acknowledge QoS 1, flush due batches and
+    // keep the session alive
+    void loop();
+
+    void setCallback(MessageCallback callback, void* context = nullptr) {
+      message_callback = callback;
+      callback_context = context;
+    }
+
+    // Dispatch a topic by its precomputed hash instead of the generic callback. With a
+    // sink the payload is streamed into the caller's buffer, never into rx_buffer.
+    // The topic string must outlive the client.
+    bool route(const char* topic, PayloadHandler handler, PayloadSink sink = nullptr, void* context = nullptr);
+
+    // True while a sink buffer is being written by the parser or is held for the next
+    // loop(); the route owner must not hand it out again until it is dispatched
+    bool holdsBuffer(const uint8_t* buffer);
+
+    // Send statistics: CIPSEND to SEND OK, per modem send
+    uint32_t sendCount() const { return send_count; }
+    uint32_t sendAverageMs() const { return send_count ? send_total_ms / send_count : 0; }
+    uint32_t sendMaxMs() const { return send_max_ms; }
+
+    // Bytes through the socket (MQTT only, without TCP/IP headers)
+    uint32_t bytesSent() const { return bytes_sent; }
+    uint32_t bytesReceived() const { return bytes_received; }
+
+    // Batching statistics: MQTT packets per CIPSEND, and first packet queued to SEND OK
+    uint32_t packetCount() const { return packet_count; }
+    float packetsPerSend() const { return send_count ? (float)packet_count / send_count : 0; }
+    uint32_t batchLatencyAverageMs() const { return send_count ? batch_latency_total_ms / send_count : 0; }
+    uint32_t batchLatencyMaxMs() const { return batch_latency_max_ms; }
+    // Packets lost with batches that failed MQTT_SIM800_FLUSH_RETRIES times
+    uint32_t droppedPackets() const { return dropped_packets; }
+    unsigned long lastPingResponse() const { return last_pingresp; }
+
+  private:
+    enum RxState { RX_TYPE, RX_LENGTH, RX_BODY, RX_TOPIC_LENGTH, RX_TOPIC, RX_PACKET_ID, RX_PAYLOAD, RX_SKIP };
+
+    struct TopicRoute {
+      const char* topic;
+      size_t length;
+      uint32_t hash;
+      PayloadHandler handler;
+      PayloadSink sink;
+      void* context;
+    };
+
+    struct HeldMessage {
+      bool pending = false;
+      int route = -1;
+      uint8_t* data = nullptr;
+      size_t length = 0;
+    };
+
+    Sim800Link link;
+    SemaphoreHandle_t lock;
+
+    // Single static packet buffers (tx_buffer also holds the outgoing batch)
+    static uint8_t tx_buffer[MQTT_SIM800_MAX_PACKET];
+    static uint8_t rx_buffer[MQTT_SIM800_MAX_PACKET];
+    static uint8_t held_buffer[MQTT_SIM800_MAX_PACKET];   // A PUBLISH that arrived outside loop()
+    char held_topic[MQTT_SIM800_MAX_TOPIC];
+    HeldMessage held_message;       // Payload copied to held_buffer
+    HeldMessage held_streams[MQTT_SIM800_HELD_STREAMS];  // Payloads left in their route's sink buffer
+    bool dispatch_ready = false;    // Only loop() runs the callback
+
+    // MQTT packet parser
+    RxState rx_state = RX_TYPE;
+    uint8_t rx_type = 0;
+    size_t rx_length = 0;
+    size_t rx_pos = 0;
+    uint32_t rx_multiplier = 1;
+    char rx_topic[MQTT_SIM800_MAX_TOPIC];
+    size_t rx_topic_length = 0;
+    uint32_t rx_hash = 0;
+    uint16_t rx_packet_id = 0;
+    int rx_route = -1;
+    uint8_t* rx_payload = nullptr;  // rx_buffer or a route's sink
+    size_t rx_payload_start = 0;
+
+    TopicRoute routes[MQTT_SIM800_MAX_ROUTES];
+    size_t route_count = 0;
+
+    // Session and acknowledgement tracking
+    bool is_connected = false;
+    uint16_t keep_alive_s = 60;
+    unsigned long last_send_ms = 0;
+    unsigned long last_pingresp = 0;
+    unsigned long last_pingreq = 0;
+    unsigned long last_alive_ms = 0;
+    uint16_t ping_interval_s = 0;
+    bool ping_outstanding = false;
+    unsigned long ping_idle_ms = 0;     // Idle time when the outstanding ping was sent
+    unsigned long answered_idle_ms = 0;
+    unsigned long loss_idle_ms = 0;
+    uint32_t ping_responses = 0;
+    uint16_t next_packet_id = 1;
+    bool connack_received = false;
+    uint8_t connack_code = 0;
+    uint8_t awaiting_type = 0;
+    uint16_t awaiting_id = 0;
+    bool ack_received = false;
+    uint8_t ack_code = 0;
+    uint16_t puback_queue[MQTT_SIM800_PUBACK_QUEUE];
+    size_t puback_count = 0;
+
+    MessageCallback message_callback = nullptr;
+    void* callback_context = nullptr;
+
+    // Outgoing batch: tx_buffer[0, batch_length)
+    size_t batch_limit = 0;
+    uint16_t batch_delay_ms = 0;
+    size_t batch_length = 0;
+    size_t batch_packets = 0;
+    unsigned long batch_started = 0;
+    uint8_t batch_failures = 0;
+
+    uint32_t send_count = 0;
+    uint32_t send_total_ms = 0;
+    uint32_t send_max_ms = 0;
+    uint32_t bytes_sent = 0;
+    uint32_t bytes_received = 0;
+    uint32_t packet_count = 0;
+    uint32_t batch_latency_total_ms = 0;
+    uint32_t batch_latency_max_ms = 0;
+    uint32_t dropped_packets = 0;
+
+    // Sim800Link::Receiver: the TCP stream, +IPD frame by frame
+    void frameStart(size_t length) override;
+    uint8_t* frameBuffer(size_t& length) override;
+    void frameWritten(size_t count, bool end) override;
+    void frameByte(uint8_t c, bool end) override { parseByte(c); }
+    void closed() override;
+
+    void parseByte(uint8_t c);
+    void handlePacket();
+    void endTopic();
+    void beginPayload();
+    void finishPublish();
+    int findRoute(uint32_t hash, size_t topic_length) const;
+    static uint32_t topicHash(const char* topic, size_t length);
+    void dispatchPublish(int route, const char* topic, uint8_t* payload, size_t length);
+
+    size_t beginPacket(uint8_t header, size_t remaining_length);
+    static size_t writeString(uint8_t* dest, const char* str);
+    bool sendPacket(size_t length, bool immediate = true);
+    bool failBatch();
+    bool sendAck(uint8_t type, uint16_t packet_id);
+    void expectAck(uint8_t type, uint16_t packet_id);
+    bool waitForAck();
+    uint16_t packetId();
+
+    void lockClient() { xSemaphoreTakeRecursive(lock, portMAX_DELAY); }
+    void unlockClient() { xSemaphoreGiveRecursive(lock); }
+};
+
+#endif // MQTT_SIM800_H
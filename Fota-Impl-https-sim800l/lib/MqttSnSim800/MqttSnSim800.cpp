@@ -0,0 +1,555 @@
+#include "MqttSnSim800.h"
+
+// MQTT-SN Message Types
+#define MQTT_SN_CONNECT       0x04
+#define MQTT_SN_CONNACK       0x05
+#define MQTT_SN_REGISTER      0x0A
+#define MQTT_SN_REGACK        0x0B
+#define MQTT_SN_PUBLISH       0x0C
+#define MQTT_SN_PUBACK        0x0D
+#define MQTT_SN_SUBSCRIBE     0x12
+#define MQTT_SN_SUBACK        0x13
+#define MQTT_SN_PINGREQ       0x16
+#define MQTT_SN_PINGRESP      0x17
+#define MQTT_SN_DISCONNECT    0x18
+
+// Flags
+#define FLAG_DUP              0x80
+#define FLAG_QOS_0            0x00
+#define FLAG_QOS_1            0x20
+#define FLAG_QOS_MINUS_1      0x60
+#define FLAG_QOS_MASK         0x60
+#define FLAG_CLEAN_SESSION    0x04
+#define TOPIC_NORMAL          0x00
+#define TOPIC_PREDEFINED      0x01
+
+#define PROTOCOL_ID           0x01
+#define RC_ACCEPTED           0x00
+#define RC_INVALID_TOPIC      0x02
+
+uint8_t MqttSnSim800::tx_buffer[MQTT_SN_MAX_PACKET];
+uint8_t MqttSnSim800::rx_buffer[MQTT_SN_MAX_PACKET];
+uint8_t MqttSnSim800::held_buffer[MQTT_SN_MAX_PACKET];
+
+MqttSnSim800::MqttSnSim800(Stream& serial) : link(serial, *this) {
+  lock = xSemaphoreCreateRecursiveMutex();
+}
+
+// ==================== Datagrams from the link ====================
+
+// Datagram bytes go straight from the UART into rx_buffer
+uint8_t* MqttSnSim800::frameBuffer(size_t& length) {
+  if (rx_length >= MQTT_SN_MAX_PACKET) {
+    return nullptr;
+  }
+  length = min(length, MQTT_SN_MAX_PACKET - rx_length);
+  return rx_buffer + rx_length;
+}
+
+void MqttSnSim800::frameWritten(size_t count, bool end) {
+  rx_length += count;
+  if (end) {
+    handleDatagram(rx_buffer, rx_length);
+  }
+}
+
+// Rest of a datagram too large for rx_buffer
+void MqttSnSim800::frameByte(uint8_t c, bool end) {
+  if (end) {
+    Serial.println("MQTT-SN datagram too large, dropped");
+  }
+}
+
+void MqttSnSim800::closed() {
+  Serial.println("MQTT-SN socket closed");
+  socket_open = false;
+  is_connected = false;
+}
+
+// ==================== MQTT-SN message parser ====================
+
+void MqttSnSim800::handleDatagram(uint8_t* data, size_t length) {
+  bytes_received += length;
+  datagrams_received++;
+
+  // Length is one byte, or 0x01 followed by two bytes for messages over 255
+  size_t header = 1;
+  size_t message_length = data[0];
+  if (message_length == 0x01 && length >= 3) {
+    message_length = (data[1] << 8) | data[2];
+    header = 3;
+  }
+  if (message_length < header + 1 || message_length > length) {
+    Serial.println("MQTT-SN malformed datagram, dropped");
+    return;
+  }
+
+  uint8_t type = data[header];
+  uint8_t* body = data + header + 1;
+  size_t body_length = message_length - header - 1;
+
+  switch (type) {
+    case MQTT_SN_CONNACK:
+      if (awaiting_type == MQTT_SN_CONNACK && body_length >= 1) {
+        ack_code = body[0];
+        ack_received = true;
+      }
+      break;
+
+    case MQTT_SN_REGACK:
+    case MQTT_SN_PUBACK:
+      // Topic ID, message ID, return code
+      if (body_length >= 5 && type == awaiting_type && ((body[2] << 8) | body[3]) == awaiting_id) {
+        ack_topic_id = (body[0] << 8) | body[1];
+        ack_code = body[4];
+        ack_received = true;
+      }
+      break;
+
+    case MQTT_SN_SUBACK:
+      // Flags, topic ID, message ID, return code
+      if (body_length >= 6 && type == awaiting_type && ((body[3] << 8) | body[4]) == awaiting_id) {
+        ack_topic_id = (body[1] << 8) | body[2];
+        ack_code = body[5];
+        ack_received = true;
+      }
+      break;
+
+    case MQTT_SN_PINGRESP:
+      pings_outstanding = 0;
+      if (awaiting_type == MQTT_SN_PINGRESP) {
+        ack_received = true;
+      }
+      break;
+
+    case MQTT_SN_REGISTER:
+      // The gateway names a topic before publishing on it (e.g. a wildcard match)
+      if (body_length > 4) {
+        uint16_t topic_id = (body[0] << 8) | body[1];
+        storeTopic(topic_id, (const char*)body + 4, body_length - 4);
+        queueAck(MQTT_SN_REGACK, topic_id, (body[2] << 8) | body[3]);
+      }
+      break;
+
+    case MQTT_SN_PUBLISH:
+      handlePublish(body, body_length);
+      break;
+
+    case MQTT_SN_DISCONNECT:
+      Serial.println("MQTT-SN disconnected by gateway");
+      is_connected = false;
+      break;
+  }
+}
+
+void MqttSnSim800::handlePublish(uint8_t* body, size_t length) {
+  // Flags, topic ID, message ID, data
+  if (length < 5) {
+    return;
+  }
+
+  // Read before the callback, which may reuse rx_buffer
+  bool qos1 = (body[0] & FLAG_QOS_MASK) == FLAG_QOS_1;
+  uint16_t topic_id = (body[1] << 8) | body[2];
+  uint16_t msg_id = (body[3] << 8) | body[4];
+
+  if (dispatch_ready) {
+    dispatchPublish(body, length);
+  } else if (held_length == 0) {
+    // Outside loop() (mid-send or mid-ack) the callback could not publish, so hold it
+    memcpy(held_buffer, body, length);
+    held_length = length;
+  } else {
+    // Not acknowledged, so the gateway sends it again
+    Serial.println("MQTT-SN message dropped, one already held");
+    return;
+  }
+
+  if (qos1) {
+    queueAck(MQTT_SN_PUBACK, topic_id, msg_id);
+  }
+}
+
+void MqttSnSim800::dispatchPublish(uint8_t* body, size_t length) {
+  if (message_callback == nullptr) {
+    return;
+  }
+
+  bool ready = dispatch_ready;
+  dispatch_ready = false;
+  message_callback((body[1] << 8) | body[2], body + 5, length - 5, callback_context);
+  dispatch_ready = ready;
+}
+
+void MqttSnSim800::queueAck(uint8_t type, uint16_t topic_id, uint16_t msg_id) {
+  if (ack_queue_count < MQTT_SN_ACK_QUEUE) {
+    ack_queue[ack_queue_count][0] = type;
+    ack_queue[ack_queue_count][1] = topic_id;
+    ack_queue[ack_queue_count][2] = msg_id;
+    ack_queue_count++;
+  }
+}
+
+void MqttSnSim800::storeTopic(uint16_t topic_id, const char* name, size_t length) {
+  size_t index = 0;
+  while (index < topic_count && topics[index].id != topic_id) {
+    index++;
+  }
+
+  if (index == topic_count) {
+    if (topic_count == MQTT_SN_MAX_TOPICS) {
+      Serial.println("MQTT-SN topic table full");
+      return;
+    }
+    topic_count++;
+  }
+
+  length = min(length, sizeof(topics[index].name) - 1);
+  topics[index].id = topic_id;
+  memcpy(topics[index].name, name, length);
+  topics[index].name[length] = '\0';
+}
+
+const char* MqttSnSim800::topicName(uint16_t topic_id) const {
+  for (size_t i = 0; i < topic_count; i++) {
+    if (topics[i].id == topic_id) {
+      return topics[i].name;
+    }
+  }
+  return nullptr;
+}
+
+// ==================== Message building and sending ====================
+
+size_t MqttSnSim800::beginPacket(uint8_t type, size_t body_length) {
+  size_t length = 0;
+  size_t total = 2 + body_length;
+
+  if (total <= 255) {
+    tx_buffer[length++] = total;
+  } else {
+    total += 2;
+    tx_buffer[length++] = 0x01;
+    tx_buffer[length++] = total >> 8;
+    tx_buffer[length++] = total & 0xFF;
+  }
+  tx_buffer[length++] = type;
+  return length;
+}
+
+// One datagram per CIPSEND; the modem reports SEND OK once it is on its way
+bool MqttSnSim800::sendDatagram(size_t length) {
+  unsigned long start = millis();
+
+  if (!link.send(tx_buffer, length)) {
+    Serial.println("MQTT-SN send failed");
+    return false;
+  }
+
+  uint32_t elapsed = millis() - start;
+  send_count++;
+  send_total_ms += elapsed;
+  send_max_ms = max(send_max_ms, elapsed);
+  bytes_sent += length;
+  last_send_ms = millis();
+  return true;
+}
+
+// Sends tx_buffer and waits for the reply, resending (with DUP set for a PUBLISH)
+// every MQTT_SN_RETRY_TIMEOUT, MQTT_SN_RETRY_COUNT times
+bool MqttSnSim800::sendRequest(size_t length, uint8_t reply_type, uint16_t msg_id, int dup_offset) {
+  unsigned long start = millis();
+
+  for (int attempt = 0; attempt <= MQTT_SN_RETRY_COUNT && socket_open; attempt++) {
+    if (attempt > 0) {
+      retransmit_count++;
+      if (dup_offset >= 0) {
+        tx_buffer[dup_offset] |= FLAG_DUP;
+      }
+    }
+
+    awaiting_type = reply_type;
+    awaiting_id = msg_id;
+    ack_received = false;
+
+    if (sendDatagram(length)) {
+      if (link.waitFor(ack_received, MQTT_SN_RETRY_TIMEOUT)) {
+        uint32_t elapsed = millis() - start;
+        ack_count++;
+        ack_total_ms += elapsed;
+        ack_max_ms = max(ack_max_ms, elapsed);
+        awaiting_type = 0;
+        return true;
+      }
+    }
+  }
+
+  awaiting_type = 0;
+  return false;
+}
+
+bool MqttSnSim800::sendAck(uint8_t type, uint16_t topic_id, uint16_t msg_id, uint8_t code) {
+  size_t length = beginPacket(type, 5);
+  tx_buffer[length++] = topic_id >> 8;
+  tx_buffer[length++] = topic_id & 0xFF;
+  tx_buffer[length++] = msg_id >> 8;
+  tx_buffer[length++] = msg_id & 0xFF;
+  tx_buffer[length++] = code;
+  return sendDatagram(length);
+}
+
+uint16_t MqttSnSim800::msgId() {
+  if (next_msg_id == 0) {
+    next_msg_id = 1;
+  }
+  return next_msg_id++;
+}
+
+// ==================== Public API ====================
+
+bool MqttSnSim800::begin(const char* host, int port) {
+  lockClient();
+
+  if (socket_open) {
+    end();
+  }
+
+  link.reset();
+  ack_queue_count = 0;
+  held_length = 0;
+
+  // Frame incoming data as +IPD,<len>: so datagrams can be told apart from AT responses
+  link.command("AT+CIPHEAD=1", "OK");
+
+  String cmd = "AT+CIPSTART=\"UDP\",\"" + String(host) + "\",\"" + String(port) + "\"";
+  socket_open = link.command(cmd, "CONNECT", MQTT_SN_CONNECT_TIMEOUT);
+  if (!socket_open) {
+    Serial.println("UDP socket to gateway failed");
+  }
+
+  unlockClient();
+  return socket_open;
+}
+
+void MqttSnSim800::end() {
+  lockClient();
+  disconnect();
+  if (socket_open) {
+    link.command("AT+CIPCLOSE", "CLOSE OK");
+    socket_open = false;
+  }
+  unlockClient();
+}
+
+bool MqttSnSim800::connect(const char* client_id, uint16_t duration) {
+  lockClient();
+
+  is_connected = false;
+  duration_s = duration;
+  pings_outstanding = 0;
+  topic_count = 0;
+
+  // CONNECT: flags, protocol ID, duration, client ID
+  size_t client_length = strlen(client_id);
+  size_t length = beginPacket(MQTT_SN_CONNECT, 4 + client_length);
+  tx_buffer[length++] = FLAG_CLEAN_SESSION;
+  tx_buffer[length++] = PROTOCOL_ID;
+  tx_buffer[length++] = duration >> 8;
+  tx_buffer[length++] = duration & 0xFF;
+  memcpy(tx_buffer + length, client_id, client_length);
+  length += client_length;
+
+  if (!sendRequest(length, MQTT_SN_CONNACK, 0) || ack_code != RC_ACCEPTED) {
+    Serial.printf("MQTT-SN CONNECT failed (code %d)\n", ack_received ? ack_code : -1);
+    unlockClient();
+    return false;
+  }
+
+  Serial.println(">> MQTT-SN connected");
+  is_connected = true;
+  unlockClient();
+  return true;
+}
+
+void MqttSnSim800::disconnect() {
+  lockClient();
+
+  if (is_connected) {
+    size_t length = beginPacket(MQTT_SN_DISCONNECT, 0);
+    sendDatagram(length);
+    is_connected = false;
+  }
+
+  unlockClient();
+}
+
+uint16_t MqttSnSim800::registerTopic(const char* topic) {
+  if (!is_connected) {
+    return 0;
+  }
+
+  lockClient();
+
+  // REGISTER: topic ID (0 from a client), message ID, topic name
+  uint16_t id = msgId();
+  size_t topic_length = strlen(topic);
+  size_t length = beginPacket(MQTT_SN_REGISTER, 4 + topic_length);
+  tx_buffer[length++] = 0;
+  tx_buffer[length++] = 0;
+  tx_buffer[length++] = id >> 8;
+  tx_buffer[length++] = id & 0xFF;
+  memcpy(tx_buffer + length, topic, topic_length);
+  length += topic_length;
+
+  uint16_t topic_id = 0;
+  if (sendRequest(length, MQTT_SN_REGACK, id) && ack_code == RC_ACCEPTED) {
+    topic_id = ack_topic_id;
+    storeTopic(topic_id, topic, topic_length);
+  }
+  Serial.printf(">> MQTT-SN REGISTER %s: %s (ID %u)\n", topic, topic_id ? "ok" : "failed", topic_id);
+
+  unlockClient();
+  return topic_id;
+}
+
+bool MqttSnSim800::publish(uint16_t topic_id, const uint8_t* payload, size_t length, int8_t qos, bool predefined) {
+  // QoS -1 is only defined for predefined topics
+  if ((qos < 0 && !predefined) || (qos >= 0 && !is_connected) || !socket_open) {
+    return false;
+  }
+
+  if (5 + 5 + length > MQTT_SN_MAX_PACKET) {
+    Serial.println("MQTT-SN publish too large");
+    return false;
+  }
+
+  lockClient();
+
+  // PUBLISH: flags, topic ID, message ID (0 unless QoS 1), data
+  uint16_t id = qos > 0 ? msgId() : 0;
+  size_t packet_length = beginPacket(MQTT_SN_PUBLISH, 5 + length);
+  size_t flags_offset = packet_length;
+  tx_buffer[packet_length++] = (qos > 0 ? FLAG_QOS_1 : qos < 0 ? FLAG_QOS_MINUS_1 : FLAG_QOS_0) |
+                               (predefined ? TOPIC_PREDEFINED : TOPIC_NORMAL);
+  tx_buffer[packet_length++] = topic_id >> 8;
+  tx_buffer[packet_length++] = topic_id & 0xFF;
+  tx_buffer[packet_length++] = id >> 8;
+  tx_buffer[packet_length++] = id & 0xFF;
+  memcpy(tx_buffer + packet_length, payload, length);
+  packet_length += length;
+
+  bool ok;
+  if (qos > 0) {
+    ok = sendRequest(packet_length, MQTT_SN_PUBACK, id, flags_offset) && ack_code == RC_ACCEPTED;
+    if (!ok && ack_code == RC_INVALID_TOPIC) {
+      Serial.printf("MQTT-SN topic ID %u rejected by gateway\n", topic_id);
+    }
+  } else {
+    ok = sendDatagram(packet_length);
+  }
+
+  unlockClient();
+  return ok;
+}
+
+bool MqttSnSim800::subscribe(uint16_t topic_id, uint8_t qos) {
+  if (!is_connected) {
+    return false;
+  }
+
+  lockClient();
+
+  // SUBSCRIBE: flags, message ID, predefined topic ID
+  uint16_t id = msgId();
+  size_t length = beginPacket(MQTT_SN_SUBSCRIBE, 5);
+  size_t flags_offset = length;
+  tx_buffer[length++] = (qos > 0 ? FLAG_QOS_1 : FLAG_QOS_0) | TOPIC_PREDEFINED;
+  tx_buffer[length++] = id >> 8;
+  tx_buffer[length++] = id & 0xFF;
+  tx_buffer[length++] = topic_id >> 8;
+  tx_buffer[length++] = topic_id & 0xFF;
+
+  bool ok = sendRequest(length, MQTT_SN_SUBACK, id, flags_offset) && ack_code == RC_ACCEPTED;
+  Serial.printf(">> MQTT-SN SUBSCRIBE topic %u (QoS %d): %s\n", topic_id, qos, ok ? "granted" : "failed");
+
+  unlockClient();
+  return ok;
+}
+
+uint16_t MqttSnSim800::subscribe(const char* topic, uint8_t qos) {
+  if (!is_connected) {
+    return 0;
+  }
+
+  lockClient();
+
+  // SUBSCRIBE: flags, message ID, topic name
+  uint16_t id = msgId();
+  size_t topic_length = strlen(topic);
+  size_t length = beginPacket(MQTT_SN_SUBSCRIBE, 3 + topic_length);
+  size_t flags_offset = length;
+  tx_buffer[length++] = (qos > 0 ? FLAG_QOS_1 : FLAG_QOS_0) | TOPIC_NORMAL;
+  tx_buffer[length++] = id >> 8;
+  tx_buffer[length++] = id & 0xFF;
+  memcpy(tx_buffer + length, topic, topic_length);
+  length += topic_length;
+
+  uint16_t topic_id = 0;
+  if (sendRequest(length, MQTT_SN_SUBACK, id, flags_offset) && ack_code == RC_ACCEPTED) {
+    topic_id = ack_topic_id;
+    storeTopic(topic_id, topic, topic_length);
+  }
+  Serial.printf(">> MQTT-SN SUBSCRIBE %s (QoS %d): %s\n", topic, qos, topic_id ? "granted" : "failed");
+
+  unlockClient();
+  return topic_id;
+}
+
+bool MqttSnSim800::ping() {
+  lockClient();
+  size_t length = beginPacket(MQTT_SN_PINGREQ, 0);
+  pings_outstanding++;
+  bool ok = sendDatagram(length);
+  unlockClient();
+  return ok;
+}
+
+void MqttSnSim800::loop() {
+  lockClient();
+
+  dispatch_ready = true;
+  link.pump();
+  dispatch_ready = false;
+
+  // Message that arrived while a send was in progress
+  if (held_length > 0) {
+    size_t length = held_length;
+    held_length = 0;
+    dispatch_ready = true;
+    dispatchPublish(held_buffer, length);
+    dispatch_ready = false;
+  }
+
+  // Acknowledge what the gateway sent (more may arrive while we send)
+  uint16_t pending[MQTT_SN_ACK_QUEUE][3];
+  size_t pending_count = ack_queue_count;
+  memcpy(pending, ack_queue, sizeof(pending[0]) * pending_count);
+  ack_queue_count = 0;
+  for (size_t i = 0; i < pending_count; i++) {
+    sendAck(pending[i][0], pending[i][1], pending[i][2], RC_ACCEPTED);
+  }
+
+  // Keep-alive: ping after three quarters of the duration without traffic, and every
+  // T_retry while unanswered. No answer after N_retry resends: the session is gone.
+  unsigned long interval = pings_outstanding > 0 ? MQTT_SN_RETRY_TIMEOUT : duration_s * 750UL;
+  if (is_connected && millis() - last_send_ms > interval) {
+    if (pings_outstanding > MQTT_SN_RETRY_COUNT) {
+      Serial.println("MQTT-SN gateway not responding");
+      is_connected = false;
+    } else {
+      ping();
+    }
+  }
+
+  unlockClient();
+}
@@ -0,0 +1,160 @@
+#ifndef MQTT_SN_SIM800_H
+#define MQTT_SN_SIM800_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <Sim800Link.h>
+
+#define MQTT_SN_MAX_PACKET        512    // One static buffer each way
+#define MQTT_SN_MAX_TOPICS        8      // Topic names registered by either side
+#define MQTT_SN_ACK_QUEUE         8      // PUBACKs/REGACKs owed to the gateway, sent from loop()
+
+// Timeouts
+#define MQTT_SN_AT_TIMEOUT        2000
+#define MQTT_SN_CONNECT_TIMEOUT   10000
+#define MQTT_SN_RETRY_TIMEOUT     5000   // T_retry: UDP has no retransmission of its own
+#define MQTT_SN_RETRY_COUNT       3      // N_retry
+
+// MQTT-SN 1.2 client over a SIM800L UDP socket (AT+CIPSTART="UDP" / AT+CIPSEND=<len>).
+//
+// Compared with MqttSim800 there is no TCP handshake or TCP acknowledgements, and a
+// PUBLISH carries a 2-byte topic ID instead of the topic string. Predefined IDs are
+// agreed with the gateway up front and need no registration at all; other topics
+// are registered once per session. Each "+IPD,<len>:" frame from the Sim800Link
+// is one datagram.
+//
+// Requests that expect a reply (CONNECT, REGISTER, SUBSCRIBE, QoS 1 PUBLISH,
+// PINGREQ) are retried MQTT_SN_RETRY_COUNT times. A gateway that stops answering
+// pings marks the session as lost. Locking and callback rules are the same as
+// MqttSim800: the callback only runs from loop().
+class MqttSnSim800 : private Sim800Link::Receiver {
+  public:
+    // Payload points into the shared receive buffer
+    typedef void (*MessageCallback)(uint16_t topic_id, const uint8_t* payload, size_t length, void* context);
+
+    explicit MqttSnSim800(Stream& serial);
+
+    // Open the UDP socket to the gateway
+    bool begin(const char* host, int port);
+    void end();
+
+    bool connect(const char* client_id, uint16_t duration = 60);
+    void disconnect();
+    bool connected() const { return is_connected; }
+
+    // Topic ID for a topic name, assigned by the gateway; 0 on failure
+    uint16_t registerTopic(const char* topic);
+
+    // QoS 0 and 1 need a session. QoS -1 sends to a predefined topic without one.
+    // QoS 1 returns once the PUBACK arrives.
+    bool publish(uint16_t topic_id, const uint8_t* payload, size_t length, int8_t qos = 0, bool predefined = true);
+    bool publish(uint16_t topic_id, const char* message, int8_t qos = 0, bool predefined = true) {
+      return publish(topic_id, (const uint8_t*)message, strlen(message), qos, predefined);
+    }
+
+    // Subscribe to a predefined topic ID, or to a topic name (returns its ID, 0 on failure)
+    bool subscribe(uint16_t topic_id, uint8_t qos = 0);
+    uint16_t subscribe(const char* topic, uint8_t qos = 0);
+
+    bool ping();
+
+    // Drain the UART, dispatch messages, acknowledge QoS 1 and keep the session alive
+    void loop();
+
+    void setCallback(MessageCallback callback, void* context = nullptr) {
+      message_callback = callback;
+      callback_context = context;
+    }
+
+    // Topic name registered for an ID, nullptr for predefined or unknown IDs
+    const char* topicName(uint16_t topic_id) const;
+
+    // Send statistics: CIPSEND to SEND OK, per datagram
+    uint32_t sendCount() const { return send_count; }
+    uint32_t sendAverageMs() const { return send_count ? send_total_ms / send_count : 0; }
+    uint32_t sendMaxMs() const { return send_max_ms; }
+
+    // Bytes through the socket (MQTT-SN only, without IP/UDP headers)
+    uint32_t bytesSent() const { return bytes_sent; }
+    uint32_t bytesReceived() const { return bytes_received; }
+    uint32_t datagramsReceived() const { return datagrams_received; }
+
+    // Request to reply, including retries
+    uint32_t retransmits() const { return retransmit_count; }
+    uint32_t ackAverageMs() const { return ack_count ? ack_total_ms / ack_count : 0; }
+    uint32_t ackMaxMs() const { return ack_max_ms; }
+
+  private:
+    struct TopicEntry {
+      uint16_t id;
+      char name[48];
+    };
+
+    Sim800Link link;
+    SemaphoreHandle_t lock;
+
+    static uint8_t tx_buffer[MQTT_SN_MAX_PACKET];
+    static uint8_t rx_buffer[MQTT_SN_MAX_PACKET];
+    static uint8_t held_buffer[MQTT_SN_MAX_PACKET];   // A PUBLISH that arrived outside loop()
+    size_t held_length = 0;
+    bool dispatch_ready = false;    // Only loop() runs the callback
+
+    size_t rx_length = 0;           // Datagram received so far in rx_buffer
+
+    // Session and acknowledgement tracking
+    bool socket_open = false;
+    bool is_connected = false;
+    uint16_t duration_s = 60;
+    unsigned long last_send_ms = 0;
+    uint8_t pings_outstanding = 0;
+    uint16_t next_msg_id = 1;
+    uint8_t awaiting_type = 0;
+    uint16_t awaiting_id = 0;
+    bool ack_received = false;
+    uint8_t ack_code = 0;
+    uint16_t ack_topic_id = 0;
+    uint16_t ack_queue[MQTT_SN_ACK_QUEUE][3];   // Type, topic ID, message ID
+    size_t ack_queue_count = 0;
+
+    TopicEntry topics[MQTT_SN_MAX_TOPICS];
+    size_t topic_count = 0;
+
+    MessageCallback message_callback = nullptr;
+    void* callback_context = nullptr;
+
+    uint32_t send_count = 0;
+    uint32_t send_total_ms = 0;
+    uint32_t send_max_ms = 0;
+    uint32_t bytes_sent = 0;
+    uint32_t bytes_received = 0;
+    uint32_t datagrams_received = 0;
+    uint32_t retransmit_count = 0;
+    uint32_t ack_count = 0;
+    uint32_t ack_total_ms = 0;
+    uint32_t ack_max_ms = 0;
+
+    // Sim800Link::Receiver: one datagram per +IPD frame
+    void frameStart(size_t length) override { rx_length = 0; }
+    uint8_t* frameBuffer(size_t& length) override;
+    void frameWritten(size_t count, bool end) override;
+    void frameByte(uint8_t c, bool end) override;
+    void closed() override;
+
+    void handleDatagram(uint8_t* data, size_t length);
+    void handlePublish(uint8_t* body, size_t length);
+    void dispatchPublish(uint8_t* body, size_t length);
+    void queueAck(uint8_t type, uint16_t topic_id, uint16_t msg_id);
+
+    size_t beginPacket(uint8_t type, size_t body_length);
+    bool sendDatagram(size_t length);
+    bool sendRequest(size_t length, uint8_t reply_type, uint16_t msg_id, int dup_offset = -1);
+    bool sendAck(uint8_t type, uint16_t topic_id, uint16_t msg_id, uint8_t code);
+    uint16_t msgId();
+    void storeTopic(uint16_t topic_id, const char* name, size_t length);
+
+    void lockClient() { xSemaphoreTakeRecursive(lock, portMAX_DELAY); }
+    void unlockClient() { xSemaphoreGiveRecursive(lock); }
+};
+
+#endif // MQTT_SN_SIM800_H
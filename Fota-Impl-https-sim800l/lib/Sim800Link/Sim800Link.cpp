@@ -0,0 +1,153 @@
+#include "Sim800Link.h"
+
+bool Sim800Link::process(bool one_frame) {
+  while (serialAT.available()) {
+    if (ipd_remaining == 0) {
+      processByte(serialAT.read());
+      continue;
+    }
+
+    // Frame bytes go straight from the UART into the receiver's buffer when it has one.
+    // ipd_remaining is settled before the callback, which may pump again.
+    size_t length = min((size_t)serialAT.available(), ipd_remaining);
+    uint8_t* dest = receiver.frameBuffer(length);
+    if (dest != nullptr && length > 0) {
+      size_t count = serialAT.readBytes(dest, length);
+      ipd_remaining -= count;
+      receiver.frameWritten(count, ipd_remaining == 0);
+    } else {
+      uint8_t c = serialAT.read();
+      ipd_remaining--;
+      receiver.frameByte(c, ipd_remaining == 0);
+    }
+
+    if (one_frame && ipd_remaining == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void Sim800Link::processByte(uint8_t c) {
+  if (c == '\n') {
+    line[line_length] = '\0';
+    if (line_length > 0) {
+      handleLine();
+    }
+    line_length = 0;
+    return;
+  }
+
+  if (c == '\r') {
+    return;
+  }
+
+  // The send prompt is "> " with no line ending
+  if (c == '>' && line_length == 0) {
+    prompt_seen = true;
+    return;
+  }
+
+  if (line_length < SIM800_LINK_LINE_SIZE - 1) {
+    line[line_length++] = c;
+  }
+
+  if (c == ':' && line_length > 5 && strncmp(line, "+IPD,", 5) == 0) {
+    line[line_length] = '\0';
+    ipd_remaining = atoi(line + 5);
+    line_length = 0;
+    receiver.frameStart(ipd_remaining);
+  }
+}
+
+void Sim800Link::handleLine() {
+  if (strcmp(line, "SEND OK") == 0) {
+    send_result = 1;
+  } else if (strcmp(line, "SEND FAIL") == 0) {
+    send_result = -1;
+  } else if (strcmp(line, "CLOSED") == 0) {
+    send_result = -1;
+    receiver.closed();
+  }
+
+  if (expect_token != nullptr) {
+    // Failures first: "CONNECT FAIL" also contains "CONNECT"
+    if (strstr(line, "ERROR") != nullptr || strstr(line, "FAIL") != nullptr) {
+      expect_result = -1;
+    } else if (strstr(line, expect_token) != nullptr) {
+      expect_result = 1;
+      if (capture != nullptr && capture_size > 0) {
+        strncpy(capture, line, capture_size - 1);
+        capture[capture_size - 1] = '\0';
+      }
+    }
+  } else if (strstr(line, "ERROR") != nullptr) {
+    send_result = -1;
+  }
+}
+
+bool Sim800Link::waitFor(const bool& flag, unsigned long timeout) {
+  unsigned long start = millis();
+
+  while (!flag && send_result >= 0 && millis() - start < timeout) {
+    pump();
+    if (!flag) {
+      yield();
+    }
+  }
+
+  return flag;
+}
+
+bool Sim800Link::command(const String& cmd, const char* expected, unsigned long timeout, char* response, size_t size) {
+  pump();
+
+  Serial.print(">> ");
+  Serial.println(cmd);
+
+  expect_token = expected;
+  expect_result = 0;
+  capture = response;
+  capture_size = size;
+  serialAT.println(cmd);
+
+  unsigned long start = millis();
+  while (expect_result == 0 && millis() - start < timeout) {
+    pump();
+    yield();
+  }
+
+  expect_token = nullptr;
+  capture = nullptr;
+  return expect_result == 1;
+}
+
+bool Sim800Link::send(const uint8_t* data, size_t length) {
+  pump();
+  prompt_seen = false;
+  send_result = 0;
+
+  serialAT.print("AT+CIPSEND=");
+  serialAT.println(length);
+
+  if (!waitFor(prompt_seen, SIM800_LINK_PROMPT_TIMEOUT)) {
+    Serial.println("No CIPSEND prompt");
+    return false;
+  }
+
+  serialAT.write(data, length);
+
+  unsigned long start = millis();
+  while (send_result == 0 && millis() - start < SIM800_LINK_SEND_TIMEOUT) {
+    pump();
+    yield();
+  }
+
+  return send_result == 1;
+}
+
+void Sim800Link::reset() {
+  ipd_remaining = 0;
+  line_length = 0;
+}
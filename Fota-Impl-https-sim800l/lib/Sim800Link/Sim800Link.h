@@ -0,0 +1,84 @@
+#ifndef SIM800_LINK_H
+#define SIM800_LINK_H
+
+#include <Arduino.h>
+
+#define SIM800_LINK_LINE_SIZE      64
+#define SIM800_LINK_AT_TIMEOUT     2000
+#define SIM800_LINK_PROMPT_TIMEOUT 5000
+#define SIM800_LINK_SEND_TIMEOUT   10000
+
+// SIM800L UART demultiplexer for a socket opened with AT+CIPHEAD=1.
+//
+// AT responses, the "> " send prompt and socket data share the UART; every chunk of
+// socket data arrives as one "+IPD,<len>:" frame. Lines are matched here (SEND OK/FAIL,
+// CLOSED, ERROR, the token a command waits for) and frame bytes go to the owner's
+// Receiver, straight into its buffer where it offers one. Used by MqttSim800 (TCP),
+// MqttSnSim800 and ModemAT's UDP socket (one datagram per frame).
+//
+// No locking: the owner serialises calls. Receiver callbacks run inside pump() and
+// may send (and so pump) again.
+class Sim800Link {
+  public:
+    class Receiver {
+      public:
+        virtual ~Receiver() {}
+
+        // A "+IPD,<length>:" frame starts
+        virtual void frameStart(size_t length) = 0;
+
+        // Where the next frame bytes can be read directly: at most `length`, which the
+        // receiver may lower. nullptr: pass them one at a time to frameByte().
+        virtual uint8_t* frameBuffer(size_t& length) = 0;
+        virtual void frameWritten(size_t count, bool end) = 0;
+        virtual void frameByte(uint8_t c, bool end) = 0;
+
+        // The peer closed the socket
+        virtual void closed() = 0;
+    };
+
+    Sim800Link(Stream& serial, Receiver& receiver) : serialAT(serial), receiver(receiver) {}
+
+    Stream& stream() { return serialAT; }
+
+    // Process everything the UART holds
+    void pump() { process(false); }
+
+    // Stop at the end of a frame, leaving the next one in the UART; true if one ended
+    bool pumpFrame() { return process(true); }
+
+    // Pump until `flag` is set; stops early on SEND FAIL, ERROR or CLOSED
+    bool waitFor(const bool& flag, unsigned long timeout);
+
+    // Send an AT command and wait for a line containing `expected` (failure lines
+    // end the wait). The matching line is copied into `response` if one is given.
+    bool command(const String& cmd, const char* expected, unsigned long timeout = SIM800_LINK_AT_TIMEOUT,
+                 char* response = nullptr, size_t size = 0);
+
+    // One AT+CIPSEND=<length>: prompt, data, SEND OK. Fixed length, so binary safe
+    // (no Ctrl+Z terminator).
+    bool send(const uint8_t* data, size_t length);
+
+    // Forget a frame cut off by a reconnect
+    void reset();
+
+  private:
+    Stream& serialAT;
+    Receiver& receiver;
+
+    char line[SIM800_LINK_LINE_SIZE];
+    size_t line_length = 0;
+    size_t ipd_remaining = 0;
+    bool prompt_seen = false;
+    int send_result = 0;            // 1 SEND OK, -1 SEND FAIL/ERROR/CLOSED
+    const char* expect_token = nullptr;
+    int expect_result = 0;
+    char* capture = nullptr;
+    size_t capture_size = 0;
+
+    bool process(bool one_frame);
+    void processByte(uint8_t c);
+    void handleLine();
+};
+
+#endif // SIM800_LINK_H
@@ -0,0 +1,337 @@
+#include "TelemetryLog.h"
+
+#define RECORD_UNSENT         0xFF
+#define RECORD_SENT           0x00
+#define RECORD_ERASED         0xFFFF
+
+TelemetryLog::TelemetryLog() {
+  lock = xSemaphoreCreateRecursiveMutex();
+}
+
+// ==================== Recovery ====================
+
+bool TelemetryLog::begin(const char* label) {
+  unsigned long start = millis();
+
+  partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+  if (partition == nullptr) {
+    Serial.printf("Telemetry log: no \"%s\" partition\n", label);
+    return false;
+  }
+
+  lockLog();
+
+  sector_count = partition->size / TELEMETRY_LOG_SECTOR;
+  delete[] erase_counts;
+  erase_counts = new uint32_t[sector_count];
+
+  // Head: the formatted sector with the highest sequence
+  bool found = false;
+  for (size_t sector = 0; sector < sector_count; sector++) {
+    SectorHeader header;
+    erase_counts[sector] = 0;
+    if (!readSectorHeader(sector, header)) {
+      continue;
+    }
+    erase_counts[sector] = header.erase_count;
+    if (!found || header.sequence > head_sequence) {
+      found = true;
+      head_sequence = header.sequence;
+      head.sector = sector;
+      next_seq = header.first_seq;
+    }
+  }
+
+  pending_count = 0;
+  if (!found) {
+    // Blank partition
+    head_sequence = 0;
+    next_seq = 1;
+    bool ok = startSector(0);
+    recovery_ms = millis() - start;
+    unlockLog();
+    return ok;
+  }
+
+  scanHeadSector();
+
+  // Oldest sector: walk back while the sequences stay consecutive
+  size_t oldest = head.sector;
+  uint32_t sequence = head_sequence;
+  for (size_t i = 1; i < sector_count; i++) {
+    size_t previous = (head.sector + sector_count - i) % sector_count;
+    SectorHeader header;
+    if (!readSectorHeader(previous, header) || header.sequence != sequence - 1) {
+      break;
+    }
+    oldest = previous;
+    sequence = header.sequence;
+  }
+
+  // Tail: the first unsent record from there on
+  Cursor cursor = {oldest, sizeof(SectorHeader)};
+  RecordHeader record;
+  if (nextRecord(cursor, record)) {
+    tail = cursor;
+    pending_count = countPending(cursor, false);
+  } else {
+    tail = head;
+  }
+
+  recovery_ms = millis() - start;
+  unlockLog();
+  return true;
+}
+
+// The head sector is the only one a reset can leave half written
+void TelemetryLog::scanHeadSector() {
+  Cursor cursor = {head.sector, sizeof(SectorHeader)};
+
+  while (cursor.offset + sizeof(RecordHeader) <= TELEMETRY_LOG_SECTOR) {
+    RecordHeader record;
+    esp_partition_read(partition, address(cursor), &record, sizeof(record));
+    if (record.length == RECORD_ERASED) {
+      break;
+    }
+
+    bool valid = record.length <= TELEMETRY_LOG_MAX_RECORD &&
+                 cursor.offset + recordSize(record.length) <= TELEMETRY_LOG_SECTOR;
+    if (valid) {
+      esp_partition_read(partition, address(cursor) + sizeof(record), record_buffer, record.length);
+      valid = record.crc == recordCrc(record, record_buffer);
+    }
+
+    if (!valid) {
+      // Torn record: retire it and close the sector, appends continue in the next one
+      Serial.printf("Telemetry log: torn record at 0x%x, sector closed\n", (unsigned)address(cursor));
+      uint8_t sent = RECORD_SENT;
+      esp_partition_write(partition, address(cursor) + offsetof(RecordHeader, state), &sent, 1);
+      cursor.offset = TELEMETRY_LOG_SECTOR;
+      break;
+    }
+
+    next_seq = record.seq + 1;
+    cursor.offset += recordSize(record.length);
+  }
+
+  head.offset = cursor.offset;
+}
+
+bool TelemetryLog::readSectorHeader(size_t sector, SectorHeader& header) {
+  return esp_partition_read(partition, sector * TELEMETRY_LOG_SECTOR, &header, sizeof(header)) == ESP_OK &&
+         header.magic == TELEMETRY_LOG_MAGIC;
+}
+
+// ==================== Record walking ====================
+
+// Moves the cursor onto the next unsent record before the head, across sector ends
+bool TelemetryLog::nextRecord(Cursor& cursor, RecordHeader& header) {
+  while (true) {
+    if (cursor.sector == head.sector && cursor.offset >= head.offset) {
+      return false;
+    }
+
+    if (cursor.offset + sizeof(RecordHeader) <= TELEMETRY_LOG_SECTOR) {
+      esp_partition_read(partition, address(cursor), &header, sizeof(header));
+      if (header.length != RECORD_ERASED && header.length <= TELEMETRY_LOG_MAX_RECORD &&
+          cursor.offset + recordSize(header.length) <= TELEMETRY_LOG_SECTOR) {
+        if (header.state == RECORD_UNSENT) {
+          return true;
+        }
+        cursor.offset += recordSize(header.length);
+        continue;
+      }
+    }
+
+    // No more records in this sector
+    if (cursor.sector == head.sector) {
+      return false;
+    }
+    cursor.sector = (cursor.sector + 1) % sector_count;
+    cursor.offset = sizeof(SectorHeader);
+  }
+}
+
+size_t TelemetryLog::countPending(Cursor from, bool one_sector) {
+  size_t count = 0;
+  RecordHeader record;
+
+  while (nextRecord(from, record) && (!one_sector || from.sector == tail.sector)) {
+    count++;
+    from.offset += recordSize(record.length);
+  }
+  return count;
+}
+
+// ==================== Writing ====================
+
+bool TelemetryLog::startSector(size_t sector) {
+  // Wrapping onto unsent records: the oldest sector's records are lost
+  if (pending_count > 0 && sector == tail.sector) {
+    size_t lost = countPending(tail, true);
+    dropped_count += lost;
+    pending_count -= lost;
+    tail = {(sector + 1) % sector_count, sizeof(SectorHeader)};
+    Serial.printf("Telemetry log full, %u oldest records dropped\n", (unsigned)lost);
+  }
+
+  if (esp_partition_erase_range(partition, sector * TELEMETRY_LOG_SECTOR, TELEMETRY_LOG_SECTOR) != ESP_OK) {
+    Serial.println("Telemetry log: erase failed");
+    return false;
+  }
+
+  SectorHeader header = {TELEMETRY_LOG_MAGIC, ++head_sequence, ++erase_counts[sector], next_seq};
+  if (esp_partition_write(partition, sector * TELEMETRY_LOG_SECTOR, &header, sizeof(header)) != ESP_OK) {
+    Serial.println("Telemetry log: header write failed");
+    return false;
+  }
+
+  head = {sector, sizeof(SectorHeader)};
+  if (pending_count == 0) {
+    tail = head;
+  }
+  return true;
+}
+
+bool TelemetryLog::append(const uint8_t* data, size_t length) {
+  if (partition == nullptr || length > TELEMETRY_LOG_MAX_RECORD) {
+    return false;
+  }
+
+  lockLog();
+
+  size_t size = recordSize(length);
+  if (head.offset + size > TELEMETRY_LOG_SECTOR && !startSector((head.sector + 1) % sector_count)) {
+    unlockLog();
+    return false;
+  }
+
+  // Header, payload and padding go out in one write
+  RecordHeader header;
+  header.length = length;
+  header.state = RECORD_UNSENT;
+  header.seq = next_seq;
+  header.crc = recordCrc(header, data);
+  memcpy(record_buffer, &header, sizeof(header));
+  memcpy(record_buffer + sizeof(RecordHeader), data, length);
+  memset(record_buffer + sizeof(RecordHeader) + length, 0xFF, size - sizeof(RecordHeader) - length);
+
+  if (esp_partition_write(partition, address(head), record_buffer, size) != ESP_OK) {
+    // Whatever reached the flash cannot be overwritten; continue in a fresh sector
+    head.offset = TELEMETRY_LOG_SECTOR;
+    unlockLog();
+    return false;
+  }
+
+  head.offset += size;
+  next_seq++;
+  pending_count++;
+
+  unlockLog();
+  return true;
+}
+
+// ==================== Draining ====================
+
+size_t TelemetryLog::peek(RecordHandler handler, void* context, size_t max_records) {
+  if (partition == nullptr) {
+    return 0;
+  }
+
+  lockLog();
+
+  Cursor cursor = tail;
+  RecordHeader record;
+  size_t count = 0;
+
+  while (count < max_records && nextRecord(cursor, record)) {
+    esp_partition_read(partition, address(cursor) + sizeof(record), record_buffer, record.length);
+    if (!handler(record.seq, record_buffer, record.length, context)) {
+      break;
+    }
+    count++;
+    cursor.offset += recordSize(record.length);
+  }
+
+  unlockLog();
+  return count;
+}
+
+// Sent records are marked by clearing their state byte; the sector is erased only when reused
+bool TelemetryLog::consumeThrough(uint32_t last_seq) {
+  if (partition == nullptr) {
+    return false;
+  }
+
+  lockLog();
+
+  RecordHeader record;
+  const uint8_t sent = RECORD_SENT;
+  while (nextRecord(tail, record) && (int32_t)(record.seq - last_seq) <= 0) {
+    esp_partition_write(partition, address(tail) + offsetof(RecordHeader, state), &sent, 1);
+    tail.offset += recordSize(record.length);
+    pending_count--;
+  }
+
+  if (pending_count == 0) {
+    tail = head;
+  }
+
+  unlockLog();
+  return true;
+}
+
+bool TelemetryLog::clear() {
+  if (partition == nullptr) {
+    return false;
+  }
+
+  lockLog();
+
+  bool ok = esp_partition_erase_range(partition, 0, sector_count * TELEMETRY_LOG_SECTOR) == ESP_OK;
+  for (size_t sector = 0; sector < sector_count; sector++) {
+    erase_counts[sector]++;
+  }
+
+  head_sequence = 0;
+  next_seq = 1;
+  pending_count = 0;
+  ok = ok && startSector(0);
+
+  unlockLog();
+  return ok;
+}
+
+// ==================== Helpers ====================
+
+uint32_t TelemetryLog::minEraseCount() const {
+  uint32_t count = UINT32_MAX;
+  for (size_t sector = 0; sector < sector_count; sector++) {
+    count = min(count, erase_counts[sector]);
+  }
+  return sector_count > 0 ? count : 0;
+}
+
+uint32_t TelemetryLog::maxEraseCount() const {
+  uint32_t count = 0;
+  for (size_t sector = 0; sector < sector_count; sector++) {
+    count = max(count, erase_counts[sector]);
+  }
+  return count;
+}
+
+// CRC-8, polynomial 0x07
+uint8_t TelemetryLog::crc8(uint8_t crc, const uint8_t* data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+uint8_t TelemetryLog::recordCrc(const RecordHeader& header, const uint8_t* payload) {
+  uint8_t crc = crc8(0, (const uint8_t*)&header.seq, sizeof(header.seq));
+  return crc8(crc, payload, header.length);
+}
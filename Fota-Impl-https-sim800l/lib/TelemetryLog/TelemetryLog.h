@@ -0,0 +1,111 @@
+#ifndef TELEMETRY_LOG_H
+#define TELEMETRY_LOG_H
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#define TELEMETRY_LOG_LABEL        "data"   // partitions.csv: 512 KB at 0x290000
+#define TELEMETRY_LOG_SECTOR       4096     // Flash erase unit
+#define TELEMETRY_LOG_MAX_RECORD   256      // Largest payload
+#define TELEMETRY_LOG_MAGIC        0x31514C54UL  // "TLQ1"
+
+// Store-and-forward queue for telemetry on a raw flash partition.
+//
+// The partition is a ring of 4 KB sectors written like a log: records are only
+// appended at the head, and a record is marked sent by clearing one byte in place,
+// so draining never erases. A sector is erased only when the head wraps onto it;
+// if it still holds unsent records (the link was down long enough to fill the
+// partition), the oldest records are dropped. Sectors are used strictly in turn,
+// so erases are spread evenly; each sector header carries its erase count.
+//
+// Sector: [magic u32][sector sequence u32][erase count u32][first record seq u32]
+// Record: [length u16][state u8][crc8 u8][seq u32][payload, padded to 4 bytes]
+//
+// begin() rebuilds head and tail from the headers. A record torn by a reset
+// fails its CRC and closes its sector; the next append starts a fresh one.
+class TelemetryLog {
+  public:
+    // Return false to stop peek() early (e.g. the caller's batch is full)
+    typedef bool (*RecordHandler)(uint32_t seq, const uint8_t* data, size_t length, void* context);
+
+    TelemetryLog();
+
+    // Find the partition and recover head/tail; false if it is missing
+    bool begin(const char* label = TELEMETRY_LOG_LABEL);
+
+    bool append(const uint8_t* data, size_t length);
+    bool append(const char* text) { return append((const uint8_t*)text, strlen(text)); }
+
+    // Visit up to max_records unsent records, oldest first, without consuming them.
+    // Returns the number the handler accepted.
+    size_t peek(RecordHandler handler, void* context, size_t max_records);
+
+    // Mark every unsent record up to sequence `last_seq` as sent. By sequence rather
+    // than by count: an append that wraps onto the tail between peek() and this call
+    // drops the oldest records, and a count would then mark newer, unsent ones.
+    bool consumeThrough(uint32_t last_seq);
+
+    // Forget everything (erases the partition)
+    bool clear();
+
+    size_t pending() const { return pending_count; }
+    uint32_t nextSequence() const { return next_seq; }
+    uint32_t dropped() const { return dropped_count; }
+    uint32_t minEraseCount() const;
+    uint32_t maxEraseCount() const;
+    uint32_t recoveryMs() const { return recovery_ms; }
+    size_t capacity() const { return sector_count * TELEMETRY_LOG_SECTOR; }
+
+  private:
+    struct SectorHeader {
+      uint32_t magic;
+      uint32_t sequence;      // Increases every time a sector becomes the head
+      uint32_t erase_count;
+      uint32_t first_seq;     // Sequence of the first record written to it
+    };
+
+    struct RecordHeader {
+      uint16_t length;        // 0xFFFF: erased, no more records in this sector
+      uint8_t state;          // 0xFF unsent, 0x00 sent
+      uint8_t crc;            // CRC-8 over seq and payload
+      uint32_t seq;
+    };
+
+    struct Cursor {
+      size_t sector;
+      size_t offset;
+    };
+
+    const esp_partition_t* partition = nullptr;
+    SemaphoreHandle_t lock;
+    size_t sector_count = 0;
+
+    Cursor head = {0, 0};          // Next append
+    Cursor tail = {0, 0};          // Oldest unsent record
+    uint32_t head_sequence = 0;    // Sector sequence of the head sector
+    uint32_t next_seq = 1;
+    size_t pending_count = 0;
+    uint32_t dropped_count = 0;
+    uint32_t* erase_counts = nullptr;   // Per sector, for wear reporting
+    uint32_t recovery_ms = 0;
+
+    uint8_t record_buffer[sizeof(RecordHeader) + TELEMETRY_LOG_MAX_RECORD];
+
+    static size_t recordSize(size_t length) { return (sizeof(RecordHeader) + length + 3) & ~(size_t)3; }
+    static uint8_t crc8(uint8_t crc, const uint8_t* data, size_t length);
+    static uint8_t recordCrc(const RecordHeader& header, const uint8_t* payload);
+
+    size_t address(const Cursor& cursor) const { return cursor.sector * TELEMETRY_LOG_SECTOR + cursor.offset; }
+    bool readSectorHeader(size_t sector, SectorHeader& header);
+    bool startSector(size_t sector);
+    bool nextRecord(Cursor& cursor, RecordHeader& header);
+    size_t countPending(Cursor from, bool one_sector);
+    void scanHeadSector();
+
+    void lockLog() { xSemaphoreTakeRecursive(lock, portMAX_DELAY); }
+    void unlockLog() { xSemaphoreGiveRecursive(lock); }
+};
+
+#endif // TELEMETRY_LOG_H
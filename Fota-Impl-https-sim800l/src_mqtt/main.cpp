@@ -2,10 +2,11 @@
 #include <HardwareSerial.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <MqttSim800.h>
 
 // MQTT Configuration
 #define MQTT_BROKER           "fota.getstokfms.com"
-#define MQTT_PORT             "1883"
+#define MQTT_PORT             1883
 #define MQTT_CLIENT_ID        "client"
 #define MQTT_TOPIC            "esp32/test"
 #define MQTT_MESSAGE          "hello"
@@ -19,32 +20,22 @@
 #define SIM_APN               "internet"  // Change according to your operator
 
 // Timing Configuration
-#define PING_INTERVAL         30000  // 30 seconds
 #define PUBLISH_INTERVAL      10000  // 10 seconds
 #define AT_DEFAULT_TIMEOUT    2000   // 2 seconds
-#define AT_CONNECT_TIMEOUT    5000   // 5 seconds
-
-// MQTT Packet Types
-#define MQTT_CONNECT          0x10
-#define MQTT_PUBLISH          0x30
-#define MQTT_PINGREQ          0xC0
 
 // UART for SIM800L
 HardwareSerial SerialAT(SIM800L_SERIAL);
+MqttSim800 mqtt(SerialAT);
 
 // Global variables
 TaskHandle_t mqttTaskHandle = NULL;
 TaskHandle_t monitorTaskHandle = NULL;
-unsigned long lastPingTime = 0;
 unsigned long lastPublishTime = 0;
-bool mqttConnected = false;
 
 // Function prototypes
 void sendAT(String cmd, String expected, int timeout = AT_DEFAULT_TIMEOUT);
-void sendRawMQTTConnect();
-void sendPingReq();
+bool connectMQTT();
 void reconnectMQTT();
-void sendMQTTPublish(const char* topic, const char* message);
 void mqttTask(void *parameter);
 void monitorTask(void *parameter);
 String byteToHexString(uint8_t byte);
@@ -72,14 +63,9 @@ void setup() {
   sendAT("AT+CIICR", "OK");
   sendAT("AT+CIFSR", ".");
   
-  // Connect TCP socket to MQTT broker
-  sendAT("AT+CIPSTART=\"TCP\",\"" + String(MQTT_BROKER) + "\",\"" + String(MQTT_PORT) + "\"", "CONNECT OK", AT_CONNECT_TIMEOUT);
-  
-  delay(2000);
-  sendRawMQTTConnect();
-  lastPingTime = millis();
+  // Connect TCP socket and MQTT session to the broker
+  connectMQTT();
   lastPublishTime = millis();
-  mqttConnected = true;
   
   // Now create the tasks
   xTaskCreatePinnedToCore(
@@ -112,15 +98,14 @@ void loop() {
 void mqttTask(void *parameter) {
   // Just handle periodic operations, connection is already established
   while(true) {
-    // Send MQTT ping to keep connection alive
-    if (millis() - lastPingTime > PING_INTERVAL) {
-      sendPingReq();
-      lastPingTime = millis();
-    }
-    
-    // Publish message periodically
-    if (millis() - lastPublishTime > PUBLISH_INTERVAL) {
-      sendMQTTPublish(MQTT_TOPIC, MQTT_MESSAGE);
+    // Publish message periodically (keep-alive pings are sent by mqtt.loop())
+    if (mqtt.connected() && millis() - lastPublishTime > PUBLISH_INTERVAL) {
+      if (mqtt.publish(MQTT_TOPIC, MQTT_MESSAGE)) {
+        Serial.print(">> MQTT PUBLISH sent to ");
+        Serial.print(MQTT_TOPIC);
+        Serial.printf(" (send avg %lu ms, max %lu ms)\n",
+                      (unsigned long)mqtt.sendAverageMs(), (unsigned long)mqtt.sendMaxMs());
+      }
       lastPublishTime = millis();
     }
     
@@ -132,19 +117,15 @@ void mqttTask(void *parameter) {
 // ==================== Monitor Task ====================
 void monitorTask(void *parameter) {
   while(true) {
-    // Check for incoming data from SIM800L
-    if (SerialAT.available()) {
-      String response = SerialAT.readString();
-      Serial.print(response);
+    // Drain SIM800L data, acknowledge and keep the session alive
+    mqtt.loop();
+    
+    // Check if connection is lost
+    if (!mqtt.connected()) {
+      Serial.println("Connection lost. Will attempt to reconnect...");
       
-      // Check if connection is lost
-      if (response.indexOf("CLOSED") != -1 || response.indexOf("ERROR") != -1) {
-        Serial.println("Connection lost. Will attempt to reconnect...");
-        mqttConnected = false;
-        
-        // Attempt reconnection
-        reconnectMQTT();
-      }
+      // Attempt reconnection
+      reconnectMQTT();
     }
     
     // Check for serial input from debug console
@@ -182,93 +163,19 @@ void reconnectMQTT() {
   sendAT("AT+CIICR", "OK");
   sendAT("AT+CIFSR", ".");
   
-  // Connect TCP socket to MQTT broker
-  sendAT("AT+CIPSTART=\"TCP\",\"" + String(MQTT_BROKER) + "\",\"" + String(MQTT_PORT) + "\"", "CONNECT OK", AT_CONNECT_TIMEOUT);
-  
-  delay(2000);
-  sendRawMQTTConnect();
-  lastPingTime = millis();
+  if (!connectMQTT()) {
+    vTaskDelay(5000 / portTICK_PERIOD_MS);
+  }
   lastPublishTime = millis();
-  mqttConnected = true;
 }
 
 // ==================== MQTT Protocol Functions ====================
-void sendRawMQTTConnect() {
-  // Use exact same packet as original successful code
-  uint8_t mqttPacket[] = {
-    0x10, 0x12,                  // Fixed header (CONNECT + remaining length)
-    0x00, 0x04, 'M','Q','T','T', // Protocol Name
-    0x04,                        // Protocol Level = 4 (MQTT 3.1.1)
-    0x02,                        // Connect Flags (clean session)
-    0x00, 0x3C,                  // Keep Alive = 60s
-    0x00, 0x06,                  // Client ID length = 6
-    'c','l','i','e','n','t'      // Client ID
-  };
-
-  Serial.print("MQTT CONNECT packet (HEX): ");
-  Serial.println(bytesToHexString(mqttPacket, sizeof(mqttPacket)));
-
-  // Send exactly like original
-  SerialAT.println("AT+CIPSEND");
-  delay(1000);
-
-  for (int i = 0; i < sizeof(mqttPacket); i++) {
-    SerialAT.write(mqttPacket[i]);
+bool connectMQTT() {
+  if (!mqtt.connect(MQTT_BROKER, MQTT_PORT, MQTT_CLIENT_ID, MQTT_KEEP_ALIVE)) {
+    Serial.println("MQTT connect failed");
+    return false;
   }
-
-  delay(100);
-  SerialAT.write(0x1A); // Ctrl+Z
-  Serial.println(">> MQTT CONNECT packet sent");
-}
-
-void sendPingReq() {
-  SerialAT.println("AT+CIPSEND");
-  delay(500);
-
-  SerialAT.write(0xC0); // MQTT PINGREQ
-  SerialAT.write(0x00); // Remaining Length = 0
-  
-  delay(100);
-  SerialAT.write(0x1A); // Ctrl+Z
-
-  Serial.println(">> MQTT PINGREQ sent");
-}
-
-void sendMQTTPublish(const char* topic, const char* message) {
-  uint8_t topicLen = strlen(topic);
-  uint8_t messageLen = strlen(message);
-
-  // Total Remaining Length = Topic length (2 bytes + topic) + message
-  uint8_t remainingLength = 2 + topicLen + messageLen;
-
-  SerialAT.println("AT+CIPSEND");
-  delay(500);
-
-  SerialAT.write(0x30);           // PUBLISH (QoS 0, no DUP, no RETAIN)
-  SerialAT.write(remainingLength); // Remaining Length
-
-  // Topic Length (2 bytes MSB, LSB)
-  SerialAT.write(0x00);
-  SerialAT.write(topicLen);
-
-  // Topic
-  for (int i = 0; i < topicLen; i++) {
-    SerialAT.write(topic[i]);
-  }
-
-  // Payload
-  for (int i = 0; i < messageLen; i++) {
-    SerialAT.write(message[i]);
-  }
-
-  delay(100);
-  SerialAT.write(0x1A); // Ctrl+Z
-
-  Serial.println(">> MQTT PUBLISH sent");
-  Serial.print("   Topic: ");
-  Serial.println(topic);
-  Serial.print("   Message: ");
-  Serial.println(message);
+  return true;
 }
 
 // ==================== Utility Functions ====================
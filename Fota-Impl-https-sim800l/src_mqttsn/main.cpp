@@ -0,0 +1,325 @@
+#include <Arduino.h>
+#include <HardwareSerial.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <MqttSim800.h>
+#include <MqttSnSim800.h>
+
+// MQTT-SN Configuration (gateway inside Fota-webserver, bridged into its MQTT broker)
+#define MQTT_BROKER           "fota.getstokfms.com"
+#define MQTT_PORT             1883
+#define MQTT_SN_PORT          1884
+#define MQTT_CLIENT_ID        DEVICE_ID  // Also names the per-device predefined topics
+#define MQTT_SN_DURATION      60  // seconds
+#define TELEMETRY_QOS         1   // 1 acknowledged, 0 fire and forget, -1 without a session
+
+// Predefined topic IDs, the same table as MQTTSN_PREDEFINED_TOPICS in server.js
+#define TOPIC_ID_FIRMWARE_REQUEST  1  // device/firmware/request
+#define TOPIC_ID_FIRMWARE_INFO     2  // device/firmware/info
+#define TOPIC_ID_TELEMETRY         3  // device/telemetry/<client id>
+
+// Device Information
+#define FIRMWARE_VERSION      "1.0.0"
+#define DEVICE_ID             "esp32_001"
+
+// SIM800L Configuration
+#define SIM800L_SERIAL        2   // UART2
+#define SIM800L_BAUD          115200
+#define SIM800L_RX            16  // GPIO16
+#define SIM800L_TX            17  // GPIO17
+#define SIM_APN               "internet"  // Change according to your operator
+
+// Timing Configuration
+#define PUBLISH_INTERVAL      10000  // 10 seconds
+#define AT_DEFAULT_TIMEOUT    2000   // 2 seconds
+
+// Transport comparison at boot: the same telemetry over MQTT/TCP, then MQTT-SN/UDP
+#define TRANSPORT_BENCHMARK   1
+#define BENCHMARK_MESSAGES    20
+#define TCP_IP_HEADER         40  // IPv4 + TCP, no options
+#define UDP_IP_HEADER         28  // IPv4 + UDP
+
+// UART for SIM800L; both clients share it, only one socket is open at a time
+HardwareSerial SerialAT(SIM800L_SERIAL);
+MqttSnSim800 mqttsn(SerialAT);
+MqttSim800 mqtt(SerialAT);
+
+// Global variables
+TaskHandle_t publishTaskHandle = NULL;
+TaskHandle_t monitorTaskHandle = NULL;
+unsigned long lastPublishTime = 0;
+
+struct TransportResult {
+  const char* name;
+  uint32_t setupMs;
+  uint32_t setupBytes;       // Sent and received while connecting
+  uint32_t messages;         // Acknowledged
+  uint32_t bytesUp;          // Per message totals, MQTT layer only
+  uint32_t bytesDown;
+  uint32_t packetsUp;
+  uint32_t latencyTotalMs;   // Publish to acknowledgement
+  uint32_t latencyMaxMs;
+};
+
+// Function prototypes
+void sendAT(String cmd, String expected, int timeout = AT_DEFAULT_TIMEOUT);
+void setupGPRS();
+bool connectMQTTSN();
+void reconnectMQTTSN();
+void publishTask(void *parameter);
+void monitorTask(void *parameter);
+void onMessage(uint16_t topicId, const uint8_t* payload, size_t length, void* context);
+size_t buildTelemetry(char* buffer, size_t size);
+void benchmarkTransports();
+bool benchmarkMqtt(TransportResult& result);
+bool benchmarkMqttSn(TransportResult& result);
+void printTransportResult(const TransportResult& result, uint32_t headerBytes, uint32_t extraPackets);
+
+void setup() {
+  Serial.begin(115200);
+  SerialAT.begin(SIM800L_BAUD, SERIAL_8N1, SIM800L_RX, SIM800L_TX);
+  delay(3000);
+
+  Serial.println("Initializing MQTT-SN telemetry client with SIM800L...");
+
+  setupGPRS();
+
+#if TRANSPORT_BENCHMARK
+  benchmarkTransports();
+#endif
+
+  // UDP socket to the gateway, then the MQTT-SN session
+  mqttsn.setCallback(onMessage);
+  connectMQTTSN();
+  lastPublishTime = millis();
+
+  // Now create the tasks
+  xTaskCreatePinnedToCore(
+    publishTask,
+    "PublishTask",
+    4096,
+    NULL,
+    1,
+    &publishTaskHandle,
+    0  // Core 0
+  );
+
+  xTaskCreatePinnedToCore(
+    monitorTask,
+    "MonitorTask",
+    4096,
+    NULL,
+    1,
+    &monitorTaskHandle,
+    1  // Core 1
+  );
+}
+
+void loop() {
+  // Main loop is empty as we're using FreeRTOS tasks
+  delay(1000);
+}
+
+// ==================== Publish Task ====================
+void publishTask(void *parameter) {
+  char buffer[128];
+
+  while(true) {
+    if ((mqttsn.connected() || TELEMETRY_QOS < 0) && millis() - lastPublishTime > PUBLISH_INTERVAL) {
+      size_t length = buildTelemetry(buffer, sizeof(buffer));
+      if (mqttsn.publish(TOPIC_ID_TELEMETRY, (const uint8_t*)buffer, length, TELEMETRY_QOS)) {
+        Serial.printf(">> MQTT-SN PUBLISH %u bytes to topic %d (ack avg %lu ms, max %lu ms, %lu retransmits)\n",
+                      (unsigned)length, TOPIC_ID_TELEMETRY,
+                      (unsigned long)mqttsn.ackAverageMs(), (unsigned long)mqttsn.ackMaxMs(),
+                      (unsigned long)mqttsn.retransmits());
+      }
+      lastPublishTime = millis();
+    }
+
+    vTaskDelay(100 / portTICK_PERIOD_MS);
+  }
+}
+
+// ==================== Monitor Task ====================
+void monitorTask(void *parameter) {
+  while(true) {
+    // Drain SIM800L data, acknowledge and keep the session alive
+    mqttsn.loop();
+
+    if (!mqttsn.connected()) {
+      Serial.println("MQTT-SN session lost. Will attempt to reconnect...");
+      reconnectMQTTSN();
+    }
+
+    // Check for serial input from debug console
+    if (Serial.available()) {
+      SerialAT.write(Serial.read());
+    }
+
+    vTaskDelay(20 / portTICK_PERIOD_MS);
+  }
+}
+
+// Firmware info answers the check sent after connecting
+void onMessage(uint16_t topicId, const uint8_t* payload, size_t length, void* context) {
+  Serial.printf("<< MQTT-SN topic %u: %.*s\n", topicId, (int)length, (const char*)payload);
+}
+
+size_t buildTelemetry(char* buffer, size_t size) {
+  return snprintf(buffer, size, "{\"device\":\"%s\",\"uptime\":%lu,\"heap\":%lu}",
+                  DEVICE_ID, millis() / 1000, (unsigned long)ESP.getFreeHeap());
+}
+
+// ==================== AT Command Functions ====================
+void sendAT(String cmd, String expected, int timeout) {
+  SerialAT.println(cmd);
+  Serial.print(">> "); Serial.println(cmd);
+
+  long t = millis();
+  while (millis() - t < timeout) {
+    if (SerialAT.available()) {
+      String r = SerialAT.readString();
+      Serial.print(r);
+      if (r.indexOf(expected) != -1) break;
+    }
+    delay(10);
+  }
+}
+
+void setupGPRS() {
+  sendAT("AT", "OK");
+  sendAT("ATE0", "OK");
+  sendAT("AT+CPIN?", "READY");
+  sendAT("AT+CSQ", "OK");
+  sendAT("AT+CGATT?", "1");
+  sendAT("AT+CIPSHUT", "SHUT OK");
+  sendAT("AT+CSTT=\"" + String(SIM_APN) + "\"", "OK");
+  sendAT("AT+CIICR", "OK");
+  sendAT("AT+CIFSR", ".");
+}
+
+void reconnectMQTTSN() {
+  Serial.println("Attempting to reconnect to MQTT-SN gateway...");
+
+  mqttsn.end();
+  setupGPRS();
+
+  if (!connectMQTTSN()) {
+    vTaskDelay(5000 / portTICK_PERIOD_MS);
+  }
+  lastPublishTime = millis();
+}
+
+// ==================== MQTT-SN Protocol Functions ====================
+bool connectMQTTSN() {
+  if (!mqttsn.begin(MQTT_BROKER, MQTT_SN_PORT) || !mqttsn.connect(MQTT_CLIENT_ID, MQTT_SN_DURATION)) {
+    Serial.println("MQTT-SN connect failed");
+    return false;
+  }
+
+  // Predefined topics need no REGISTER; ask for the firmware info once as a check
+  mqttsn.subscribe(TOPIC_ID_FIRMWARE_INFO, 0);
+  mqttsn.publish(TOPIC_ID_FIRMWARE_REQUEST,
+                 "{\"device\":\"" DEVICE_ID "\",\"action\":\"check\",\"version\":\"" FIRMWARE_VERSION "\"}", 0);
+  return true;
+}
+
+// ==================== Transport Benchmark ====================
+// The same QoS 1 telemetry message over both paths. Byte counts are what went
+// through the modem socket; header overhead is estimated from the packet counts
+// (each acknowledged TCP segment is also assumed to cost one bare TCP ACK).
+void benchmarkTransports() {
+  TransportResult tcp = {"MQTT/TCP", 0, 0, 0, 0, 0, 0, 0, 0};
+  TransportResult udp = {"MQTT-SN/UDP", 0, 0, 0, 0, 0, 0, 0, 0};
+
+  Serial.printf("\nTransport benchmark: %d QoS 1 telemetry messages per transport\n", BENCHMARK_MESSAGES);
+
+  if (benchmarkMqtt(tcp)) {
+    printTransportResult(tcp, TCP_IP_HEADER, 1);
+  }
+  if (benchmarkMqttSn(udp)) {
+    printTransportResult(udp, UDP_IP_HEADER, 0);
+  }
+}
+
+bool benchmarkMqtt(TransportResult& result) {
+  char buffer[128];
+  unsigned long start = millis();
+
+  // TCP handshake and MQTT CONNECT
+  if (!mqtt.connect(MQTT_BROKER, MQTT_PORT, MQTT_CLIENT_ID "_bench", MQTT_SN_DURATION)) {
+    return false;
+  }
+  result.setupMs = millis() - start;
+  result.setupBytes = mqtt.bytesSent() + mqtt.bytesReceived();
+
+  uint32_t sentBefore = mqtt.bytesSent();
+  uint32_t receivedBefore = mqtt.bytesReceived();
+  uint32_t sendsBefore = mqtt.sendCount();
+  for (int i = 0; i < BENCHMARK_MESSAGES; i++) {
+    size_t length = buildTelemetry(buffer, sizeof(buffer));
+    unsigned long sent = millis();
+    if (!mqtt.publish("device/telemetry/" DEVICE_ID, (const uint8_t*)buffer, length, 1)) {
+      continue;
+    }
+    uint32_t latency = millis() - sent;
+    result.messages++;
+    result.latencyTotalMs += latency;
+    result.latencyMaxMs = max(result.latencyMaxMs, latency);
+  }
+
+  result.bytesUp = mqtt.bytesSent() - sentBefore;
+  result.bytesDown = mqtt.bytesReceived() - receivedBefore;
+  result.packetsUp = mqtt.sendCount() - sendsBefore;
+
+  mqtt.disconnect();
+  return result.messages > 0;
+}
+
+bool benchmarkMqttSn(TransportResult& result) {
+  char buffer[128];
+  unsigned long start = millis();
+
+  // No handshake below MQTT-SN: one CONNECT/CONNACK exchange
+  if (!mqttsn.begin(MQTT_BROKER, MQTT_SN_PORT) || !mqttsn.connect(MQTT_CLIENT_ID "_bench", MQTT_SN_DURATION)) {
+    return false;
+  }
+  result.setupMs = millis() - start;
+  result.setupBytes = mqttsn.bytesSent() + mqttsn.bytesReceived();
+
+  uint32_t sentBefore = mqttsn.bytesSent();
+  uint32_t receivedBefore = mqttsn.bytesReceived();
+  uint32_t sendsBefore = mqttsn.sendCount();
+  for (int i = 0; i < BENCHMARK_MESSAGES; i++) {
+    size_t length = buildTelemetry(buffer, sizeof(buffer));
+    unsigned long sent = millis();
+    if (!mqttsn.publish(TOPIC_ID_TELEMETRY, (const uint8_t*)buffer, length, 1)) {
+      continue;
+    }
+    uint32_t latency = millis() - sent;
+    result.messages++;
+    result.latencyTotalMs += latency;
+    result.latencyMaxMs = max(result.latencyMaxMs, latency);
+  }
+
+  result.bytesUp = mqttsn.bytesSent() - sentBefore;
+  result.bytesDown = mqttsn.bytesReceived() - receivedBefore;
+  result.packetsUp = mqttsn.sendCount() - sendsBefore;
+
+  mqttsn.end();
+  return result.messages > 0;
+}
+
+void printTransportResult(const TransportResult& result, uint32_t headerBytes, uint32_t extraPackets) {
+  uint32_t messages = result.messages;
+  // One packet up per send, one acknowledgement down per message, plus bare ACKs
+  uint32_t packets = result.packetsUp + messages + extraPackets * messages;
+  uint32_t wireBytes = result.bytesUp + result.bytesDown + packets * headerBytes;
+
+  Serial.printf("%-12s setup %lu ms / %lu B, %lu msgs, up %lu B/msg, down %lu B/msg, "
+                "~%lu B/msg with headers, latency avg %lu ms, max %lu ms\n",
+                result.name, (unsigned long)result.setupMs, (unsigned long)result.setupBytes,
+                (unsigned long)messages, (unsigned long)(result.bytesUp / messages),
+                (unsigned long)(result.bytesDown / messages), (unsigned long)(wireBytes / messages),
+                (unsigned long)(result.latencyTotalMs / messages), (unsigned long)result.latencyMaxMs);
+}
@@ -4,9 +4,29 @@
 SoftwareSerial* simSerial = NULL;
 uint8_t SIM800L_RST_PIN = -1;
 bool gprsConnected = false;
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE 4096
 char buffer[BUFFER_SIZE];
 
+// Download firmware per window dengan header Range (ukuran window dipilih dari throughput terukur)
+#ifndef HTTP_WINDOW_MIN
+#define HTTP_WINDOW_MIN (16 * 1024)
+#endif
+#ifndef HTTP_WINDOW_MAX
+#define HTTP_WINDOW_MAX (64 * 1024)
+#endif
+#define HTTP_WINDOW_STEP 4096
+#define HTTP_WINDOW_RETRY_MIN HTTP_WINDOW_STEP  // Window ulang boleh turun sampai satu slice HTTPREAD
+#define HTTP_WINDOW_RETRIES 3
+#define HTTP_ACTION_TIMEOUT 30000
+
+// Statistik latensi per slice HTTPREAD (diagnostik di log, bukan hasil ukur)
+struct SliceStats {
+  unsigned long minMs = ULONG_MAX;
+  unsigned long maxMs = 0;
+  unsigned long totalMs = 0;
+  size_t count = 0;
+};
+
 // Fungsi untuk reset SIM800L
 void resetSIM800L() {
   if (SIM800L_RST_PIN >= 0) {
@@ -72,6 +92,210 @@ String sendATCommandWithString(String command, int timeout) {
   return sendATCommand(command.c_str(), timeout);
 }
 
+// Baca satu baris respons AT (tanpa CR/LF) ke buffer kecil, kembalikan false jika timeout
+static bool readATLine(char* line, size_t size, unsigned long startTime, unsigned long timeout) {
+  size_t pos = 0;
+  
+  while (millis() - startTime < timeout) {
+    if (!simSerial->available()) {
+      yield();
+      continue;
+    }
+    
+    char c = simSerial->read();
+    if (c == '\n') {
+      line[pos] = '\0';
+      if (pos > 0) {
+        return true;
+      }
+    } else if (c != '\r' && pos < size - 1) {
+      line[pos++] = c;
+    }
+  }
+  
+  return false;
+}
+
+// Parser streaming untuk "+HTTPREAD: <len>\r\n<len byte mentah>\r\nOK\r\n".
+// Data dibaca tepat <len> byte langsung ke dest, tanpa String, jadi aman untuk byte NUL,
+// dan fungsi kembali begitu slice selesai (bukan setelah timeout penuh).
+int readHTTPSlice(size_t start, size_t length, uint8_t* dest, unsigned long timeout) {
+  if (simSerial == NULL) {
+    return -1;
+  }
+  
+  // Buang sisa respons sebelumnya
+  while (simSerial->available()) {
+    simSerial->read();
+  }
+  
+  simSerial->print("AT+HTTPREAD=");
+  simSerial->print(start);
+  simSerial->print(",");
+  simSerial->println(length);
+  
+  unsigned long startTime = millis();
+  char line[32];
+  
+  // 1. Header "+HTTPREAD: <len>"
+  int dataLength = -1;
+  while (dataLength < 0) {
+    if (!readATLine(line, sizeof(line), startTime, timeout)) {
+      return -1;
+    }
+    if (strncmp(line, "+HTTPREAD:", 10) == 0) {
+      dataLength = atoi(line + 10);
+    } else if (strstr(line, "ERROR") != NULL) {
+      return -1;
+    }
+  }
+  
+  if ((size_t)dataLength > length) {
+    return -1;
+  }
+  
+  // 2. Tepat dataLength byte mentah
+  size_t received = 0;
+  while (received < (size_t)dataLength) {
+    if (millis() - startTime >= timeout) {
+      return -1;
+    }
+    
+    int available = simSerial->available();
+    if (available > 0) {
+      size_t toRead = min((size_t)available, (size_t)dataLength - received);
+      received += simSerial->readBytes(dest + received, toRead);
+    } else {
+      yield();
+    }
+  }
+  
+  // 3. Penutup "OK" datang langsung setelah data
+  while (readATLine(line, sizeof(line), startTime, timeout)) {
+    if (strcmp(line, "OK") == 0) {
+      return dataLength;
+    }
+  }
+  
+  return -1;
+}
+
+// Kirim perintah AT dan kembali begitu "OK" atau "ERROR" diterima
+static bool sendATCommandOK(const String& command, unsigned long timeout) {
+  while (simSerial->available()) {
+    simSerial->read();
+  }
+  
+  simSerial->println(command);
+  
+  unsigned long startTime = millis();
+  char line[64];
+  while (readATLine(line, sizeof(line), startTime, timeout)) {
+    if (strcmp(line, "OK") == 0) {
+      return true;
+    }
+    if (strstr(line, "ERROR") != NULL) {
+      break;
+    }
+  }
+  
+  Serial.println("AT Command gagal: " + command);
+  return false;
+}
+
+// Jalankan AT+HTTPACTION=0 dan tunggu URC "+HTTPACTION: 0,<status>,<panjang>"
+static bool httpGetAction(int &status, size_t &length, unsigned long timeout) {
+  if (!sendATCommandOK("AT+HTTPACTION=0", 2000)) {
+    return false;
+  }
+  
+  unsigned long startTime = millis();
+  char line[64];
+  while (readATLine(line, sizeof(line), startTime, timeout)) {
+    if (strncmp(line, "+HTTPACTION:", 12) == 0) {
+      int method = 0;
+      unsigned long bodyLength = 0;
+      if (sscanf(line + 12, "%d,%d,%lu", &method, &status, &bodyLength) != 3) {
+        return false;
+      }
+      length = bodyLength;
+      return true;
+    }
+  }
+  
+  return false;
+}
+
+// Unduh satu window [start, start + length) dengan header Range dan tulis ke flash.
+// written bertambah per slice, jadi window yang gagal bisa dilanjutkan dari byte terakhir.
+static bool downloadWindow(size_t start, size_t length, size_t &written,
+                           unsigned long &actionMs, unsigned long &readMs, SliceStats &stats) {
+  String rangeCmd = "AT+HTTPPARA=\"USERDATA\",\"Range: bytes=";
+  rangeCmd += String(start) + "-" + String(start + length - 1) + "\"";
+  if (!sendATCommandOK(rangeCmd, 1000)) {
+    return false;
+  }
+  
+  unsigned long actionStart = millis();
+  int status = 0;
+  size_t bodyLength = 0;
+  if (!httpGetAction(status, bodyLength, HTTP_ACTION_TIMEOUT)) {
+    Serial.println("HTTPACTION tidak merespons");
+    return false;
+  }
+  actionMs = millis() - actionStart;
+  
+  if (status != 206 || bodyLength != length) {
+    Serial.printf("Respons window tidak valid: status %d, panjang %u\n", status, (unsigned)bodyLength);
+    return false;
+  }
+  
+  // Kuras window dengan HTTPREAD sebesar buffer
+  unsigned long readStart = millis();
+  size_t offset = 0;
+  while (offset < length) {
+    size_t requestLength = min((size_t)BUFFER_SIZE, length - offset);
+    unsigned long sliceStart = millis();
+    int bytesRead = readHTTPSlice(offset, requestLength, (uint8_t*)buffer, 10000);
+    unsigned long sliceMs = millis() - sliceStart;
+    
+    if (bytesRead <= 0) {
+      Serial.println("Respons tidak valid");
+      return false;
+    }
+    
+    stats.count++;
+    stats.totalMs += sliceMs;
+    stats.minMs = min(stats.minMs, sliceMs);
+    stats.maxMs = max(stats.maxMs, sliceMs);
+    
+    // Tulis buffer ke flash
+    if (Update.write((uint8_t*)buffer, bytesRead) != (size_t)bytesRead) {
+      Serial.println("Gagal menulis ke flash");
+      return false;
+    }
+    
+    offset += bytesRead;
+    written += bytesRead;
+  }
+  readMs = millis() - readStart;
+  
+  return true;
+}
+
+// Pilih ukuran window berikutnya: overhead HTTPACTION maksimal ~10% dari waktu baca window
+static size_t chooseWindowSize(size_t bytes, unsigned long actionMs, unsigned long readMs) {
+  if (readMs == 0) {
+    return HTTP_WINDOW_MAX;
+  }
+  
+  float bytesPerMs = (float)bytes / readMs;
+  size_t target = (size_t)(actionMs * bytesPerMs * 9);
+  target = (target + HTTP_WINDOW_STEP - 1) / HTTP_WINDOW_STEP * HTTP_WINDOW_STEP;
+  
+  return max((size_t)HTTP_WINDOW_MIN, min((size_t)HTTP_WINDOW_MAX, target));
+}
+
 // Fungsi untuk terhubung ke jaringan GPRS
 bool connectGPRS(const char* apn, const char* user, const char* password) {
   Serial.println("Menghubungkan ke jaringan GPRS...");
@@ -256,22 +480,7 @@ bool downloadAndUpdateFirmware(FirmwareInfo &info, const char* server) {
   urlCmd += "\"";
   sendATCommandWithString(urlCmd, 1000);
   
-  // Mulai HTTP GET
-  String response = sendATCommand("AT+HTTPACTION=0", 30000);
-  if (response.indexOf("+HTTPACTION: 0,200") == -1) {
-    Serial.println("Gagal mengunduh firmware");
-    sendATCommand("AT+HTTPTERM", 1000);
-    return false;
-  }
-  
-  // Dapatkan ukuran firmware
-  int contentLength = 0;
-  int actionIndex = response.indexOf("+HTTPACTION: 0,200,");
-  if (actionIndex > 0) {
-    contentLength = response.substring(actionIndex + 17).toInt();
-  }
-  
-  if (contentLength != info.size) {
+  if (info.size == 0) {
     Serial.println("Ukuran firmware tidak sesuai");
     sendATCommand("AT+HTTPTERM", 1000);
     return false;
@@ -287,47 +496,50 @@ bool downloadAndUpdateFirmware(FirmwareInfo &info, const char* server) {
   // Mengatur MD5 untuk verifikasi
   Update.setMD5(info.md5.c_str());
   
-  // Baca firmware dengan chunking
+  // Baca firmware per window Range; window yang gagal diulang sendiri dari byte terakhir
   size_t totalBytesRead = 0;
-  int chunkSize = 1024; // Ukuran chunk dalam byte
-  
-  for (int i = 0; i < info.size; i += chunkSize) {
-    int endPos = min(i + chunkSize - 1, (int)info.size - 1);
-    String range = "AT+HTTPREAD=" + String(i) + "," + String(endPos);
-    response = sendATCommandWithString(range, 10000);
+  size_t windowSize = HTTP_WINDOW_MIN;
+  int windowRetries = 0;
+  SliceStats sliceStats;
+  unsigned long downloadStart = millis();
+  
+  while (totalBytesRead < info.size) {
+    size_t windowStart = totalBytesRead;
+    size_t windowLength = min(windowSize, info.size - windowStart);
+    unsigned long actionMs = 0;
+    unsigned long readMs = 0;
     
-    // Ekstrak data dari respons
-    int dataStart = response.indexOf("\r\n") + 2;
-    int chunkLength = response.substring(dataStart).toInt();
-    
-    if (chunkLength <= 0) {
-      Serial.println("Respons tidak valid");
-      Update.abort();
-      sendATCommand("AT+HTTPTERM", 1000);
-      return false;
+    if (!downloadWindow(windowStart, windowLength, totalBytesRead, actionMs, readMs, sliceStats)) {
+      // Kegagalan flash tidak bisa diulang
+      if (Update.hasError() || ++windowRetries > HTTP_WINDOW_RETRIES) {
+        Serial.println("Gagal mengunduh firmware");
+        Update.abort();
+        sendATCommand("AT+HTTPTERM", 1000);
+        return false;
+      }
+      
+      // Dibagi dua tiap percobaan, di bawah HTTP_WINDOW_MIN bila perlu
+      windowSize = max((size_t)HTTP_WINDOW_RETRY_MIN, windowSize / 2);
+      Serial.printf("Ulangi window dari byte %u (percobaan %d/%d)\n",
+                    (unsigned)totalBytesRead, windowRetries, HTTP_WINDOW_RETRIES);
+      continue;
     }
     
-    // Temukan awal data sebenarnya
-    dataStart = response.indexOf("\r\n", dataStart) + 2;
-    
-    // Salin data ke buffer
-    size_t bytesToRead = min((size_t)chunkLength, (size_t)(endPos - i + 1));
-    for (size_t j = 0; j < bytesToRead && (dataStart + j) < response.length(); j++) {
-      buffer[j] = response.charAt(dataStart + j);
-    }
+    windowRetries = 0;
+    windowSize = chooseWindowSize(windowLength, actionMs, readMs);
     
-    // Tulis buffer ke flash
-    if (Update.write((uint8_t*)buffer, bytesToRead) != bytesToRead) {
-      Serial.println("Gagal menulis ke flash");
-      Update.abort();
-      sendATCommand("AT+HTTPTERM", 1000);
-      return false;
-    }
-    
-    totalBytesRead += bytesToRead;
-    Serial.printf("Diunduh %.2f%%\n", (totalBytesRead * 100.0) / info.size);
+    Serial.printf("Diunduh %.2f%% (window %u byte: action %lu ms, baca %lu ms, %.1f KB/s, window berikut %u)\n",
+                  (totalBytesRead * 100.0) / info.size, (unsigned)windowLength, actionMs, readMs,
+                  readMs ? windowLength / (float)readMs * 1000.0 / 1024.0 : 0.0,
+                  (unsigned)windowSize);
   }
   
+  unsigned long downloadMs = millis() - downloadStart;
+  Serial.printf("Unduhan selesai: %u byte dalam %lu ms (%.1f KB/s)\n", (unsigned)totalBytesRead, downloadMs,
+                downloadMs ? totalBytesRead / (float)downloadMs * 1000.0 / 1024.0 : 0.0);
+  Serial.printf("Latensi slice HTTPREAD: min %lu ms, rata-rata %lu ms, maks %lu ms (%u slice)\n",
+                sliceStats.minMs, sliceStats.totalMs / sliceStats.count, sliceStats.maxMs, (unsigned)sliceStats.count);
+  
   sendATCommand("AT+HTTPTERM", 1000);
   
   // Selesaikan update
@@ -33,6 +33,9 @@ bool isGPRSConnected();
 String sendATCommand(const char* command, int timeout = 2000);
 String sendATCommandWithString(String command, int timeout = 2000);
 
+// Baca satu slice AT+HTTPREAD langsung ke buffer (binary-safe), kembalikan jumlah byte atau -1
+int readHTTPSlice(size_t start, size_t length, uint8_t* dest, unsigned long timeout = 10000);
+
 // Fungsi cek dan update firmware
 bool getFirmwareInfo(FirmwareInfo &info, const char* server, const char* endpoint);
 bool downloadAndUpdateFirmware(FirmwareInfo &info, const char* server);
@@ -2,18 +2,25 @@
 #include <HardwareSerial.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/queue.h>
 #include <Update.h>
 #include <MD5Builder.h>
 #include <ArduinoJson.h>
+#include <MqttSim800.h>
+#include <TelemetryLog.h>
+#include <AdaptiveKeepAlive.h>
 
 // MQTT Configuration
 #define MQTT_BROKER           "fota.getstokfms.com"
-#define MQTT_PORT             "1883"
+#define MQTT_PORT             1883
 #define MQTT_CLIENT_ID        "esp32_device_001" // Unique ID for each device
 #define MQTT_TOPIC_PUB        "device/firmware/request"
 #define MQTT_TOPIC_INFO       "device/firmware/info"
-#define MQTT_TOPIC_DATA       "device/firmware/data"
-#define MQTT_KEEP_ALIVE       60  // seconds
+#define MQTT_TOPIC_CHUNK      "device/firmware/chunk/" DEVICE_ID  // QoS 1, raw chunks for this device
+#define MQTT_TOPIC_TELEMETRY  "device/telemetry/" DEVICE_ID
+#define MQTT_TOPIC_BACKLOG    "device/telemetry/" DEVICE_ID "/batch"  // QoS 1, records stored while offline
+#define MQTT_BATCH_BYTES      512 // Coalesce outgoing packets (QoS 0, PINGREQ) into one CIPSEND
+#define MQTT_BATCH_DELAY      200 // ms a packet may wait for others (PUBACKs never wait)
 
 // Device Information
 #define FIRMWARE_VERSION      "1.0.0" // Current firmware version
@@ -27,31 +34,123 @@
 #define SIM_APN               "internet"  // Change according to your operator
 
 // Timing Configuration
-#define PING_INTERVAL         30000  // 30 seconds
 #define FOTA_CHECK_INTERVAL   60000  // 60 seconds
+#define STREAM_STALL_TIMEOUT  30000  // Re-request the stream after 30 seconds without a chunk
+#define OTA_PROGRESS_INTERVAL 1000   // ms between progress events while chunks arrive
+#define FOTA_RETRY_BACKOFF    300000   // A version that failed to flash is offered again after 5 minutes,
+#define FOTA_RETRY_BACKOFF_MAX 3600000 // doubling per failure up to an hour
+#define MODEM_LOAD_TEST       0      // 1: telemetry every 100 ms on top of FOTA, to load the modem queue
+#if MODEM_LOAD_TEST
+#define TELEMETRY_INTERVAL    100
+#else
+#define TELEMETRY_INTERVAL    10000  // 10 seconds
+#endif
+#define MODEM_STATS_INTERVAL  10000  // Queue statistics on the console
+#define TELEMETRY_BATCH_SIZE  1200   // Bytes of stored records per backlog publish (one CIPSEND)
+#define TELEMETRY_DRAIN_BATCHES 4    // Backlog publishes per drain request, so FOTA requests interleave
+#define TELEMETRY_LOG_BENCHMARK 0    // 1: time the flash log at boot (erases the stored backlog)
 #define AT_DEFAULT_TIMEOUT    2000   // 2 seconds
-#define AT_CONNECT_TIMEOUT    5000   // 5 seconds
-
-// MQTT Packet Types
-#define MQTT_CONNECT          0x10
-#define MQTT_PUBLISH          0x30
-#define MQTT_SUBSCRIBE        0x82
-#define MQTT_PINGREQ          0xC0
 
 // FOTA Configuration
 #define FIRMWARE_BUFFER_SIZE  1024
+#define CHUNK_OFFSET_SIZE     4     // Big-endian image offset ahead of each chunk
+#define CHUNK_SLOT_SIZE       (CHUNK_OFFSET_SIZE + FIRMWARE_BUFFER_SIZE)
+#define FOTA_WINDOW           4     // Chunks in flight; also the reorder slots below
 #define MAX_JSON_SIZE         512
 
+// Modem ownership: modemTask is the only code touching SerialAT and the chunk slots,
+// other tasks queue requests and get typed events back on their own queue
+#define MODEM_QUEUE_LENGTH    8
+#define MODEM_EVENT_QUEUE     8
+#define MODEM_TARGET_SIZE     64
+#define MODEM_DATA_SIZE       256
+#define MODEM_RESPONSE_SIZE   48
+#define MODEM_POLL_INTERVAL   20     // ms between UART drains while no request is queued
+#define MODEM_SUBMIT_TIMEOUT  1000   // ms a task waits for room in the request queue
+#define MODEM_REPLY_TIMEOUT   15000  // ms a task waits for the outcome of its request
+
 // UART for SIM800L
 HardwareSerial SerialAT(SIM800L_SERIAL);
+MqttSim800 mqtt(SerialAT);
 
 // Global variables
-TaskHandle_t mqttTaskHandle = NULL;
-TaskHandle_t monitorTaskHandle = NULL;
+TaskHandle_t modemTaskHandle = NULL;
+TaskHandle_t telemetryTaskHandle = NULL;
 TaskHandle_t fotaTaskHandle = NULL;
-unsigned long lastPingTime = 0;
 unsigned long lastFotaCheckTime = 0;
-bool mqttConnected = false;
+unsigned long lastProgressEvent = 0;
+unsigned long otaStartTime = 0;
+
+// Last version that failed to flash, and when it may be tried again
+String failedVersion = "";
+unsigned long failedAt = 0;
+unsigned long failedBackoff = 0;
+
+// Modem requests and the events they produce
+enum ModemRequestType { MODEM_PUBLISH, MODEM_QUERY, MODEM_DRAIN, MODEM_OTA_START, MODEM_OTA_RESUME };
+enum ModemEventType {
+  MODEM_EVENT_DONE, MODEM_EVENT_FAILED,                   // Outcome of a request
+  MODEM_EVENT_CONNECTED, MODEM_EVENT_DISCONNECTED,        // Broker session
+  MODEM_EVENT_OTA_AVAILABLE,                              // FOTA task only
+  MODEM_EVENT_OTA_STARTED, MODEM_EVENT_OTA_PROGRESS, MODEM_EVENT_OTA_ENDED
+};
+enum ModemTag { TAG_NONE, TAG_CHECK, TAG_STREAM, TAG_STOP, TAG_SIGNAL, TAG_TELEMETRY, TAG_DRAIN, TAG_OTA };
+
+struct ModemRequest {
+  ModemRequestType type;
+  ModemTag tag;                     // Echoed in the event, so the sender knows which request it was
+  QueueHandle_t replyTo;            // NULL: no event wanted
+  uint8_t qos;
+  char target[MODEM_TARGET_SIZE];   // Topic, or the AT command of a query
+  char data[MODEM_DATA_SIZE];       // Payload, or the response line a query waits for
+  size_t length;
+  unsigned long queuedAt;
+};
+
+struct ModemEvent {
+  ModemEventType type;
+  ModemTag tag;
+  char response[MODEM_RESPONSE_SIZE];  // Response line of a query
+  size_t offset;                       // Bytes flashed, for the OTA events
+};
+
+// Link and update state as the events told it: the other tasks keep their own copy
+// instead of reading mqtt and fotaInfo, which the modem task changes under them
+struct ModemStatus {
+  bool connected;
+  bool updating;
+  size_t offset;
+  unsigned long lastProgress;          // When the stream last moved (or was requested)
+};
+
+// Stored telemetry report: 13 bytes on flash instead of ~80 of JSON. The JSON is
+// built when the backlog is published, with the device ID once in the batch header.
+struct __attribute__((packed)) TelemetryRecord {
+  uint32_t uptime;     // s
+  uint32_t heap;
+  uint32_t fota;       // Bytes flashed, 0 with no update running
+  int8_t csq;
+};
+
+struct ModemStats {
+  uint32_t served;
+  uint32_t failed;
+  uint32_t dropped;                 // Queue full
+  uint32_t waitTotalMs;             // Submitted to served
+  uint32_t waitMaxMs;
+};
+
+// Telemetry that could not be sent, kept on the "data" partition until the link returns
+TelemetryLog telemetryLog;
+
+// Ping interval tuned to the carrier's NAT timeout, per SIM/operator
+AdaptiveKeepAlive keepAlive;
+
+QueueHandle_t modemRequests = NULL;
+QueueHandle_t fotaEvents = NULL;       // Request outcomes, connection and update changes
+QueueHandle_t telemetryEvents = NULL;  // Same, less MODEM_EVENT_OTA_AVAILABLE
+ModemStats modemStats = {0, 0, 0, 0, 0};
+ModemStatus telemetryStatus = {false, false, 0, 0};  // Telemetry task only
 
 // FOTA Variables
 struct FotaInfo {
@@ -66,6 +165,17 @@ struct FotaInfo {
   MD5Builder md5Builder;
 };
 
+// Reorder slots: after a resend, chunks behind the gap wait here until it is filled
+enum SlotState { SLOT_FREE, SLOT_RECEIVING, SLOT_READY };
+
+struct ChunkSlot {
+  uint8_t* data;       // Offset + chunk, written directly by the MQTT parser
+  size_t length;
+  SlotState state;
+};
+
+ChunkSlot chunkSlots[FOTA_WINDOW];
+
 FotaInfo fotaInfo = {
   FIRMWARE_VERSION, // Current version
   "",               // Firmware name (will be filled)
@@ -80,23 +190,48 @@ FotaInfo fotaInfo = {
 
 // Function prototypes
 void sendAT(String cmd, String expected, int timeout = AT_DEFAULT_TIMEOUT);
-void sendRawMQTTConnect();
-void sendRawMQTTSubscribe();
-void sendPingReq();
+void beginKeepAlive();
+bool modemHasSignal();
+bool connectMQTT();
 void reconnectMQTT();
-void sendMQTTPublish(const char* topic, const char* message);
-void mqttTask(void *parameter);
-void monitorTask(void *parameter);
+uint8_t* firmwareChunkSink(size_t length, void* context);
+void onFirmwareInfo(uint8_t* payload, size_t length, void* context);
+void onFirmwareChunk(uint8_t* payload, size_t length, void* context);
+void modemTask(void *parameter);
+void telemetryTask(void *parameter);
 void fotaTask(void *parameter);
+bool submitModemRequest(ModemRequest& request);
+void serveModemRequest(const ModemRequest& request);
+void postModemEvent(QueueHandle_t queue, ModemEventType type, ModemTag tag, const char* response = "", size_t offset = 0);
+void broadcastModemEvent(ModemEventType type, size_t offset = 0);
+void trackModemStatus(ModemStatus& status, const ModemEvent& event);
+bool waitModemReply(QueueHandle_t queue, ModemTag tag, ModemEvent& event, ModemStatus& status);
+bool modemPublish(const char* topic, const char* payload, uint8_t qos, QueueHandle_t replyTo = NULL, ModemTag tag = TAG_NONE);
+bool modemQuery(const char* command, const char* expected, QueueHandle_t replyTo, ModemTag tag);
+bool modemOtaRequest(ModemRequestType type);
+void publishTelemetry();
+size_t formatTelemetryRecord(const TelemetryRecord& record, const char* device, char* buffer, size_t size);
+bool drainTelemetry();
+bool drainTelemetryLog();
+bool addBacklogRecord(uint32_t seq, const uint8_t* data, size_t length, void* context);
+void benchmarkTelemetryLog();
+void printModemStats();
 String byteToHexString(uint8_t byte);
 String bytesToHexString(const uint8_t* bytes, size_t length);
 uint8_t hexCharToByte(char c);
 void hexStringToBytes(const String& hexString, uint8_t* output, size_t* outputLength);
 bool checkFirmwareUpdate();
-void processFirmwareInfo(String jsonStr);
-void requestFirmwareChunk(size_t offset, size_t size);
+void processFirmwareInfo(const char* json, size_t length);
+void processFirmwareChunk(uint8_t* payload, size_t length);
+void flashReadyChunks();
+void finishOtaUpdate();
+void abortOtaUpdate();
+void backOffFirmwareVersion();
+void sendFirmwareVerify(const String& md5);
+void resetChunkSlots(bool keepReady);
+void requestFirmwareStream(size_t offset);
 bool verifyFirmwareChecksum();
-void startOtaUpdate();
+bool startOtaUpdate();
 int compareVersions(String v1, String v2);
 
 void setup() {
@@ -108,12 +243,28 @@ void setup() {
   Serial.print("Current firmware version: ");
   Serial.println(FIRMWARE_VERSION);
   
-  // Allocate buffer for firmware chunks
-  fotaInfo.updateBuffer = new uint8_t[FIRMWARE_BUFFER_SIZE];
+  // Allocate buffer for firmware chunks, one slot per chunk in flight
+  fotaInfo.updateBuffer = new uint8_t[FOTA_WINDOW * CHUNK_SLOT_SIZE];
   if (!fotaInfo.updateBuffer) {
     Serial.println("Failed to allocate firmware buffer memory!");
     while(1) { delay(1000); } // Fatal error
   }
+  for (int i = 0; i < FOTA_WINDOW; i++) {
+    chunkSlots[i].data = fotaInfo.updateBuffer + i * CHUNK_SLOT_SIZE;
+  }
+  resetChunkSlots(false);
+  
+  modemRequests = xQueueCreate(MODEM_QUEUE_LENGTH, sizeof(ModemRequest));
+  fotaEvents = xQueueCreate(MODEM_EVENT_QUEUE, sizeof(ModemEvent));
+  telemetryEvents = xQueueCreate(MODEM_EVENT_QUEUE, sizeof(ModemEvent));
+  
+#if TELEMETRY_LOG_BENCHMARK
+  benchmarkTelemetryLog();
+#endif
+  if (telemetryLog.begin()) {
+    Serial.printf("Telemetry log: %u records pending, recovered in %lu ms\n",
+                  (unsigned)telemetryLog.pending(), (unsigned long)telemetryLog.recoveryMs());
+  }
   
   // Initialize connection in the main setup without tasks first
   Serial.println("Setting up SIM800L for MQTT connection...");
@@ -128,36 +279,34 @@ void setup() {
   sendAT("AT+CIICR", "OK");
   sendAT("AT+CIFSR", ".");
   
-  // Connect TCP socket to MQTT broker
-  sendAT("AT+CIPSTART=\"TCP\",\"" + String(MQTT_BROKER) + "\",\"" + String(MQTT_PORT) + "\"", "CONNECT OK", AT_CONNECT_TIMEOUT);
+  beginKeepAlive();
   
-  delay(2000);
-  sendRawMQTTConnect();
-  delay(2000);
-  sendRawMQTTSubscribe(); // Subscribe to FOTA topics
+  // Connect to the MQTT broker and subscribe to FOTA topics
+  mqtt.setBatching(MQTT_BATCH_BYTES, MQTT_BATCH_DELAY);
+  mqtt.route(MQTT_TOPIC_INFO, onFirmwareInfo);
+  mqtt.route(MQTT_TOPIC_CHUNK, onFirmwareChunk, firmwareChunkSink);
+  connectMQTT();
   
-  lastPingTime = millis();
   lastFotaCheckTime = millis();
-  mqttConnected = true;
   
-  // Now create the tasks
+  // Now create the tasks; from here on only the modem task touches SerialAT
   xTaskCreatePinnedToCore(
-    mqttTask,
-    "MQTTTask",
-    4096,
+    modemTask,
+    "ModemTask",
+    6144, // JSON parsing and flashing run in the FOTA callbacks
     NULL,
-    1,
-    &mqttTaskHandle,
+    2,    // Above the others so queued requests and incoming data are served first
+    &modemTaskHandle,
     0  // Core 0
   );
   
   xTaskCreatePinnedToCore(
-    monitorTask,
-    "MonitorTask",
-    4096, // Increased stack size to handle JSON parsing
+    telemetryTask,
+    "TelemetryTask",
+    4096,
     NULL,
     1,
-    &monitorTaskHandle,
+    &telemetryTaskHandle,
     1  // Core 1
   );
   
@@ -177,381 +326,585 @@ void loop() {
   delay(1000);
 }
 
-// ==================== MQTT Task ====================
-void mqttTask(void *parameter) {
+// ==================== Modem Task ====================
+// Sole owner of SerialAT: drains the UART (FOTA messages arrive in onFirmwareInfo()/
+// onFirmwareChunk()), reconnects, and serves queued requests one at a time
+void modemTask(void *parameter) {
+  ModemRequest request;
+  bool wasConnected = mqtt.connected();
+  uint32_t pingResponses = mqtt.pingResponses();
+  
+  // setup() connected before the other tasks existed; tell them how that went
+  broadcastModemEvent(wasConnected ? MODEM_EVENT_CONNECTED : MODEM_EVENT_DISCONNECTED);
+  
   while(true) {
-    // Send MQTT ping to keep connection alive
-    if (millis() - lastPingTime > PING_INTERVAL) {
-      sendPingReq();
-      lastPingTime = millis();
+    mqtt.loop();
+    
+    // A ping answered after a longer idle than any before raises the interval
+    if (mqtt.pingResponses() != pingResponses) {
+      pingResponses = mqtt.pingResponses();
+      keepAlive.onPingAnswered(mqtt.pingIdleMs() / 1000);
+      mqtt.setPingInterval(keepAlive.interval());
     }
     
-    // FOTA check periodically
-    if (millis() - lastFotaCheckTime > FOTA_CHECK_INTERVAL && !fotaInfo.updateInProgress) {
-      lastFotaCheckTime = millis();
-      checkFirmwareUpdate();
+    if (!mqtt.connected()) {
+      if (wasConnected) {
+        Serial.println("\nConnection lost. Will attempt to reconnect...");
+        // Only an idle probe left unanswered with the radio up points at the NAT
+        if (mqtt.lossIdleMs() > 0 && modemHasSignal()) {
+          keepAlive.onConnectionLost(mqtt.lossIdleMs() / 1000);
+        }
+        broadcastModemEvent(MODEM_EVENT_DISCONNECTED);
+        wasConnected = false;
+      }
+      
+      reconnectMQTT();
+      if (!mqtt.connected()) {
+        continue;
+      }
+      wasConnected = true;
+      broadcastModemEvent(MODEM_EVENT_CONNECTED);
     }
     
-    // Short delay
-    vTaskDelay(100 / portTICK_PERIOD_MS);
+    // Check for serial input from debug console
+    if (Serial.available()) {
+      SerialAT.write(Serial.read());
+    }
+    
+    // Wait for a request instead of sleeping, so it goes out as soon as it is queued
+    if (xQueueReceive(modemRequests, &request, MODEM_POLL_INTERVAL / portTICK_PERIOD_MS) == pdTRUE) {
+      serveModemRequest(request);
+    }
   }
 }
 
-// ==================== Monitor Task ====================
-void monitorTask(void *parameter) {
-  String receivedData = "";
-  bool receivingBinaryData = false;
-  size_t binaryDataLength = 0;
-  size_t dataOffset = 0;
+// ==================== Telemetry Task ====================
+void telemetryTask(void *parameter) {
+  ModemEvent event;
+  unsigned long lastTelemetryTime = 0;
+  unsigned long lastStatsTime = millis();
+  unsigned long lastDrainFailure = millis() - TELEMETRY_INTERVAL;
   
   while(true) {
-    // Check for incoming data from SIM800L
-    while (SerialAT.available()) {
-      char c = SerialAT.read();
-      Serial.write(c); // Echo untuk debugging
-      
-      if (receivingBinaryData) {
-        fotaInfo.updateBuffer[dataOffset++] = c;
-        
-        if (dataOffset >= binaryDataLength) {
-          receivingBinaryData = false;
-          
-          // Process received firmware chunk
-          if (Update.write(fotaInfo.updateBuffer, binaryDataLength) != binaryDataLength) {
-            Serial.println("Error writing firmware chunk!");
-          } else {
-            fotaInfo.md5Builder.add(fotaInfo.updateBuffer, binaryDataLength);
-            fotaInfo.currentOffset += binaryDataLength;
-            
-            Serial.print("Chunk written. Progress: ");
-            Serial.print((fotaInfo.currentOffset * 100) / fotaInfo.size);
-            Serial.println("%");
-            
-            // Request next chunk if not complete
-            if (fotaInfo.currentOffset < fotaInfo.size) {
-              size_t remainingBytes = fotaInfo.size - fotaInfo.currentOffset;
-              size_t chunkSize = remainingBytes > FIRMWARE_BUFFER_SIZE ? FIRMWARE_BUFFER_SIZE : remainingBytes;
-              requestFirmwareChunk(fotaInfo.currentOffset, chunkSize);
-            } else {
-              // Firmware download complete, verify checksum
-              fotaInfo.md5Builder.calculate();
-              String calculatedMD5 = fotaInfo.md5Builder.toString();
-              
-              Serial.print("Download complete. Verifying MD5: ");
-              Serial.println(calculatedMD5);
-              
-              if (calculatedMD5.equalsIgnoreCase(fotaInfo.md5)) {
-                Serial.println("MD5 verification successful!");
-                if (Update.end(true)) {
-                  Serial.println("Update success! Rebooting...");
-                  ESP.restart();
-                } else {
-                  Serial.println("Update failed!");
-                }
-              } else {
-                Serial.println("MD5 verification failed. Aborting update.");
-                Update.abort();
-                fotaInfo.updateInProgress = false;
-              }
-            }
-          }
-        }
-      } else {
-        receivedData += c;
-        
-        // Cek apakah ada pesan MQTT firmware info
-        if (receivedData.indexOf(MQTT_TOPIC_INFO) != -1) {
-          int jsonStart = receivedData.indexOf('{');
-          int jsonEnd = receivedData.lastIndexOf('}');
-          
-          if (jsonStart != -1 && jsonEnd != -1 && jsonEnd > jsonStart) {
-            String jsonStr = receivedData.substring(jsonStart, jsonEnd + 1);
-            Serial.println("\n--- Received firmware info JSON: ---");
-            Serial.println(jsonStr);
-            Serial.println("-----------------------------------");
-            
-            processFirmwareInfo(jsonStr);
-            
-            // Clear buffer setelah pemrosesan
-            receivedData = "";
-          }
-        }
-        
-        // Cek apakah ada pesan MQTT firmware data
-        if (receivedData.indexOf(MQTT_TOPIC_DATA) != -1) {
-          int headerStart = receivedData.indexOf('{');
-          int headerEnd = receivedData.indexOf('\n', headerStart);
-          
-          if (headerStart != -1 && headerEnd != -1) {
-            String headerJson = receivedData.substring(headerStart, headerEnd);
-            
-            // Parse header
-            StaticJsonDocument<200> doc;
-            DeserializationError error = deserializeJson(doc, headerJson);
-            
-            if (!error) {
-              size_t offset = doc["offset"];
-              size_t size = doc["size"];
-              size_t total = doc["total"];
-              
-              Serial.print("\nReceived firmware chunk: offset=");
-              Serial.print(offset);
-              Serial.print(", size=");
-              Serial.print(size);
-              Serial.print(", total=");
-              Serial.println(total);
-              
-              // Prepare to receive binary data
-              receivingBinaryData = true;
-              binaryDataLength = size;
-              dataOffset = 0;
-              
-              // Look for any binary data already received
-              int dataStart = headerEnd + 1;
-              if (dataStart < receivedData.length()) {
-                // Copy binary data already in the buffer
-                for (int i = dataStart; i < receivedData.length() && dataOffset < binaryDataLength; i++) {
-                  fotaInfo.updateBuffer[dataOffset++] = receivedData[i];
-                }
-              }
-              
-              // Clear buffer after processing header
-              receivedData = "";
-            }
-          }
-        }
-        
-        // Prevent buffer overflow - trim if too long
-        if (receivedData.length() > 1024) {
-          receivedData = receivedData.substring(receivedData.length() - 512);
-        }
-        
-        // Cek koneksi terputus
-        if (receivedData.indexOf("CLOSED") != -1 || receivedData.indexOf("ERROR") != -1) {
-          Serial.println("\nConnection lost. Will attempt to reconnect...");
-          mqttConnected = false;
-          receivedData = "";
-          
-          // Attempt reconnection
-          reconnectMQTT();
-        }
-      }
+    // Connection and update changes since the last pass (replies are taken by waitModemReply)
+    while (xQueueReceive(telemetryEvents, &event, 0) == pdTRUE) {
+      trackModemStatus(telemetryStatus, event);
     }
     
-    // Check for serial input from debug console
-    if (Serial.available()) {
-      SerialAT.write(Serial.read());
+    // FOTA check periodically (keep-alive pings are sent by the modem task)
+    if (telemetryStatus.connected && !telemetryStatus.updating &&
+        millis() - lastFotaCheckTime > FOTA_CHECK_INTERVAL) {
+      lastFotaCheckTime = millis();
+      checkFirmwareUpdate();
     }
     
-    // Short delay
-    vTaskDelay(20 / portTICK_PERIOD_MS);
+    // Sampled offline too; the report is stored and sent once the link returns
+    if (millis() - lastTelemetryTime >= TELEMETRY_INTERVAL) {
+      lastTelemetryTime = millis();
+      publishTelemetry();
+    }
+    
+    // Backlog waits while a firmware stream needs the modem, and a report period after a failure
+    if (telemetryStatus.connected && !telemetryStatus.updating && telemetryLog.pending() > 0 &&
+        millis() - lastDrainFailure >= TELEMETRY_INTERVAL && !drainTelemetry()) {
+      lastDrainFailure = millis();
+    }
+    
+    if (millis() - lastStatsTime >= MODEM_STATS_INTERVAL) {
+      lastStatsTime = millis();
+      printModemStats();
+    }
+    
+    vTaskDelay(100 / portTICK_PERIOD_MS);
   }
 }
 
 // ==================== FOTA Task ====================
+// The slots and the update itself belong to the modem task, which also writes them
+// from the parser: starting and resuming are requests, and what happened comes back
+// as events, so nothing here reads fotaInfo
 void fotaTask(void *parameter) {
+  ModemEvent event;
+  ModemStatus status = {false, false, 0, 0};
+  
   while(true) {
-    if (fotaInfo.updateAvailable && !fotaInfo.updateInProgress) {
-      Serial.println("\n!!! New firmware version available. Starting update process !!!");
-      startOtaUpdate();
-    } else {
-      if (fotaInfo.updateAvailable) {
-        Serial.println("Update available but already in progress");
+    // Outcomes of our requests, connection and update changes, or a one second tick
+    if (xQueueReceive(fotaEvents, &event, 1000 / portTICK_PERIOD_MS) == pdTRUE) {
+      trackModemStatus(status, event);
+      
+      if (event.type == MODEM_EVENT_OTA_AVAILABLE && !status.updating) {
+        // A start that cannot be queued waits for the reply to the next check
+        Serial.println("\n!!! New firmware version available. Starting update process !!!");
+        modemOtaRequest(MODEM_OTA_START);
+      } else if (event.type == MODEM_EVENT_CONNECTED && status.updating) {
+        // Resume the stream where flashing stopped
+        status.lastProgress = millis();
+        modemOtaRequest(MODEM_OTA_RESUME);
+      } else if (event.type == MODEM_EVENT_FAILED && event.tag == TAG_STREAM) {
+        // Retried by the stall timeout below
+        Serial.println("Stream request failed");
       }
+      continue;
     }
     
-    // Not much to do if no update is available or in progress
-    vTaskDelay(1000 / portTICK_PERIOD_MS);
+    if (status.updating && millis() - status.lastProgress > STREAM_STALL_TIMEOUT) {
+      // Request lost, server gave up or broker restarted: ask again from what is flashed
+      Serial.println("No firmware chunk received, requesting the stream again");
+      status.lastProgress = millis();  // One request per stall period, even while it is queued
+      modemOtaRequest(MODEM_OTA_RESUME);
+    }
   }
 }
 
-// ==================== AT Command Functions ====================
-void sendAT(String cmd, String expected, int timeout) {
-  SerialAT.println(cmd);
-  Serial.print(">> "); Serial.println(cmd);
+// ==================== Modem Requests ====================
+bool submitModemRequest(ModemRequest& request) {
+  request.queuedAt = millis();
   
-  long t = millis();
-  while (millis() - t < timeout) {
-    if (SerialAT.available()) {
-      String r = SerialAT.readString();
-      Serial.print(r);
-      if (r.indexOf(expected) != -1) break;
-    }
-    delay(10);
+  // FOTA callbacks already run on the modem task: serve inline rather than queue to ourselves
+  if (xTaskGetCurrentTaskHandle() == modemTaskHandle) {
+    serveModemRequest(request);
+    return true;
+  }
+  
+  if (xQueueSend(modemRequests, &request, MODEM_SUBMIT_TIMEOUT / portTICK_PERIOD_MS) != pdTRUE) {
+    modemStats.dropped++;
+    Serial.println("Modem queue full, request dropped");
+    return false;
   }
+  return true;
 }
 
-// Reconnect function
-void reconnectMQTT() {
-  Serial.println("Attempting to reconnect to MQTT broker...");
+void serveModemRequest(const ModemRequest& request) {
+  uint32_t wait = millis() - request.queuedAt;
+  modemStats.waitTotalMs += wait;
+  modemStats.waitMaxMs = max(modemStats.waitMaxMs, wait);
   
-  sendAT("AT+CIPSHUT", "SHUT OK");
-  sendAT("AT+CSTT=\"" + String(SIM_APN) + "\"", "OK");
-  sendAT("AT+CIICR", "OK");
-  sendAT("AT+CIFSR", ".");
-  
-  // Connect TCP socket to MQTT broker
-  sendAT("AT+CIPSTART=\"TCP\",\"" + String(MQTT_BROKER) + "\",\"" + String(MQTT_PORT) + "\"", "CONNECT OK", AT_CONNECT_TIMEOUT);
+  char response[MODEM_RESPONSE_SIZE] = "";
+  bool ok;
+  if (request.type == MODEM_PUBLISH) {
+    ok = mqtt.publish(request.target, (const uint8_t*)request.data, request.length, request.qos);
+  } else if (request.type == MODEM_DRAIN) {
+    ok = drainTelemetryLog();
+  } else if (request.type == MODEM_OTA_START) {
+    // A start queued twice must not restart an update that is already running
+    ok = fotaInfo.updateInProgress || startOtaUpdate();
+  } else if (request.type == MODEM_OTA_RESUME) {
+    ok = fotaInfo.updateInProgress;
+    if (ok) {
+      resetChunkSlots(true);
+      requestFirmwareStream(fotaInfo.currentOffset);
+    }
+  } else {
+    ok = mqtt.query(request.target, request.data, response, sizeof(response));
+  }
   
-  delay(2000);
-  sendRawMQTTConnect();
-  delay(1000);
-  sendRawMQTTSubscribe(); // Re-subscribe to FOTA topics
+  modemStats.served++;
+  if (!ok) {
+    modemStats.failed++;
+  }
   
-  lastPingTime = millis();
-  mqttConnected = true;
+  if (request.replyTo != NULL) {
+    postModemEvent(request.replyTo, ok ? MODEM_EVENT_DONE : MODEM_EVENT_FAILED, request.tag, response);
+  }
 }
 
-// ==================== MQTT Protocol Functions ====================
-void sendRawMQTTConnect() {
-  uint8_t clientId[] = MQTT_CLIENT_ID;
-  uint8_t clientIdLength = strlen(MQTT_CLIENT_ID);
+// Never blocks the modem task: a full event queue loses the event
+void postModemEvent(QueueHandle_t queue, ModemEventType type, ModemTag tag, const char* response, size_t offset) {
+  ModemEvent event;
+  event.type = type;
+  event.tag = tag;
+  strlcpy(event.response, response, sizeof(event.response));
+  event.offset = offset;
   
-  // Fixed header
-  uint8_t fixedHeader = MQTT_CONNECT;
-  // Variable header length + payload length
-  uint8_t remainingLength = 10 + 2 + clientIdLength;
+  if (xQueueSend(queue, &event, 0) != pdTRUE) {
+    Serial.println("Modem event queue full, event dropped");
+  }
+}
+
+// Connection and update changes, to every task that keeps a ModemStatus
+void broadcastModemEvent(ModemEventType type, size_t offset) {
+  postModemEvent(fotaEvents, type, TAG_NONE, "", offset);
+  postModemEvent(telemetryEvents, type, TAG_NONE, "", offset);
+}
+
+void trackModemStatus(ModemStatus& status, const ModemEvent& event) {
+  switch (event.type) {
+    case MODEM_EVENT_CONNECTED:
+      status.connected = true;
+      break;
+    case MODEM_EVENT_DISCONNECTED:
+      status.connected = false;
+      break;
+    case MODEM_EVENT_OTA_STARTED:
+    case MODEM_EVENT_OTA_PROGRESS:
+      status.updating = true;
+      status.offset = event.offset;
+      status.lastProgress = millis();
+      break;
+    case MODEM_EVENT_OTA_ENDED:
+      status.updating = false;
+      status.offset = 0;
+      break;
+    default:
+      break;
+  }
+}
+
+bool waitModemReply(QueueHandle_t queue, ModemTag tag, ModemEvent& event, ModemStatus& status) {
+  unsigned long start = millis();
   
-  // Fixed Header
-  // MQTT CONNECT (1 byte) + Remaining Length (1 byte)
-  uint8_t mqttPacket[2] = {fixedHeader, remainingLength};
+  while (millis() - start < MODEM_REPLY_TIMEOUT) {
+    if (xQueueReceive(queue, &event, (MODEM_REPLY_TIMEOUT - (millis() - start)) / portTICK_PERIOD_MS) != pdTRUE) {
+      break;
+    }
+    // A reply to an earlier request that timed out is skipped; state changes are kept
+    if (event.tag == tag) {
+      return event.type == MODEM_EVENT_DONE;
+    }
+    trackModemStatus(status, event);
+  }
+  return false;
+}
+
+bool modemPublish(const char* topic, const char* payload, uint8_t qos, QueueHandle_t replyTo, ModemTag tag) {
+  ModemRequest request;
+  request.type = MODEM_PUBLISH;
+  request.tag = tag;
+  request.replyTo = replyTo;
+  request.qos = qos;
+  strlcpy(request.target, topic, sizeof(request.target));
+  request.length = strlcpy(request.data, payload, sizeof(request.data));
   
-  Serial.print("MQTT CONNECT header (HEX): ");
-  Serial.println(bytesToHexString(mqttPacket, sizeof(mqttPacket)));
+  if (request.length >= sizeof(request.data)) {
+    Serial.println("Publish too large for a modem request");
+    return false;
+  }
+  return submitModemRequest(request);
+}
 
-  // Start CIPSEND
-  SerialAT.println("AT+CIPSEND");
-  delay(100);
+bool modemQuery(const char* command, const char* expected, QueueHandle_t replyTo, ModemTag tag) {
+  ModemRequest request;
+  request.type = MODEM_QUERY;
+  request.tag = tag;
+  request.replyTo = replyTo;
+  request.qos = 0;
+  strlcpy(request.target, command, sizeof(request.target));
+  request.length = strlcpy(request.data, expected, sizeof(request.data));
+  return submitModemRequest(request);
+}
 
-  // Send fixed header
-  SerialAT.write(mqttPacket, 2);
+// Start or resume the firmware stream on the modem task; no event wanted
+bool modemOtaRequest(ModemRequestType type) {
+  ModemRequest request;
+  request.type = type;
+  request.tag = TAG_OTA;
+  request.replyTo = NULL;
+  request.qos = 0;
+  request.target[0] = '\0';
+  request.length = 0;
+  return submitModemRequest(request);
+}
+
+// Signal quality from the modem, then a QoS 0 report (batched with other traffic)
+void publishTelemetry() {
+  ModemEvent event;
+  int rssi = 99;  // AT+CSQ "not known"
+  bool online = telemetryStatus.connected;
+  
+  if (online && modemQuery("AT+CSQ", "+CSQ:", telemetryEvents, TAG_SIGNAL) &&
+      waitModemReply(telemetryEvents, TAG_SIGNAL, event, telemetryStatus)) {
+    rssi = atoi(event.response + 5);
+  }
   
-  // Variable Header
-  // Protocol Name
-  SerialAT.write(0x00); // Length MSB
-  SerialAT.write(0x04); // Length LSB
-  SerialAT.write('M');
-  SerialAT.write('Q');
-  SerialAT.write('T');
-  SerialAT.write('T');
+  TelemetryRecord record;
+  record.uptime = millis() / 1000;
+  record.heap = ESP.getFreeHeap();
+  record.fota = telemetryStatus.offset;
+  record.csq = rssi;
   
-  // Protocol Level
-  SerialAT.write(0x04); // MQTT 3.1.1
+  // Live only when nothing older is waiting, so the broker sees reports in order
+  if (online && telemetryLog.pending() == 0) {
+    char buffer[256];
+    formatTelemetryRecord(record, DEVICE_ID, buffer, sizeof(buffer));
+    if (modemPublish(MQTT_TOPIC_TELEMETRY, buffer, 0, telemetryEvents, TAG_TELEMETRY) &&
+        waitModemReply(telemetryEvents, TAG_TELEMETRY, event, telemetryStatus)) {
+      return;
+    }
+  }
   
-  // Connect Flags
-  SerialAT.write(0x02); // Clean Session
+  if (!telemetryLog.append((const uint8_t*)&record, sizeof(record))) {
+    Serial.println("Telemetry report lost");
+  }
+}
+
+// The report as JSON; a backlog batch names the device once, so its records pass NULL
+size_t formatTelemetryRecord(const TelemetryRecord& record, const char* device, char* buffer, size_t size) {
+  StaticJsonDocument<200> doc;
+  if (device != NULL) {
+    doc["device"] = device;
+  }
+  doc["uptime"] = record.uptime;
+  doc["heap"] = record.heap;
+  doc["csq"] = (int)record.csq;
+  doc["fota"] = record.fota;
+  return serializeJson(doc, buffer, size);
+}
+
+// Ask the modem task to send part of the backlog and wait for it
+bool drainTelemetry() {
+  ModemRequest request;
+  ModemEvent event;
+  request.type = MODEM_DRAIN;
+  request.tag = TAG_DRAIN;
+  request.replyTo = telemetryEvents;
+  request.qos = 1;
+  request.target[0] = '\0';
+  request.length = 0;
   
-  // Keep Alive
-  SerialAT.write(0x00); // MSB
-  SerialAT.write(MQTT_KEEP_ALIVE); // LSB
+  if (!submitModemRequest(request) || !waitModemReply(telemetryEvents, TAG_DRAIN, event, telemetryStatus)) {
+    Serial.println("Telemetry backlog publish failed, retrying later");
+    return false;
+  }
+  return true;
+}
+
+// Records of one backlog publish, written behind room for the JSON header
+#define BACKLOG_HEADER_SIZE   64
+
+struct BacklogBatch {
+  char* buffer;
+  size_t length;
+  size_t records;
+  uint32_t first;      // Sequence of the first record
+  uint32_t last;       // Sequence of the last one, or of a first record that did not fit
+};
+
+// Appends one stored report to the JSON array; false once the batch is full.
+// Records written before the binary format are JSON already and go in as they are.
+bool addBacklogRecord(uint32_t seq, const uint8_t* data, size_t length, void* context) {
+  BacklogBatch* batch = (BacklogBatch*)context;
+  char json[128];
   
-  // Payload
-  // Client ID
-  SerialAT.write(0x00); // Length MSB
-  SerialAT.write(clientIdLength); // Length LSB
-  SerialAT.write(clientId, clientIdLength);
+  if (length == sizeof(TelemetryRecord)) {
+    TelemetryRecord record;
+    memcpy(&record, data, sizeof(record));
+    length = formatTelemetryRecord(record, NULL, json, sizeof(json));
+    data = (const uint8_t*)json;
+  }
   
-  // End CIPSEND
-  SerialAT.write(0x1A); // CTRL+Z
+  // Separator and the closing "]}"
+  if (BACKLOG_HEADER_SIZE + batch->length + 1 + length + 2 > TELEMETRY_BATCH_SIZE) {
+    if (batch->records == 0) {
+      batch->last = seq;
+    }
+    return false;
+  }
+  if (batch->records == 0) {
+    batch->first = seq;
+  } else {
+    batch->buffer[batch->length++] = ',';
+  }
+  memcpy(batch->buffer + batch->length, data, length);
+  batch->length += length;
+  batch->records++;
+  batch->last = seq;
+  return true;
+}
+
+// Modem task only: publishes up to TELEMETRY_DRAIN_BATCHES full batches at QoS 1 and
+// marks each one sent, by sequence, once its PUBACK arrives. A failed batch stays at
+// the tail. The telemetry task may append (and wrap onto the tail) meanwhile.
+bool drainTelemetryLog() {
+  static char buffer[TELEMETRY_BATCH_SIZE];
   
-  Serial.println(">> MQTT CONNECT packet sent");
+  for (int i = 0; i < TELEMETRY_DRAIN_BATCHES && telemetryLog.pending() > 0; i++) {
+    BacklogBatch batch = {buffer + BACKLOG_HEADER_SIZE, 0, 0, 0, 0};
+    telemetryLog.peek(addBacklogRecord, &batch, SIZE_MAX);
+    if (batch.records == 0) {
+      // A record that cannot fit in a batch by itself would block the queue
+      Serial.println("Telemetry record too large, skipped");
+      telemetryLog.consumeThrough(batch.last);
+      continue;
+    }
+    batch.buffer[batch.length++] = ']';
+    batch.buffer[batch.length++] = '}';
+    
+    // Header goes right in front of the records, now that the first sequence is known
+    char header[BACKLOG_HEADER_SIZE];
+    size_t headerLength = snprintf(header, sizeof(header), "{\"device\":\"%s\",\"first\":%lu,\"records\":[",
+                                   DEVICE_ID, (unsigned long)batch.first);
+    char* message = batch.buffer - headerLength;
+    memcpy(message, header, headerLength);
+    
+    if (!mqtt.publish(MQTT_TOPIC_BACKLOG, (const uint8_t*)message, headerLength + batch.length, 1)) {
+      return false;
+    }
+    telemetryLog.consumeThrough(batch.last);
+    Serial.printf("Telemetry backlog: %u records sent (%u bytes), %u pending\n",
+                  (unsigned)batch.records, (unsigned)(headerLength + batch.length),
+                  (unsigned)telemetryLog.pending());
+  }
+  return true;
+}
+
+void printModemStats() {
+  Serial.printf("Modem: %lu requests (%lu failed, %lu dropped), queue wait avg %lu ms, max %lu ms\n",
+                (unsigned long)modemStats.served, (unsigned long)modemStats.failed,
+                (unsigned long)modemStats.dropped,
+                (unsigned long)(modemStats.served ? modemStats.waitTotalMs / modemStats.served : 0),
+                (unsigned long)modemStats.waitMaxMs);
+  Serial.printf("MQTT: %lu sends, %.2f packets/send, batch latency avg %lu ms, max %lu ms, %lu dropped\n",
+                (unsigned long)mqtt.sendCount(), mqtt.packetsPerSend(),
+                (unsigned long)mqtt.batchLatencyAverageMs(), (unsigned long)mqtt.batchLatencyMaxMs(),
+                (unsigned long)mqtt.droppedPackets());
+  Serial.printf("Telemetry log: %u pending, %lu dropped, sector erases %lu..%lu\n",
+                (unsigned)telemetryLog.pending(), (unsigned long)telemetryLog.dropped(),
+                (unsigned long)telemetryLog.minEraseCount(), (unsigned long)telemetryLog.maxEraseCount());
+  Serial.printf("Keep-alive: ping after %u s idle (NAT timeout %u..%u s, %s, %lu restarts)\n",
+                keepAlive.interval(), keepAlive.lowerBound(), keepAlive.upperBound(),
+                keepAlive.settled() ? "settled" : "probing", (unsigned long)keepAlive.restarts());
 }
 
-void sendRawMQTTSubscribe() {
-  // Topics to subscribe
-  const char* topics[] = {MQTT_TOPIC_INFO, MQTT_TOPIC_DATA};
-  uint8_t topicsCount = 2;
+#if TELEMETRY_LOG_BENCHMARK
+// Append rate, recovery scan and drain throughput on the real flash. Draining here
+// only reads and marks records (no modem), so it bounds what the flash side allows.
+void benchmarkTelemetryLog() {
+  const int records = 2000;
+  const TelemetryRecord sample = {123456, 201234, 0, 18};
+  static char buffer[TELEMETRY_BATCH_SIZE];
   
-  // Packet ID
-  uint16_t packetId = 1; // Can be any 16-bit value
+  if (!telemetryLog.begin() || !telemetryLog.clear()) {
+    return;
+  }
   
-  // Calculate length
-  uint8_t lengthSum = 2; // Packet ID length
-  for (int i = 0; i < topicsCount; i++) {
-    lengthSum += 2 + strlen(topics[i]) + 1; // Topic length (2 bytes) + Topic + QoS (1 byte)
+  unsigned long start = millis();
+  for (int i = 0; i < records; i++) {
+    telemetryLog.append((const uint8_t*)&sample, sizeof(sample));
   }
+  unsigned long elapsed = max(millis() - start, 1UL);
+  Serial.printf("Log benchmark: %d appends of %u bytes in %lu ms (%lu records/s)\n",
+                records, (unsigned)sizeof(sample), elapsed, records * 1000UL / elapsed);
   
-  // Start CIPSEND
-  SerialAT.println("AT+CIPSEND");
-  delay(500);
+  telemetryLog.begin();
+  Serial.printf("Log benchmark: recovery scan of %u records in %lu ms\n",
+                (unsigned)telemetryLog.pending(), (unsigned long)telemetryLog.recoveryMs());
   
-  // Fixed Header
-  SerialAT.write(MQTT_SUBSCRIBE); // SUBSCRIBE
-  SerialAT.write(lengthSum); // Remaining Length
+  size_t batches = 0;
+  size_t bytes = 0;
+  start = millis();
+  while (telemetryLog.pending() > 0) {
+    BacklogBatch batch = {buffer + BACKLOG_HEADER_SIZE, 0, 0, 0, 0};
+    telemetryLog.peek(addBacklogRecord, &batch, SIZE_MAX);
+    telemetryLog.consumeThrough(batch.last);
+    batches++;
+    bytes += batch.length;
+  }
+  elapsed = max(millis() - start, 1UL);
+  Serial.printf("Log benchmark: drained %d records in %u batches, %lu ms (%lu records/s, %lu KB/s)\n",
+                records, (unsigned)batches, elapsed, records * 1000UL / elapsed, bytes / elapsed);
   
-  // Variable Header
-  SerialAT.write(packetId >> 8); // Packet ID MSB
-  SerialAT.write(packetId & 0xFF); // Packet ID LSB
+  telemetryLog.clear();
+}
+#endif
+
+// ==================== AT Command Functions ====================
+void sendAT(String cmd, String expected, int timeout) {
+  SerialAT.println(cmd);
+  Serial.print(">> "); Serial.println(cmd);
   
-  // Payload
-  for (int i = 0; i < topicsCount; i++) {
-    uint16_t topicLength = strlen(topics[i]);
-    SerialAT.write(topicLength >> 8); // Topic Length MSB
-    SerialAT.write(topicLength & 0xFF); // Topic Length LSB
-    
-    // Topic Name
-    for (int j = 0; j < topicLength; j++) {
-      SerialAT.write(topics[i][j]);
+  long t = millis();
+  while (millis() - t < timeout) {
+    if (SerialAT.available()) {
+      String r = SerialAT.readString();
+      Serial.print(r);
+      if (r.indexOf(expected) != -1) break;
     }
-    
-    // QoS
-    SerialAT.write(0x00); // QoS 0
+    delay(10);
   }
+}
+
+// Keep-alive state is per SIM and operator: a new SIM or network probes again
+void beginKeepAlive() {
+  char iccid[MODEM_RESPONSE_SIZE] = "";
+  char network[MODEM_RESPONSE_SIZE] = "";
   
-  // End CIPSEND
-  SerialAT.write(0x1A); // CTRL+Z
+  mqtt.query("AT+CCID", "89", iccid, sizeof(iccid));  // ICCIDs start with the telecom prefix 89
+  mqtt.query("AT+COPS?", "+COPS:", network, sizeof(network));
   
-  Serial.println(">> MQTT SUBSCRIBE packet sent for FOTA topics");
+  String identity = String(iccid) + "/" + String(network);
+  keepAlive.begin(identity.c_str());
 }
 
-void sendPingReq() {
-  SerialAT.println("AT+CIPSEND");
-  delay(500);
+// False without coverage (RSSI 0 or 99 "not known"), or when the modem does not answer
+bool modemHasSignal() {
+  char response[MODEM_RESPONSE_SIZE] = "";
+  if (!mqtt.query("AT+CSQ", "+CSQ:", response, sizeof(response))) {
+    return false;
+  }
+  int rssi = atoi(response + 5);
+  return rssi > 0 && rssi != 99;
+}
 
-  SerialAT.write(0xC0); // MQTT PINGREQ
-  SerialAT.write(0x00); // Remaining Length = 0
+// Reconnect function (modem task only)
+void reconnectMQTT() {
+  Serial.println("Attempting to reconnect to MQTT broker...");
   
-  delay(100);
-  SerialAT.write(0x1A); // Ctrl+Z
-
-  Serial.println(">> MQTT PINGREQ sent");
+  sendAT("AT+CIPSHUT", "SHUT OK");
+  sendAT("AT+CSTT=\"" + String(SIM_APN) + "\"", "OK");
+  sendAT("AT+CIICR", "OK");
+  sendAT("AT+CIFSR", ".");
+  
+  // Re-subscribe to FOTA topics; the FOTA task resumes the stream on MODEM_EVENT_CONNECTED
+  bool connected = connectMQTT();
+  
+  // A chunk cut off by the disconnect never completes; connect() dropped it, free its slot
+  resetChunkSlots(true);
+  
+  if (!connected) {
+    vTaskDelay(5000 / portTICK_PERIOD_MS);
+  }
 }
 
-void sendMQTTPublish(const char* topic, const char* message) {
-  uint8_t topicLen = strlen(topic);
-  uint8_t messageLen = strlen(message);
-
-  // Total Remaining Length = Topic length (2 bytes + topic) + message
-  uint8_t remainingLength = 2 + topicLen + messageLen;
-
-  SerialAT.println("AT+CIPSEND");
-  delay(500);
-
-  SerialAT.write(0x30);           // PUBLISH (QoS 0, no DUP, no RETAIN)
-  SerialAT.write(remainingLength); // Remaining Length
+// ==================== MQTT Protocol Functions ====================
+bool connectMQTT() {
+  if (!mqtt.connect(MQTT_BROKER, MQTT_PORT, MQTT_CLIENT_ID, keepAlive.brokerKeepAlive())) {
+    Serial.println("MQTT connect failed");
+    return false;
+  }
+  mqtt.setPingInterval(keepAlive.interval());
+  
+  // SUBACK is awaited for each topic; chunks are QoS 1 so every one is acknowledged
+  return mqtt.subscribe(MQTT_TOPIC_INFO) && mqtt.subscribe(MQTT_TOPIC_CHUNK, 1);
+}
 
-  // Topic Length (2 bytes MSB, LSB)
-  SerialAT.write(0x00);
-  SerialAT.write(topicLen);
+void onFirmwareInfo(uint8_t* payload, size_t length, void* context) {
+  Serial.println("\n--- Received firmware info JSON: ---");
+  Serial.write(payload, length);
+  Serial.println("\n-----------------------------------");
+  
+  processFirmwareInfo((const char*)payload, length);
+}
 
-  // Topic
-  for (int i = 0; i < topicLen; i++) {
-    SerialAT.write(topic[i]);
+// The parser writes the whole chunk into a free slot, so nothing is copied before Update.write().
+// With no slot free the chunk is skipped without a PUBACK and the server resends it.
+uint8_t* firmwareChunkSink(size_t length, void* context) {
+  if (!fotaInfo.updateInProgress || length <= CHUNK_OFFSET_SIZE || length > CHUNK_SLOT_SIZE) {
+    return nullptr;
   }
-
-  // Payload
-  for (int i = 0; i < messageLen; i++) {
-    SerialAT.write(message[i]);
+  
+  for (int i = 0; i < FOTA_WINDOW; i++) {
+    if (chunkSlots[i].state == SLOT_FREE) {
+      chunkSlots[i].state = SLOT_RECEIVING;
+      return chunkSlots[i].data;
+    }
   }
+  
+  Serial.println("No free chunk slot, waiting for resend");
+  return nullptr;
+}
 
-  delay(100);
-  SerialAT.write(0x1A); // Ctrl+Z
-
-  Serial.println(">> MQTT PUBLISH sent");
-  Serial.print("   Topic: ");
-  Serial.println(topic);
-  Serial.print("   Message: ");
-  Serial.println(message);
+void onFirmwareChunk(uint8_t* payload, size_t length, void* context) {
+  processFirmwareChunk(payload, length);
 }
 
 // ==================== FOTA Functions ====================
@@ -569,16 +922,14 @@ bool checkFirmwareUpdate() {
   serializeJson(doc, buffer);
   
   // Send request
-  sendMQTTPublish(MQTT_TOPIC_PUB, buffer);
-  
-  return true;
+  return modemPublish(MQTT_TOPIC_PUB, buffer, 0);
 }
 
-void processFirmwareInfo(String jsonStr) {
+void processFirmwareInfo(const char* json, size_t length) {
   Serial.println("\n=== Processing firmware info ===");
   
   StaticJsonDocument<MAX_JSON_SIZE> doc;
-  DeserializationError error = deserializeJson(doc, jsonStr);
+  DeserializationError error = deserializeJson(doc, json, length);
   
   if (error) {
     Serial.print("JSON parsing error: ");
@@ -586,6 +937,18 @@ void processFirmwareInfo(String jsonStr) {
     return;
   }
   
+  // Replies to every device share the info topic
+  const char* device = doc["device"] | DEVICE_ID;
+  if (strcmp(device, DEVICE_ID) != 0) {
+    Serial.println("Firmware info for another device, ignored");
+    return;
+  }
+  
+  // Verify and error replies share the topic but carry no version
+  if (!doc.containsKey("version")) {
+    return;
+  }
+  
   String newVersion = doc["version"].as<String>();
   Serial.print("Current firmware version: ");
   Serial.println(FIRMWARE_VERSION);
@@ -598,7 +961,12 @@ void processFirmwareInfo(String jsonStr) {
   Serial.println(compResult);
   
   // Compare versions to see if update needed
-  if (compResult > 0) {
+  if (compResult > 0 && newVersion == failedVersion && millis() - failedAt < failedBackoff) {
+    Serial.print("Update to this version failed before, next attempt in ");
+    Serial.print((failedBackoff - (millis() - failedAt)) / 1000);
+    Serial.println(" s");
+    fotaInfo.updateAvailable = false;
+  } else if (compResult > 0) {
     Serial.println("NEW FIRMWARE VERSION AVAILABLE!");
     
     // Store firmware details
@@ -607,6 +975,7 @@ void processFirmwareInfo(String jsonStr) {
     fotaInfo.size = doc["size"];
     fotaInfo.md5 = doc["md5"].as<String>();
     fotaInfo.updateAvailable = true;
+    postModemEvent(fotaEvents, MODEM_EVENT_OTA_AVAILABLE, TAG_NONE);
     
     Serial.print("Firmware details: name=");
     Serial.print(fotaInfo.name);
@@ -622,7 +991,187 @@ void processFirmwareInfo(String jsonStr) {
   Serial.println("=== End processing firmware info ===\n");
 }
 
-void startOtaUpdate() {
+// Payload: 4-byte big-endian offset followed by the raw chunk, already in its slot
+void processFirmwareChunk(uint8_t* payload, size_t length) {
+  ChunkSlot* slot = nullptr;
+  for (int i = 0; i < FOTA_WINDOW; i++) {
+    if (chunkSlots[i].data == payload) {
+      slot = &chunkSlots[i];
+    }
+  }
+  if (slot == nullptr) {
+    return;
+  }
+  
+  size_t offset = ((size_t)payload[0] << 24) | ((size_t)payload[1] << 16) | ((size_t)payload[2] << 8) | payload[3];
+  
+  // Keeps the FOTA task's stall timeout from firing, and the telemetry offset current
+  if (fotaInfo.updateInProgress && millis() - lastProgressEvent >= OTA_PROGRESS_INTERVAL) {
+    lastProgressEvent = millis();
+    broadcastModemEvent(MODEM_EVENT_OTA_PROGRESS, fotaInfo.currentOffset);
+  }
+  
+  // Resent chunk we already flashed: the PUBACK still goes out, the data is dropped
+  if (!fotaInfo.updateInProgress || offset < fotaInfo.currentOffset ||
+      offset + length - CHUNK_OFFSET_SIZE > fotaInfo.size) {
+    slot->state = SLOT_FREE;
+    return;
+  }
+  
+  slot->length = length;
+  slot->state = SLOT_READY;
+  
+  if (offset != fotaInfo.currentOffset) {
+    Serial.print("Chunk ");
+    Serial.print(offset);
+    Serial.print(" ahead of ");
+    Serial.print(fotaInfo.currentOffset);
+    Serial.println(", holding it");
+    return;
+  }
+  
+  flashReadyChunks();
+}
+
+// Write every slot that continues the image, in order
+void flashReadyChunks() {
+  bool progressed = true;
+  
+  while (progressed && fotaInfo.updateInProgress) {
+    progressed = false;
+    
+    for (int i = 0; i < FOTA_WINDOW; i++) {
+      ChunkSlot& slot = chunkSlots[i];
+      if (slot.state != SLOT_READY) {
+        continue;
+      }
+      
+      size_t offset = ((size_t)slot.data[0] << 24) | ((size_t)slot.data[1] << 16) | ((size_t)slot.data[2] << 8) | slot.data[3];
+      if (offset != fotaInfo.currentOffset) {
+        continue;
+      }
+      
+      uint8_t* data = slot.data + CHUNK_OFFSET_SIZE;
+      size_t size = slot.length - CHUNK_OFFSET_SIZE;
+      
+      // Process received firmware chunk
+      if (Update.write(data, size) != size) {
+        Serial.println("Error writing firmware chunk!");
+        abortOtaUpdate();
+        return;
+      }
+      
+      fotaInfo.md5Builder.add(data, size);
+      fotaInfo.currentOffset += size;
+      slot.state = SLOT_FREE;
+      progressed = true;
+      
+      Serial.print("Chunk written. Progress: ");
+      Serial.print((fotaInfo.currentOffset * 100) / fotaInfo.size);
+      Serial.println("%");
+    }
+  }
+  
+  if (fotaInfo.updateInProgress && fotaInfo.currentOffset >= fotaInfo.size) {
+    finishOtaUpdate();
+  }
+}
+
+void finishOtaUpdate() {
+  // Firmware download complete, verify checksum
+  fotaInfo.md5Builder.calculate();
+  String calculatedMD5 = fotaInfo.md5Builder.toString();
+  
+  Serial.print("Download complete. Verifying MD5: ");
+  Serial.println(calculatedMD5);
+  
+  if (calculatedMD5.equalsIgnoreCase(fotaInfo.md5)) {
+    Serial.println("MD5 verification successful!");
+    if (Update.end(true)) {
+      // The server completes the session on this, not on the last PUBACK
+      sendFirmwareVerify(calculatedMD5);
+      Serial.println("Update success! Rebooting...");
+      ESP.restart();
+    } else {
+      // The stall timeout would otherwise re-request the stream past the end forever
+      Serial.println("Update failed!");
+      abortOtaUpdate();
+    }
+  } else {
+    // Reported so the server counts the failure and keeps the session open
+    Serial.println("MD5 verification failed. Aborting update.");
+    sendFirmwareVerify(calculatedMD5);
+    abortOtaUpdate();
+  }
+}
+
+// QoS 1, so the report is acknowledged before a restart cuts the link
+void sendFirmwareVerify(const String& md5) {
+  StaticJsonDocument<200> doc;
+  doc["device"] = DEVICE_ID;
+  doc["action"] = "verify";
+  doc["hash"] = md5;
+  doc["hashType"] = "md5";
+  doc["bytes"] = fotaInfo.currentOffset;
+  doc["elapsed"] = millis() - otaStartTime;
+  
+  char buffer[256];
+  serializeJson(doc, buffer);
+  modemPublish(MQTT_TOPIC_PUB, buffer, 1);
+}
+
+// Stop flashing and tell the server to stop streaming. Every caller is a terminal
+// failure (write error, Update.end() or MD5), so the version is not retried at once.
+void abortOtaUpdate() {
+  Update.abort();
+  fotaInfo.updateInProgress = false;
+  resetChunkSlots(false);
+  backOffFirmwareVersion();
+  broadcastModemEvent(MODEM_EVENT_OTA_ENDED);
+  
+  StaticJsonDocument<100> doc;
+  doc["device"] = DEVICE_ID;
+  doc["action"] = "stop";
+  
+  char buffer[128];
+  serializeJson(doc, buffer);
+  modemPublish(MQTT_TOPIC_PUB, buffer, 0);
+}
+
+// Without this the next check offers the same version again and fotaTask restarts a
+// download that fails the same way; each failure doubles the wait
+void backOffFirmwareVersion() {
+  if (fotaInfo.version == failedVersion) {
+    failedBackoff = min(failedBackoff * 2, (unsigned long)FOTA_RETRY_BACKOFF_MAX);
+  } else {
+    failedVersion = fotaInfo.version;
+    failedBackoff = FOTA_RETRY_BACKOFF;
+  }
+  failedAt = millis();
+  fotaInfo.updateAvailable = false;
+  
+  Serial.print("Update to ");
+  Serial.print(failedVersion);
+  Serial.print(" failed, next attempt in ");
+  Serial.print(failedBackoff / 1000);
+  Serial.println(" s");
+}
+
+// Modem task only. A slot the parser is still writing, or holds until the next loop(),
+// stays claimed so the sink cannot hand it out again under a chunk in flight.
+void resetChunkSlots(bool keepReady) {
+  for (int i = 0; i < FOTA_WINDOW; i++) {
+    if (mqtt.holdsBuffer(chunkSlots[i].data)) {
+      continue;
+    }
+    if (!keepReady || chunkSlots[i].state != SLOT_READY) {
+      chunkSlots[i].state = SLOT_FREE;
+    }
+  }
+}
+
+// Modem task only, through MODEM_OTA_START
+bool startOtaUpdate() {
   Serial.println("Starting OTA update process...");
   
   // Initialize MD5 builder
@@ -631,42 +1180,44 @@ void startOtaUpdate() {
   // Initialize update
   if (!Update.begin(fotaInfo.size)) {
     Serial.println("Not enough space for update!");
-    fotaInfo.updateAvailable = false;
-    return;
+    backOffFirmwareVersion();
+    return false;
   }
   
   // Mark update as in progress
-  fotaInfo.updateInProgress = true;
+  resetChunkSlots(false);
   fotaInfo.currentOffset = 0;
+  fotaInfo.updateInProgress = true;
+  otaStartTime = millis();
+  lastProgressEvent = millis();
+  broadcastModemEvent(MODEM_EVENT_OTA_STARTED, 0);
   
-  // Request first chunk
-  size_t chunkSize = FIRMWARE_BUFFER_SIZE;
-  if (chunkSize > fotaInfo.size) {
-    chunkSize = fotaInfo.size;
-  }
-  
-  requestFirmwareChunk(0, chunkSize);
+  requestFirmwareStream(0);
+  return true;
 }
 
-void requestFirmwareChunk(size_t offset, size_t size) {
-  Serial.print("Requesting firmware chunk: offset=");
+// The server keeps FOTA_WINDOW chunks in flight from here on; our PUBACKs move the window
+void requestFirmwareStream(size_t offset) {
+  Serial.print("Requesting firmware stream: offset=");
   Serial.print(offset);
-  Serial.print(", size=");
-  Serial.println(size);
+  Serial.print(", window=");
+  Serial.println(FOTA_WINDOW);
   
   // Prepare JSON request
   StaticJsonDocument<200> doc;
   doc["device"] = DEVICE_ID;
-  doc["action"] = "download";
+  doc["action"] = "stream";
   doc["offset"] = offset;
-  doc["size"] = size;
+  doc["chunk"] = FIRMWARE_BUFFER_SIZE;
+  doc["window"] = FOTA_WINDOW;
   
   // Serialize JSON
   char buffer[256];
   serializeJson(doc, buffer);
   
-  // Send request
-  sendMQTTPublish(MQTT_TOPIC_PUB, buffer);
+  // Send request (QoS 1: a lost request would otherwise stall until the stall timeout).
+  // The outcome comes back to the FOTA task as an event.
+  modemPublish(MQTT_TOPIC_PUB, buffer, 1, fotaEvents, TAG_STREAM);
 }
 
 // ==================== Utility Functions ====================
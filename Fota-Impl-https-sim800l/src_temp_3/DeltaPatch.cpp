@@ -0,0 +1,159 @@
+#include "DeltaPatch.h"
+
+uint32_t DeltaPatch::readLE32(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bool DeltaPatch::begin(const esp_partition_t* base_partition, size_t base_image_size,
+                       OutputSink output, void* context) {
+  base = base_partition;
+  base_size = base_image_size;
+  sink = output;
+  sink_context = context;
+  state = STATE_HEADER;
+  field_pos = 0;
+  new_size = 0;
+  new_pos = 0;
+  old_pos = 0;
+  old_cache_len = 0;
+  out_pos = 0;
+  
+  if (!base || base_size == 0 || base_size > base->size) {
+    return fail("Invalid base partition");
+  }
+  return true;
+}
+
+bool DeltaPatch::fail(const char* reason) {
+  Serial.print("Delta patch error: ");
+  Serial.println(reason);
+  state = STATE_ERROR;
+  return false;
+}
+
+bool DeltaPatch::readOld(size_t pos, uint8_t& value) {
+  if (pos < old_cache_start || pos >= old_cache_start + old_cache_len) {
+    if (pos >= base_size) {
+      return false;
+    }
+    old_cache_start = pos;
+    old_cache_len = min(OLD_CACHE_SIZE, base_size - pos);
+    if (esp_partition_read(base, old_cache_start, old_cache, old_cache_len) != ESP_OK) {
+      old_cache_len = 0;
+      return false;
+    }
+  }
+  value = old_cache[pos - old_cache_start];
+  return true;
+}
+
+bool DeltaPatch::emit(uint8_t value) {
+  out_buffer[out_pos++] = value;
+  new_pos++;
+  return out_pos < OUT_BUFFER_SIZE || flushOutput();
+}
+
+bool DeltaPatch::flushOutput() {
+  if (out_pos == 0) {
+    return true;
+  }
+  if (!sink(sink_context, out_buffer, out_pos)) {
+    return fail("output write failed");
+  }
+  out_pos = 0;
+  return true;
+}
+
+bool DeltaPatch::startBlock() {
+  diff_left = readLE32(field);
+  extra_left = readLE32(field + 4);
+  seek = (int32_t)readLE32(field + 8);
+  
+  if (diff_left > new_size - new_pos || extra_left > new_size - new_pos - diff_left) {
+    return fail("block overruns output");
+  }
+  if (old_pos < 0 || (size_t)old_pos + diff_left > base_size) {
+    return fail("block reads outside base image");
+  }
+  
+  state = diff_left > 0 ? STATE_DIFF : STATE_EXTRA;
+  return true;
+}
+
+bool DeltaPatch::write(const uint8_t* data, size_t length) {
+  size_t i = 0;
+  
+  while (i < length) {
+    switch (state) {
+      case STATE_HEADER:
+        field[field_pos++] = data[i++];
+        if (field_pos == HEADER_SIZE) {
+          field_pos = 0;
+          if (memcmp(field, "FDL1", 4) != 0) {
+            return fail("bad magic");
+          }
+          new_size = readLE32(field + 4);
+          if (readLE32(field + 8) != base_size) {
+            return fail("base size mismatch");
+          }
+          state = new_size > 0 ? STATE_CONTROL : STATE_DONE;
+        }
+        break;
+        
+      case STATE_CONTROL:
+        field[field_pos++] = data[i++];
+        if (field_pos == CONTROL_SIZE) {
+          field_pos = 0;
+          if (!startBlock()) {
+            return false;
+          }
+        }
+        break;
+        
+      case STATE_DIFF: {
+        uint8_t old_byte;
+        if (!readOld((size_t)old_pos, old_byte)) {
+          return fail("base read failed");
+        }
+        if (!emit(data[i++] + old_byte)) {
+          return false;
+        }
+        old_pos++;
+        if (--diff_left == 0) {
+          state = STATE_EXTRA;
+        }
+        break;
+      }
+        
+      case STATE_EXTRA:
+        if (extra_left > 0) {
+          if (!emit(data[i++])) {
+            return false;
+          }
+          extra_left--;
+        }
+        break;
+        
+      case STATE_DONE:
+        return fail("trailing data after patch");
+        
+      case STATE_ERROR:
+        return false;
+    }
+    
+    // Block finished: apply seek, then either stop or expect the next control
+    if (state == STATE_EXTRA && extra_left == 0) {
+      old_pos += seek;
+      if (new_pos == new_size) {
+        if (!flushOutput()) {
+          return false;
+        }
+        state = STATE_DONE;
+      } else {
+        state = STATE_CONTROL;
+      }
+    }
+  }
+  
+  return true;
+}
@@ -0,0 +1,66 @@
+#ifndef DELTA_PATCH_H
+#define DELTA_PATCH_H
+
+#include <Arduino.h>
+#include <esp_partition.h>
+
+// Streaming applier for the server's "FDL1" delta format (Fota-webserver/lib/bsdiff.js).
+// Old bytes are read from the base partition, new bytes go to the output sink.
+class DeltaPatch {
+  public:
+    typedef bool (*OutputSink)(void* context, const uint8_t* data, size_t length);
+    
+  private:
+    enum State { STATE_HEADER, STATE_CONTROL, STATE_DIFF, STATE_EXTRA, STATE_DONE, STATE_ERROR };
+    
+    static const size_t HEADER_SIZE = 12;
+    static const size_t CONTROL_SIZE = 12;
+    static const size_t OLD_CACHE_SIZE = 256;
+    static const size_t OUT_BUFFER_SIZE = 512;
+    
+    // Base image
+    const esp_partition_t* base = nullptr;
+    size_t base_size = 0;
+    OutputSink sink = nullptr;
+    void* sink_context = nullptr;
+    
+    // Parser state
+    State state = STATE_HEADER;
+    uint8_t field[HEADER_SIZE];
+    size_t field_pos = 0;
+    size_t new_size = 0;
+    size_t new_pos = 0;
+    int64_t old_pos = 0;
+    size_t diff_left = 0;
+    size_t extra_left = 0;
+    int32_t seek = 0;
+    
+    // Small read cache over the base partition
+    uint8_t old_cache[OLD_CACHE_SIZE];
+    size_t old_cache_start = 0;
+    size_t old_cache_len = 0;
+    
+    // Output staging so the sink sees reasonably sized blocks
+    uint8_t out_buffer[OUT_BUFFER_SIZE];
+    size_t out_pos = 0;
+    
+    bool readOld(size_t pos, uint8_t& value);
+    bool emit(uint8_t value);
+    bool flushOutput();
+    bool startBlock();
+    bool fail(const char* reason);
+    static uint32_t readLE32(const uint8_t* p);
+    
+  public:
+    // Prepare to patch against the first base_image_size bytes of base_partition
+    bool begin(const esp_partition_t* base_partition, size_t base_image_size,
+               OutputSink output, void* context);
+    
+    // Feed the next slice of the (already inflated) patch
+    bool write(const uint8_t* data, size_t length);
+    
+    bool isFinished() const { return state == STATE_DONE; }
+    size_t outputSize() const { return new_pos; }
+};
+
+#endif // DELTA_PATCH_H
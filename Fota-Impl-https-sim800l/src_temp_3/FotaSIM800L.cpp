@@ -1,4 +1,5 @@
 #include "FotaSIM800L.h"
+#include <new>
 
 FotaSIM800L::FotaSIM800L(HardwareSerial& serial, const char* server_address, int port, 
                          const char* device_name, const char* version, 
@@ -17,6 +18,7 @@ bool FotaSIM800L::begin() {
   Serial.println("Initializing SIM800L...");
   
   // Initialize serial port
+  serialAT.setRxBufferSize(SIM800L_RX_BUFFER);
   serialAT.begin(SIM800L_BAUD, SERIAL_8N1, SIM800L_RX, SIM800L_TX);
   delay(3000);
   
@@ -428,11 +430,12 @@ bool FotaSIM800L::receiveBinaryData(size_t chunk_size) {
   
   while (remaining > 0 && millis() < timeout) {
     if (serialAT.available()) {
-      // Read data into buffer
+      // Read data into buffer (the pipeline slot we own, or the inline buffer)
+      uint8_t* dest = pipeline_enabled ? fill_slot->data : buffer;
       size_t to_read = min(BUFFER_SIZE - buffer_pos, remaining);
       
       while (to_read > 0 && serialAT.available()) {
-        buffer[buffer_pos++] = serialAT.read();
+        dest[buffer_pos++] = serialAT.read();
         bytes_read++;
         remaining--;
         to_read--;
@@ -443,8 +446,11 @@ bool FotaSIM800L::receiveBinaryData(size_t chunk_size) {
       
       // If buffer is full or all data is read, write to flash
       if (buffer_pos == BUFFER_SIZE || remaining == 0) {
-        if (Update.write(buffer, buffer_pos) != buffer_pos) {
-          Serial.println("Error writing to flash");
+        uint32_t stall_start = micros();
+        bool committed = pipeline_enabled ? handOffBuffer(buffer_pos) : commitBuffer(buffer, buffer_pos);
+        recordStall(stall_start);
+        
+        if (!committed) {
           return false;
         }
         buffer_pos = 0;
@@ -457,15 +463,273 @@ bool FotaSIM800L::receiveBinaryData(size_t chunk_size) {
   return bytes_read == chunk_size;
 }
 
+bool FotaSIM800L::commitBuffer(const uint8_t* data, size_t length) {
+  if (stream_compressed) {
+    return inflateToFlash(data, length);
+  }
+  
+  return writeFlash(data, length);
+}
+
+void FotaSIM800L::recordStall(uint32_t start_us) {
+  uint32_t elapsed = micros() - start_us;
+  stall_count++;
+  stall_total_us += elapsed;
+  if (elapsed > stall_max_us) {
+    stall_max_us = elapsed;
+  }
+}
+
+bool FotaSIM800L::startFlashPipeline() {
+  stall_count = 0;
+  stall_max_us = 0;
+  stall_total_us = 0;
+  
+  if (!pipeline_enabled) {
+    return true;
+  }
+  
+  flash_queue = new (std::nothrow) SpscQueue<FlashSlot, FLASH_PIPELINE_DEPTH>();
+  if (!flash_queue) {
+    Serial.println("Not enough memory for flash pipeline");
+    return false;
+  }
+  
+  fill_slot = flash_queue->writeSlot();
+  flash_writer_stop = false;
+  flash_writer_error = false;
+  flash_writer_running = true;
+  
+  if (xTaskCreatePinnedToCore(flashWriterTask, "FlashWriter", FLASH_WRITER_STACK, this, 2,
+                              &flash_writer_task, FLASH_WRITER_CORE) != pdPASS) {
+    Serial.println("Failed to start flash writer task");
+    flash_writer_running = false;
+    delete flash_queue;
+    flash_queue = nullptr;
+    return false;
+  }
+  
+  return true;
+}
+
+void FotaSIM800L::flashWriterTask(void* parameter) {
+  FotaSIM800L* self = static_cast<FotaSIM800L*>(parameter);
+  
+  while (true) {
+    FlashSlot* slot;
+    while ((slot = self->flash_queue->readSlot()) != nullptr) {
+      // Keep draining after an error so the reader never blocks on a full queue
+      if (!self->flash_writer_error && !self->commitBuffer(slot->data, slot->length)) {
+        self->flash_writer_error = true;
+      }
+      self->flash_queue->release();
+    }
+    
+    if (self->flash_writer_stop) {
+      break;
+    }
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+  }
+  
+  self->flash_writer_running = false;
+  vTaskDelete(NULL);
+}
+
+bool FotaSIM800L::handOffBuffer(size_t length) {
+  fill_slot->length = length;
+  flash_queue->publish();
+  xTaskNotifyGive(flash_writer_task);
+  
+  // All slots in flight: this wait is the only time the UART goes undrained
+  while ((fill_slot = flash_queue->writeSlot()) == nullptr) {
+    if (flash_writer_error) {
+      return false;
+    }
+    vTaskDelay(1);
+  }
+  
+  return !flash_writer_error;
+}
+
+bool FotaSIM800L::drainFlashPipeline() {
+  if (!flash_queue) {
+    return true;
+  }
+  
+  while (!flash_queue->empty()) {
+    vTaskDelay(1);
+  }
+  return !flash_writer_error;
+}
+
+void FotaSIM800L::stopFlashPipeline() {
+  if (!flash_queue) {
+    return;
+  }
+  
+  flash_writer_stop = true;
+  xTaskNotifyGive(flash_writer_task);
+  while (flash_writer_running) {
+    vTaskDelay(1);
+  }
+  
+  flash_writer_task = nullptr;
+  delete flash_queue;
+  flash_queue = nullptr;
+  fill_slot = nullptr;
+}
+
+bool FotaSIM800L::beginInflate() {
+  // Decompressor state (~11 KB) plus the ring window are the whole RAM cost
+  inflater = (tinfl_decompressor*)malloc(sizeof(tinfl_decompressor));
+  inflate_window = (uint8_t*)malloc(INFLATE_WINDOW_SIZE);
+  
+  if (!inflater || !inflate_window) {
+    Serial.println("Not enough memory for decompression");
+    endInflate();
+    return false;
+  }
+  
+  tinfl_init(inflater);
+  inflate_pos = 0;
+  inflate_done = false;
+  return true;
+}
+
+bool FotaSIM800L::inflateToFlash(const uint8_t* data, size_t length) {
+  size_t in_pos = 0;
+  
+  while (!inflate_done) {
+    size_t in_bytes = length - in_pos;
+    size_t out_bytes = INFLATE_WINDOW_SIZE - inflate_pos;
+    
+    // Output wraps inside the window, so back-references never leave RAM we own
+    tinfl_status status = tinfl_decompress(inflater, data + in_pos, &in_bytes,
+                                           inflate_window, inflate_window + inflate_pos, &out_bytes,
+                                           TINFL_FLAG_HAS_MORE_INPUT);
+    in_pos += in_bytes;
+    
+    if (out_bytes > 0) {
+      if (!writeImage(inflate_window + inflate_pos, out_bytes)) {
+        return false;
+      }
+      inflate_pos = (inflate_pos + out_bytes) & (INFLATE_WINDOW_SIZE - 1);
+    }
+    
+    if (status < TINFL_STATUS_DONE) {
+      Serial.print("Decompression error: ");
+      Serial.println((int)status);
+      return false;
+    }
+    
+    if (status == TINFL_STATUS_DONE) {
+      inflate_done = true;
+    } else if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+      break;
+    }
+  }
+  
+  return true;
+}
+
+bool FotaSIM800L::writeImage(const uint8_t* data, size_t length) {
+  if (stream_delta) {
+    return delta_patch.write(data, length);
+  }
+  
+  return writeFlash(data, length);
+}
+
+// Single exit to flash: every image byte is hashed from the same buffer it is written from
+bool FotaSIM800L::writeFlash(const uint8_t* data, size_t length) {
+  mbedtls_sha256_update_ret(&sha_ctx, data, length);
+  
+  if (ota.write(data, length) != length) {
+    Serial.println("Error writing to flash");
+    return false;
+  }
+  return true;
+}
+
+bool FotaSIM800L::deltaSink(void* context, const uint8_t* data, size_t length) {
+  return static_cast<FotaSIM800L*>(context)->writeFlash(data, length);
+}
+
+String FotaSIM800L::finishSHA256() {
+  uint8_t digest[32];
+  char hex[65];
+  
+  mbedtls_sha256_finish_ret(&sha_ctx, digest);
+  mbedtls_sha256_free(&sha_ctx);
+  
+  for (int i = 0; i < 32; i++) {
+    sprintf(hex + i * 2, "%02x", digest[i]);
+  }
+  return String(hex);
+}
+
+bool FotaSIM800L::reportVerification(const String& sha256, unsigned long download_ms) {
+  StaticJsonDocument<384> request;
+  request["device"] = device_id;
+  request["action"] = "verify";
+  request["sessionId"] = session_id;
+  request["hash"] = sha256;
+  request["hashType"] = "sha256";
+  request["bytes"] = stream_size;
+  request["elapsed"] = download_ms;
+  
+  StaticJsonDocument<512> response;
+  if (!sendRequest(request) || !readResponseHeader(response)) {
+    // Local SHA-256/MD5 still guard the image; the server just misses the report
+    Serial.println("Server verification unavailable");
+    return true;
+  }
+  
+  if (response["status"] != "success") {
+    Serial.print("Verify error: ");
+    Serial.println(response["message"].as<String>());
+    return true;
+  }
+  
+  return response["verified"].as<bool>();
+}
+
+bool FotaSIM800L::runningImageMatches(const String& expected_md5, size_t image_size) {
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  if (!running || image_size == 0 || image_size > running->size || expected_md5.length() != 32) {
+    return false;
+  }
+  
+  MD5Builder md5;
+  md5.begin();
+  for (size_t pos = 0; pos < image_size; pos += BUFFER_SIZE) {
+    size_t len = min(BUFFER_SIZE, image_size - pos);
+    if (esp_partition_read(running, pos, buffer, len) != ESP_OK) {
+      return false;
+    }
+    md5.add(buffer, len);
+  }
+  md5.calculate();
+  
+  return md5.toString().equalsIgnoreCase(expected_md5);
+}
+
+void FotaSIM800L::endInflate() {
+  free(inflater);
+  free(inflate_window);
+  inflater = nullptr;
+  inflate_window = nullptr;
+}
+
 bool FotaSIM800L::verifyMD5(const String& expected_md5) {
-  if (!Update.end()) {
+  if (!ota.end()) {
     Serial.println("Error finalizing update");
-    Serial.println(Update.errorString());
+    Serial.println(ota.errorString());
     return false;
   }
   
   if (expected_md5.length() == 32) {
-    if (Update.md5String().equalsIgnoreCase(expected_md5)) {
+    if (ota.md5String().equalsIgnoreCase(expected_md5)) {
       Serial.println("MD5 verification passed");
       return true;
     } else {
@@ -473,7 +737,7 @@ bool FotaSIM800L::verifyMD5(const String& expected_md5) {
       Serial.print("Expected: ");
       Serial.println(expected_md5);
       Serial.print("Actual: ");
-      Serial.println(Update.md5String());
+      Serial.println(ota.md5String());
       return false;
     }
   }
@@ -556,6 +820,9 @@ bool FotaSIM800L::checkForUpdates() {
   request["device"] = device_id;
   request["action"] = "check";
   request["version"] = current_version;
+  if (manifest_token.length() > 0) {
+    request["token"] = manifest_token;
+  }
   
   // Send request
   if (!sendRequest(request)) {
@@ -565,13 +832,20 @@ bool FotaSIM800L::checkForUpdates() {
   }
   
   // Read response
-  StaticJsonDocument<512> response;
+  StaticJsonDocument<1024> response;
   if (!readResponseHeader(response)) {
     Serial.println("Failed to parse response");
     disconnectTCP();
     return false;
   }
   
+  // {"nm":1}: nothing changed since the manifest behind our token
+  if (response["nm"].as<int>() == 1) {
+    Serial.println("Manifest unchanged, already running the latest version");
+    disconnectTCP();
+    return false;
+  }
+  
   // Check response status
   if (response["status"] != "success") {
     Serial.print("Error: ");
@@ -584,6 +858,26 @@ bool FotaSIM800L::checkForUpdates() {
   update_version = response["version"].as<String>();
   total_size = response["size"].as<size_t>();
   update_md5 = response["md5"].as<String>();
+  update_sha256 = response["sha256"].as<String>();
+  session_id = response["sessionId"].as<String>();
+  
+  // Prefer the precompressed stream when the server offers a window we can hold
+  stream_compressed = response["encoding"] == "deflate" &&
+                      response["windowBits"].as<int>() <= INFLATE_WINDOW_BITS;
+  stream_size = stream_compressed ? response["compressedSize"].as<size_t>() : total_size;
+  
+  // A delta is only usable if our running partition holds exactly the server's base image
+  stream_delta = false;
+  if (stream_compressed && response.containsKey("deltaSize")) {
+    delta_base_size = response["deltaBaseSize"].as<size_t>();
+    if (runningImageMatches(response["deltaBaseMd5"].as<String>(), delta_base_size)) {
+      stream_delta = true;
+      stream_size = response["deltaSize"].as<size_t>();
+      Serial.println("Delta update available against running image");
+    } else {
+      Serial.println("Running image differs from delta base, using full image");
+    }
+  }
   
   Serial.print("Server firmware version: ");
   Serial.println(update_version);
@@ -593,14 +887,23 @@ bool FotaSIM800L::checkForUpdates() {
   // Compare versions
   if (update_version == current_version) {
     Serial.println("Already running the latest version");
+    manifest_token = response["token"] | "";
     disconnectTCP();
     return false;
   }
   
+  // Keep asking for the full manifest until this update has been applied
+  manifest_token = "";
+  
   Serial.println("New firmware available");
   Serial.print("Size: ");
   Serial.print(total_size);
-  Serial.println(" bytes");
+  Serial.print(" bytes (");
+  Serial.print(stream_size);
+  Serial.println(" bytes on the wire)");
+  
+  // Start clearing the OTA slot now; it overlaps the reconnect in downloadAndApplyUpdate()
+  ota.preErase(total_size);
   
   disconnectTCP();
   return true;
@@ -615,84 +918,91 @@ bool FotaSIM800L::downloadAndApplyUpdate() {
     return false;
   }
   
-  // Begin OTA update
-  if (!Update.begin(total_size)) {
+  // Begin OTA update (keeps the background erase started by checkForUpdates)
+  if (!ota.begin(total_size)) {
     Serial.println("Not enough space for update");
     disconnectTCP();
     return false;
   }
   
-  // Set the MD5
-  Update.setMD5(update_md5.c_str());
+  // Set the MD5 (always of the decompressed image)
+  ota.setMD5(update_md5.c_str());
+  
+  if ((stream_compressed && !beginInflate()) ||
+      (stream_delta && !delta_patch.begin(esp_ota_get_running_partition(), delta_base_size, deltaSink, this)) ||
+      !startFlashPipeline()) {
+    endInflate();
+    ota.abort();
+    disconnectTCP();
+    return false;
+  }
   
   // Reset buffer and offset
   buffer_pos = 0;
   current_offset = 0;
   update_in_progress = true;
+  unsigned long download_start = millis();
+  
+  mbedtls_sha256_init(&sha_ctx);
+  mbedtls_sha256_starts_ret(&sha_ctx, 0);
   
-  // Download firmware in chunks
-  while (current_offset < total_size) {
+  // Pipelined, a chunk spans several buffers: each full buffer goes to the writer while
+  // the rest of the chunk is still arriving. Inline, a chunk is one buffer, so nothing
+  // arrives while it is committed.
+  size_t request_size = pipeline_enabled ? FLASH_CHUNK_REQUEST : BUFFER_SIZE;
+  
+  // Download firmware in chunks (offsets address the wire stream)
+  while (current_offset < stream_size) {
     // Calculate chunk size
-    size_t chunk_size = min(BUFFER_SIZE, total_size - current_offset);
+    size_t chunk_size = min(request_size, stream_size - current_offset);
     
     // Create download request
     StaticJsonDocument<256> request;
     request["device"] = device_id;
     request["action"] = "download";
+    request["sessionId"] = session_id;
     request["offset"] = current_offset;
     request["size"] = chunk_size;
+    if (stream_compressed) {
+      request["encoding"] = stream_delta ? "delta" : "deflate";
+    }
     
     // Send request
     if (!sendRequest(request)) {
       Serial.println("Failed to send download request");
-      Update.abort();
-      disconnectTCP();
-      update_in_progress = false;
-      return false;
+      break;
     }
     
-    // Read response header
+    // Read length-prefixed header: {"s":size,"o":offset,"c":crc,"f":flags,"p":progress,...}
     StaticJsonDocument<512> response;
     if (!readResponseHeader(response)) {
       Serial.println("Failed to parse response");
-      Update.abort();
-      disconnectTCP();
-      update_in_progress = false;
-      return false;
+      break;
     }
     
-    // Check response status
-    if (response["status"] != "success") {
+    // Error responses are plain JSON with a status field
+    if (response.containsKey("status")) {
       Serial.print("Error: ");
       Serial.println(response["message"].as<String>());
-      Update.abort();
-      disconnectTCP();
-      update_in_progress = false;
-      return false;
+      break;
     }
     
     // Get chunk information
-    size_t response_offset = response["offset"].as<size_t>();
-    size_t response_size = response["size"].as<size_t>();
-    size_t response_total = response["total"].as<size_t>();
-    float position = response["position"].as<float>();
+    size_t response_offset = response["o"].as<size_t>();
+    size_t response_size = response["s"].as<size_t>();
+    int position = response["p"].as<int>();
     
     // Validate response
-    if (response_offset != current_offset || response_total != total_size) {
+    if (response_offset != current_offset || response_size == 0 ||
+        response_size > stream_size - current_offset) {
       Serial.println("Invalid chunk information received");
-      Update.abort();
-      disconnectTCP();
-      update_in_progress = false;
-      return false;
+      break;
     }
     
     // Read and process binary data
     if (!receiveBinaryData(response_size)) {
       Serial.println("Failed to receive binary data");
-      Update.abort();
-      disconnectTCP();
-      update_in_progress = false;
-      return false;
+      break;
     }
     
     // Update offset
@@ -704,13 +1014,81 @@ bool FotaSIM800L::downloadAndApplyUpdate() {
     Serial.print("% (");
     Serial.print(current_offset);
     Serial.print("/");
-    Serial.print(total_size);
+    Serial.print(stream_size);
     Serial.println(" bytes)");
   }
   
+  // Let the writer commit everything still queued before judging the stream
+  bool flushed = drainFlashPipeline();
+  stopFlashPipeline();
+  
+  bool stream_ok = flushed && current_offset == stream_size &&
+                   (!stream_compressed || inflate_done) &&
+                   (!stream_delta || delta_patch.isFinished()) &&
+                   ota.progress() == total_size;
+  if (stream_compressed) {
+    endInflate();
+  }
+  
+  String image_sha256 = finishSHA256();
+  
+  if (!stream_ok) {
+    Serial.println("Firmware stream incomplete");
+    ota.abort();
+    disconnectTCP();
+    update_in_progress = false;
+    return false;
+  }
+  
+  Serial.print("UART stall on flash commit: max ");
+  Serial.print(stall_max_us);
+  Serial.print(" us, total ");
+  Serial.print((uint32_t)(stall_total_us / 1000));
+  Serial.print(" ms over ");
+  Serial.print(stall_count);
+  Serial.println(pipeline_enabled ? " handoffs (pipelined)" : " commits (inline)");
+  Serial.print("Flash erase: waited ");
+  Serial.print(ota.eraseWaitMs());
+  Serial.print(" ms on background erase, ");
+  Serial.print(ota.inlineEraseMs());
+  Serial.println(" ms erasing inline");
+  
+  unsigned long download_ms = millis() - download_start;
+  Serial.print("Transferred ");
+  Serial.print(stream_size);
+  Serial.print(" bytes for a ");
+  Serial.print(total_size);
+  Serial.print(" byte image in ");
+  Serial.print(download_ms);
+  Serial.println(" ms");
+  
+  // Check SHA-256 before ota.end() switches the boot partition
+  if (update_sha256.length() == 64 && !image_sha256.equalsIgnoreCase(update_sha256)) {
+    Serial.println("SHA-256 verification failed");
+    Serial.print("Expected: ");
+    Serial.println(update_sha256);
+    Serial.print("Actual: ");
+    Serial.println(image_sha256);
+    ota.abort();
+    disconnectTCP();
+    update_in_progress = false;
+    return false;
+  }
+  Serial.println("SHA-256 verification passed");
+  
+  // Close the loop with the server so it records the end-to-end result
+  if (!reportVerification(image_sha256, download_ms)) {
+    Serial.println("Server rejected firmware hash");
+    ota.abort();
+    disconnectTCP();
+    update_in_progress = false;
+    return false;
+  }
+  
   // Verify firmware
   if (!verifyMD5(update_md5)) {
     Serial.println("Firmware verification failed");
+    ota.abort();
     disconnectTCP();
     update_in_progress = false;
     return false;
@@ -4,8 +4,15 @@
 #include <Arduino.h>
 #include <HardwareSerial.h>
 #include <ArduinoJson.h>
-#include <Update.h>
 #include <MD5Builder.h>
+#include <esp32/rom/miniz.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "DeltaPatch.h"
+#include "OtaWriter.h"
+#include "SpscQueue.h"
 
 // SIM800L Configuration
 #define SIM800L_SERIAL        2   // UART2
@@ -18,6 +25,20 @@
 #define AT_CONNECT_TIMEOUT    10000  // 10 seconds
 #define AT_DATA_TIMEOUT       5000   // 5 seconds
 
+// Compressed OTA: server sends raw deflate with a 2^12 window
+#define INFLATE_WINDOW_BITS   12
+#define INFLATE_WINDOW_SIZE   (1 << INFLATE_WINDOW_BITS)
+
+// Receive/flash pipeline: UART reader hands full buffers to a writer task on the other core
+#ifndef FOTA_FLASH_PIPELINE
+#define FOTA_FLASH_PIPELINE   1
+#endif
+#define FLASH_PIPELINE_DEPTH  4      // Buffers in flight (power of two)
+#define FLASH_CHUNK_REQUEST   4096   // Chunk asked for while pipelined: several buffers per response
+#define SIM800L_RX_BUFFER     2048   // UART RX buffer, covers a slot handoff while data streams in
+#define FLASH_WRITER_CORE     0
+#define FLASH_WRITER_STACK    6144
+
 class FotaSIM800L {
   private:
     // Server details
@@ -31,12 +52,34 @@ class FotaSIM800L {
     // SIM800L Serial
     HardwareSerial& serialAT;
     
+    // Target OTA slot (pre-erased in the background once an update is announced)
+    OtaWriter ota;
+    
     // Update status
     bool update_in_progress = false;
     size_t total_size = 0;
     size_t current_offset = 0;
     String update_md5 = "";
     String update_version = "";
+    String session_id = "";
+    String update_sha256 = "";
+    String manifest_token = "";   // Token of the last manifest that left us up to date
+    
+    // Streaming SHA-256 over the image bytes handed to flash (hardware SHA via mbedtls)
+    mbedtls_sha256_context sha_ctx;
+    
+    // Whole-image compression (stream_size is the wire size)
+    bool stream_compressed = false;
+    size_t stream_size = 0;
+    tinfl_decompressor* inflater = nullptr;
+    uint8_t* inflate_window = nullptr;
+    size_t inflate_pos = 0;
+    bool inflate_done = false;
+    
+    // Delta OTA against the running image (patch is deflated as well)
+    bool stream_delta = false;
+    size_t delta_base_size = 0;
+    DeltaPatch delta_patch;
     
     // Connection status
     bool tcp_connected = false;
@@ -52,6 +95,24 @@ class FotaSIM800L {
     uint8_t buffer[BUFFER_SIZE];
     size_t buffer_pos = 0;
     
+    // Receive/flash pipeline
+    struct FlashSlot {
+      uint8_t data[BUFFER_SIZE];
+      size_t length;
+    };
+    SpscQueue<FlashSlot, FLASH_PIPELINE_DEPTH>* flash_queue = nullptr;
+    FlashSlot* fill_slot = nullptr;
+    TaskHandle_t flash_writer_task = nullptr;
+    volatile bool flash_writer_running = false;
+    volatile bool flash_writer_stop = false;
+    volatile bool flash_writer_error = false;
+    bool pipeline_enabled = FOTA_FLASH_PIPELINE;
+    
+    // UART stall accounting (time the reader spends unable to drain the modem)
+    uint32_t stall_count = 0;
+    uint32_t stall_max_us = 0;
+    uint64_t stall_total_us = 0;
+    
     // Response buffer for AT commands
     String response_buffer;
     
@@ -70,6 +131,22 @@ class FotaSIM800L {
     bool sendRequest(const JsonDocument& doc);
     bool readResponseHeader(JsonDocument& doc);
     bool receiveBinaryData(size_t chunk_size);
+    bool commitBuffer(const uint8_t* data, size_t length);
+    bool startFlashPipeline();
+    bool drainFlashPipeline();
+    void stopFlashPipeline();
+    bool handOffBuffer(size_t length);
+    static void flashWriterTask(void* parameter);
+    void recordStall(uint32_t start_us);
+    bool beginInflate();
+    bool inflateToFlash(const uint8_t* data, size_t length);
+    void endInflate();
+    bool writeImage(const uint8_t* data, size_t length);
+    bool writeFlash(const uint8_t* data, size_t length);
+    static bool deltaSink(void* context, const uint8_t* data, size_t length);
+    String finishSHA256();
+    bool reportVerification(const String& sha256, unsigned long download_ms);
+    bool runningImageMatches(const String& expected_md5, size_t image_size);
     bool verifyMD5(const String& expected_md5);
     void flushSerialAT();
 
@@ -93,6 +170,9 @@ class FotaSIM800L {
     // Function to download and apply update
     bool downloadAndApplyUpdate();
     
+    // Enable/disable the receive/flash pipeline (for stall comparisons)
+    void setFlashPipeline(bool enabled) { pipeline_enabled = enabled; }
+    
     // Function to reset device after update
     void restart();
     
@@ -0,0 +1,222 @@
+#include "OtaWriter.h"
+
+static size_t roundUpToSector(size_t size) {
+  return (size + OTA_SECTOR_SIZE - 1) & ~(size_t)(OTA_SECTOR_SIZE - 1);
+}
+
+bool OtaWriter::fail(const String& reason) {
+  error = reason;
+  Serial.print("OTA error: ");
+  Serial.println(reason);
+  return false;
+}
+
+bool OtaWriter::preErase(size_t size) {
+  const esp_partition_t* next = esp_ota_get_next_update_partition(NULL);
+  if (!next || size == 0 || size > next->size) {
+    return fail("No OTA slot large enough to pre-erase");
+  }
+  
+  // Already erasing (or erased) this slot far enough
+  if (next == partition && erase_target >= roundUpToSector(size) && !erase_failed) {
+    return true;
+  }
+  
+  stopPreErase();
+  partition = next;
+  erase_target = roundUpToSector(size);
+  erased_bytes = 0;
+  erase_cancel = false;
+  erase_failed = false;
+  erase_running = true;
+  
+  if (xTaskCreatePinnedToCore(eraseTask, "OtaErase", OTA_ERASE_TASK_STACK, this, 1,
+                              &erase_task, OTA_ERASE_TASK_CORE) != pdPASS) {
+    erase_running = false;
+    erase_task = nullptr;
+    return fail("Failed to start erase task");
+  }
+  
+  Serial.print("Pre-erasing ");
+  Serial.print(partition->label);
+  Serial.print(" (");
+  Serial.print(erase_target);
+  Serial.println(" bytes) in background");
+  return true;
+}
+
+void OtaWriter::eraseTask(void* parameter) {
+  OtaWriter* self = static_cast<OtaWriter*>(parameter);
+  unsigned long start = millis();
+  
+  while (self->erased_bytes < self->erase_target && !self->erase_cancel) {
+    // Block-aligned steps let the flash driver use 64 KB block erase
+    size_t offset = self->erased_bytes;
+    size_t step = min((size_t)OTA_ERASE_STEP - (offset % OTA_ERASE_STEP), self->erase_target - offset);
+    
+    if (esp_partition_erase_range(self->partition, offset, step) != ESP_OK) {
+      self->erase_failed = true;
+      break;
+    }
+    self->erased_bytes = offset + step;
+    
+    // Give the modem/AT tasks a slice between blocks
+    vTaskDelay(1);
+  }
+  
+  Serial.print("Background erase ");
+  Serial.print(self->erase_failed ? "failed" : (self->erase_cancel ? "cancelled" : "done"));
+  Serial.print(" after ");
+  Serial.print(millis() - start);
+  Serial.println(" ms");
+  
+  self->erase_task = nullptr;
+  self->erase_running = false;
+  vTaskDelete(NULL);
+}
+
+void OtaWriter::stopPreErase() {
+  if (!erase_running) {
+    return;
+  }
+  erase_cancel = true;
+  while (erase_running) {
+    vTaskDelay(1);
+  }
+}
+
+bool OtaWriter::begin(size_t size) {
+  const esp_partition_t* next = esp_ota_get_next_update_partition(NULL);
+  if (!next || size == 0 || size > next->size) {
+    return fail("Not enough space for update");
+  }
+  
+  // Keep a background erase of this slot; anything else starts from scratch
+  if (next != partition || erase_failed) {
+    stopPreErase();
+    partition = next;
+    erased_bytes = 0;
+    erase_target = 0;
+  }
+  
+  image_size = size;
+  written = 0;
+  stash_len = 0;
+  erase_wait_ms = 0;
+  inline_erase_ms = 0;
+  error = "";
+  md5_string = "";
+  md5.begin();
+  active = true;
+  return true;
+}
+
+bool OtaWriter::ensureErased(size_t end_offset) {
+  if (end_offset <= erased_bytes) {
+    return true;
+  }
+  
+  // Background erase still ahead of us: wait for it rather than erase twice
+  if (erase_running) {
+    unsigned long start = millis();
+    while (erase_running && erased_bytes < end_offset) {
+      vTaskDelay(1);
+    }
+    erase_wait_ms += millis() - start;
+    if (end_offset <= erased_bytes) {
+      return true;
+    }
+  }
+  
+  // Fallback: erase the missing sectors inline (what Update would have done)
+  unsigned long start = millis();
+  size_t from = erased_bytes;
+  size_t to = roundUpToSector(end_offset);
+  if (esp_partition_erase_range(partition, from, to - from) != ESP_OK) {
+    return false;
+  }
+  erased_bytes = to;
+  inline_erase_ms += millis() - start;
+  return true;
+}
+
+size_t OtaWriter::write(const uint8_t* data, size_t length) {
+  if (!active) {
+    return 0;
+  }
+  if (length > image_size - written) {
+    fail("Data exceeds image size");
+    return 0;
+  }
+  if (written == 0 && length > 0 && data[0] != ESP_IMAGE_HEADER_MAGIC) {
+    fail("Invalid image magic byte");
+    return 0;
+  }
+  
+  if (!ensureErased(written + length)) {
+    fail("Flash erase failed");
+    return 0;
+  }
+  
+  md5.add((uint8_t*)data, length);
+  
+  // Hold back the image header until end() so an interrupted update is not bootable
+  size_t skip = 0;
+  if (written < OTA_HEADER_STASH_SIZE) {
+    skip = min(OTA_HEADER_STASH_SIZE - written, length);
+    memcpy(header_stash + written, data, skip);
+    stash_len = written + skip;
+  }
+  
+  if (length > skip &&
+      esp_partition_write(partition, written + skip, data + skip, length - skip) != ESP_OK) {
+    fail("Flash write failed");
+    return 0;
+  }
+  
+  written += length;
+  return length;
+}
+
+bool OtaWriter::end() {
+  if (!active) {
+    return fail("No update in progress");
+  }
+  active = false;
+  
+  // Anything below may have programmed the slot, so every failure resets
+  // the erase state through abort()
+  if (written != image_size) {
+    abort();
+    return fail("Image incomplete");
+  }
+  
+  md5.calculate();
+  md5_string = md5.toString();
+  if (expected_md5.length() == 32 && !md5_string.equalsIgnoreCase(expected_md5)) {
+    abort();
+    return fail("MD5 mismatch");
+  }
+  
+  if (esp_partition_write(partition, 0, header_stash, stash_len) != ESP_OK) {
+    abort();
+    return fail("Header write failed");
+  }
+  
+  // Validates the image before switching the boot slot
+  esp_err_t err = esp_ota_set_boot_partition(partition);
+  if (err != ESP_OK) {
+    abort();
+    return fail(String("Set boot partition failed: ") + esp_err_to_name(err));
+  }
+  
+  return true;
+}
+
+void OtaWriter::abort() {
+  stopPreErase();
+  active = false;
+  // The next update re-erases everything we may have programmed
+  erased_bytes = 0;
+  erase_target = 0;
+}
@@ -0,0 +1,69 @@
+#ifndef OTA_WRITER_H
+#define OTA_WRITER_H
+
+#include <Arduino.h>
+#include <MD5Builder.h>
+#include <esp_ota_ops.h>
+#include <esp_image_format.h>
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Pre-erase configuration
+#define OTA_SECTOR_SIZE        0x1000   // 4 KB flash sector
+#define OTA_ERASE_STEP         0x10000  // Background erase granularity (64 KB block)
+#define OTA_ERASE_TASK_STACK   3072
+#define OTA_ERASE_TASK_CORE    0
+#define OTA_HEADER_STASH_SIZE  16       // Written last so a partial image never boots
+
+// Minimal OTA writer on top of esp_partition/esp_ota. Unlike Update, it can erase
+// the target slot in a background task ahead of time; write() then only programs
+// flash, erasing inline only what the background task has not reached yet.
+class OtaWriter {
+  private:
+    const esp_partition_t* partition = nullptr;
+    size_t image_size = 0;
+    size_t written = 0;
+    
+    // Erase progress (bytes from partition start known to be erased)
+    volatile size_t erased_bytes = 0;
+    size_t erase_target = 0;
+    TaskHandle_t erase_task = nullptr;
+    volatile bool erase_running = false;
+    volatile bool erase_cancel = false;
+    volatile bool erase_failed = false;
+    uint32_t erase_wait_ms = 0;
+    uint32_t inline_erase_ms = 0;
+    
+    // Integrity
+    uint8_t header_stash[OTA_HEADER_STASH_SIZE];
+    size_t stash_len = 0;
+    MD5Builder md5;
+    String expected_md5;
+    String md5_string;
+    String error;
+    bool active = false;
+    
+    static void eraseTask(void* parameter);
+    bool ensureErased(size_t end_offset);
+    void stopPreErase();
+    bool fail(const String& reason);
+    
+  public:
+    // Start erasing the next OTA slot in the background (returns immediately)
+    bool preErase(size_t size);
+    
+    bool begin(size_t size);
+    void setMD5(const char* expected) { expected_md5 = String(expected); }
+    size_t write(const uint8_t* data, size_t length);
+    bool end();
+    void abort();
+    
+    size_t progress() const { return written; }
+    String md5String() const { return md5_string; }
+    String errorString() const { return error; }
+    uint32_t eraseWaitMs() const { return erase_wait_ms; }
+    uint32_t inlineEraseMs() const { return inline_erase_ms; }
+};
+
+#endif // OTA_WRITER_H
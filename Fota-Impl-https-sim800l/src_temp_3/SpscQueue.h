@@ -0,0 +1,58 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+
+// Lock-free single-producer/single-consumer ring of in-place slots.
+// The producer fills writeSlot() and publish()es it; the consumer works on
+// readSlot() and release()s it when done, so a slot is never reused while
+// the consumer still holds it. N must be a power of two.
+template <typename T, size_t N>
+class SpscQueue {
+  private:
+    static_assert((N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+    
+    T slots[N];
+    std::atomic<size_t> head{0};  // Advanced by the producer only
+    std::atomic<size_t> tail{0};  // Advanced by the consumer only
+    
+  public:
+    // Producer side
+    T* writeSlot() {
+      size_t h = head.load(std::memory_order_relaxed);
+      if (h - tail.load(std::memory_order_acquire) == N) {
+        return nullptr;
+      }
+      return &slots[h & (N - 1)];
+    }
+    
+    void publish() {
+      head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    
+    // Consumer side
+    T* readSlot() {
+      size_t t = tail.load(std::memory_order_relaxed);
+      if (head.load(std::memory_order_acquire) == t) {
+        return nullptr;
+      }
+      return &slots[t & (N - 1)];
+    }
+    
+    void release() {
+      tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    
+    bool empty() const {
+      return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+    
+    // Only safe while neither side is running
+    void reset() {
+      head.store(0, std::memory_order_relaxed);
+      tail.store(0, std::memory_order_relaxed);
+    }
+};
+
+#endif // SPSC_QUEUE_H
@@ -0,0 +1,111 @@
+#include <Arduino.h>
+#include <HardwareSerial.h>
+#include <ModemAT.h>
+#include <TcpTransport.h>
+#include <HttpTransport.h>
+#include <MqttTransport.h>
+#include <CoapTransport.h>
+#include <FotaEngine.h>
+
+// Current firmware version
+#define FIRMWARE_VERSION      "1.0.0"
+
+// FOTA server details (one host, four ways in)
+#define FOTA_SERVER           "fota.getstokfms.com"
+#define FOTA_TCP_PORT         8266
+#define FOTA_HTTP_URL         "http://fota.getstokfms.com:3000"
+#define FOTA_MQTT_PORT        1883
+#define FOTA_COAP_PORT        5683
+
+// Device identification
+#define DEVICE_ID             "ESP32-SIM800L-001"
+
+// SIM800L Configuration
+#define SIM800L_BAUD          115200
+#define SIM800L_RX            16  // GPIO16
+#define SIM800L_TX            17  // GPIO17
+#define SIM_APN               "internet"  // Change according to your operator
+
+const unsigned long UPDATE_CHECK_INTERVAL = 3600000; // 1 hour
+
+HardwareSerial SerialAT(2); // UART2
+ModemAT modem(SerialAT);
+
+TcpTransport tcpTransport(modem, FOTA_SERVER, FOTA_TCP_PORT, DEVICE_ID, FIRMWARE_VERSION);
+HttpTransport httpTransport(modem, FOTA_HTTP_URL, DEVICE_ID, SIM_APN);
+MqttTransport mqttTransport(modem, FOTA_SERVER, FOTA_MQTT_PORT, DEVICE_ID, DEVICE_ID);
+CoapTransport coapTransport(modem, FOTA_SERVER, FOTA_COAP_PORT, DEVICE_ID);
+
+FotaEngine fota;
+FotaImage manifest;  // Last manifest seen, its token keeps hourly checks to a few bytes
+unsigned long lastUpdateCheck = 0;
+
+void checkForFirmwareUpdates() {
+  Serial.println("\n--- Checking for firmware updates ---");
+
+  FotaImage& image = manifest;
+  if (!fota.check(FIRMWARE_VERSION, image)) {
+    Serial.println("Update check failed");
+    return;
+  }
+
+  if (image.unchanged || FotaEngine::compareVersions(image.version, FIRMWARE_VERSION) <= 0) {
+    Serial.println("Firmware is up to date");
+    return;
+  }
+
+  Serial.println("\n!!! NEW FIRMWARE AVAILABLE !!!");
+
+  // Only an up-to-date device keeps the token; after a failed update we want the full manifest again
+  image.token = "";
+
+  // Pick the fastest path for this session, then download over it
+  FotaTransport* transport = fota.selectTransport(image);
+  if (transport != nullptr && fota.download(transport, image)) {
+    Serial.println("\n*** FIRMWARE UPDATE SUCCESSFUL ***");
+    Serial.println("Device will restart in 3 seconds...");
+    delay(3000);
+    ESP.restart();
+  }
+
+  Serial.println("\n*** FIRMWARE UPDATE FAILED ***");
+  Serial.println("Device will continue with current firmware");
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+
+  Serial.println("\n\n==================================");
+  Serial.println("ESP32 FOTA Client (TCP / HTTP / MQTT / CoAP)");
+  Serial.print("Current Firmware Version: ");
+  Serial.println(FIRMWARE_VERSION);
+  Serial.println("==================================\n");
+
+  SerialAT.begin(SIM800L_BAUD, SERIAL_8N1, SIM800L_RX, SIM800L_TX);
+  delay(3000);
+
+  if (!modem.init() || !modem.attachGPRS(SIM_APN)) {
+    Serial.println("Failed to initialize SIM800L, retrying in 30 seconds...");
+    delay(30000);
+    ESP.restart();
+  }
+
+  // Order matters only for the manifest check: first transport that answers wins
+  fota.addTransport(&tcpTransport);
+  fota.addTransport(&httpTransport);
+  fota.addTransport(&mqttTransport);
+  fota.addTransport(&coapTransport);
+
+  checkForFirmwareUpdates();
+  lastUpdateCheck = millis();
+}
+
+void loop() {
+  if (millis() - lastUpdateCheck > UPDATE_CHECK_INTERVAL) {
+    lastUpdateCheck = millis();
+    checkForFirmwareUpdates();
+  }
+
+  delay(100);
+}
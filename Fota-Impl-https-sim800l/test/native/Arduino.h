@@ -0,0 +1,182 @@
+#ifndef NATIVE_ARDUINO_H
+#define NATIVE_ARDUINO_H
+
+// Host stand-in for the parts of the Arduino core used by the libraries in lib/,
+// so [env:native] can drive them against a scripted modem. String keeps WString's
+// allocation pattern (exact-size realloc per append) so the parser benchmark
+// charges the old monitorTask parser what it costs on the device.
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+inline unsigned long millis() {
+  static const auto start = std::chrono::steady_clock::now();
+  return (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+inline void yield() {}
+
+template<typename T> inline T min(T a, T b) { return b < a ? b : a; }
+template<typename T> inline T max(T a, T b) { return a < b ? b : a; }
+
+class String {
+  public:
+    String(const char* str = "") { assign(str, strlen(str)); }
+    String(const String& other) { assign(other.c_str(), other.len); }
+    String(char c) { assign(&c, 1); }
+    String(int value) : String(std::to_string(value).c_str()) {}
+    String(unsigned int value) : String(std::to_string(value).c_str()) {}
+    String(long value) : String(std::to_string(value).c_str()) {}
+    String(unsigned long value) : String(std::to_string(value).c_str()) {}
+    ~String() { free(buffer); }
+
+    String& operator=(const String& other) {
+      if (this != &other) {
+        len = 0;
+        concat(other.c_str(), other.len);
+      }
+      return *this;
+    }
+
+    String& operator+=(const String& other) { concat(other.c_str(), other.len); return *this; }
+    String& operator+=(const char* str) { concat(str, strlen(str)); return *this; }
+    String& operator+=(char c) { concat(&c, 1); return *this; }
+
+    friend String operator+(const String& a, const String& b) {
+      String result(a);
+      result += b;
+      return result;
+    }
+
+    const char* c_str() const { return buffer != nullptr ? buffer : ""; }
+    unsigned int length() const { return len; }
+    char operator[](unsigned int index) const { return index < len ? buffer[index] : 0; }
+
+    // Byte-wise, so embedded NULs do not end the search (WString's strstr would)
+    int indexOf(const char* str, unsigned int from = 0) const {
+      size_t n = strlen(str);
+      for (size_t i = from; n <= len && i + n <= len; i++) {
+        if (memcmp(buffer + i, str, n) == 0) {
+          return (int)i;
+        }
+      }
+      return -1;
+    }
+    int indexOf(char c, unsigned int from = 0) const {
+      for (size_t i = from; i < len; i++) {
+        if (buffer[i] == c) {
+          return (int)i;
+        }
+      }
+      return -1;
+    }
+    int lastIndexOf(char c) const {
+      for (size_t i = len; i > 0; i--) {
+        if (buffer[i - 1] == c) {
+          return (int)(i - 1);
+        }
+      }
+      return -1;
+    }
+
+    String substring(unsigned int from, unsigned int to) const {
+      String result;
+      if (from < to && from < len) {
+        result.concat(buffer + from, min(to, len) - from);
+      }
+      return result;
+    }
+    String substring(unsigned int from) const { return substring(from, len); }
+
+  private:
+    char* buffer = nullptr;
+    unsigned int len = 0;
+
+    void assign(const char* str, size_t n) {
+      len = 0;
+      concat(str, n);
+    }
+
+    void concat(const char* str, size_t n) {
+      char* grown = (char*)realloc(buffer, len + n + 1);
+      if (grown == nullptr) {
+        return;
+      }
+      buffer = grown;
+      memmove(buffer + len, str, n);
+      len += n;
+      buffer[len] = '\0';
+    }
+};
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* data, size_t size) {
+      for (size_t i = 0; i < size; i++) {
+        write(data[i]);
+      }
+      return size;
+    }
+
+    size_t print(const char* str) { return write((const uint8_t*)str, strlen(str)); }
+    size_t print(const String& str) { return write((const uint8_t*)str.c_str(), str.length()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int value) { return print(String(value)); }
+    size_t print(unsigned int value) { return print(String(value)); }
+    size_t print(long value) { return print(String(value)); }
+    size_t print(unsigned long value) { return print(String(value)); }
+
+    template<typename T> size_t println(const T& value) { return print(value) + print("\r\n"); }
+    size_t println() { return print("\r\n"); }
+
+    size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+      char text[256];
+      va_list args;
+      va_start(args, format);
+      int n = vsnprintf(text, sizeof(text), format, args);
+      va_end(args);
+      return n > 0 ? write((const uint8_t*)text, min((size_t)n, sizeof(text) - 1)) : 0;
+    }
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+
+    // No timeout on the host: whatever is buffered, up to `length`
+    virtual size_t readBytes(uint8_t* dest, size_t length) {
+      size_t count = 0;
+      while (count < length && available() > 0) {
+        dest[count++] = (uint8_t)read();
+      }
+      return count;
+    }
+    size_t readBytes(char* dest, size_t length) { return readBytes((uint8_t*)dest, length); }
+};
+
+// Debug output; quiet unless NATIVE_SERIAL_ECHO is defined
+class NativeSerial : public Stream {
+  public:
+    int available() override { return 0; }
+    int read() override { return -1; }
+    size_t write(uint8_t c) override {
+#ifdef NATIVE_SERIAL_ECHO
+      fputc(c, stdout);
+#endif
+      (void)c;
+      return 1;
+    }
+};
+
+inline NativeSerial Serial;
+
+#endif // NATIVE_ARDUINO_H
@@ -0,0 +1,163 @@
+#ifndef SCRIPTED_MODEM_H
+#define SCRIPTED_MODEM_H
+
+// SIM800L as seen over the UART by MqttSim800: AT commands get their usual replies,
+// AT+CIPSEND=<n> gets the "> " prompt and SEND OK once <n> bytes were written, and
+// CONNECT/SUBSCRIBE/QoS 1 PUBLISH are answered by a broker through "+IPD,<len>:"
+// frames. Test data is queued with feed() and read back at most `trickle` bytes per
+// available(), so a frame can be split anywhere. With down_rate/up_rate set, data
+// arrives and SEND OK comes back at the speed of the radio link instead.
+
+#include <Arduino.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+class ScriptedModem : public Stream {
+  public:
+    std::vector<std::string> packets;   // Each CIPSEND body, as sent
+    size_t trickle = 0;                 // 0: everything queued is available
+    int fail_sends = 0;                 // CIPSENDs still to answer with SEND FAIL
+    uint32_t down_rate = 0;             // Bytes/s the modem receives, 0: no limit
+    uint32_t up_rate = 0;               // Bytes/s of CIPSEND data, 0: SEND OK at once
+
+    virtual ~ScriptedModem() {}
+
+    void feed(const uint8_t* data, size_t length) { incoming.insert(incoming.end(), data, data + length); }
+    void feed(const std::string& data) { feed((const uint8_t*)data.data(), data.size()); }
+
+    // Broker data in one +IPD frame
+    void feedIpd(const std::string& data) { feed("\r\n+IPD," + std::to_string(data.size()) + ":" + data); }
+
+    size_t pending() const { return incoming.size(); }
+
+    int available() override {
+      if (sending && millis() >= send_done_at) {
+        sending = false;
+        sent(body);
+      }
+      size_t count = trickle > 0 ? min(trickle, incoming.size()) : incoming.size();
+      return (int)(down_rate > 0 ? min(count, downlinkCredit()) : count);
+    }
+
+    int read() override {
+      if (incoming.empty()) {
+        return -1;
+      }
+      uint8_t c = incoming.front();
+      incoming.pop_front();
+      if (down_rate > 0 && credit >= 1) {
+        credit--;
+      }
+      return c;
+    }
+
+    size_t readBytes(uint8_t* dest, size_t length) override {
+      size_t count = min(length, (size_t)available());
+      for (size_t i = 0; i < count; i++) {
+        dest[i] = (uint8_t)read();
+      }
+      return count;
+    }
+
+    size_t write(uint8_t c) override {
+      if (send_remaining > 0) {
+        body += (char)c;
+        if (--send_remaining == 0 && fail_sends > 0) {
+          fail_sends--;
+          feed("\r\nSEND FAIL\r\n");
+        } else if (send_remaining == 0 && up_rate > 0) {
+          sending = true;
+          send_done_at = millis() + body.size() * 1000 / up_rate;
+        } else if (send_remaining == 0) {
+          sent(body);
+        }
+        return 1;
+      }
+
+      if (c == '\n') {
+        handleCommand();
+        command.clear();
+      } else if (c != '\r') {
+        command += (char)c;
+      }
+      return 1;
+    }
+
+  protected:
+    // Every MQTT packet the client sent, once its CIPSEND went through
+    virtual void onPacket(uint8_t type, const std::string& packet) {}
+
+  private:
+    std::deque<uint8_t> incoming;
+    std::string command;
+    std::string body;
+    size_t send_remaining = 0;
+    bool sending = false;
+    unsigned long send_done_at = 0;
+    double credit = 0;
+    unsigned long credit_at = 0;
+
+    // At most 100 ms of data builds up while nobody reads, as in the UART FIFO and buffers
+    size_t downlinkCredit() {
+      unsigned long now = millis();
+      credit = min(credit + (double)(now - credit_at) * down_rate / 1000, down_rate / 10.0);
+      credit_at = now;
+      return (size_t)credit;
+    }
+
+    void sent(const std::string& data) {
+      feed("\r\nSEND OK\r\n");
+      packets.push_back(data);
+      answer(data);
+    }
+
+    void handleCommand() {
+      if (command.rfind("AT+CIPSEND=", 0) == 0) {
+        send_remaining = strtoul(command.c_str() + 11, nullptr, 10);
+        body.clear();
+        feed("> ");
+      } else if (command.rfind("AT+CIPSTART", 0) == 0) {
+        feed("\r\nOK\r\n\r\nCONNECT OK\r\n");
+      } else if (command.rfind("AT+CSQ", 0) == 0) {
+        feed("\r\n+CSQ: 18,0\r\n\r\nOK\r\n");
+      } else if (command.rfind("AT+CIPCLOSE", 0) == 0) {
+        feed("\r\nCLOSE OK\r\n");
+      } else if (command.rfind("AT", 0) == 0) {
+        feed("\r\nOK\r\n");
+      }
+    }
+
+    // The broker's side of the packets that wait for a reply
+    void answer(const std::string& sent) {
+      size_t pos = 0;
+      while (pos + 2 <= sent.size()) {
+        uint8_t type = (uint8_t)sent[pos];
+        size_t length = 0;
+        size_t multiplier = 1;
+        size_t header = 1;
+        uint8_t digit;
+        do {
+          digit = (uint8_t)sent[pos + header++];
+          length += (digit & 0x7F) * multiplier;
+          multiplier *= 128;
+        } while ((digit & 0x80) && pos + header < sent.size());
+
+        if (type == 0x10) {
+          feedIpd(std::string("\x20\x02\x00\x00", 4));
+        } else if (type == 0x82) {
+          std::string suback("\x90\x03", 2);
+          suback += sent.substr(pos + header, 2);
+          suback += (char)0x00;
+          feedIpd(suback);
+        } else if ((type & 0xF6) == 0x32) {
+          size_t topic = ((uint8_t)sent[pos + header] << 8) | (uint8_t)sent[pos + header + 1];
+          feedIpd(std::string("\x40\x02", 2) + sent.substr(pos + header + 2 + topic, 2));
+        }
+        onPacket(type, sent.substr(pos, header + length));
+        pos += header + length;
+      }
+    }
+};
+
+#endif // SCRIPTED_MODEM_H
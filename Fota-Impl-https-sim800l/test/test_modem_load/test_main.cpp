@@ -0,0 +1,353 @@
+// Modem queue load test: the src_temp_2 task layout on the host. A modem thread owns
+// MqttSim800 and the modem and serves queued requests, like modemTask; a FOTA thread
+// asks for a firmware stream, and a telemetry thread queues AT+CSQ and a report every
+// 100 ms (MODEM_LOAD_TEST=1), each waiting for its reply. The modem is a SIM800L at
+// 10 KB/s down and 5 KB/s up with a broker that keeps FOTA_WINDOW QoS 1 chunks in
+// flight and resends one that is not acknowledged within 2 s.
+// The sketch itself needs the ESP32 core (Update, ArduinoJson), so this mirrors its
+// modem task rather than compiling it. Host timings; the ESP32 is not measured.
+// Run with: pio test -e native -f test_modem_load -v
+
+#include <unity.h>
+#include <MqttSim800.h>
+#include <ScriptedModem.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define LOAD_IMAGE_SIZE       (32 * 1024)
+#define LOAD_CHUNK_SIZE       1024
+#define LOAD_WINDOW           4       // FOTA_WINDOW, and the chunk slots
+#define LOAD_DOWN_RATE        10000
+#define LOAD_UP_RATE          5000
+#define LOAD_RESEND_TIMEOUT   2000
+#define LOAD_TIMEOUT          60000
+#define LOAD_TELEMETRY_INTERVAL 100
+#define LOAD_POLL_INTERVAL    20      // MODEM_POLL_INTERVAL
+#define LOAD_QUEUE_LENGTH     8       // MODEM_QUEUE_LENGTH
+#define LOAD_TOPIC_REQUEST    "device/firmware/request"
+#define LOAD_TOPIC_CHUNK      "device/firmware/chunk/load-device"
+#define LOAD_TOPIC_TELEMETRY  "device/telemetry/load-device"
+
+// Bounded queue with timeouts, standing in for a FreeRTOS queue
+template<typename T> class TaskQueue {
+  public:
+    bool send(const T& item, unsigned long timeout_ms) {
+      std::unique_lock<std::mutex> guard(mutex);
+      if (!changed.wait_for(guard, std::chrono::milliseconds(timeout_ms),
+                            [this] { return items.size() < LOAD_QUEUE_LENGTH; })) {
+        return false;
+      }
+      items.push_back(item);
+      changed.notify_all();
+      return true;
+    }
+
+    bool receive(T& item, unsigned long timeout_ms) {
+      std::unique_lock<std::mutex> guard(mutex);
+      if (!changed.wait_for(guard, std::chrono::milliseconds(timeout_ms), [this] { return !items.empty(); })) {
+        return false;
+      }
+      item = items.front();
+      items.pop_front();
+      changed.notify_all();
+      return true;
+    }
+
+  private:
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<T> items;
+};
+
+enum RequestType { REQUEST_PUBLISH, REQUEST_QUERY };
+
+struct Reply {
+  bool ok;
+  char response[48];
+};
+
+struct Request {
+  RequestType type;
+  TaskQueue<Reply>* replyTo;
+  uint8_t qos;
+  std::string target;
+  std::string data;
+  unsigned long queuedAt;
+};
+
+// SIM800L and broker; the broker streams the image once it sees a "stream" request.
+// Every call is checked against the thread that owns the modem.
+class LoadModem : public ScriptedModem {
+  public:
+    std::vector<uint8_t> image;
+    std::thread::id owner;
+    std::atomic<int> foreign_calls{0};
+    int resends = 0;
+
+    int available() override {
+      checkOwner();
+      resendExpired();
+      return ScriptedModem::available();
+    }
+    int read() override {
+      checkOwner();
+      return ScriptedModem::read();
+    }
+    size_t write(uint8_t c) override {
+      checkOwner();
+      return ScriptedModem::write(c);
+    }
+
+  protected:
+    void onPacket(uint8_t type, const std::string& packet) override {
+      if ((type & 0xF0) == 0x30 && packet.find(LOAD_TOPIC_REQUEST) != std::string::npos &&
+          packet.find("\"stream\"") != std::string::npos) {
+        next_offset = 0;
+        inflight.clear();
+        fillWindow();
+      } else if (type == 0x40) {
+        inflight.erase(((uint8_t)packet[2] << 8) | (uint8_t)packet[3]);
+        fillWindow();
+      }
+    }
+
+  private:
+    struct Inflight {
+      size_t offset;
+      unsigned long sentAt;
+    };
+
+    size_t next_offset = 0;
+    uint16_t next_id = 1;
+    std::map<uint16_t, Inflight> inflight;
+
+    void checkOwner() {
+      if (std::this_thread::get_id() != owner) {
+        foreign_calls++;
+      }
+    }
+
+    void fillWindow() {
+      while (inflight.size() < LOAD_WINDOW && next_offset < image.size()) {
+        uint16_t id = next_id++;
+        inflight[id] = {next_offset, millis()};
+        sendChunk(id, next_offset, false);
+        next_offset += LOAD_CHUNK_SIZE;
+      }
+    }
+
+    void resendExpired() {
+      for (auto& entry : inflight) {
+        if (millis() - entry.second.sentAt >= LOAD_RESEND_TIMEOUT) {
+          entry.second.sentAt = millis();
+          sendChunk(entry.first, entry.second.offset, true);
+          resends++;
+        }
+      }
+    }
+
+    // 4-byte big-endian offset ahead of the chunk, as the server sends it
+    void sendChunk(uint16_t id, size_t offset, bool dup) {
+      std::string topic = LOAD_TOPIC_CHUNK;
+      size_t size = min((size_t)LOAD_CHUNK_SIZE, image.size() - offset);
+      std::string body;
+      body += (char)(topic.size() >> 8);
+      body += (char)(topic.size() & 0xFF);
+      body += topic;
+      body += (char)(id >> 8);
+      body += (char)(id & 0xFF);
+      for (int shift = 24; shift >= 0; shift -= 8) {
+        body += (char)(offset >> shift);
+      }
+      body.append((const char*)image.data() + offset, size);
+
+      std::string packet(1, (char)(dup ? 0x3A : 0x32));
+      size_t length = body.size();
+      do {
+        uint8_t digit = length % 128;
+        length /= 128;
+        packet += (char)(digit | (length > 0 ? 0x80 : 0));
+      } while (length > 0);
+      feedIpd(packet + body);
+    }
+};
+
+struct LoadResult {
+  double kbPerSecond;
+  bool complete;
+  uint32_t served;
+  uint32_t waitTotalMs;
+  uint32_t waitMaxMs;
+};
+
+static LoadModem* modem;
+static MqttSim800* mqtt;
+static TaskQueue<Request>* requests;
+
+// Chunk slots as in the sketch: the parser writes into a free one, the handler flashes it
+static uint8_t slots[LOAD_WINDOW][4 + LOAD_CHUNK_SIZE];
+static bool slot_used[LOAD_WINDOW];
+static std::vector<uint8_t> flashed;
+static std::atomic<size_t> flashed_bytes{0};
+static std::atomic<bool> stream_done{false};
+
+static uint8_t* chunkSink(size_t length, void*) {
+  for (int i = 0; i < LOAD_WINDOW; i++) {
+    if (!slot_used[i] && length <= sizeof(slots[i])) {
+      slot_used[i] = true;
+      return slots[i];
+    }
+  }
+  return nullptr;   // Skipped without a PUBACK; the broker resends it
+}
+
+static void onChunk(uint8_t* payload, size_t length, void*) {
+  size_t offset = ((size_t)payload[0] << 24) | ((size_t)payload[1] << 16) | ((size_t)payload[2] << 8) | payload[3];
+  if (offset + length - 4 <= flashed.size() && offset == flashed_bytes) {
+    memcpy(flashed.data() + offset, payload + 4, length - 4);
+    flashed_bytes += length - 4;
+  }
+  slot_used[(payload - slots[0]) / sizeof(slots[0])] = false;
+  if (flashed_bytes == flashed.size()) {
+    stream_done = true;
+  }
+}
+
+static bool submit(Request request, TaskQueue<Reply>& replies, Reply& reply) {
+  request.replyTo = &replies;
+  request.queuedAt = millis();
+  return requests->send(request, 1000) && replies.receive(reply, 15000);
+}
+
+static LoadResult runLoad(bool telemetry) {
+  LoadResult result = {0, false, 0, 0, 0};
+  std::atomic<bool> stop{false};
+  TaskQueue<Reply> fota_replies;
+  TaskQueue<Reply> telemetry_replies;
+  flashed.assign(modem->image.size(), 0);
+  flashed_bytes = 0;
+  stream_done = false;
+  memset(slot_used, 0, sizeof(slot_used));
+
+  std::thread modem_thread([&] {
+    modem->owner = std::this_thread::get_id();
+    while (!stop) {
+      mqtt->loop();
+      Request request;
+      if (!requests->receive(request, LOAD_POLL_INTERVAL)) {
+        continue;
+      }
+      uint32_t wait = millis() - request.queuedAt;
+      result.served++;
+      result.waitTotalMs += wait;
+      result.waitMaxMs = max(result.waitMaxMs, wait);
+
+      Reply reply = {false, ""};
+      if (request.type == REQUEST_PUBLISH) {
+        reply.ok = mqtt->publish(request.target.c_str(), (const uint8_t*)request.data.data(),
+                                 request.data.size(), request.qos);
+      } else {
+        reply.ok = mqtt->query(request.target.c_str(), request.data.c_str(), reply.response, sizeof(reply.response));
+      }
+      request.replyTo->send(reply, 0);
+    }
+  });
+
+  std::thread telemetry_thread([&] {
+    while (telemetry && !stop) {
+      Reply reply;
+      submit({REQUEST_QUERY, nullptr, 0, "AT+CSQ", "+CSQ:", 0}, telemetry_replies, reply);
+      int rssi = reply.ok ? atoi(reply.response + 5) : 99;
+      std::string report = "{\"device\":\"load-device\",\"uptime\":" + std::to_string(millis() / 1000) +
+                           ",\"heap\":201234,\"csq\":" + std::to_string(rssi) +
+                           ",\"fota\":" + std::to_string(flashed_bytes) + "}";
+      submit({REQUEST_PUBLISH, nullptr, 0, LOAD_TOPIC_TELEMETRY, report, 0}, telemetry_replies, reply);
+      std::this_thread::sleep_for(std::chrono::milliseconds(LOAD_TELEMETRY_INTERVAL));
+    }
+  });
+
+  // FOTA thread: request the stream, then wait for the last chunk
+  unsigned long start = millis();
+  Reply reply;
+  submit({REQUEST_PUBLISH, nullptr, 1, LOAD_TOPIC_REQUEST,
+          "{\"device\":\"load-device\",\"action\":\"stream\",\"offset\":0,\"chunk\":1024,\"window\":4}", 0},
+         fota_replies, reply);
+  while (!stream_done && millis() - start < LOAD_TIMEOUT) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  unsigned long elapsed = max(millis() - start, 1UL);
+
+  stop = true;
+  telemetry_thread.join();
+  modem_thread.join();
+
+  result.complete = stream_done;
+  result.kbPerSecond = (double)flashed_bytes / 1024 * 1000 / elapsed;
+  return result;
+}
+
+void setUp() {
+  modem = new LoadModem();
+  modem->owner = std::this_thread::get_id();
+  modem->image.resize(LOAD_IMAGE_SIZE);
+  uint32_t seed = 0x2468ACE0;
+  for (size_t i = 0; i < modem->image.size(); i++) {
+    seed = seed * 1103515245 + 12345;
+    modem->image[i] = seed >> 24;
+  }
+
+  mqtt = new MqttSim800(*modem);
+  mqtt->setBatching(512, 200);    // MQTT_BATCH_BYTES, MQTT_BATCH_DELAY
+  mqtt->route(LOAD_TOPIC_CHUNK, onChunk, chunkSink);
+  TEST_ASSERT_TRUE(mqtt->connect("broker", 1883, "load-device"));
+  TEST_ASSERT_TRUE(mqtt->subscribe(LOAD_TOPIC_CHUNK, 1));
+  modem->down_rate = LOAD_DOWN_RATE;
+  modem->up_rate = LOAD_UP_RATE;
+  requests = new TaskQueue<Request>();
+}
+
+void tearDown() {
+  delete requests;
+  delete mqtt;
+  delete modem;
+}
+
+static void report(const char* name, const LoadResult& result) {
+  char text[200];
+  snprintf(text, sizeof(text),
+           "%s: %.1f KB/s, %lu requests, queue wait avg %lu ms, max %lu ms, %d resends, %.2f packets/send",
+           name, result.kbPerSecond, (unsigned long)result.served,
+           (unsigned long)(result.served ? result.waitTotalMs / result.served : 0),
+           (unsigned long)result.waitMaxMs, modem->resends, mqtt->packetsPerSend());
+  TEST_MESSAGE(text);
+}
+
+void test_fota_alone() {
+  LoadResult result = runLoad(false);
+  report("FOTA alone", result);
+
+  TEST_ASSERT_TRUE(result.complete);
+  TEST_ASSERT_EQUAL_MEMORY(modem->image.data(), flashed.data(), flashed.size());
+  TEST_ASSERT_EQUAL(0, modem->foreign_calls.load());
+}
+
+void test_fota_with_telemetry_load() {
+  LoadResult result = runLoad(true);
+  report("FOTA + telemetry every 100 ms", result);
+
+  TEST_ASSERT_TRUE(result.complete);
+  TEST_ASSERT_EQUAL_MEMORY(modem->image.data(), flashed.data(), flashed.size());
+  TEST_ASSERT_EQUAL(0, modem->foreign_calls.load());
+  TEST_ASSERT_EQUAL(0, mqtt->droppedPackets());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_fota_alone);
+  RUN_TEST(test_fota_with_telemetry_load);
+  return UNITY_END();
+}
@@ -0,0 +1,269 @@
+// Byte-level tests for the MqttSim800 receive path: +IPD framing, the PUBLISH
+// state machine and routed sinks, fed through a scripted modem.
+// Run with: pio test -e native
+
+#include <unity.h>
+#include <MqttSim800.h>
+#include <ScriptedModem.h>
+
+static ScriptedModem* modem;
+static MqttSim800* mqtt;
+
+struct Received {
+  int count = 0;
+  std::string topic;
+  std::string payload;
+};
+static Received received;
+
+static uint8_t sink_buffer[2048];
+static int sink_calls = 0;
+static Received routed;
+
+static void onMessage(const char* topic, const uint8_t* payload, size_t length, void*) {
+  received.count++;
+  received.topic = topic;
+  received.payload.assign((const char*)payload, length);
+}
+
+static uint8_t* chunkSink(size_t length, void*) {
+  sink_calls++;
+  return length <= sizeof(sink_buffer) ? sink_buffer : nullptr;
+}
+
+static void onChunk(uint8_t* payload, size_t length, void*) {
+  TEST_ASSERT_EQUAL_PTR(sink_buffer, payload);
+  routed.count++;
+  routed.payload.assign((const char*)payload, length);
+}
+
+static std::string remainingLength(size_t length) {
+  std::string encoded;
+  do {
+    uint8_t digit = length % 128;
+    length /= 128;
+    encoded += (char)(digit | (length > 0 ? 0x80 : 0));
+  } while (length > 0);
+  return encoded;
+}
+
+static std::string publishPacket(const std::string& topic, const std::string& payload, uint16_t id = 0) {
+  std::string body;
+  body += (char)(topic.size() >> 8);
+  body += (char)(topic.size() & 0xFF);
+  body += topic;
+  if (id != 0) {
+    body += (char)(id >> 8);
+    body += (char)(id & 0xFF);
+  }
+  body += payload;
+  return std::string(1, (char)(id != 0 ? 0x32 : 0x30)) + remainingLength(body.size()) + body;
+}
+
+// Runs loop() until the modem has nothing left for the client
+static void drain() {
+  for (int i = 0; i < 100000 && modem->pending() > 0; i++) {
+    mqtt->loop();
+  }
+  mqtt->loop();
+}
+
+void setUp() {
+  modem = new ScriptedModem();
+  mqtt = new MqttSim800(*modem);
+  mqtt->setCallback(onMessage);
+  received = Received();
+  routed = Received();
+  sink_calls = 0;
+  TEST_ASSERT_TRUE(mqtt->connect("broker", 1883, "test-device"));
+  modem->packets.clear();
+}
+
+void tearDown() {
+  delete mqtt;
+  delete modem;
+}
+
+void test_publish_in_one_frame() {
+  modem->feedIpd(publishPacket("device/firmware/info", "{\"version\":\"1.2\"}"));
+  drain();
+
+  TEST_ASSERT_EQUAL(1, received.count);
+  TEST_ASSERT_EQUAL_STRING("device/firmware/info", received.topic.c_str());
+  TEST_ASSERT_EQUAL_STRING("{\"version\":\"1.2\"}", received.payload.c_str());
+}
+
+void test_ipd_header_split_across_reads() {
+  std::string packet = publishPacket("t", "hello");
+  std::string frame = "\r\n+IPD," + std::to_string(packet.size()) + ":" + packet;
+
+  // Every split point, including inside "+IPD,<len>:" and the MQTT fixed header
+  for (size_t split = 1; split < frame.size(); split++) {
+    received = Received();
+    modem->feed(frame.substr(0, split));
+    mqtt->loop();
+    modem->feed(frame.substr(split));
+    drain();
+
+    TEST_ASSERT_EQUAL_MESSAGE(1, received.count, ("split at " + std::to_string(split)).c_str());
+    TEST_ASSERT_EQUAL_STRING("hello", received.payload.c_str());
+  }
+}
+
+void test_packet_split_across_ipd_frames() {
+  std::string packet = publishPacket("device/firmware/info", std::string(300, 'x'));
+
+  // The varint length, topic length, topic and payload each end up cut in two
+  for (size_t split = 1; split < packet.size(); split += 7) {
+    received = Received();
+    modem->feedIpd(packet.substr(0, split));
+    modem->feedIpd(packet.substr(split));
+    drain();
+
+    TEST_ASSERT_EQUAL(1, received.count);
+    TEST_ASSERT_EQUAL(300, received.payload.size());
+  }
+}
+
+void test_one_byte_per_read() {
+  modem->trickle = 1;
+  modem->feedIpd(publishPacket("a/b", "payload") + publishPacket("c/d", "second"));
+  drain();
+
+  TEST_ASSERT_EQUAL(2, received.count);
+  TEST_ASSERT_EQUAL_STRING("c/d", received.topic.c_str());
+  TEST_ASSERT_EQUAL_STRING("second", received.payload.c_str());
+}
+
+void test_routed_payload_is_binary_safe() {
+  TEST_ASSERT_TRUE(mqtt->route("device/firmware/data/test-device", onChunk, chunkSink));
+
+  // AT look-alikes and NULs inside +IPD data belong to the payload
+  static const char raw[] = "\x00\r\nSEND OK\r\n+IPD,5:\r\nCLOSED\r\n>\x00\xff";
+  std::string payload(raw, sizeof(raw) - 1);
+  modem->feedIpd(publishPacket("device/firmware/data/test-device", payload));
+  drain();
+
+  TEST_ASSERT_EQUAL(1, sink_calls);
+  TEST_ASSERT_EQUAL(1, routed.count);
+  TEST_ASSERT_EQUAL(0, received.count);
+  TEST_ASSERT_EQUAL(payload.size(), routed.payload.size());
+  TEST_ASSERT_EQUAL_MEMORY(payload.data(), routed.payload.data(), payload.size());
+  TEST_ASSERT_TRUE(mqtt->connected());
+}
+
+void test_routed_payload_streamed_in_pieces() {
+  TEST_ASSERT_TRUE(mqtt->route("device/firmware/data/test-device", onChunk, chunkSink));
+
+  std::string payload;
+  for (int i = 0; i < 1024; i++) {
+    payload += (char)(i * 7);
+  }
+  modem->trickle = 13;
+  modem->feedIpd(publishPacket("device/firmware/data/test-device", payload));
+  drain();
+
+  TEST_ASSERT_EQUAL(1, routed.count);
+  TEST_ASSERT_EQUAL_MEMORY(payload.data(), routed.payload.data(), payload.size());
+}
+
+void test_topic_length_past_packet_is_skipped() {
+  // Topic length 0x0100 in a 9-byte packet
+  std::string bad("\x30\x09\x01\x00topicxx", 11);
+  modem->feedIpd(bad + publishPacket("ok", "next"));
+  drain();
+
+  TEST_ASSERT_EQUAL(1, received.count);
+  TEST_ASSERT_EQUAL_STRING("ok", received.topic.c_str());
+  TEST_ASSERT_EQUAL_STRING("next", received.payload.c_str());
+}
+
+void test_oversized_message_is_skipped() {
+  modem->feedIpd(publishPacket("big", std::string(MQTT_SIM800_MAX_PACKET + 100, 'z')));
+  modem->feedIpd(publishPacket("small", "fits"));
+  drain();
+
+  TEST_ASSERT_EQUAL(1, received.count);
+  TEST_ASSERT_EQUAL_STRING("small", received.topic.c_str());
+}
+
+void test_truncated_packet_is_discarded_on_reconnect() {
+  // The broker drops the connection 10 bytes into a 50-byte payload
+  std::string packet = publishPacket("t", std::string(50, 'p'));
+  modem->feedIpd(packet.substr(0, packet.size() - 40));
+  modem->feed("\r\nCLOSED\r\n");
+  drain();
+
+  TEST_ASSERT_FALSE(mqtt->connected());
+  TEST_ASSERT_EQUAL(0, received.count);
+
+  TEST_ASSERT_TRUE(mqtt->connect("broker", 1883, "test-device"));
+  modem->feedIpd(publishPacket("t", "fresh"));
+  drain();
+
+  TEST_ASSERT_EQUAL(1, received.count);
+  TEST_ASSERT_EQUAL_STRING("fresh", received.payload.c_str());
+}
+
+void test_qos1_publish_is_acknowledged() {
+  modem->feedIpd(publishPacket("device/firmware/info", "{}", 0x1234));
+  drain();
+  mqtt->flush();
+
+  TEST_ASSERT_EQUAL(1, received.count);
+  TEST_ASSERT_EQUAL(1, modem->packets.size());
+  TEST_ASSERT_EQUAL(4, modem->packets[0].size());
+  TEST_ASSERT_EQUAL_MEMORY("\x40\x02\x12\x34", modem->packets[0].data(), 4);
+}
+
+void test_puback_skips_the_batch_deadline() {
+  mqtt->setBatching(512, 60000);
+  mqtt->publish("telemetry", "queued");   // QoS 0, waits for the deadline
+  TEST_ASSERT_EQUAL(0, modem->packets.size());
+
+  modem->feedIpd(publishPacket("device/firmware/chunk", "data", 7));
+  drain();
+
+  // The ack goes out in the same loop(), with the waiting publish in one CIPSEND
+  TEST_ASSERT_EQUAL(1, modem->packets.size());
+  const std::string& sent = modem->packets[0];
+  TEST_ASSERT_EQUAL(0x30, (uint8_t)sent[0]);
+  TEST_ASSERT_EQUAL_MEMORY("\x40\x02\x00\x07", sent.data() + sent.size() - 4, 4);
+}
+
+void test_failed_batch_is_kept_then_dropped() {
+  mqtt->setBatching(512, 60000);
+  mqtt->publish("telemetry", "first");
+
+  modem->fail_sends = 1;
+  TEST_ASSERT_FALSE(mqtt->flush());
+  TEST_ASSERT_TRUE(mqtt->flush());
+  TEST_ASSERT_EQUAL(1, modem->packets.size());
+  TEST_ASSERT_EQUAL(0, mqtt->droppedPackets());
+
+  mqtt->publish("telemetry", "second");
+  modem->fail_sends = MQTT_SIM800_FLUSH_RETRIES;
+  for (int i = 0; i < MQTT_SIM800_FLUSH_RETRIES; i++) {
+    TEST_ASSERT_FALSE(mqtt->flush());
+  }
+  TEST_ASSERT_EQUAL(1, mqtt->droppedPackets());
+  TEST_ASSERT_TRUE(mqtt->flush());        // Nothing left to send
+  TEST_ASSERT_EQUAL(1, modem->packets.size());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_publish_in_one_frame);
+  RUN_TEST(test_ipd_header_split_across_reads);
+  RUN_TEST(test_packet_split_across_ipd_frames);
+  RUN_TEST(test_one_byte_per_read);
+  RUN_TEST(test_routed_payload_is_binary_safe);
+  RUN_TEST(test_routed_payload_streamed_in_pieces);
+  RUN_TEST(test_topic_length_past_packet_is_skipped);
+  RUN_TEST(test_oversized_message_is_skipped);
+  RUN_TEST(test_truncated_packet_is_discarded_on_reconnect);
+  RUN_TEST(test_qos1_publish_is_acknowledged);
+  RUN_TEST(test_puback_skips_the_batch_deadline);
+  RUN_TEST(test_failed_batch_is_kept_then_dropped);
+  return UNITY_END();
+}
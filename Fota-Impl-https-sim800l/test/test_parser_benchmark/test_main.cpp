@@ -0,0 +1,212 @@
+// Receive parser benchmark: the String-based monitorTask loop that src_temp_2 used
+// before MqttSim800, against MqttSim800 with the firmware data topic routed into a
+// sink. Both get the same chunks and must flash the same image; only the parsing
+// differs (the chunk header is read with sscanf and the "flash write" is a memcpy
+// in both). Host timings only: they rank the two parsers, not the ESP32.
+// Run with: pio test -e native -f test_parser_benchmark -v
+
+#include <unity.h>
+#include <MqttSim800.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#define BENCH_CHUNKS        1000
+#define BENCH_CHUNK_SIZE    1024
+#define BENCH_UART_READ     128     // Bytes available per poll, as from the UART FIFO
+#define BENCH_TOPIC_INFO    "device/firmware/info"
+#define BENCH_TOPIC_DATA    "device/firmware/data/bench-device"
+
+// Contiguous receive stream, read at most BENCH_UART_READ bytes per available()
+class BufferStream : public Stream {
+  public:
+    std::string data;
+    size_t pos = 0;
+
+    int available() override { return (int)min((size_t)BENCH_UART_READ, data.size() - pos); }
+    int read() override { return pos < data.size() ? (uint8_t)data[pos++] : -1; }
+    size_t readBytes(uint8_t* dest, size_t length) override {
+      size_t count = min(length, (size_t)available());
+      memcpy(dest, data.data() + pos, count);
+      pos += count;
+      return count;
+    }
+    size_t write(uint8_t) override { return 1; }
+};
+
+static std::vector<uint8_t> image;
+static std::vector<uint8_t> flashed;
+static std::string chunk_packets;   // MQTT packets as the broker sends them
+
+static std::string remainingLength(size_t length) {
+  std::string encoded;
+  do {
+    uint8_t digit = length % 128;
+    length /= 128;
+    encoded += (char)(digit | (length > 0 ? 0x80 : 0));
+  } while (length > 0);
+  return encoded;
+}
+
+static void buildStream() {
+  image.resize(BENCH_CHUNKS * BENCH_CHUNK_SIZE);
+  uint32_t seed = 0x12345678;
+  for (size_t i = 0; i < image.size(); i++) {
+    seed = seed * 1103515245 + 12345;
+    image[i] = seed >> 24;
+  }
+
+  std::string topic = BENCH_TOPIC_DATA;
+  for (size_t offset = 0; offset < image.size(); offset += BENCH_CHUNK_SIZE) {
+    char header[96];
+    snprintf(header, sizeof(header), "{\"offset\":%u,\"size\":%u,\"total\":%u}\n",
+             (unsigned)offset, BENCH_CHUNK_SIZE, (unsigned)image.size());
+
+    std::string body;
+    body += (char)(topic.size() >> 8);
+    body += (char)(topic.size() & 0xFF);
+    body += topic;
+    body += header;
+    body.append((const char*)image.data() + offset, BENCH_CHUNK_SIZE);
+    chunk_packets += (char)0x30 + remainingLength(body.size()) + body;
+  }
+}
+
+static bool parseHeader(const char* json, size_t* offset, size_t* size) {
+  unsigned o = 0;
+  unsigned s = 0;
+  if (sscanf(json, "{\"offset\":%u,\"size\":%u", &o, &s) != 2) {
+    return false;
+  }
+  *offset = o;
+  *size = s;
+  return true;
+}
+
+// ---- The old monitorTask receive loop (without the Serial echo) ----
+
+static void legacyParse(Stream& serial) {
+  static uint8_t updateBuffer[BENCH_CHUNK_SIZE];
+  String receivedData = "";
+  bool receivingBinaryData = false;
+  size_t binaryDataLength = 0;
+  size_t dataOffset = 0;
+  size_t chunkOffset = 0;
+
+  while (serial.available()) {
+    char c = serial.read();
+
+    if (receivingBinaryData) {
+      updateBuffer[dataOffset++] = c;
+      if (dataOffset >= binaryDataLength) {
+        receivingBinaryData = false;
+        memcpy(flashed.data() + chunkOffset, updateBuffer, binaryDataLength);
+      }
+      continue;
+    }
+
+    receivedData += c;
+
+    if (receivedData.indexOf(BENCH_TOPIC_INFO) != -1) {
+      int jsonStart = receivedData.indexOf('{');
+      int jsonEnd = receivedData.lastIndexOf('}');
+      if (jsonStart != -1 && jsonEnd != -1 && jsonEnd > jsonStart) {
+        receivedData = "";
+      }
+    }
+
+    if (receivedData.indexOf(BENCH_TOPIC_DATA) != -1) {
+      int headerStart = receivedData.indexOf('{');
+      int headerEnd = receivedData.indexOf('\n', headerStart);
+      if (headerStart != -1 && headerEnd != -1) {
+        String headerJson = receivedData.substring(headerStart, headerEnd);
+        size_t size = 0;
+        if (parseHeader(headerJson.c_str(), &chunkOffset, &size)) {
+          receivingBinaryData = true;
+          binaryDataLength = size;
+          dataOffset = 0;
+          receivedData = "";
+        }
+      }
+    }
+
+    if (receivedData.length() > 1024) {
+      receivedData = receivedData.substring(receivedData.length() - 512);
+    }
+
+    if (receivedData.indexOf("CLOSED") != -1 || receivedData.indexOf("ERROR") != -1) {
+      receivedData = "";
+    }
+  }
+}
+
+// ---- MqttSim800 with the data topic routed into the chunk buffer ----
+
+static uint8_t chunk_buffer[BENCH_CHUNK_SIZE + 128];
+
+static uint8_t* chunkSink(size_t length, void*) {
+  return length <= sizeof(chunk_buffer) ? chunk_buffer : nullptr;
+}
+
+static void onChunk(uint8_t* payload, size_t length, void*) {
+  uint8_t* newline = (uint8_t*)memchr(payload, '\n', length);
+  size_t offset = 0;
+  size_t size = 0;
+  if (newline == nullptr) {
+    return;
+  }
+  *newline = '\0';
+  if (parseHeader((const char*)payload, &offset, &size)) {
+    memcpy(flashed.data() + offset, newline + 1, size);
+  }
+}
+
+static double nsPerByte(std::chrono::steady_clock::duration elapsed, size_t bytes) {
+  return std::chrono::duration<double, std::nano>(elapsed).count() / bytes;
+}
+
+void setUp() {
+  flashed.assign(image.size(), 0);
+}
+
+void tearDown() {}
+
+void test_parsers_flash_the_same_image() {
+  BufferStream legacy_stream;
+  legacy_stream.data = chunk_packets;   // No +IPD framing before CIPHEAD=1
+  auto start = std::chrono::steady_clock::now();
+  while (legacy_stream.available()) {
+    legacyParse(legacy_stream);
+  }
+  auto legacy_elapsed = std::chrono::steady_clock::now() - start;
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), flashed.data(), image.size());
+
+  flashed.assign(image.size(), 0);
+  BufferStream framed_stream;
+  for (size_t pos = 0; pos < chunk_packets.size(); pos += 1360) {
+    std::string frame = chunk_packets.substr(pos, 1360);
+    framed_stream.data += "\r\n+IPD," + std::to_string(frame.size()) + ":" + frame;
+  }
+  MqttSim800 mqtt(framed_stream);
+  mqtt.route(BENCH_TOPIC_DATA, onChunk, chunkSink);
+  start = std::chrono::steady_clock::now();
+  while (framed_stream.available()) {
+    mqtt.loop();
+  }
+  auto stream_elapsed = std::chrono::steady_clock::now() - start;
+  TEST_ASSERT_EQUAL_MEMORY(image.data(), flashed.data(), image.size());
+
+  char report[160];
+  snprintf(report, sizeof(report), "%u x %u B chunks: old String parser %.2f ns/byte, MqttSim800 %.2f ns/byte",
+           BENCH_CHUNKS, BENCH_CHUNK_SIZE,
+           nsPerByte(legacy_elapsed, legacy_stream.data.size()),
+           nsPerByte(stream_elapsed, framed_stream.data.size()));
+  TEST_MESSAGE(report);
+}
+
+int main() {
+  buildStream();
+  UNITY_BEGIN();
+  RUN_TEST(test_parsers_flash_the_same_image);
+  return UNITY_END();
+}
@@ -0,0 +1,270 @@
+// ====== BINARY DELTA (bsdiff algorithm, streaming-friendly patch layout) ======
+//
+// Patch layout (all integers little-endian):
+//   header : "FDL1" | newSize u32 | oldSize u32
+//   block* : diffLen u32 | extraLen u32 | seek i32 | diff bytes | extra bytes
+//
+// Diff bytes are added (mod 256) to the old image starting at the current old
+// position, extra bytes are copied verbatim, then the old position moves by
+// seek. Control and data are interleaved so a device can apply the patch in a
+// single forward pass while reading the old image from flash.
+
+const PATCH_MAGIC = Buffer.from('FDL1');
+const HEADER_SIZE = 12;
+const CONTROL_SIZE = 12;
+
+// Larsson-Sadakane suffix sorting, as in the reference bsdiff
+function split(I, V, start, len, h) {
+  let i, j, k, x, tmp;
+  
+  if (len < 16) {
+    for (k = start; k < start + len; k += j) {
+      j = 1;
+      x = V[I[k] + h];
+      for (i = 1; k + i < start + len; i++) {
+        if (V[I[k + i] + h] < x) {
+          x = V[I[k + i] + h];
+          j = 0;
+        }
+        if (V[I[k + i] + h] === x) {
+          tmp = I[k + j]; I[k + j] = I[k + i]; I[k + i] = tmp;
+          j++;
+        }
+      }
+      for (i = 0; i < j; i++) V[I[k + i]] = k + j - 1;
+      if (j === 1) I[k] = -1;
+    }
+    return;
+  }
+  
+  x = V[I[start + (len >> 1)] + h];
+  let jj = 0;
+  let kk = 0;
+  for (i = start; i < start + len; i++) {
+    if (V[I[i] + h] < x) jj++;
+    if (V[I[i] + h] === x) kk++;
+  }
+  jj += start;
+  kk += jj;
+  
+  i = start; j = 0; k = 0;
+  while (i < jj) {
+    if (V[I[i] + h] < x) {
+      i++;
+    } else if (V[I[i] + h] === x) {
+      tmp = I[i]; I[i] = I[jj + j]; I[jj + j] = tmp;
+      j++;
+    } else {
+      tmp = I[i]; I[i] = I[kk + k]; I[kk + k] = tmp;
+      k++;
+    }
+  }
+  while (jj + j < kk) {
+    if (V[I[jj + j] + h] === x) {
+      j++;
+    } else {
+      tmp = I[jj + j]; I[jj + j] = I[kk + k]; I[kk + k] = tmp;
+      k++;
+    }
+  }
+  
+  if (jj > start) split(I, V, start, jj - start, h);
+  for (i = 0; i < kk - jj; i++) V[I[jj + i]] = kk - 1;
+  if (jj === kk - 1) I[jj] = -1;
+  if (start + len > kk) split(I, V, kk, start + len - kk, h);
+}
+
+function suffixSort(old) {
+  const oldSize = old.length;
+  const I = new Int32Array(oldSize + 1);
+  const V = new Int32Array(oldSize + 1);
+  const buckets = new Int32Array(256);
+  let i, h, len;
+  
+  for (i = 0; i < oldSize; i++) buckets[old[i]]++;
+  for (i = 1; i < 256; i++) buckets[i] += buckets[i - 1];
+  for (i = 255; i > 0; i--) buckets[i] = buckets[i - 1];
+  buckets[0] = 0;
+  
+  for (i = 0; i < oldSize; i++) I[++buckets[old[i]]] = i;
+  I[0] = oldSize;
+  for (i = 0; i < oldSize; i++) V[i] = buckets[old[i]];
+  V[oldSize] = 0;
+  for (i = 1; i < 256; i++) {
+    if (buckets[i] === buckets[i - 1] + 1) I[buckets[i]] = -1;
+  }
+  I[0] = -1;
+  
+  for (h = 1; I[0] !== -(oldSize + 1); h += h) {
+    len = 0;
+    for (i = 0; i < oldSize + 1;) {
+      if (I[i] < 0) {
+        len -= I[i];
+        i -= I[i];
+      } else {
+        if (len) I[i - len] = -len;
+        len = V[I[i]] + 1 - i;
+        split(I, V, i, len, h);
+        i += len;
+        len = 0;
+      }
+    }
+    if (len) I[i - len] = -len;
+  }
+  
+  for (i = 0; i < oldSize + 1; i++) I[V[i]] = i;
+  return I;
+}
+
+function matchLength(a, aStart, b, bStart) {
+  const max = Math.min(a.length - aStart, b.length - bStart);
+  let i = 0;
+  while (i < max && a[aStart + i] === b[bStart + i]) i++;
+  return i;
+}
+
+// Longest match of newBuf[scan..] among the sorted suffixes of old
+function search(I, old, newBuf, scan) {
+  let st = 0;
+  let en = old.length;
+  
+  while (en - st >= 2) {
+    const x = st + ((en - st) >> 1);
+    const n = Math.min(old.length - I[x], newBuf.length - scan);
+    const cmp = Buffer.compare(old.subarray(I[x], I[x] + n), newBuf.subarray(scan, scan + n));
+    if (cmp < 0) {
+      st = x;
+    } else {
+      en = x;
+    }
+  }
+  
+  const x = matchLength(old, I[st], newBuf, scan);
+  const y = matchLength(old, I[en], newBuf, scan);
+  return x > y ? { pos: I[st], len: x } : { pos: I[en], len: y };
+}
+
+function createPatch(old, newBuf) {
+  const I = suffixSort(old);
+  const oldSize = old.length;
+  const newSize = newBuf.length;
+  const blocks = [];
+  
+  const header = Buffer.alloc(HEADER_SIZE);
+  PATCH_MAGIC.copy(header, 0);
+  header.writeUInt32LE(newSize, 4);
+  header.writeUInt32LE(oldSize, 8);
+  blocks.push(header);
+  
+  let scan = 0, len = 0, pos = 0;
+  let lastScan = 0, lastPos = 0, lastOffset = 0;
+  
+  while (scan < newSize) {
+    let oldScore = 0;
+    let scsc;
+    
+    for (scsc = scan += len; scan < newSize; scan++) {
+      const match = search(I, old, newBuf, scan);
+      pos = match.pos;
+      len = match.len;
+      
+      for (; scsc < scan + len; scsc++) {
+        if (scsc + lastOffset < oldSize && old[scsc + lastOffset] === newBuf[scsc]) oldScore++;
+      }
+      if ((len === oldScore && len !== 0) || len > oldScore + 8) break;
+      if (scan + lastOffset < oldSize && old[scan + lastOffset] === newBuf[scan]) oldScore--;
+    }
+    
+    if (len !== oldScore || scan === newSize) {
+      let s = 0, Sf = 0, lenf = 0;
+      for (let i = 0; lastScan + i < scan && lastPos + i < oldSize;) {
+        if (old[lastPos + i] === newBuf[lastScan + i]) s++;
+        i++;
+        if (s * 2 - i > Sf * 2 - lenf) { Sf = s; lenf = i; }
+      }
+      
+      let lenb = 0;
+      if (scan < newSize) {
+        let Sb = 0;
+        s = 0;
+        for (let i = 1; scan >= lastScan + i && pos >= i; i++) {
+          if (old[pos - i] === newBuf[scan - i]) s++;
+          if (s * 2 - i > Sb * 2 - lenb) { Sb = s; lenb = i; }
+        }
+      }
+      
+      if (lastScan + lenf > scan - lenb) {
+        const overlap = (lastScan + lenf) - (scan - lenb);
+        let Ss = 0, lens = 0;
+        s = 0;
+        for (let i = 0; i < overlap; i++) {
+          if (newBuf[lastScan + lenf - overlap + i] === old[lastPos + lenf - overlap + i]) s++;
+          if (newBuf[scan - lenb + i] === old[pos - lenb + i]) s--;
+          if (s > Ss) { Ss = s; lens = i + 1; }
+        }
+        lenf += lens - overlap;
+        lenb -= lens;
+      }
+      
+      const extraLen = (scan - lenb) - (lastScan + lenf);
+      const block = Buffer.alloc(CONTROL_SIZE + lenf + extraLen);
+      block.writeUInt32LE(lenf, 0);
+      block.writeUInt32LE(extraLen, 4);
+      block.writeInt32LE((pos - lenb) - (lastPos + lenf), 8);
+      for (let i = 0; i < lenf; i++) {
+        block[CONTROL_SIZE + i] = (newBuf[lastScan + i] - old[lastPos + i]) & 0xFF;
+      }
+      newBuf.copy(block, CONTROL_SIZE + lenf, lastScan + lenf, lastScan + lenf + extraLen);
+      blocks.push(block);
+      
+      lastScan = scan - lenb;
+      lastPos = pos - lenb;
+      lastOffset = pos - scan;
+    }
+  }
+  
+  return Buffer.concat(blocks);
+}
+
+// Reference applier, used to self-check every patch before it is served
+function applyPatch(old, patch) {
+  if (patch.length < HEADER_SIZE || !patch.subarray(0, 4).equals(PATCH_MAGIC)) {
+    throw new Error('Invalid patch header');
+  }
+  
+  const newSize = patch.readUInt32LE(4);
+  const oldSize = patch.readUInt32LE(8);
+  if (oldSize !== old.length) {
+    throw new Error(`Patch expects a ${oldSize} byte base, got ${old.length}`);
+  }
+  
+  const out = Buffer.alloc(newSize);
+  let p = HEADER_SIZE, newPos = 0, oldPos = 0;
+  
+  while (newPos < newSize) {
+    const diffLen = patch.readUInt32LE(p);
+    const extraLen = patch.readUInt32LE(p + 4);
+    const seek = patch.readInt32LE(p + 8);
+    p += CONTROL_SIZE;
+    
+    if (newPos + diffLen + extraLen > newSize || oldPos < 0 || oldPos + diffLen > oldSize) {
+      throw new Error('Corrupt patch block');
+    }
+    
+    for (let i = 0; i < diffLen; i++) {
+      out[newPos + i] = (patch[p + i] + old[oldPos + i]) & 0xFF;
+    }
+    p += diffLen;
+    newPos += diffLen;
+    oldPos += diffLen;
+    
+    patch.copy(out, newPos, p, p + extraLen);
+    p += extraLen;
+    newPos += extraLen;
+    oldPos += seek;
+  }
+  
+  return out;
+}
+
+module.exports = { createPatch, applyPatch };
@@ -0,0 +1,137 @@
+// ====== INCREMENTAL FRAME DECODER (one per stream connection) ======
+//
+// Two framings share a connection, told apart by the first byte of a frame:
+//   line   : any bytes up to '\n' (newline-delimited JSON); surrounding
+//            whitespace, including a '\r', is trimmed and empty lines skipped
+//   binary : 0xFD | length u16 BE | payload
+//
+// Complete frames are handed out as views straight into the received packet;
+// only the partial frame at the end of a packet is copied, once, into a
+// per-connection buffer of maxFrame bytes. Each byte is scanned once, and a
+// frame longer than maxFrame (or a slow-loris line that never ends) is an
+// overflow instead of an ever-growing buffer.
+
+const FRAME_LINE = 1;
+const FRAME_BINARY = 2;
+const BINARY_MARKER = 0xFD;
+const BINARY_HEADER_SIZE = 3;
+const NEWLINE = 0x0A;
+
+class FrameDecoder {
+  constructor(maxFrame = 2048) {
+    this.maxFrame = maxFrame;
+    this.pending = null;      // Allocated on the first frame split across packets
+    this.pendingLength = 0;
+    this.frames = 0;
+    this.bufferedBytes = 0;   // Bytes that had to be copied into pending
+    this.overflows = 0;
+  }
+
+  // Feed one received packet. onFrame(kind, payload) runs for every complete
+  // frame; payload is only valid during the call. Returns false on overflow,
+  // after which the connection should be dropped.
+  push(data, onFrame) {
+    let pos = 0;
+
+    if (this.pendingLength > 0) {
+      pos = this.completePending(data, onFrame);
+      if (pos < 0) return false;
+      if (this.pendingLength > 0) return true; // Still incomplete, packet used up
+    }
+
+    while (pos < data.length) {
+      if (data[pos] === BINARY_MARKER) {
+        if (data.length - pos < BINARY_HEADER_SIZE) break;
+        const length = data.readUInt16BE(pos + 1);
+        if (length > this.maxFrame) return this.overflow();
+        const end = pos + BINARY_HEADER_SIZE + length;
+        if (end > data.length) break;
+        this.emit(FRAME_BINARY, data, pos + BINARY_HEADER_SIZE, end, onFrame);
+        pos = end;
+      } else {
+        const newline = data.indexOf(NEWLINE, pos);
+        if (newline < 0) break;
+        if (newline - pos > this.maxFrame) return this.overflow();
+        this.emit(FRAME_LINE, data, pos, newline, onFrame);
+        pos = newline + 1;
+      }
+    }
+
+    // Keep the partial frame at the tail of the packet
+    const rest = data.length - pos;
+    if (rest === 0) return true;
+    if (rest > this.maxFrame + BINARY_HEADER_SIZE) return this.overflow();
+    this.append(data, pos, data.length);
+    return true;
+  }
+
+  // Finish the frame held in pending with the start of a new packet; returns the
+  // bytes of data used, or -1 on overflow
+  completePending(data, onFrame) {
+    if (this.pending[0] === BINARY_MARKER) {
+      let used = 0;
+      if (this.pendingLength < BINARY_HEADER_SIZE) {
+        used = Math.min(BINARY_HEADER_SIZE - this.pendingLength, data.length);
+        this.append(data, 0, used);
+        if (this.pendingLength < BINARY_HEADER_SIZE) return used;
+      }
+
+      const length = this.pending.readUInt16BE(1);
+      if (length > this.maxFrame) {
+        this.overflow();
+        return -1;
+      }
+      const take = Math.min(BINARY_HEADER_SIZE + length - this.pendingLength, data.length - used);
+      this.append(data, used, used + take);
+      used += take;
+      if (this.pendingLength === BINARY_HEADER_SIZE + length) {
+        this.pendingLength = 0;
+        this.emit(FRAME_BINARY, this.pending, BINARY_HEADER_SIZE, BINARY_HEADER_SIZE + length, onFrame);
+      }
+      return used;
+    }
+
+    // Only the new bytes are scanned for the end of the line
+    const newline = data.indexOf(NEWLINE);
+    const end = newline < 0 ? data.length : newline;
+    if (this.pendingLength + end > this.maxFrame) {
+      this.overflow();
+      return -1;
+    }
+    this.append(data, 0, end);
+    if (newline < 0) return end;
+
+    const length = this.pendingLength;
+    this.pendingLength = 0;
+    this.emit(FRAME_LINE, this.pending, 0, length, onFrame);
+    return newline + 1;
+  }
+
+  append(data, start, end) {
+    if (!this.pending) {
+      this.pending = Buffer.allocUnsafe(this.maxFrame + BINARY_HEADER_SIZE);
+    }
+    data.copy(this.pending, this.pendingLength, start, end);
+    this.pendingLength += end - start;
+    this.bufferedBytes += end - start;
+  }
+
+  emit(kind, data, start, end, onFrame) {
+    if (kind === FRAME_LINE) {
+      while (start < end && data[start] <= 0x20) start++;
+      while (end > start && data[end - 1] <= 0x20) end--;
+      if (start === end) return;
+    }
+    this.frames++;
+    onFrame(kind, data.subarray(start, end));
+  }
+
+  // Drops the frame in progress
+  overflow() {
+    this.pendingLength = 0;
+    this.overflows++;
+    return false;
+  }
+}
+
+module.exports = { FrameDecoder, FRAME_LINE, FRAME_BINARY, BINARY_MARKER };
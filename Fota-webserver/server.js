@@ -4,19 +4,35 @@ const fs = require('fs');
 const path = require('path');
 const crypto = require('crypto');
 const net = require('net');
+const dgram = require('dgram');
+const { Duplex } = require('stream');
 const zlib = require('zlib');
+const { createPatch, applyPatch } = require('./lib/bsdiff');
+const { FrameDecoder, FRAME_LINE } = require('./lib/framing');
 
 // Configuration
 const app = express();
 const PORT = 3000;
 const TCP_PORT = 8266;
+const MQTT_PORT = 1883;
+const MQTTSN_PORT = 1884;
+const COAP_PORT = 5683;
 
 // FOTA Configuration
 const FIRMWARE_DIR = path.join(__dirname, 'firmware');
 const DEFAULT_CHUNK_SIZE = 512; // Optimized for mobile data
 const MAX_CHUNK_SIZE = 1024;
+const TCP_MAX_CHUNK_SIZE = 4096; // TCP only: a device may stream a chunk into several flash buffers
 const MIN_CHUNK_SIZE = 128;
 const CONNECTION_TIMEOUT = 30000;
+const TCP_MAX_FRAME = 2048; // Longest request frame; a longer one drops the connection
+
+// Per-device chunk sizing: halve on a stall, double back after a run of clean chunks
+const STALL_GAP_FACTOR = 4;     // A request gap this many times the smoothed gap is a stall
+const STALL_MIN_GAP_MS = 2000;  // ... and never one shorter than this
+const CHUNK_GROW_AFTER = 8;     // Clean chunks before the chunk size doubles again
+const PACING_GAIN = 1.25;       // Pipelined chunks go out at most this much faster than the device's rate
+const PACING_MAX_DELAY = 2000;
 const CHUNK_RETRY_LIMIT = 3;
 
 // Session Management
@@ -32,30 +48,320 @@ const performanceMetrics = {
   chunksServed: 0,
   retryCount: 0,
   httpDownloads: 0,
-  tcpDownloads: 0
+  tcpDownloads: 0,
+  checks: 0,
+  notModifiedChecks: 0,
+  mqttChunksPublished: 0,
+  mqttRetransmits: 0,
+  manifestBuilds: 0,
+  tcpFrameOverflows: 0
 };
 
+// MQTT FOTA: chunks are published at QoS 1 to a per-device topic, the device's
+// PUBACKs slide a window of chunks in flight and unacked chunks are resent
+const MQTT_TOPIC_REQUEST = 'device/firmware/request';
+const MQTT_TOPIC_INFO = 'device/firmware/info';
+const MQTT_TOPIC_CHUNK_PREFIX = 'device/firmware/chunk/';
+const MQTT_TOPIC_DATA_PREFIX = 'device/firmware/data/';
+const MQTT_DEFAULT_WINDOW = 4;
+const MQTT_MAX_WINDOW = 8;
+const MQTT_RETRANSMIT_MS = 8000;
+const MQTT_RETRANSMIT_LIMIT = 5;
+const mqttStreams = new Map();
+const mqttClients = new Map();
+
+// Raw firmware images, read once and shared by TCP, MQTT and compression. Entries
+// stay until a manifest rebuild finds their file changed (see FIRMWARE MANIFEST).
+const firmwareImages = new Map();
+
+// Persistent MD5/SHA-256 of every stored image, keyed by file name (see HASH INDEX)
+const HASH_INDEX_FILE = path.join(FIRMWARE_DIR, '.hash-index.json');
+const hashIndex = new Map();
+let hashIndexDirty = false;
+
+// Whole-image compression (raw deflate, small window so the device can inflate in a 4 KB ring)
+const COMPRESSION_WINDOW_BITS = 12;
+const COMPRESSION_LEVEL = 9;
+const REFERENCE_LINK_SPEED = 5 * 1024; // bytes/s, typical SIM800L GPRS downlink
+const compressedImages = new Map();
+const deltaPatches = new Map();
+const STREAM_FLAGS = { deflate: 2, delta: 6 };
+
 // Ensure firmware directory exists
 if (!fs.existsSync(FIRMWARE_DIR)) {
   fs.mkdirSync(FIRMWARE_DIR, { recursive: true });
 }
 
 // ======= CRC16 CALCULATION FOR LENGTH PREFIXING =======
+// CRC-16/MODBUS (reflected polynomial 0xA001), one table lookup per byte
+const CRC16_TABLE = new Uint16Array(256).map((_, n) => {
+  let crc = n;
+  for (let j = 0; j < 8; j++) {
+    crc = (crc & 1) ? (crc >>> 1) ^ 0xA001 : crc >>> 1;
+  }
+  return crc;
+});
+
 function calculateCRC16(data) {
   let crc = 0xFFFF;
   const buffer = Buffer.isBuffer(data) ? data : Buffer.from(data);
   
   for (let i = 0; i < buffer.length; i++) {
-    crc ^= buffer[i];
-    for (let j = 0; j < 8; j++) {
-      if (crc & 1) {
-        crc = (crc >> 1) ^ 0xA001;
-      } else {
-        crc >>= 1;
-      }
+    crc = (crc >>> 8) ^ CRC16_TABLE[(crc ^ buffer[i]) & 0xFF];
+  }
+  return crc;
+}
+
+// ======= CHUNK TABLE =======
+// Every stream served in chunks (raw image, deflated image, delta patch) is an
+// immutable buffer, cut into slices with their CRC16 for every supported chunk size
+// as soon as the stream is loaded or built. A request at an aligned offset is a table
+// lookup; any other offset or size gets a fresh slice and CRC. Tables hang off the
+// stream buffer, so they go when it does.
+const CHUNK_TABLE_SIZES = [];
+for (let size = MIN_CHUNK_SIZE; size <= TCP_MAX_CHUNK_SIZE; size *= 2) {
+  CHUNK_TABLE_SIZES.push(size); // The sizes adaptive chunk sizing can settle on
+}
+const chunkTables = new WeakMap(); // stream buffer -> Map(chunk size -> chunks)
+
+function makeChunk(data, offset, size) {
+  const chunk = data.subarray(offset, Math.min(offset + size, data.length));
+  return {
+    chunk: chunk,
+    crc: calculateCRC16(chunk),
+    actualSize: chunk.length,
+    totalSize: data.length
+  };
+}
+
+function buildChunkTables(data) {
+  const tables = new Map();
+  for (const size of CHUNK_TABLE_SIZES) {
+    const chunks = [];
+    for (let offset = 0; offset < data.length; offset += size) {
+      chunks.push(makeChunk(data, offset, size));
+    }
+    tables.set(size, chunks);
+  }
+  chunkTables.set(data, tables);
+  return tables;
+}
+
+function getChunkTable(data, size) {
+  return (chunkTables.get(data) || buildChunkTables(data)).get(size);
+}
+
+// ======= HASH INDEX =======
+// Hashes are computed once per image (at upload, or when a rebuild of the manifest
+// finds a new or changed file) and kept in a sidecar file next to the images, so a
+// restart or a listing never rehashes anything. An entry is valid for the size and
+// mtime it was computed at.
+function loadHashIndex() {
+  try {
+    const stored = JSON.parse(fs.readFileSync(HASH_INDEX_FILE, 'utf8'));
+    Object.entries(stored.images || {}).forEach(([name, entry]) => hashIndex.set(name, entry));
+    console.log(`🔑 Hash index: ${hashIndex.size} images from ${path.basename(HASH_INDEX_FILE)}`);
+  } catch (error) {
+    if (error.code !== 'ENOENT') {
+      console.warn(`⚠️ Hash index unreadable (${error.message}), rebuilding it`);
+    }
+  }
+}
+
+function saveHashIndex() {
+  if (!hashIndexDirty) {
+    return;
+  }
+  
+  // Written aside and renamed, so a crash never leaves a truncated index
+  const tmpFile = `${HASH_INDEX_FILE}.tmp`;
+  fs.writeFileSync(tmpFile, JSON.stringify({ images: Object.fromEntries(hashIndex) }, null, 2));
+  fs.renameSync(tmpFile, HASH_INDEX_FILE);
+  hashIndexDirty = false;
+}
+
+// Hashes of an image as it is on disk; `data` is only read when they must be computed
+function getImageHashes(name, stats, data = null) {
+  const entry = hashIndex.get(name);
+  if (entry && entry.size === stats.size && entry.mtimeMs === stats.mtimeMs) {
+    return entry;
+  }
+  
+  const buffer = data || fs.readFileSync(path.join(FIRMWARE_DIR, name));
+  const computed = {
+    size: stats.size,
+    mtimeMs: stats.mtimeMs,
+    md5: crypto.createHash('md5').update(buffer).digest('hex'),
+    sha256: crypto.createHash('sha256').update(buffer).digest('hex')
+  };
+  hashIndex.set(name, computed);
+  hashIndexDirty = true;
+  return computed;
+}
+
+function forgetImageHashes(name) {
+  hashIndexDirty = hashIndex.delete(name) || hashIndexDirty;
+}
+
+loadHashIndex();
+
+// ======= FIRMWARE IMAGE CACHE =======
+// Chunks of every transport are slices of this buffer instead of a file read each
+function getFirmwareImage(filePath) {
+  const cached = firmwareImages.get(filePath);
+  if (cached) {
+    return cached;
+  }
+  
+  const stats = fs.statSync(filePath);
+  const data = fs.readFileSync(filePath);
+  const hashes = getImageHashes(path.basename(filePath), stats, data);
+  saveHashIndex();
+  buildChunkTables(data);
+  
+  const entry = {
+    data: data,
+    size: data.length,
+    mtimeMs: stats.mtimeMs,
+    md5: hashes.md5,
+    sha256: hashes.sha256
+  };
+  firmwareImages.set(filePath, entry);
+  return entry;
+}
+
+// ======= WHOLE-IMAGE COMPRESSION =======
+// Each image is deflated once (per path/mtime) and chunks are served as slices of that stream
+function compressFirmwareImage(filePath, rawBuffer, mtimeMs) {
+  const startTime = Date.now();
+  const data = zlib.deflateRawSync(rawBuffer, {
+    level: COMPRESSION_LEVEL,
+    windowBits: COMPRESSION_WINDOW_BITS,
+    memLevel: 9
+  });
+  buildChunkTables(data);
+  
+  const entry = {
+    data: data,
+    rawSize: rawBuffer.length,
+    compressedSize: data.length,
+    mtimeMs: mtimeMs,
+    ratio: data.length / rawBuffer.length
+  };
+  compressedImages.set(filePath, entry);
+  
+  console.log(`🗜️ Precompressed ${path.basename(filePath)}: ${entry.rawSize} → ${entry.compressedSize} bytes (${(entry.ratio * 100).toFixed(1)}%) in ${Date.now() - startTime}ms`);
+  return entry;
+}
+
+function getCompressedImage(filePath) {
+  const image = getFirmwareImage(filePath);
+  const cached = compressedImages.get(filePath);
+  if (cached && cached.mtimeMs === image.mtimeMs && cached.rawSize === image.size) {
+    return cached;
+  }
+  return compressFirmwareImage(filePath, image.data, image.mtimeMs);
+}
+
+function findFirmwareByVersion(version) {
+  if (!version) {
+    return null;
+  }
+  return getFirmwareManifest().versions.get(version) || null;
+}
+
+// Delta patch (base -> target), deflated like full images and cached per mtime pair
+function getDeltaPatch(basePath, targetPath) {
+  const baseImage = getFirmwareImage(basePath);
+  const targetImage = getFirmwareImage(targetPath);
+  const key = `${basePath}@${baseImage.mtimeMs}->${targetPath}@${targetImage.mtimeMs}`;
+  
+  const cached = deltaPatches.get(key);
+  if (cached) {
+    return cached;
+  }
+  
+  const startTime = Date.now();
+  const base = baseImage.data;
+  const target = targetImage.data;
+  const patch = createPatch(base, target);
+  
+  if (!applyPatch(base, patch).equals(target)) {
+    throw new Error(`Delta self-check failed for ${path.basename(basePath)} -> ${path.basename(targetPath)}`);
+  }
+  
+  const data = zlib.deflateRawSync(patch, {
+    level: COMPRESSION_LEVEL,
+    windowBits: COMPRESSION_WINDOW_BITS,
+    memLevel: 9
+  });
+  buildChunkTables(data);
+  
+  const entry = {
+    key: key,
+    basePath: basePath,
+    targetPath: targetPath,
+    data: data,
+    patchSize: patch.length,
+    compressedSize: data.length,
+    baseSize: base.length,
+    baseMd5: baseImage.md5,
+    targetSize: target.length,
+    ratio: data.length / target.length
+  };
+  deltaPatches.set(key, entry);
+  
+  console.log(`🧬 Delta ${path.basename(basePath)} → ${path.basename(targetPath)}: ${entry.targetSize} → ${entry.compressedSize} bytes (${(entry.ratio * 100).toFixed(2)}%) in ${Date.now() - startTime}ms`);
+  return entry;
+}
+
+function dropCachedStreams(filePath) {
+  firmwareImages.delete(filePath);
+  compressedImages.delete(filePath);
+  for (let [key, entry] of deltaPatches.entries()) {
+    if (entry.basePath === filePath || entry.targetPath === filePath) {
+      deltaPatches.delete(key);
     }
   }
-  return crc & 0xFFFF;
+}
+
+function getCompressionReport() {
+  return fs.readdirSync(FIRMWARE_DIR)
+    .filter(file => file.endsWith('.bin'))
+    .map(file => {
+      const image = getCompressedImage(path.join(FIRMWARE_DIR, file));
+      return {
+        name: file,
+        rawBytes: image.rawSize,
+        compressedBytes: image.compressedSize,
+        ratio: Number(image.ratio.toFixed(3)),
+        rawTransferSeconds: Number((image.rawSize / REFERENCE_LINK_SPEED).toFixed(1)),
+        compressedTransferSeconds: Number((image.compressedSize / REFERENCE_LINK_SPEED).toFixed(1))
+      };
+    });
+}
+
+// Patch size from every other stored image to the latest one
+async function getDeltaReport() {
+  const latest = await getLatestFirmwareInfo();
+  if (!latest) {
+    return [];
+  }
+  
+  return fs.readdirSync(FIRMWARE_DIR)
+    .filter(file => file.endsWith('.bin') && file !== latest.name)
+    .map(file => {
+      const delta = getDeltaPatch(path.join(FIRMWARE_DIR, file), latest.path);
+      return {
+        from: file,
+        to: latest.name,
+        rawBytes: delta.targetSize,
+        deflateBytes: getCompressedImage(latest.path).compressedSize,
+        deltaBytes: delta.compressedSize,
+        ratio: Number(delta.ratio.toFixed(4)),
+        deltaTransferSeconds: Number((delta.compressedSize / REFERENCE_LINK_SPEED).toFixed(1))
+      };
+    });
 }
 
 // ======= ENHANCED TCP SERVER IMPLEMENTATION =======
@@ -70,36 +376,26 @@ const tcpServer = net.createServer((socket) => {
     connectedAt: Date.now(),
     lastActivity: Date.now(),
     chunksRequested: 0,
+    downloadsInFlight: 0, // Download requests received and not answered yet
     bytesTransferred: 0,
     currentSession: null
   });
   
   socket.setTimeout(CONNECTION_TIMEOUT);
-  let dataBuffer = Buffer.alloc(0);
+  const decoder = new FrameDecoder(TCP_MAX_FRAME);
+  const onFrame = (kind, payload) => {
+    handleTcpRequest(socket, kind === FRAME_LINE ? payload.toString() : payload, clientId);
+  };
   
   socket.on('data', (data) => {
     updateLastActivity(clientId);
-    dataBuffer = Buffer.concat([dataBuffer, data]);
     
-    // Process complete messages (ended with newline)
-    let messages = [];
-    let startIndex = 0;
-    
-    for (let i = 0; i < dataBuffer.length; i++) {
-      if (dataBuffer[i] === 0x0A) { // newline
-        const messageBuffer = dataBuffer.slice(startIndex, i);
-        messages.push(messageBuffer.toString().trim());
-        startIndex = i + 1;
-      }
+    // JSON lines and binary frames, handled straight out of the packet
+    if (!decoder.push(data, onFrame)) {
+      console.warn(`🚫 Request frame over ${TCP_MAX_FRAME} bytes from ${clientId}, closing`);
+      performanceMetrics.tcpFrameOverflows++;
+      socket.destroy();
     }
-    
-    dataBuffer = dataBuffer.slice(startIndex);
-    
-    messages.forEach(message => {
-      if (message.length > 0) {
-        handleTcpRequest(socket, message, clientId);
-      }
-    });
   });
   
   socket.on('close', () => {
@@ -134,17 +430,52 @@ function cleanupConnection(clientId) {
     if (session) {
       session.interrupted = true;
       session.interruptedAt = Date.now();
+      // Lost mid-transfer, not a device hanging up after its last chunk
+      if (!session.completed && session.lastOffset < (session.streamSize || session.firmwareInfo.size)) {
+        recordStall(session, 'connection lost');
+        session.transport.lastRequestAt = 0; // A gap across a reconnect says nothing about the link
+      }
     }
   }
   deviceConnections.delete(clientId);
 }
 
+// Binary request frame (lib/framing.js), a compact alternative to the JSON line for
+// the download loop: 0x01 | offset u32 BE | size u16 BE | encoding u8 | session ID.
+// Encodings are 0 identity, 1 deflate, 2 delta; the device is the session's.
+const BINARY_REQUEST_DOWNLOAD = 0x01;
+const BINARY_DOWNLOAD_HEADER = 8;
+const BINARY_ENCODINGS = ['identity', 'deflate', 'delta'];
+
+function decodeBinaryRequest(payload) {
+  if (payload.length <= BINARY_DOWNLOAD_HEADER || payload[0] !== BINARY_REQUEST_DOWNLOAD) {
+    throw new Error(`Unknown binary request: ${payload.length ? payload[0] : 'empty'}`);
+  }
+  
+  const encoding = BINARY_ENCODINGS[payload[7]];
+  if (!encoding) {
+    throw new Error(`Unknown encoding: ${payload[7]}`);
+  }
+  
+  const sessionId = payload.toString('latin1', BINARY_DOWNLOAD_HEADER);
+  const session = activeSessions.get(sessionId);
+  return {
+    device: session ? session.deviceId : undefined,
+    action: 'download',
+    offset: payload.readUInt32BE(1),
+    size: payload.readUInt16BE(5),
+    encoding,
+    sessionId
+  };
+}
+
 // Enhanced request handler
 async function handleTcpRequest(socket, message, clientId) {
   const startTime = Date.now();
   
   try {
-    const request = JSON.parse(message);
+    // A binary payload is a view into the receive buffer: decoded before anything awaits
+    const request = typeof message === 'string' ? JSON.parse(message) : decodeBinaryRequest(message);
     const deviceId = request.device || 'unknown';
     const action = request.action;
     
@@ -192,6 +523,11 @@ async function handleTcpRequest(socket, message, clientId) {
 // Enhanced firmware check with session management
 async function handleFirmwareCheck(socket, deviceId, request, clientId) {
   try {
+    // Nothing changed since the device last looked: answer in a few bytes
+    if (await isManifestUnchanged(request.token)) {
+      return sendTcpResponse(socket, { nm: 1 });
+    }
+    
     const firmwareInfo = await getLatestFirmwareInfo();
     
     if (!firmwareInfo) {
@@ -202,45 +538,22 @@ async function handleFirmwareCheck(socket, deviceId, request, clientId) {
       });
     }
     
-    // Check if there's an existing session for this device
-    let existingSession = null;
-    for (let [sessionId, session] of activeSessions.entries()) {
-      if (session.deviceId === deviceId && !session.completed) {
-        existingSession = { sessionId, session };
-        break;
-      }
+    // A device already on this version gets the manifest and no session
+    const upToDate = request.version && !isNewerVersion(firmwareInfo.version, request.version);
+    if (upToDate) {
+      console.log(`✅ Firmware check for ${deviceId}: already on v${firmwareInfo.version}`);
+      return sendTcpResponse(socket, {
+        status: 'success',
+        version: firmwareInfo.version,
+        name: firmwareInfo.name,
+        size: firmwareInfo.size,
+        md5: firmwareInfo.md5,
+        sha256: firmwareInfo.sha256,
+        token: firmwareInfo.token
+      });
     }
     
-    let sessionId, session;
-    
-    if (existingSession && existingSession.session.firmwareInfo.version === firmwareInfo.version) {
-      // Resume existing session
-      sessionId = existingSession.sessionId;
-      session = existingSession.session;
-      session.interrupted = false;
-      console.log(`🔄 Resuming existing session for ${deviceId}: ${sessionId}`);
-    } else {
-      // Create new session
-      sessionId = generateSessionId();
-      sessionId = sessionId.substring(0, 16); // Shorter session ID
-      
-      session = {
-        sessionId,
-        clientId,
-        deviceId,
-        firmwareInfo,
-        startTime: Date.now(),
-        chunks: new Map(),
-        totalChunks: Math.ceil(firmwareInfo.size / DEFAULT_CHUNK_SIZE),
-        downloadedChunks: 0,
-        lastOffset: 0,
-        completed: false,
-        interrupted: false
-      };
-      
-      activeSessions.set(sessionId, session);
-      console.log(`✨ Created new session for ${deviceId}: ${sessionId}`);
-    }
+    const { sessionId, session } = findOrCreateSession(deviceId, firmwareInfo, clientId);
     
     // Update connection session
     const connection = deviceConnections.get(clientId);
@@ -248,6 +561,11 @@ async function handleFirmwareCheck(socket, deviceId, request, clientId) {
       connection.currentSession = sessionId;
     }
     
+    // Offer a delta when we hold the image the device says it is running. Patches are
+    // built with the manifest; one still being built is simply not offered yet.
+    const basePath = findFirmwareByVersion(request.version);
+    session.delta = (basePath && getFirmwareManifest().deltas.get(basePath)) || null;
+    
     const response = {
       status: 'success',
       version: firmwareInfo.version,
@@ -256,11 +574,21 @@ async function handleFirmwareCheck(socket, deviceId, request, clientId) {
       md5: firmwareInfo.md5,
       sha256: firmwareInfo.sha256,
       sessionId: sessionId,
+      token: firmwareInfo.token,
       chunkSize: DEFAULT_CHUNK_SIZE,
       totalChunks: session.totalChunks,
       resumeOffset: session.lastOffset,
       downloadedChunks: session.downloadedChunks,
       compressionSupported: true,
+      encoding: 'deflate',
+      windowBits: COMPRESSION_WINDOW_BITS,
+      compressedSize: getCompressedImage(firmwareInfo.path).compressedSize,
+      ...(session.delta && {
+        deltaFrom: request.version,
+        deltaSize: session.delta.compressedSize,
+        deltaBaseSize: session.delta.baseSize,
+        deltaBaseMd5: session.delta.baseMd5
+      }),
       // Add HTTP download URL
       httpDownloadUrl: `http://localhost:${PORT}/api/firmware/download/${firmwareInfo.name}`
     };
@@ -278,13 +606,139 @@ async function handleFirmwareCheck(socket, deviceId, request, clientId) {
   }
 }
 
+// Session for this device and image, shared by the TCP and MQTT servers
+function findOrCreateSession(deviceId, firmwareInfo, clientId) {
+  // Check if there's an existing session for this device
+  let existingSession = null;
+  for (let [sessionId, session] of activeSessions.entries()) {
+    if (session.deviceId === deviceId && !session.completed) {
+      existingSession = { sessionId, session };
+      break;
+    }
+  }
+  
+  if (existingSession && existingSession.session.firmwareInfo.version === firmwareInfo.version) {
+    // Resume existing session
+    existingSession.session.interrupted = false;
+    existingSession.session.clientId = clientId;
+    console.log(`🔄 Resuming existing session for ${deviceId}: ${existingSession.sessionId}`);
+    return existingSession;
+  }
+  
+  // Create new session
+  const sessionId = generateSessionId().substring(0, 16); // Shorter session ID
+  const session = {
+    sessionId,
+    clientId,
+    deviceId,
+    firmwareInfo,
+    startTime: Date.now(),
+    chunks: new Map(),
+    totalChunks: Math.ceil(firmwareInfo.size / DEFAULT_CHUNK_SIZE),
+    downloadedChunks: 0,
+    lastOffset: 0,
+    completed: false,
+    interrupted: false,
+    transport: createTransportState()
+  };
+  
+  activeSessions.set(sessionId, session);
+  console.log(`✨ Created new session for ${deviceId}: ${sessionId}`);
+  return { sessionId, session };
+}
+
+// ======= PER-DEVICE TRANSPORT STATE =======
+// Kept on the session, so it follows the device across reconnects and resumes.
+// Every download request is a sample: the gap since the previous one is smoothed
+// like an RTT, and gives the bytes/s the device actually took the last chunk at.
+// A stall (the same offset asked again, a gap far beyond the smoothed one, or
+// the connection lost mid-transfer) halves this device's chunk size; a run of
+// clean chunks doubles it back. A device never gets more than it asks for.
+function createTransportState() {
+  return {
+    chunkSize: TCP_MAX_CHUNK_SIZE,
+    gapMs: 0,
+    bytesPerSecond: 0,
+    stalls: 0,
+    cleanChunks: 0,
+    lastRequestAt: 0,
+    lastOffset: -1,
+    lastBytes: 0,
+    nextSendAt: 0
+  };
+}
+
+function recordStall(session, reason) {
+  const transport = session.transport;
+  transport.stalls++;
+  transport.cleanChunks = 0;
+  if (transport.chunkSize > MIN_CHUNK_SIZE) {
+    transport.chunkSize = Math.max(MIN_CHUNK_SIZE, transport.chunkSize / 2);
+    console.log(`📉 Reducing chunk size for ${session.deviceId} to ${transport.chunkSize} (${reason})`);
+  }
+}
+
+function observeDownloadRequest(session, offset, now) {
+  const transport = session.transport;
+  
+  if (transport.lastRequestAt) {
+    const gap = now - transport.lastRequestAt;
+    if (offset === transport.lastOffset) {
+      recordStall(session, 'chunk requested again');
+    } else if (transport.gapMs && gap > Math.max(STALL_MIN_GAP_MS, STALL_GAP_FACTOR * transport.gapMs)) {
+      recordStall(session, `${gap}ms gap`);
+    } else {
+      // A gap far below the smoothed one is a pipelined burst, not the link
+      if (gap > 0 && !(transport.gapMs && gap < transport.gapMs / STALL_GAP_FACTOR)) {
+        const rate = transport.lastBytes * 1000 / gap;
+        transport.gapMs = transport.gapMs ? transport.gapMs + (gap - transport.gapMs) / 8 : gap;
+        transport.bytesPerSecond = transport.bytesPerSecond ? transport.bytesPerSecond + (rate - transport.bytesPerSecond) / 8 : rate;
+      }
+      
+      if (++transport.cleanChunks >= CHUNK_GROW_AFTER && transport.chunkSize < TCP_MAX_CHUNK_SIZE) {
+        transport.chunkSize *= 2;
+        transport.cleanChunks = 0;
+        console.log(`📈 Raising chunk size for ${session.deviceId} to ${transport.chunkSize}`);
+      }
+    }
+  }
+  
+  transport.lastRequestAt = now;
+  transport.lastOffset = offset;
+}
+
+// Once a device has stalled, chunks it requested back to back are spaced at a little
+// over the rate it has been achieving. A request that is the only one in flight on
+// its connection is never held back: its device is already waiting on each answer.
+function pacingDelay(session, bytes, now, inFlight) {
+  const transport = session.transport;
+  if (!transport.stalls || !transport.bytesPerSecond) {
+    return 0;
+  }
+  
+  const spacing = bytes * 1000 / (transport.bytesPerSecond * PACING_GAIN);
+  if (inFlight <= 1) {
+    transport.nextSendAt = now + spacing;
+    return 0;
+  }
+  
+  const delay = Math.min(transport.nextSendAt - now, PACING_MAX_DELAY);
+  transport.nextSendAt = Math.max(now, transport.nextSendAt) + spacing;
+  return Math.max(0, delay);
+}
+
 // Enhanced firmware download with length prefixing
 async function handleFirmwareDownload(socket, deviceId, request, clientId) {
+  const connection = deviceConnections.get(clientId);
+  if (connection) {
+    connection.downloadsInFlight++;
+  }
+  
   try {
     const offset = request.offset || 0;
     let chunkSize = request.size || DEFAULT_CHUNK_SIZE;
     const sessionId = request.sessionId;
-    const useCompression = request.compression || false;
+    const encoding = request.encoding || 'identity';
     
     // Validate session
     const session = activeSessions.get(sessionId);
@@ -296,20 +750,30 @@ async function handleFirmwareDownload(socket, deviceId, request, clientId) {
       });
     }
     
-    // Adaptive chunk sizing
-    const connection = deviceConnections.get(clientId);
-    if (connection && connection.chunksRequested > 5) {
-      const errorRate = (performanceMetrics.retryCount / connection.chunksRequested);
-      if (errorRate > 0.15) { // Lower threshold for mobile networks
-        chunkSize = Math.max(MIN_CHUNK_SIZE, chunkSize / 2);
-        console.log(`📉 Reducing chunk size to ${chunkSize} due to error rate: ${(errorRate*100).toFixed(1)}%`);
-      }
-    }
+    // Adaptive chunk sizing, from this device's own transport state
+    const requestedAt = Date.now();
+    observeDownloadRequest(session, offset, requestedAt);
     
-    chunkSize = Math.min(chunkSize, MAX_CHUNK_SIZE);
+    chunkSize = Math.min(chunkSize, session.transport.chunkSize);
     chunkSize = Math.max(chunkSize, MIN_CHUNK_SIZE);
     
-    const firmwareData = await getFirmwareChunk(session.firmwareInfo.path, offset, chunkSize);
+    if (encoding === 'delta' && !session.delta) {
+      return sendTcpResponse(socket, {
+        status: 'error',
+        message: 'No delta available for this session',
+        code: 'NO_DELTA'
+      });
+    }
+    
+    // Deflate/delta offsets address the precompressed stream, not the raw image
+    let firmwareData;
+    if (encoding === 'delta') {
+      firmwareData = getStreamChunk(session.delta.data, offset, chunkSize);
+    } else if (encoding === 'deflate') {
+      firmwareData = getStreamChunk(getCompressedImage(session.firmwareInfo.path).data, offset, chunkSize);
+    } else {
+      firmwareData = getStreamChunk(getFirmwareImage(session.firmwareInfo.path).data, offset, chunkSize);
+    }
     
     if (!firmwareData) {
       return sendTcpResponse(socket, {
@@ -319,32 +783,16 @@ async function handleFirmwareDownload(socket, deviceId, request, clientId) {
       });
     }
     
-    // Calculate data CRC16 for integrity
-    const dataCrc16 = calculateCRC16(firmwareData.chunk);
-    
-    // Optional compression
-    let finalChunk = firmwareData.chunk;
-    let compressed = false;
-    
-    if (useCompression && firmwareData.chunk.length > 100) {
-      try {
-        const compressedChunk = zlib.gzipSync(firmwareData.chunk);
-        if (compressedChunk.length < firmwareData.chunk.length * 0.85) {
-          finalChunk = compressedChunk;
-          compressed = true;
-          console.log(`🗜️ Compressed ${firmwareData.chunk.length} → ${compressedChunk.length} bytes`);
-        }
-      } catch (compError) {
-        console.warn('Compression failed, using uncompressed data');
-      }
-    }
+    // Data CRC16 for integrity, precomputed with the chunk
+    const dataCrc16 = firmwareData.crc;
+    const finalChunk = firmwareData.chunk;
     
     // OPTIMIZED HEADER - Length Prefixing Approach
     const minimalHeader = {
       s: finalChunk.length,           // Size (length prefixing!)
       o: offset,                      // Offset
-      c: dataCrc16,                   // CRC16 of original data
-      f: compressed ? 1 : 0,          // Flags (compressed bit)
+      c: dataCrc16,                   // CRC16 of the bytes on the wire
+      f: STREAM_FLAGS[encoding] || 0, // Flags (bit 1: deflate stream, bit 2: delta patch)
       p: Math.floor(((offset + firmwareData.actualSize) / firmwareData.totalSize) * 100),
       id: session.totalChunks > 255 ? Math.floor(offset / DEFAULT_CHUNK_SIZE) : Math.floor(offset / DEFAULT_CHUNK_SIZE) & 0xFF // Chunk ID
     };
@@ -354,15 +802,25 @@ async function handleFirmwareDownload(socket, deviceId, request, clientId) {
     const headerCrc16 = calculateCRC16(headerString);
     minimalHeader.h = headerCrc16;
     
+    // Offsets of different encodings are not comparable, so restart progress on a switch
+    if (session.encoding && session.encoding !== encoding) {
+      session.chunks.clear();
+      session.downloadedChunks = 0;
+      session.lastOffset = 0;
+    }
+    
     // Update session progress
     session.chunks.set(offset, {
       offset,
       size: firmwareData.actualSize,
       crc: dataCrc16,
-      timestamp: Date.now()
+      timestamp: requestedAt
     });
+    session.transport.lastBytes = firmwareData.actualSize;
     session.downloadedChunks++;
     session.lastOffset = Math.max(session.lastOffset, offset + firmwareData.actualSize);
+    session.encoding = encoding;
+    session.streamSize = firmwareData.totalSize;
     
     // Update connection stats
     if (connection) {
@@ -372,7 +830,19 @@ async function handleFirmwareDownload(socket, deviceId, request, clientId) {
     performanceMetrics.chunksServed++;
     performanceMetrics.tcpDownloads++;
     
-    console.log(`📦 Chunk: offset=${offset}, size=${firmwareData.actualSize}→${finalChunk.length}, crc=${dataCrc16}, comp=${compressed}, prog=${minimalHeader.p}%`);
+    console.log(`📦 Chunk: offset=${offset}, size=${firmwareData.actualSize}, crc=${dataCrc16}, enc=${session.encoding}, prog=${minimalHeader.p}%`);
+    
+    if (offset + firmwareData.actualSize >= firmwareData.totalSize) {
+      const elapsed = Date.now() - session.startTime;
+      const rawSize = session.firmwareInfo.size;
+      console.log(`📊 Transfer finished for ${deviceId}: ${firmwareData.totalSize} wire bytes for ${rawSize} image bytes (${((1 - firmwareData.totalSize / rawSize) * 100).toFixed(1)}% saved) in ${elapsed}ms`);
+    }
+    
+    const delay = pacingDelay(session, firmwareData.actualSize, requestedAt,
+                              connection ? connection.downloadsInFlight : 1);
+    if (delay > 0) {
+      await new Promise(resolve => setTimeout(resolve, delay));
+    }
     
     // Send response with LENGTH PREFIXED binary data
     await sendTcpResponseWithLengthPrefix(socket, minimalHeader, finalChunk);
@@ -386,6 +856,10 @@ async function handleFirmwareDownload(socket, deviceId, request, clientId) {
       code: 'DOWNLOAD_ERROR',
       retryable: true
     });
+  } finally {
+    if (connection) {
+      connection.downloadsInFlight--;
+    }
   }
 }
 
@@ -441,7 +915,6 @@ async function handleFirmwareVerify(socket, deviceId, request, clientId) {
   try {
     const sessionId = request.sessionId;
     const clientHash = request.hash;
-    const hashType = request.hashType || 'md5';
     
     const session = activeSessions.get(sessionId);
     if (!session) {
@@ -452,189 +925,1516 @@ async function handleFirmwareVerify(socket, deviceId, request, clientId) {
       });
     }
     
-    const expectedHash = hashType === 'sha256' ? 
-      session.firmwareInfo.sha256 : session.firmwareInfo.md5;
+    if (!clientHash) {
+      return sendTcpResponse(socket, {
+        status: 'error',
+        message: 'Missing hash',
+        code: 'MISSING_PARAMETERS'
+      });
+    }
     
-    const isValid = clientHash.toLowerCase() === expectedHash.toLowerCase();
+    await sendTcpResponse(socket, verifySession(session, deviceId, request));
     
-    const response = {
-      status: 'success',
-      verified: isValid,
-      expectedHash: expectedHash,
-      receivedHash: clientHash,
-      hashType: hashType,
-      message: isValid ? 'Firmware integrity verified' : 'Hash mismatch detected'
-    };
+  } catch (error) {
+    console.error('Error in firmware verification:', error);
+    await sendTcpResponse(socket, {
+      status: 'error',
+      message: 'Verification failed',
+      code: 'VERIFY_ERROR'
+    });
+  }
+}
+
+// Hash check shared by the TCP and MQTT verify requests. Only a matching hash
+// completes a session (and counts as a successful download); a mismatch leaves it
+// open for the device to download again.
+function verifySession(session, deviceId, request) {
+  const clientHash = request.hash;
+  const hashType = request.hashType || 'md5';
+  const expectedHash = hashType === 'sha256' ? 
+    session.firmwareInfo.sha256 : session.firmwareInfo.md5;
+  
+  const isValid = clientHash.toLowerCase() === expectedHash.toLowerCase();
+  
+  // End-to-end timing: server-side session age plus the device's own download time
+  const sessionMs = Date.now() - session.startTime;
+  const deviceMs = request.elapsed || sessionMs;
+  const wireBytes = request.bytes || session.streamSize || session.firmwareInfo.size;
+  session.verifiedAt = Date.now();
+  session.transferMs = deviceMs;
+  
+  if (isValid) {
+    session.completed = true;
+    performanceMetrics.successfulDownloads++;
     
-    if (isValid) {
-      session.completed = true;
-      performanceMetrics.successfulDownloads++;
-      console.log(`✅ Firmware verification successful for ${deviceId} (${hashType.toUpperCase()})`);
-    } else {
-      performanceMetrics.failedDownloads++;
-      console.log(`❌ Firmware verification failed for ${deviceId} (${hashType.toUpperCase()})`);
+    const speed = wireBytes / Math.max(deviceMs / 1000, 0.001);
+    performanceMetrics.averageSpeed = Math.round(
+      performanceMetrics.averageSpeed + (speed - performanceMetrics.averageSpeed) / performanceMetrics.successfulDownloads
+    );
+    
+    console.log(`✅ Firmware verification successful for ${deviceId} (${hashType.toUpperCase()}): ${wireBytes} bytes in ${deviceMs}ms on device, ${sessionMs}ms session, ${Math.round(speed)} B/s`);
+  } else {
+    performanceMetrics.failedDownloads++;
+    console.log(`❌ Firmware verification failed for ${deviceId} (${hashType.toUpperCase()})`);
+  }
+  
+  return {
+    status: 'success',
+    verified: isValid,
+    expectedHash: expectedHash,
+    receivedHash: clientHash,
+    hashType: hashType,
+    message: isValid ? 'Firmware integrity verified' : 'Hash mismatch detected'
+  };
+}
+
+// ======= FIRMWARE MANIFEST =======
+// Every check (TCP, MQTT, CoAP, HTTP), the listing and the download/verify hash
+// headers are answered from an in-memory manifest of the stored images, so they cost
+// no disk I/O or hashing. fs.watch on the firmware directory and the upload/delete
+// endpoints drop it; the next request (or the upload itself) rebuilds it, statting
+// each image and hashing only those the hash index has no entry for at their current
+// size and mtime. The token (ETag) for conditional checks is the first 8 hex digits
+// of the MD5. Each manifest then builds the delta patches from every stored version
+// to the latest in the background (manifest.deltas), so a check only looks one up.
+const MANIFEST_UNWATCHED_TTL = 60000; // ms; rebuild interval if the directory can't be watched
+let firmwareManifest = null;
+let firmwareManifestBuiltAt = 0;
+let firmwareWatcher = null;
+
+function buildFirmwareManifest() {
+  const files = fs.readdirSync(FIRMWARE_DIR)
+    .filter(file => file.endsWith('.bin'))
+    .map(file => {
+      const filePath = path.join(FIRMWARE_DIR, file);
+      const stats = fs.statSync(filePath);
+      const versionMatch = file.match(/_v(\d+\.\d+\.\d+)\.bin$/);
+      const hashes = getImageHashes(file, stats);
+      return {
+        name: file,
+        path: filePath,
+        version: versionMatch ? versionMatch[1] : null,
+        size: stats.size,
+        mtime: stats.mtime,
+        mtimeMs: stats.mtimeMs,
+        md5: hashes.md5,
+        sha256: hashes.sha256
+      };
+    })
+    .sort((a, b) => b.mtime - a.mtime);
+  
+  // Images that went away leave the index too
+  for (const name of hashIndex.keys()) {
+    if (!files.some(file => file.name === name)) {
+      forgetImageHashes(name);
+    }
+  }
+  saveHashIndex();
+  
+  // Cached images (and their deflated/delta streams) whose file changed or went away
+  const onDisk = new Map(files.map(file => [file.path, file]));
+  for (const filePath of new Set([...firmwareImages.keys(), ...compressedImages.keys()])) {
+    const file = onDisk.get(filePath);
+    const image = firmwareImages.get(filePath);
+    const compressed = compressedImages.get(filePath);
+    const stale = (entry, size) => entry && (file.mtimeMs !== entry.mtimeMs || file.size !== size);
+    if (!file || stale(image, image && image.size) || stale(compressed, compressed && compressed.rawSize)) {
+      dropCachedStreams(filePath);
+    }
+  }
+  
+  performanceMetrics.manifestBuilds++;
+  
+  // Oldest first, so the newest file wins when two carry the same version
+  const versions = new Map(files.filter(file => file.version).reverse().map(file => [file.version, file.path]));
+  const images = new Map(files.map(file => [file.name, file]));
+  const deltas = new Map(); // base image path -> patch to latest, filled by buildDeltaPatches()
+  if (files.length === 0) {
+    return { latest: null, versions, images, files, deltas };
+  }
+  
+  const latestFirmware = files[0];
+  const image = getFirmwareImage(latestFirmware.path);
+  
+  return {
+    latest: {
+      name: latestFirmware.name,
+      path: latestFirmware.path,
+      version: latestFirmware.version || '1.0.0',
+      size: image.size,
+      md5: image.md5,
+      sha256: image.sha256,
+      mtime: latestFirmware.mtime,
+      token: image.md5.substring(0, 8)
+    },
+    versions,
+    images,
+    files,
+    deltas
+  };
+}
+
+// One patch per event-loop turn, so requests keep flowing in between. Only patches
+// smaller than the deflated image are offered. A newer manifest abandons the work.
+function buildDeltaPatches(manifest) {
+  if (!manifest.latest) {
+    return;
+  }
+  const target = manifest.latest.path;
+  const bases = [...manifest.versions.values()].filter(basePath => basePath !== target);
+  
+  const next = () => {
+    if (firmwareManifest !== manifest || bases.length === 0) {
+      return;
+    }
+    const basePath = bases.shift();
+    try {
+      const delta = getDeltaPatch(basePath, target);
+      if (delta.compressedSize < getCompressedImage(target).compressedSize) {
+        manifest.deltas.set(basePath, delta);
+      }
+    } catch (error) {
+      console.warn(`Delta ${path.basename(basePath)} → ${path.basename(target)} unavailable: ${error.message}`);
+    }
+    setImmediate(next);
+  };
+  setImmediate(next);
+}
+
+function getFirmwareManifest() {
+  const expired = !firmwareWatcher && Date.now() - firmwareManifestBuiltAt > MANIFEST_UNWATCHED_TTL;
+  if (!firmwareManifest || expired) {
+    firmwareManifest = buildFirmwareManifest();
+    firmwareManifestBuiltAt = Date.now();
+    buildDeltaPatches(firmwareManifest);
+  }
+  return firmwareManifest;
+}
+
+async function getLatestFirmwareInfo() {
+  try {
+    return getFirmwareManifest().latest;
+  } catch (error) {
+    console.error('Error getting firmware info:', error);
+    return null;
+  }
+}
+
+// Stored image by file name, with its hashes (null if there is no such image)
+function getStoredImage(name) {
+  return getFirmwareManifest().images.get(name) || null;
+}
+
+function invalidateFirmwareManifest() {
+  firmwareManifest = null;
+}
+
+function watchFirmwareDir() {
+  const unwatched = (error) => {
+    console.warn(`⚠️ Not watching ${FIRMWARE_DIR} (${error.message}), manifest rebuilt every ${MANIFEST_UNWATCHED_TTL / 1000}s`);
+    firmwareWatcher = null;
+  };
+  
+  try {
+    // Writes of the hash index itself are not a firmware change
+    firmwareWatcher = fs.watch(FIRMWARE_DIR, (event, filename) => {
+      if (!filename || filename.endsWith('.bin')) {
+        invalidateFirmwareManifest();
+      }
+    });
+    firmwareWatcher.on('error', (error) => {
+      firmwareWatcher.close();
+      unwatched(error);
+    });
+  } catch (error) {
+    unwatched(error);
+  }
+}
+
+watchFirmwareDir();
+
+// True when the device already holds the current manifest
+async function isManifestUnchanged(deviceToken) {
+  performanceMetrics.checks++;
+  const latest = await getLatestFirmwareInfo();
+  if (!deviceToken || !latest || deviceToken !== latest.token) {
+    return false;
+  }
+  
+  performanceMetrics.notModifiedChecks++;
+  return true;
+}
+
+// Zero-copy slice of an in-memory stream (raw image, deflated image or delta patch),
+// with its CRC16. Shared with the chunk table: callers must not modify it.
+function getStreamChunk(data, offset, requestedSize) {
+  if (offset >= data.length) {
+    console.error(`Invalid offset: ${offset}, stream size: ${data.length}`);
+    return null;
+  }
+  
+  if (offset % requestedSize === 0 && CHUNK_TABLE_SIZES.includes(requestedSize)) {
+    return getChunkTable(data, requestedSize)[offset / requestedSize];
+  }
+  return makeChunk(data, offset, requestedSize);
+}
+
+// Standard JSON response
+async function sendTcpResponse(socket, responseObject) {
+  return new Promise((resolve, reject) => {
+    try {
+      const responseStr = JSON.stringify(responseObject) + '\n';
+      socket.write(responseStr, (err) => {
+        if (err) {
+          console.error('Error sending TCP response:', err);
+          reject(err);
+        } else {
+          resolve();
+        }
+      });
+    } catch (error) {
+      console.error('Error creating TCP response:', error);
+      reject(error);
+    }
+  });
+}
+
+// NEW: Length-prefixed binary response
+async function sendTcpResponseWithLengthPrefix(socket, header, binaryData) {
+  return new Promise((resolve, reject) => {
+    try {
+      // The header already contains 's' field with binary data length
+      // ESP32 will read exactly header.s bytes after parsing JSON
+      const headerStr = JSON.stringify(header) + '\n';
+      
+      // Header and data leave in one writev; the data is the cached slice, never copied
+      socket.cork();
+      socket.write(headerStr);
+      socket.write(binaryData, (err) => {
+        if (err) {
+          console.error('Error sending length-prefixed response:', err);
+          reject(err);
+        } else {
+          resolve();
+        }
+      });
+      socket.uncork();
+    } catch (error) {
+      console.error('Error creating length-prefixed response:', error);
+      reject(error);
+    }
+  });
+}
+
+function generateSessionId() {
+  return crypto.randomBytes(8).toString('hex'); // Shorter session IDs
+}
+
+// Enhanced session cleanup
+setInterval(() => {
+  const now = Date.now();
+  const SESSION_TIMEOUT = 45 * 60 * 1000; // 45 minutes
+  const INTERRUPTED_TIMEOUT = 10 * 60 * 1000; // 10 minutes for interrupted sessions
+  
+  for (let [sessionId, session] of activeSessions.entries()) {
+    const age = now - session.startTime;
+    const shouldCleanup = session.completed || 
+      (session.interrupted && (now - session.interruptedAt) > INTERRUPTED_TIMEOUT) ||
+      age > SESSION_TIMEOUT;
+    
+    if (shouldCleanup) {
+      console.log(`🧹 Cleaning up session: ${sessionId} (${session.completed ? 'completed' : session.interrupted ? 'interrupted' : 'expired'})`);
+      activeSessions.delete(sessionId);
+    }
+  }
+}, 5 * 60 * 1000);
+
+// ======= MQTT FOTA (EMBEDDED AEDES BROKER) =======
+const broker = require('aedes')();
+const mqttServer = net.createServer(broker.handle);
+
+broker.on('client', (client) => {
+  getMqttClientStats(client.id);
+});
+
+broker.on('publish', (packet, client) => {
+  if (!client || packet.topic !== MQTT_TOPIC_REQUEST) {
+    return;
+  }
+  handleMqttRequest(client, packet.payload.toString());
+});
+
+// PUBACK from the device for one of our QoS 1 chunks
+broker.on('ack', (packet, client) => {
+  if (packet && packet.topic && packet.topic.startsWith(MQTT_TOPIC_CHUNK_PREFIX)) {
+    handleChunkAck(packet);
+  }
+});
+
+broker.on('clientDisconnect', (client) => {
+  mqttClients.delete(client.id);
+  for (const [deviceId, stream] of mqttStreams.entries()) {
+    if (stream.clientId === client.id) {
+      // The device asks again with its own offset after reconnecting
+      stream.session.interrupted = true;
+      stream.session.interruptedAt = Date.now();
+      mqttStreams.delete(deviceId);
+      console.log(`🔌 MQTT stream paused for ${deviceId} at ${stream.session.lastOffset}`);
+    }
+  }
+});
+
+// Per-client counters for /api/metrics, dropped when the client disconnects
+function getMqttClientStats(clientId) {
+  let stats = mqttClients.get(clientId);
+  if (!stats) {
+    stats = {
+      clientId: clientId,
+      deviceId: null,
+      connectedAt: Date.now(),
+      lastActivity: Date.now(),
+      requests: 0,
+      checks: 0,
+      notModified: 0,
+      chunksServed: 0,
+      bytesServed: 0,
+      chunksAcked: 0,
+      retransmits: 0,
+      errors: 0
+    };
+    mqttClients.set(clientId, stats);
+  }
+  stats.lastActivity = Date.now();
+  return stats;
+}
+
+function publishMqtt(topic, payload, qos = 0) {
+  return new Promise((resolve) => {
+    broker.publish({ cmd: 'publish', topic, payload, qos, retain: false, dup: false }, resolve);
+  });
+}
+
+async function handleMqttRequest(client, message) {
+  let deviceId = client.id;
+  try {
+    const stats = getMqttClientStats(client.id);
+    stats.requests++;
+    
+    const request = JSON.parse(message);
+    deviceId = request.device || client.id;
+    stats.deviceId = deviceId;
+    
+    // Legacy per-chunk downloads would flood the log
+    if (request.action !== 'download') {
+      console.log(`📨 MQTT Request from ${deviceId} (${client.id}): ${request.action}`);
+    }
+    
+    switch (request.action) {
+      case 'check':
+        await handleMqttCheck(client, deviceId, request);
+        break;
+        
+      case 'download':
+        await handleMqttDownload(client, deviceId, request);
+        break;
+        
+      case 'stream':
+        await handleMqttStream(client, deviceId, request);
+        break;
+        
+      case 'verify':
+        await handleMqttVerify(client, deviceId, request);
+        break;
+        
+      case 'stop':
+        mqttStreams.delete(deviceId);
+        console.log(`⏹️ MQTT stream stopped by ${deviceId}`);
+        break;
+        
+      default:
+        throw new Error(`Unknown action: ${request.action}`);
+    }
+  } catch (error) {
+    console.error(`🚨 Error handling MQTT request from ${client.id}:`, error.message);
+    getMqttClientStats(client.id).errors++;
+    await publishMqtt(MQTT_TOPIC_INFO, JSON.stringify({
+      device: deviceId,
+      status: 'error',
+      message: error.message,
+      code: 'REQUEST_ERROR'
+    }));
+  }
+}
+
+// Replies share the info topic with every device, so each one names the device it
+// answers; a "not modified" meant for another device's token must not be taken as ours
+async function handleMqttCheck(client, deviceId, request) {
+  const stats = getMqttClientStats(client.id);
+  stats.checks++;
+  
+  if (await isManifestUnchanged(request.token)) {
+    stats.notModified++;
+    return publishMqtt(MQTT_TOPIC_INFO, JSON.stringify({ device: deviceId, nm: 1 }));
+  }
+  
+  const firmwareInfo = await getLatestFirmwareInfo();
+  if (!firmwareInfo) {
+    return publishMqtt(MQTT_TOPIC_INFO, JSON.stringify({
+      device: deviceId,
+      status: 'error',
+      message: 'No firmware available',
+      code: 'NO_FIRMWARE'
+    }));
+  }
+  
+  console.log(`✅ MQTT firmware check for ${deviceId}: v${firmwareInfo.version}, ${firmwareInfo.size} bytes`);
+  await publishMqtt(MQTT_TOPIC_INFO, JSON.stringify({
+    device: deviceId,
+    status: 'success',
+    version: firmwareInfo.version,
+    name: firmwareInfo.name,
+    size: firmwareInfo.size,
+    md5: firmwareInfo.md5,
+    sha256: firmwareInfo.sha256,
+    token: firmwareInfo.token,
+    chunkSize: MAX_CHUNK_SIZE,
+    window: MQTT_DEFAULT_WINDOW
+  }));
+}
+
+// Request/response download used by MqttTransport: one chunk per request on the device's
+// own data topic, a JSON header line followed by the raw bytes. Served from the image
+// cache and tracked in the same session table as TCP.
+async function handleMqttDownload(client, deviceId, request) {
+  const firmwareInfo = await getLatestFirmwareInfo();
+  if (!firmwareInfo) {
+    throw new Error('No firmware available');
+  }
+  
+  const offset = request.offset || 0;
+  const size = Math.max(1, Math.min(request.size || DEFAULT_CHUNK_SIZE, MAX_CHUNK_SIZE));
+  const chunkData = getStreamChunk(getFirmwareImage(firmwareInfo.path).data, offset, size);
+  if (!chunkData) {
+    throw new Error(`Invalid offset: ${offset}, file size: ${firmwareInfo.size}`);
+  }
+  
+  const { session } = findOrCreateSession(deviceId, firmwareInfo, client.id);
+  
+  const header = JSON.stringify({
+    device: deviceId,
+    offset: offset,
+    size: chunkData.actualSize,
+    total: chunkData.totalSize
+  }) + '\n';
+  await publishMqtt(MQTT_TOPIC_DATA_PREFIX + deviceId, Buffer.concat([Buffer.from(header), chunkData.chunk]));
+  
+  const stats = getMqttClientStats(client.id);
+  stats.chunksServed++;
+  stats.bytesServed += chunkData.actualSize;
+  
+  session.chunks.set(offset, { size: chunkData.actualSize, timestamp: Date.now() });
+  session.downloadedChunks++;
+  session.lastOffset = offset + chunkData.actualSize;
+  session.encoding = 'identity';
+  performanceMetrics.chunksServed++;
+  
+  // Completion is left to the verify request, so a device that fails its hash check
+  // can still resume this session
+  if (session.lastOffset >= chunkData.totalSize) {
+    console.log(`📊 MQTT download served for ${deviceId}: ${chunkData.totalSize} bytes in ${Date.now() - session.startTime}ms`);
+  }
+}
+
+// The device's hash of what it flashed, after a stream or request/response download.
+// The reply names the device and carries no version, so it is never taken for a manifest.
+async function handleMqttVerify(client, deviceId, request) {
+  if (!request.hash) {
+    throw new Error('Missing hash');
+  }
+  
+  let session = null;
+  for (const candidate of activeSessions.values()) {
+    if (candidate.deviceId === deviceId && !candidate.completed) {
+      session = candidate;
+    }
+  }
+  if (!session) {
+    throw new Error('No session to verify');
+  }
+  
+  await publishMqtt(MQTT_TOPIC_INFO, JSON.stringify({
+    device: deviceId,
+    action: 'verify',
+    ...verifySession(session, deviceId, request)
+  }));
+}
+
+// Start (or restart) a windowed stream from the offset the device has flashed up to
+async function handleMqttStream(client, deviceId, request) {
+  const firmwareInfo = await getLatestFirmwareInfo();
+  if (!firmwareInfo) {
+    throw new Error('No firmware available');
+  }
+  
+  const offset = request.offset || 0;
+  if (offset >= firmwareInfo.size) {
+    throw new Error(`Invalid offset: ${offset}, file size: ${firmwareInfo.size}`);
+  }
+  
+  const { session } = findOrCreateSession(deviceId, firmwareInfo, client.id);
+  
+  const stream = {
+    deviceId,
+    clientId: client.id,
+    session,
+    topic: MQTT_TOPIC_CHUNK_PREFIX + deviceId,
+    image: getFirmwareImage(firmwareInfo.path).data, // Chunks are slices of the cached image
+    chunkSize: Math.max(MIN_CHUNK_SIZE, Math.min(request.chunk || MAX_CHUNK_SIZE, MAX_CHUNK_SIZE)),
+    window: Math.max(1, Math.min(request.window || MQTT_DEFAULT_WINDOW, MQTT_MAX_WINDOW)),
+    nextOffset: offset,
+    inflight: new Map(),
+    startTime: Date.now(),
+    startOffset: offset,
+    published: 0,
+    retransmits: 0
+  };
+  
+  session.lastOffset = offset;
+  session.streamSize = stream.image.length;
+  session.encoding = 'identity';
+  mqttStreams.set(deviceId, stream);
+  
+  console.log(`📡 MQTT stream for ${deviceId}: offset=${offset}, chunk=${stream.chunkSize}, window=${stream.window}`);
+  fillWindow(stream);
+}
+
+// The window starts at the first unacknowledged chunk, so a device never has to
+// hold more than `window` chunks while it waits for a resend
+function fillWindow(stream) {
+  const base = stream.inflight.size > 0 ? Math.min(...stream.inflight.keys()) : stream.nextOffset;
+  const limit = Math.min(base + stream.window * stream.chunkSize, stream.image.length);
+  
+  while (stream.nextOffset < limit) {
+    const size = publishChunk(stream, stream.nextOffset, 0);
+    stream.nextOffset += size;
+  }
+}
+
+// Payload: 4-byte big-endian offset followed by the raw image bytes
+function publishChunk(stream, offset, retries) {
+  const size = Math.min(stream.chunkSize, stream.image.length - offset);
+  const payload = Buffer.allocUnsafe(4 + size);
+  payload.writeUInt32BE(offset, 0);
+  stream.image.copy(payload, 4, offset, offset + size);
+  
+  stream.inflight.set(offset, { size, sentAt: Date.now(), retries });
+  stream.published++;
+  const stats = getMqttClientStats(stream.clientId);
+  stats.chunksServed++;
+  stats.bytesServed += size;
+  if (retries > 0) {
+    stats.retransmits++;
+  }
+  performanceMetrics.mqttChunksPublished++;
+  performanceMetrics.chunksServed++;
+  
+  broker.publish({ cmd: 'publish', topic: stream.topic, payload, qos: 1, retain: false, dup: retries > 0 });
+  return size;
+}
+
+function handleChunkAck(packet) {
+  const deviceId = packet.topic.substring(MQTT_TOPIC_CHUNK_PREFIX.length);
+  const stream = mqttStreams.get(deviceId);
+  if (!stream || packet.payload.length < 4) {
+    return;
+  }
+  
+  // A late PUBACK for a chunk that was already resent and acknowledged is ignored
+  const offset = packet.payload.readUInt32BE(0);
+  const chunk = stream.inflight.get(offset);
+  if (!chunk) {
+    return;
+  }
+  stream.inflight.delete(offset);
+  getMqttClientStats(stream.clientId).chunksAcked++;
+  
+  const session = stream.session;
+  session.downloadedChunks++;
+  session.lastOffset = stream.inflight.size > 0 ? Math.min(...stream.inflight.keys()) : stream.nextOffset;
+  
+  // Every chunk acknowledged only means it arrived: the device's verify completes the session
+  if (stream.inflight.size === 0 && stream.nextOffset >= stream.image.length) {
+    const elapsed = Date.now() - stream.startTime;
+    const bytes = stream.image.length - stream.startOffset;
+    mqttStreams.delete(deviceId);
+    console.log(`📊 MQTT stream finished for ${deviceId}: ${bytes} bytes in ${elapsed}ms (${Math.round(bytes / Math.max(elapsed / 1000, 0.001))} B/s), ${stream.published} chunks published, ${stream.retransmits} resent`);
+    return;
+  }
+  
+  fillWindow(stream);
+}
+
+// Resend chunks whose PUBACK did not arrive in time
+setInterval(() => {
+  const now = Date.now();
+  
+  for (const [deviceId, stream] of mqttStreams.entries()) {
+    for (const [offset, chunk] of stream.inflight.entries()) {
+      if (now - chunk.sentAt < MQTT_RETRANSMIT_MS) {
+        continue;
+      }
+      
+      if (chunk.retries >= MQTT_RETRANSMIT_LIMIT) {
+        console.warn(`⏰ MQTT stream for ${deviceId} abandoned: chunk ${offset} unacknowledged after ${chunk.retries} resends`);
+        stream.session.interrupted = true;
+        stream.session.interruptedAt = now;
+        mqttStreams.delete(deviceId);
+        break;
+      }
+      
+      console.log(`🔁 Resending chunk ${offset} to ${deviceId} (attempt ${chunk.retries + 1})`);
+      stream.retransmits++;
+      performanceMetrics.mqttRetransmits++;
+      performanceMetrics.retryCount++;
+      publishChunk(stream, offset, chunk.retries + 1);
+    }
+  }
+}, 1000);
+
+// ======= MQTT-SN GATEWAY (UDP) =======
+// Transparent gateway: every MQTT-SN client gets its own MQTT connection into the
+// embedded broker over an in-process stream, so the FOTA responder, per-client
+// metrics and disconnect handling treat it exactly like a TCP client.
+// Predefined topic IDs are agreed with the firmware and need no REGISTER;
+// {client} is replaced by the MQTT-SN client ID.
+const MQTTSN_PREDEFINED_TOPICS = {
+  1: MQTT_TOPIC_REQUEST,
+  2: MQTT_TOPIC_INFO,
+  3: 'device/telemetry/{client}'
+};
+const MQTTSN_FIRST_TOPIC_ID = 0x100;  // Registered topics, above the predefined range
+const MQTTSN_RETRY_MS = 5000;
+const MQTTSN_RETRY_LIMIT = 3;
+const MQTTSN = {
+  CONNECT: 0x04, CONNACK: 0x05, REGISTER: 0x0A, REGACK: 0x0B, PUBLISH: 0x0C, PUBACK: 0x0D,
+  SUBSCRIBE: 0x12, SUBACK: 0x13, PINGREQ: 0x16, PINGRESP: 0x17, DISCONNECT: 0x18
+};
+const MQTTSN_RC = { ACCEPTED: 0, CONGESTION: 1, INVALID_TOPIC: 2, NOT_SUPPORTED: 3 };
+const MQTTSN_FLAG_DUP = 0x80;
+const MQTTSN_TOPIC_NORMAL = 0;
+const MQTTSN_TOPIC_PREDEFINED = 1;
+const MQTTSN_TOPIC_SHORT = 2;
+
+const mqttsnServer = dgram.createSocket('udp4');
+const mqttsnSessions = new Map();  // "address:port" -> session
+const mqttsnMetrics = {
+  datagramsIn: 0,
+  datagramsOut: 0,
+  bytesIn: 0,
+  bytesOut: 0,
+  publishesIn: 0,
+  publishesOut: 0,
+  retransmits: 0,
+  rejected: 0
+};
+
+function encodeMqttsn(type, body = Buffer.alloc(0)) {
+  // Length counts itself: one byte up to 255, else 0x01 and two bytes
+  const total = body.length + 2;
+  const header = total <= 255
+    ? Buffer.from([total, type])
+    : Buffer.from([0x01, (total + 2) >> 8, (total + 2) & 0xFF, type]);
+  return Buffer.concat([header, body]);
+}
+
+function decodeMqttsn(msg) {
+  if (msg.length < 2) {
+    return null;
+  }
+  let length = msg[0];
+  let header = 1;
+  if (length === 0x01) {
+    if (msg.length < 4) {
+      return null;
+    }
+    length = msg.readUInt16BE(1);
+    header = 3;
+  }
+  if (length < header + 1 || length > msg.length) {
+    return null;
+  }
+  return { type: msg[header], body: msg.subarray(header + 1, length) };
+}
+
+// Minimal MQTT 3.1.1 framing for the broker side of the bridge
+function encodeMqtt(header, body) {
+  const length = [];
+  let n = body.length;
+  do {
+    let digit = n % 128;
+    n = Math.floor(n / 128);
+    if (n > 0) digit |= 0x80;
+    length.push(digit);
+  } while (n > 0);
+  return Buffer.concat([Buffer.from([header, ...length]), body]);
+}
+
+function mqttString(s) {
+  const data = Buffer.from(s);
+  const length = Buffer.alloc(2);
+  length.writeUInt16BE(data.length);
+  return Buffer.concat([length, data]);
+}
+
+function uint16(n) {
+  const b = Buffer.alloc(2);
+  b.writeUInt16BE(n & 0xFFFF);
+  return b;
+}
+
+function sendMqttsn(session, type, body) {
+  const datagram = encodeMqttsn(type, body);
+  mqttsnServer.send(datagram, session.port, session.address);
+  mqttsnMetrics.datagramsOut++;
+  mqttsnMetrics.bytesOut += datagram.length;
+  session.stats.datagramsOut++;
+  session.stats.bytesOut += datagram.length;
+  return datagram;
+}
+
+function sendMqttsnTo(rinfo, type, body) {
+  const datagram = encodeMqttsn(type, body);
+  mqttsnServer.send(datagram, rinfo.port, rinfo.address);
+  mqttsnMetrics.datagramsOut++;
+  mqttsnMetrics.bytesOut += datagram.length;
+}
+
+function predefinedTopicName(topicId, clientId) {
+  const name = MQTTSN_PREDEFINED_TOPICS[topicId];
+  return name ? name.replace('{client}', clientId) : null;
+}
+
+function predefinedTopicId(topic, clientId) {
+  for (const [id, name] of Object.entries(MQTTSN_PREDEFINED_TOPICS)) {
+    if (name.replace('{client}', clientId) === topic) {
+      return Number(id);
+    }
+  }
+  return 0;
+}
+
+function registerMqttsnTopic(session, topic) {
+  let topicId = session.topicIds.get(topic);
+  if (!topicId) {
+    topicId = session.nextTopicId++;
+    session.topicIds.set(topic, topicId);
+    session.topics.set(topicId, topic);
+  }
+  return topicId;
+}
+
+function resolveMqttsnTopic(session, flags, topicId, topicBytes) {
+  switch (flags & 0x03) {
+    case MQTTSN_TOPIC_PREDEFINED:
+      return predefinedTopicName(topicId, session ? session.clientId : 'unknown');
+    case MQTTSN_TOPIC_SHORT:
+      return topicBytes.toString();
+    default:
+      return session ? session.topics.get(topicId) || null : null;
+  }
+}
+
+function createMqttsnSession(rinfo, clientId, duration) {
+  const key = `${rinfo.address}:${rinfo.port}`;
+  
+  // Same address reconnecting, or the same device behind a new NAT mapping
+  for (const session of mqttsnSessions.values()) {
+    if (session.key === key || session.clientId === clientId) {
+      closeMqttsnSession(session, 'replaced');
+    }
+  }
+  
+  const session = {
+    key,
+    address: rinfo.address,
+    port: rinfo.port,
+    clientId,
+    duration,
+    connectedAt: Date.now(),
+    lastSeen: Date.now(),
+    brokerReady: false,
+    mqttBuffer: Buffer.alloc(0),
+    topics: new Map(),
+    topicIds: new Map(),
+    nextTopicId: MQTTSN_FIRST_TOPIC_ID,
+    pendingPubacks: new Map(),  // Device QoS 1 publishes waiting for the broker's PUBACK
+    pendingSubacks: new Map(),
+    outgoing: new Map(),        // QoS 1 deliveries waiting for the device's PUBACK
+    stats: { datagramsIn: 0, datagramsOut: 0, bytesIn: 0, bytesOut: 0, publishesIn: 0, publishesOut: 0, retransmits: 0 }
+  };
+  
+  session.conn = new Duplex({
+    read() {},
+    write(chunk, encoding, callback) {
+      handleBrokerBytes(session, chunk);
+      callback();
+    }
+  });
+  session.conn.remoteAddress = rinfo.address;
+  session.conn.on('error', () => {});
+  mqttsnSessions.set(key, session);
+  broker.handle(session.conn);
+  
+  // CONNECT: protocol "MQTT" level 4, clean session, keep-alive = MQTT-SN duration
+  const keepAlive = Math.min(duration, 0xFFFF);
+  session.conn.push(encodeMqtt(0x10, Buffer.concat([
+    mqttString('MQTT'), Buffer.from([0x04, 0x02, keepAlive >> 8, keepAlive & 0xFF]), mqttString(clientId)
+  ])));
+  return session;
+}
+
+function closeMqttsnSession(session, reason) {
+  if (mqttsnSessions.get(session.key) !== session) {
+    return;
+  }
+  mqttsnSessions.delete(session.key);
+  console.log(`📴 MQTT-SN session closed for ${session.clientId} (${reason}): ${session.stats.publishesIn} in, ${session.stats.publishesOut} out`);
+  if (session.brokerReady) {
+    session.conn.push(encodeMqtt(0xE0, Buffer.alloc(0)));
+  }
+  session.conn.destroy();
+}
+
+// Broker -> device: MQTT packets arriving on the session's bridge stream
+function handleBrokerBytes(session, chunk) {
+  session.mqttBuffer = Buffer.concat([session.mqttBuffer, chunk]);
+  
+  while (session.mqttBuffer.length >= 2) {
+    let length = 0;
+    let multiplier = 1;
+    let i = 1;
+    for (;; i++) {
+      if (i >= session.mqttBuffer.length) return;
+      length += (session.mqttBuffer[i] & 0x7F) * multiplier;
+      multiplier *= 128;
+      if (!(session.mqttBuffer[i] & 0x80)) break;
+    }
+    if (session.mqttBuffer.length < i + 1 + length) return;
+    
+    const header = session.mqttBuffer[0];
+    const body = session.mqttBuffer.subarray(i + 1, i + 1 + length);
+    session.mqttBuffer = session.mqttBuffer.subarray(i + 1 + length);
+    handleBrokerPacket(session, header, body);
+  }
+}
+
+function handleBrokerPacket(session, header, body) {
+  switch (header >> 4) {
+    case 2: {  // CONNACK
+      session.brokerReady = body[1] === 0;
+      sendMqttsn(session, MQTTSN.CONNACK, Buffer.from([session.brokerReady ? MQTTSN_RC.ACCEPTED : MQTTSN_RC.CONGESTION]));
+      if (session.brokerReady) {
+        console.log(`📶 MQTT-SN client ${session.clientId} connected from ${session.key}`);
+      } else {
+        closeMqttsnSession(session, 'refused by broker');
+      }
+      break;
+    }
+    
+    case 3: {  // PUBLISH
+      const qos = (header >> 1) & 0x03;
+      const topicLength = body.readUInt16BE(0);
+      const topic = body.subarray(2, 2 + topicLength).toString();
+      let offset = 2 + topicLength;
+      let messageId = 0;
+      if (qos > 0) {
+        messageId = body.readUInt16BE(offset);
+        offset += 2;
+      }
+      deliverToMqttsn(session, topic, body.subarray(offset), Math.min(qos, 1), messageId);
+      break;
+    }
+    
+    case 4: {  // PUBACK for a device publish
+      const messageId = body.readUInt16BE(0);
+      const topicId = session.pendingPubacks.get(messageId);
+      if (topicId !== undefined) {
+        session.pendingPubacks.delete(messageId);
+        sendMqttsn(session, MQTTSN.PUBACK, Buffer.concat([uint16(topicId), uint16(messageId), Buffer.from([MQTTSN_RC.ACCEPTED])]));
+      }
+      break;
+    }
+    
+    case 9: {  // SUBACK
+      const messageId = body.readUInt16BE(0);
+      const pending = session.pendingSubacks.get(messageId);
+      if (pending) {
+        session.pendingSubacks.delete(messageId);
+        const granted = body[2];
+        const rc = granted === 0x80 ? MQTTSN_RC.NOT_SUPPORTED : MQTTSN_RC.ACCEPTED;
+        sendMqttsn(session, MQTTSN.SUBACK, Buffer.concat([
+          Buffer.from([(granted & 0x01) << 5]), uint16(pending.topicId), uint16(messageId), Buffer.from([rc])
+        ]));
+      }
+      break;
+    }
+  }
+}
+
+function deliverToMqttsn(session, topic, payload, qos, messageId) {
+  let topicId = predefinedTopicId(topic, session.clientId);
+  let topicType = MQTTSN_TOPIC_PREDEFINED;
+  
+  if (!topicId) {
+    // Name the topic first; the device stores it and acknowledges with REGACK
+    topicType = MQTTSN_TOPIC_NORMAL;
+    topicId = session.topicIds.get(topic);
+    if (!topicId) {
+      topicId = registerMqttsnTopic(session, topic);
+      sendMqttsn(session, MQTTSN.REGISTER, Buffer.concat([uint16(topicId), uint16(0), Buffer.from(topic)]));
+    }
+  }
+  
+  const datagram = sendMqttsn(session, MQTTSN.PUBLISH, Buffer.concat([
+    Buffer.from([(qos << 5) | topicType]), uint16(topicId), uint16(qos > 0 ? messageId : 0), payload
+  ]));
+  session.stats.publishesOut++;
+  mqttsnMetrics.publishesOut++;
+  
+  if (qos > 0) {
+    session.outgoing.set(messageId, { datagram, sentAt: Date.now(), retries: 0 });
+  }
+}
+
+// Device -> broker
+function handleMqttsnDatagram(msg, rinfo) {
+  mqttsnMetrics.datagramsIn++;
+  mqttsnMetrics.bytesIn += msg.length;
+  
+  const packet = decodeMqttsn(msg);
+  if (!packet) {
+    mqttsnMetrics.rejected++;
+    return;
+  }
+  
+  const { type, body } = packet;
+  const session = mqttsnSessions.get(`${rinfo.address}:${rinfo.port}`);
+  if (session) {
+    session.lastSeen = Date.now();
+    session.stats.datagramsIn++;
+    session.stats.bytesIn += msg.length;
+  }
+  
+  try {
+    if (type === MQTTSN.CONNECT) {
+      // Flags, protocol ID, duration, client ID
+      const duration = body.readUInt16BE(2);
+      const clientId = body.subarray(4).toString() || `mqttsn_${rinfo.address}_${rinfo.port}`;
+      createMqttsnSession(rinfo, clientId, duration);
+      return;
+    }
+    
+    if (type === MQTTSN.PUBLISH && (body[0] & 0x60) === 0x60) {
+      handleMqttsnPublishNoSession(body, rinfo);
+      return;
+    }
+    
+    // Anything else needs a session: tell an unknown sender to connect again
+    if (!session || !session.brokerReady) {
+      mqttsnMetrics.rejected++;
+      sendMqttsnTo(rinfo, MQTTSN.DISCONNECT);
+      return;
+    }
+    
+    switch (type) {
+      case MQTTSN.REGISTER: {
+        const messageId = body.readUInt16BE(2);
+        const topicId = registerMqttsnTopic(session, body.subarray(4).toString());
+        sendMqttsn(session, MQTTSN.REGACK, Buffer.concat([uint16(topicId), uint16(messageId), Buffer.from([MQTTSN_RC.ACCEPTED])]));
+        break;
+      }
+      
+      case MQTTSN.PUBLISH:
+        handleMqttsnPublish(session, body);
+        break;
+      
+      case MQTTSN.PUBACK: {
+        const messageId = body.readUInt16BE(2);
+        if (session.outgoing.delete(messageId)) {
+          session.conn.push(encodeMqtt(0x40, uint16(messageId)));
+        }
+        break;
+      }
+      
+      case MQTTSN.REGACK:
+        break;
+      
+      case MQTTSN.SUBSCRIBE:
+        handleMqttsnSubscribe(session, body);
+        break;
+      
+      case MQTTSN.PINGREQ:
+        // Answered here; the broker gets its own ping to keep the bridged session alive
+        session.conn.push(encodeMqtt(0xC0, Buffer.alloc(0)));
+        sendMqttsn(session, MQTTSN.PINGRESP);
+        break;
+      
+      case MQTTSN.DISCONNECT:
+        sendMqttsn(session, MQTTSN.DISCONNECT);
+        closeMqttsnSession(session, 'disconnect');
+        break;
     }
-    
-    await sendTcpResponse(socket, response);
-    
   } catch (error) {
-    console.error('Error in firmware verification:', error);
-    await sendTcpResponse(socket, {
-      status: 'error',
-      message: 'Verification failed',
-      code: 'VERIFY_ERROR'
-    });
+    // Truncated fields
+    mqttsnMetrics.rejected++;
+    console.warn(`⚠️ Malformed MQTT-SN message 0x${type.toString(16)} from ${rinfo.address}:${rinfo.port}: ${error.message}`);
   }
 }
 
-// Enhanced firmware info with dual hash calculation
-async function getLatestFirmwareInfo() {
-  try {
-    const files = fs.readdirSync(FIRMWARE_DIR);
-    const firmwareFiles = files
-      .filter(file => file.endsWith('.bin'))
-      .map(file => {
-        const filePath = path.join(FIRMWARE_DIR, file);
-        const stats = fs.statSync(filePath);
-        return {
-          name: file,
-          path: filePath,
-          size: stats.size,
-          mtime: stats.mtime
-        };
-      })
-      .sort((a, b) => b.mtime - a.mtime);
-    
-    if (firmwareFiles.length === 0) {
-      return null;
+function handleMqttsnPublish(session, body) {
+  const flags = body[0];
+  const topicId = body.readUInt16BE(1);
+  const messageId = body.readUInt16BE(3);
+  const qos = (flags >> 5) & 0x03;
+  const topic = resolveMqttsnTopic(session, flags, topicId, body.subarray(1, 3));
+  
+  if (!topic || qos > 1) {
+    mqttsnMetrics.rejected++;
+    sendMqttsn(session, MQTTSN.PUBACK, Buffer.concat([
+      uint16(topicId), uint16(messageId), Buffer.from([topic ? MQTTSN_RC.NOT_SUPPORTED : MQTTSN_RC.INVALID_TOPIC])
+    ]));
+    return;
+  }
+  
+  session.stats.publishesIn++;
+  mqttsnMetrics.publishesIn++;
+  
+  // QoS 1 keeps the device's message ID; a DUP resend is simply forwarded again
+  let header = 0x30 | (qos << 1);
+  let variable = mqttString(topic);
+  if (qos > 0) {
+    if (flags & MQTTSN_FLAG_DUP) header |= 0x08;
+    variable = Buffer.concat([variable, uint16(messageId)]);
+    session.pendingPubacks.set(messageId, topicId);
+  }
+  session.conn.push(encodeMqtt(header, Buffer.concat([variable, body.subarray(5)])));
+}
+
+// QoS -1: predefined topic, no session, no acknowledgement
+function handleMqttsnPublishNoSession(body, rinfo) {
+  const topicId = body.readUInt16BE(1);
+  const topic = (body[0] & 0x03) === MQTTSN_TOPIC_PREDEFINED
+    ? predefinedTopicName(topicId, `${rinfo.address}:${rinfo.port}`)
+    : null;
+  if (!topic) {
+    mqttsnMetrics.rejected++;
+    return;
+  }
+  
+  mqttsnMetrics.publishesIn++;
+  publishMqtt(topic, Buffer.from(body.subarray(5)));
+}
+
+function handleMqttsnSubscribe(session, body) {
+  const flags = body[0];
+  const messageId = body.readUInt16BE(1);
+  const qos = Math.min((flags >> 5) & 0x03, 1);
+  const topicType = flags & 0x03;
+  
+  let topic;
+  let topicId;
+  if (topicType === MQTTSN_TOPIC_PREDEFINED) {
+    topicId = body.readUInt16BE(3);
+    topic = predefinedTopicName(topicId, session.clientId);
+  } else {
+    topic = body.subarray(3).toString();
+    // Wildcards would need a REGISTER per matching topic; not offered by this gateway
+    if (topicType === MQTTSN_TOPIC_NORMAL && !/[+#]/.test(topic)) {
+      topicId = registerMqttsnTopic(session, topic);
+    } else {
+      topic = null;
     }
-    
-    const latestFirmware = firmwareFiles[0];
-    const versionMatch = latestFirmware.name.match(/_v(\d+\.\d+\.\d+)\.bin$/);
-    const version = versionMatch ? versionMatch[1] : '1.0.0';
-    
-    // Calculate both hashes efficiently
-    const fileBuffer = fs.readFileSync(latestFirmware.path);
-    const md5Hash = crypto.createHash('md5').update(fileBuffer).digest('hex');
-    const sha256Hash = crypto.createHash('sha256').update(fileBuffer).digest('hex');
-    
-    return {
-      name: latestFirmware.name,
-      path: latestFirmware.path,
-      version: version,
-      size: latestFirmware.size,
-      md5: md5Hash,
-      sha256: sha256Hash,
-      mtime: latestFirmware.mtime
-    };
-    
-  } catch (error) {
-    console.error('Error getting firmware info:', error);
-    return null;
   }
+  
+  if (!topic) {
+    mqttsnMetrics.rejected++;
+    sendMqttsn(session, MQTTSN.SUBACK, Buffer.concat([
+      Buffer.from([0]), uint16(0), uint16(messageId), Buffer.from([MQTTSN_RC.INVALID_TOPIC])
+    ]));
+    return;
+  }
+  
+  session.pendingSubacks.set(messageId, { topicId });
+  session.conn.push(encodeMqtt(0x82, Buffer.concat([uint16(messageId), mqttString(topic), Buffer.from([qos])])));
 }
 
-async function getFirmwareChunk(filePath, offset, requestedSize) {
-  try {
-    const stats = fs.statSync(filePath);
-    const totalSize = stats.size;
-    
-    if (offset >= totalSize) {
-      throw new Error(`Invalid offset: ${offset}, file size: ${totalSize}`);
+mqttsnServer.on('message', handleMqttsnDatagram);
+
+// Resend unacknowledged QoS 1 deliveries and drop sessions that went silent
+setInterval(() => {
+  const now = Date.now();
+  
+  for (const session of mqttsnSessions.values()) {
+    if (now - session.lastSeen > session.duration * 1500) {
+      closeMqttsnSession(session, 'keep-alive expired');
+      continue;
     }
     
-    const actualSize = Math.min(requestedSize, totalSize - offset);
-    const fileHandle = fs.openSync(filePath, 'r');
-    const chunk = Buffer.alloc(actualSize);
-    
-    const bytesRead = fs.readSync(fileHandle, chunk, 0, actualSize, offset);
-    fs.closeSync(fileHandle);
-    
-    if (bytesRead !== actualSize) {
-      throw new Error(`Read mismatch: expected ${actualSize}, got ${bytesRead}`);
+    for (const [messageId, delivery] of session.outgoing.entries()) {
+      if (now - delivery.sentAt < MQTTSN_RETRY_MS) {
+        continue;
+      }
+      if (delivery.retries >= MQTTSN_RETRY_LIMIT) {
+        closeMqttsnSession(session, `message ${messageId} unacknowledged`);
+        break;
+      }
+      
+      // DUP flag sits right after the length and type bytes
+      delivery.datagram[delivery.datagram[0] === 0x01 ? 4 : 2] |= MQTTSN_FLAG_DUP;
+      delivery.retries++;
+      delivery.sentAt = now;
+      session.stats.retransmits++;
+      mqttsnMetrics.retransmits++;
+      mqttsnServer.send(delivery.datagram, session.port, session.address);
     }
-    
-    return {
-      chunk: chunk,
-      actualSize: actualSize,
-      totalSize: totalSize
-    };
-    
-  } catch (error) {
-    console.error('Error reading firmware chunk:', error);
-    return null;
   }
-}
+}, 1000);
 
-// Standard JSON response
-async function sendTcpResponse(socket, responseObject) {
-  return new Promise((resolve, reject) => {
+// ======= COAP BLOCK-WISE FOTA (UDP) =======
+// CoAP (RFC 7252) with Block2 (RFC 7959) for devices that would rather not hold a
+// TCP connection over GPRS. Three resources, served from the same image cache:
+//   GET /fw/check?d=<device>&v=<version>  manifest as JSON; ETag is the manifest
+//                                         token, 2.03 Valid when the device sent it
+//   GET /fw/<name>?d=<device>             image bytes, one Block2 block per request
+//   POST /fw/verify?d=<device>            hash of the flashed image (JSON, as on
+//                                         TCP/MQTT); a match completes the session
+// Responses are piggybacked on the ACK. The client picks the block size and runs
+// the retransmission timers; a duplicate CON is answered again from the last
+// response sent to that peer instead of being re-executed.
+const COAP_VERSION = 1;
+const COAP_TYPE = { CON: 0, NON: 1, ACK: 2, RST: 3 };
+const COAP_CODE = {
+  GET: 0x01,
+  POST: 0x02,
+  CHANGED: 0x44,         // 2.04
+  CONTENT: 0x45,         // 2.05
+  VALID: 0x43,           // 2.03
+  BAD_REQUEST: 0x80,     // 4.00
+  BAD_OPTION: 0x82,      // 4.02
+  NOT_FOUND: 0x84,       // 4.04
+  METHOD_NOT_ALLOWED: 0x85,
+  INTERNAL_ERROR: 0xA0   // 5.00
+};
+const COAP_OPTION = { ETAG: 4, URI_PATH: 11, CONTENT_FORMAT: 12, URI_QUERY: 15, BLOCK2: 23, SIZE2: 28 };
+const COAP_FORMAT_JSON = 50;
+const COAP_MAX_SZX = 6;                // 1024-byte blocks, under one SIM800L CIPSEND
+const COAP_EXCHANGE_LIFETIME = 247000; // ms, RFC 7252 default; deduplication state is kept this long
+
+const coapServer = dgram.createSocket('udp4');
+const coapPeers = new Map();  // "address:port" -> { lastMessageId, lastResponse, lastSeen }
+const coapMetrics = {
+  requests: 0,
+  duplicates: 0,
+  blocksServed: 0,
+  bytesServed: 0,
+  notModified: 0,
+  rejected: 0
+};
+
+function decodeCoap(msg) {
+  if (msg.length < 4 || (msg[0] >> 6) !== COAP_VERSION) {
+    return null;
+  }
+  const tokenLength = msg[0] & 0x0F;
+  if (tokenLength > 8 || msg.length < 4 + tokenLength) {
+    return null;
+  }
+  
+  const packet = {
+    type: (msg[0] >> 4) & 0x03,
+    code: msg[1],
+    messageId: msg.readUInt16BE(2),
+    token: msg.subarray(4, 4 + tokenLength),
+    options: [],
+    payload: Buffer.alloc(0)
+  };
+  
+  // Options are delta-encoded; 13 and 14 announce one or two extension bytes
+  let pos = 4 + tokenLength;
+  let number = 0;
+  while (pos < msg.length) {
+    if (msg[pos] === 0xFF) {
+      packet.payload = msg.subarray(pos + 1);
+      break;
+    }
+    let delta = msg[pos] >> 4;
+    let length = msg[pos] & 0x0F;
+    pos++;
+    const extend = (nibble) => {
+      if (nibble === 13) return msg[pos++] + 13;
+      if (nibble === 14) { const v = msg.readUInt16BE(pos) + 269; pos += 2; return v; }
+      if (nibble === 15) throw new Error('reserved option nibble');
+      return nibble;
+    };
     try {
-      const responseStr = JSON.stringify(responseObject) + '\n';
-      socket.write(responseStr, (err) => {
-        if (err) {
-          console.error('Error sending TCP response:', err);
-          reject(err);
-        } else {
-          resolve();
-        }
-      });
+      delta = extend(delta);
+      length = extend(length);
     } catch (error) {
-      console.error('Error creating TCP response:', error);
-      reject(error);
+      return null;
+    }
+    if (pos + length > msg.length) {
+      return null;
     }
+    number += delta;
+    packet.options.push({ number, value: msg.subarray(pos, pos + length) });
+    pos += length;
+  }
+  
+  return packet;
+}
+
+function encodeCoap(type, code, messageId, token, options = [], payload = null) {
+  const parts = [Buffer.from([(COAP_VERSION << 6) | (type << 4) | token.length, code, messageId >> 8, messageId & 0xFF]), token];
+  
+  let previous = 0;
+  for (const option of options.slice().sort((a, b) => a.number - b.number)) {
+    const nibble = (n) => n < 13 ? n : (n < 269 ? 13 : 14);
+    const extension = (n) => n < 13 ? [] : (n < 269 ? [n - 13] : [(n - 269) >> 8, (n - 269) & 0xFF]);
+    const delta = option.number - previous;
+    const length = option.value.length;
+    parts.push(Buffer.from([(nibble(delta) << 4) | nibble(length), ...extension(delta), ...extension(length)]), option.value);
+    previous = option.number;
+  }
+  
+  if (payload && payload.length > 0) {
+    parts.push(Buffer.from([0xFF]), payload);
+  }
+  return Buffer.concat(parts);
+}
+
+// Unsigned option values drop their leading zero bytes
+function coapUint(n) {
+  const bytes = [];
+  while (n > 0) {
+    bytes.unshift(n & 0xFF);
+    n = Math.floor(n / 256);
+  }
+  return Buffer.from(bytes);
+}
+
+function readCoapUint(value) {
+  return value.reduce((n, byte) => n * 256 + byte, 0);
+}
+
+function coapOption(packet, number) {
+  const option = packet.options.find(o => o.number === number);
+  return option ? option.value : null;
+}
+
+function coapQuery(packet) {
+  const query = {};
+  packet.options.filter(o => o.number === COAP_OPTION.URI_QUERY).forEach(o => {
+    const [key, ...value] = o.value.toString().split('=');
+    query[key] = value.join('=');
   });
+  return query;
 }
 
-// NEW: Length-prefixed binary response
-async function sendTcpResponseWithLengthPrefix(socket, header, binaryData) {
-  return new Promise((resolve, reject) => {
-    try {
-      // Create the response with length prefixing
-      const headerStr = JSON.stringify(header) + '\n';
-      const headerBuffer = Buffer.from(headerStr);
-      
-      // The header already contains 's' field with binary data length
-      // ESP32 will read exactly header.s bytes after parsing JSON
-      const responseBuffer = Buffer.concat([headerBuffer, binaryData]);
-      
-      socket.write(responseBuffer, (err) => {
-        if (err) {
-          console.error('Error sending length-prefixed response:', err);
-          reject(err);
-        } else {
-          resolve();
-        }
-      });
-    } catch (error) {
-      console.error('Error creating length-prefixed response:', error);
-      reject(error);
+function sendCoap(rinfo, request, code, options = [], payload = null) {
+  // CON is answered in the ACK, NON with a NON carrying a fresh message ID
+  const type = request.type === COAP_TYPE.CON ? COAP_TYPE.ACK : COAP_TYPE.NON;
+  const messageId = type === COAP_TYPE.ACK ? request.messageId : crypto.randomInt(0x10000);
+  const datagram = encodeCoap(type, code, messageId, request.token, options, payload);
+  coapServer.send(datagram, rinfo.port, rinfo.address);
+  
+  if (request.type === COAP_TYPE.CON) {
+    const peer = coapPeers.get(`${rinfo.address}:${rinfo.port}`);
+    peer.lastMessageId = request.messageId;
+    peer.lastResponse = datagram;
+  }
+}
+
+async function handleCoapCheck(rinfo, request) {
+  const query = coapQuery(request);
+  const etag = coapOption(request, COAP_OPTION.ETAG);
+  
+  if (await isManifestUnchanged(etag ? etag.toString() : null)) {
+    coapMetrics.notModified++;
+    return sendCoap(rinfo, request, COAP_CODE.VALID, [{ number: COAP_OPTION.ETAG, value: etag }]);
+  }
+  
+  const firmwareInfo = await getLatestFirmwareInfo();
+  if (!firmwareInfo) {
+    return sendCoap(rinfo, request, COAP_CODE.NOT_FOUND);
+  }
+  
+  const token = firmwareInfo.token;
+  console.log(`✅ CoAP firmware check for ${query.d || rinfo.address}: v${firmwareInfo.version}, ${firmwareInfo.size} bytes`);
+  sendCoap(rinfo, request, COAP_CODE.CONTENT, [
+    { number: COAP_OPTION.ETAG, value: Buffer.from(token) },
+    { number: COAP_OPTION.CONTENT_FORMAT, value: coapUint(COAP_FORMAT_JSON) }
+  ], Buffer.from(JSON.stringify({
+    status: 'success',
+    version: firmwareInfo.version,
+    name: firmwareInfo.name,
+    size: firmwareInfo.size,
+    md5: firmwareInfo.md5,
+    sha256: firmwareInfo.sha256,
+    token: token
+  })));
+}
+
+// One block of the latest image. The ETag lets the client notice the image
+// changing under a download; blocks are tracked in the shared session table.
+async function handleCoapBlock(rinfo, request, name) {
+  const firmwareInfo = await getLatestFirmwareInfo();
+  if (!firmwareInfo || firmwareInfo.name !== name) {
+    return sendCoap(rinfo, request, COAP_CODE.NOT_FOUND);
+  }
+  
+  // No Block2 option: the client takes the first block at the server's size
+  const block = coapOption(request, COAP_OPTION.BLOCK2);
+  const requested = block ? readCoapUint(block) : COAP_MAX_SZX;
+  const szx = Math.min(requested & 0x07, COAP_MAX_SZX);
+  const blockSize = 1 << (szx + 4);
+  // A smaller size than asked keeps the same byte offset: renumber the block
+  const offset = (requested >> 4) * (1 << ((requested & 0x07) + 4));
+  const num = Math.floor(offset / blockSize);
+  
+  const chunkData = getStreamChunk(getFirmwareImage(firmwareInfo.path).data, num * blockSize, blockSize);
+  if (!chunkData) {
+    return sendCoap(rinfo, request, COAP_CODE.BAD_REQUEST);
+  }
+  
+  const more = num * blockSize + chunkData.actualSize < chunkData.totalSize;
+  const options = [
+    { number: COAP_OPTION.ETAG, value: Buffer.from(firmwareInfo.md5.substring(0, 8)) },
+    { number: COAP_OPTION.BLOCK2, value: coapUint((num << 4) | (more ? 0x08 : 0) | szx) }
+  ];
+  if (num === 0) {
+    options.push({ number: COAP_OPTION.SIZE2, value: coapUint(chunkData.totalSize) });
+  }
+  sendCoap(rinfo, request, COAP_CODE.CONTENT, options, chunkData.chunk);
+  
+  coapMetrics.blocksServed++;
+  coapMetrics.bytesServed += chunkData.actualSize;
+  performanceMetrics.chunksServed++;
+  
+  const deviceId = coapQuery(request).d || rinfo.address;
+  const { session } = findOrCreateSession(deviceId, firmwareInfo, `coap_${rinfo.address}_${rinfo.port}`);
+  const blockOffset = num * blockSize;
+  if (!session.chunks.has(blockOffset)) {
+    session.downloadedChunks++;
+  }
+  session.chunks.set(blockOffset, { size: chunkData.actualSize, timestamp: Date.now() });
+  session.lastOffset = blockOffset + chunkData.actualSize;
+  session.encoding = 'identity';
+  
+  // Serving the last block proves nothing about what was flashed: the session
+  // completes on /fw/verify
+  if (!more) {
+    console.log(`📊 CoAP last block served to ${deviceId}: ${chunkData.totalSize} bytes in ${Date.now() - session.startTime}ms`);
+  }
+}
+
+async function handleCoapVerify(rinfo, request) {
+  const deviceId = coapQuery(request).d || rinfo.address;
+  
+  let verify;
+  try {
+    verify = JSON.parse(request.payload.toString());
+  } catch (error) {
+    verify = null;
+  }
+  if (!verify || !verify.hash) {
+    return sendCoap(rinfo, request, COAP_CODE.BAD_REQUEST);
+  }
+  
+  let session = null;
+  for (const candidate of activeSessions.values()) {
+    if (candidate.deviceId === deviceId && !candidate.completed) {
+      session = candidate;
     }
-  });
+  }
+  if (!session) {
+    return sendCoap(rinfo, request, COAP_CODE.NOT_FOUND);
+  }
+  
+  sendCoap(rinfo, request, COAP_CODE.CHANGED, [
+    { number: COAP_OPTION.CONTENT_FORMAT, value: coapUint(COAP_FORMAT_JSON) }
+  ], Buffer.from(JSON.stringify(verifySession(session, deviceId, verify))));
 }
 
-function generateSessionId() {
-  return crypto.randomBytes(8).toString('hex'); // Shorter session IDs
+async function handleCoapDatagram(msg, rinfo) {
+  const request = decodeCoap(msg);
+  if (!request) {
+    coapMetrics.rejected++;
+    return;
+  }
+  
+  // Empty ACKs and resets: nothing of ours is waiting for them
+  if (request.type === COAP_TYPE.ACK || request.type === COAP_TYPE.RST || request.code === 0) {
+    return;
+  }
+  
+  const key = `${rinfo.address}:${rinfo.port}`;
+  let peer = coapPeers.get(key);
+  if (!peer) {
+    peer = { lastMessageId: -1, lastResponse: null, lastSeen: 0 };
+    coapPeers.set(key, peer);
+  }
+  peer.lastSeen = Date.now();
+  
+  // Our ACK was lost and the client retransmitted
+  if (request.type === COAP_TYPE.CON && request.messageId === peer.lastMessageId && peer.lastResponse) {
+    coapMetrics.duplicates++;
+    coapServer.send(peer.lastResponse, rinfo.port, rinfo.address);
+    return;
+  }
+  
+  coapMetrics.requests++;
+  
+  try {
+    const uriPath = request.options.filter(o => o.number === COAP_OPTION.URI_PATH).map(o => o.value.toString());
+    const isVerify = uriPath.length === 2 && uriPath[0] === 'fw' && uriPath[1] === 'verify';
+    if (request.code !== (isVerify ? COAP_CODE.POST : COAP_CODE.GET)) {
+      coapMetrics.rejected++;
+      return sendCoap(rinfo, request, COAP_CODE.METHOD_NOT_ALLOWED);
+    }
+    
+    // Unrecognised critical (odd-numbered) options must be refused
+    const known = Object.values(COAP_OPTION);
+    if (request.options.some(o => (o.number & 1) && !known.includes(o.number))) {
+      coapMetrics.rejected++;
+      return sendCoap(rinfo, request, COAP_CODE.BAD_OPTION);
+    }
+    
+    if (isVerify) {
+      await handleCoapVerify(rinfo, request);
+    } else if (uriPath.length === 2 && uriPath[0] === 'fw' && uriPath[1] === 'check') {
+      await handleCoapCheck(rinfo, request);
+    } else if (uriPath.length === 2 && uriPath[0] === 'fw') {
+      await handleCoapBlock(rinfo, request, uriPath[1]);
+    } else {
+      sendCoap(rinfo, request, COAP_CODE.NOT_FOUND);
+    }
+  } catch (error) {
+    console.error('CoAP request failed:', error);
+    sendCoap(rinfo, request, COAP_CODE.INTERNAL_ERROR);
+  }
 }
 
-// Enhanced session cleanup
+coapServer.on('message', handleCoapDatagram);
+
+// Forget peers once their message IDs can no longer be retransmitted
 setInterval(() => {
   const now = Date.now();
-  const SESSION_TIMEOUT = 45 * 60 * 1000; // 45 minutes
-  const INTERRUPTED_TIMEOUT = 10 * 60 * 1000; // 10 minutes for interrupted sessions
-  
-  for (let [sessionId, session] of activeSessions.entries()) {
-    const age = now - session.startTime;
-    const shouldCleanup = session.completed || 
-      (session.interrupted && (now - session.interruptedAt) > INTERRUPTED_TIMEOUT) ||
-      age > SESSION_TIMEOUT;
-    
-    if (shouldCleanup) {
-      console.log(`🧹 Cleaning up session: ${sessionId} (${session.completed ? 'completed' : session.interrupted ? 'interrupted' : 'expired'})`);
-      activeSessions.delete(sessionId);
+  for (const [key, peer] of coapPeers.entries()) {
+    if (now - peer.lastSeen > COAP_EXCHANGE_LIFETIME) {
+      coapPeers.delete(key);
     }
   }
-}, 5 * 60 * 1000);
+}, 60000);
 
 // Compare Firmware Version
 function isNewerVersion(serverVersion, deviceVersion) {
@@ -705,8 +2505,9 @@ app.get('/api/fota/download/:filename', async (req, res) => {
     
     console.log(`📥 HTTP FOTA download request from ${deviceId}: ${filename}`);
     
-    // Verify file exists
-    if (!fs.existsSync(filePath)) {
+    // Only stored images are served; size and hashes come from the index
+    const image = getStoredImage(filename);
+    if (!image) {
       return res.status(404).json({
         status: 'error',
         message: 'Firmware file not found',
@@ -714,14 +2515,9 @@ app.get('/api/fota/download/:filename', async (req, res) => {
       });
     }
     
-    // Get file stats
-    const stats = fs.statSync(filePath);
-    const fileSize = stats.size;
-    
-    // Calculate MD5 for integrity check
-    const fileBuffer = fs.readFileSync(filePath);
-    const md5Hash = crypto.createHash('md5').update(fileBuffer).digest('hex');
-    const sha256Hash = crypto.createHash('sha256').update(fileBuffer).digest('hex');
+    const fileSize = image.size;
+    const md5Hash = image.md5;
+    const sha256Hash = image.sha256;
     
     // Set appropriate headers
     res.setHeader('Content-Type', 'application/octet-stream');
@@ -782,9 +2578,8 @@ app.post('/api/fota/verify', express.json(), async (req, res) => {
       });
     }
     
-    const filePath = path.join(FIRMWARE_DIR, filename);
-    
-    if (!fs.existsSync(filePath)) {
+    const image = getStoredImage(filename);
+    if (!image) {
       return res.status(404).json({
         status: 'error',
         message: 'Firmware file not found',
@@ -792,11 +2587,7 @@ app.post('/api/fota/verify', express.json(), async (req, res) => {
       });
     }
     
-    // Calculate expected hash
-    const fileBuffer = fs.readFileSync(filePath);
-    const expectedHash = hashType === 'sha256' ? 
-      crypto.createHash('sha256').update(fileBuffer).digest('hex') :
-      crypto.createHash('md5').update(fileBuffer).digest('hex');
+    const expectedHash = hashType === 'sha256' ? image.sha256 : image.md5;
     
     const isValid = hash.toLowerCase() === expectedHash.toLowerCase();
     
@@ -835,17 +2626,56 @@ app.get('/api/metrics', (req, res) => {
   const sessionsInfo = Array.from(activeSessions.values()).map(s => ({
     id: s.sessionId,
     device: s.deviceId,
-    progress: Math.floor((s.lastOffset / s.firmwareInfo.size) * 100),
+    encoding: s.encoding || 'identity',
+    progress: Math.floor((s.lastOffset / (s.streamSize || s.firmwareInfo.size)) * 100),
     interrupted: s.interrupted,
     completed: s.completed,
+    transferMs: s.transferMs,
+    chunkSize: s.transport.chunkSize,
+    gapMs: Math.round(s.transport.gapMs),
+    bytesPerSecond: Math.round(s.transport.bytesPerSecond),
+    stalls: s.transport.stalls,
     age: Math.floor((Date.now() - s.startTime) / 1000)
   }));
   
+  const mqttClientsInfo = Array.from(mqttClients.values()).map(c => {
+    const stream = c.deviceId ? mqttStreams.get(c.deviceId) : null;
+    return {
+      ...c,
+      connectedFor: Math.floor((Date.now() - c.connectedAt) / 1000),
+      idle: Math.floor((Date.now() - c.lastActivity) / 1000),
+      stream: stream && stream.clientId === c.clientId ? {
+        nextOffset: stream.nextOffset,
+        inflight: stream.inflight.size,
+        window: stream.window,
+        chunkSize: stream.chunkSize
+      } : null
+    };
+  });
+  
   const metrics = {
     ...performanceMetrics,
     activeConnections: activeConnectionCount,
     activeSessions: activeSessionCount,
     sessions: sessionsInfo,
+    mqttClients: mqttClientsInfo,
+    mqttsn: {
+      ...mqttsnMetrics,
+      sessions: Array.from(mqttsnSessions.values()).map(s => ({
+        clientId: s.clientId,
+        address: s.key,
+        duration: s.duration,
+        connectedFor: Math.floor((Date.now() - s.connectedAt) / 1000),
+        idle: Math.floor((Date.now() - s.lastSeen) / 1000),
+        registeredTopics: s.topics.size,
+        inflight: s.outgoing.size,
+        ...s.stats
+      }))
+    },
+    coap: {
+      ...coapMetrics,
+      peers: coapPeers.size
+    },
     uptime: process.uptime(),
     memoryUsage: process.memoryUsage(),
     timestamp: new Date().toISOString()
@@ -857,16 +2687,56 @@ app.get('/api/metrics', (req, res) => {
 // Start servers
 tcpServer.listen(TCP_PORT, () => {
   console.log(`🚀 Enhanced TCP FOTA server with Length Prefixing running on port ${TCP_PORT}`);
-  console.log(`📊 Chunk size range: ${MIN_CHUNK_SIZE}-${MAX_CHUNK_SIZE} bytes`);
+  console.log(`📊 Chunk size range: ${MIN_CHUNK_SIZE}-${MAX_CHUNK_SIZE} bytes (TCP up to ${TCP_MAX_CHUNK_SIZE})`);
   console.log(`🔧 Features: Length prefixing, CRC16, Resume, Compression, SHA256`);
+  
+  // Precompress bundled images and report the savings at the reference link speed
+  try {
+    getCompressionReport().forEach(r => {
+      console.log(`🗜️ ${r.name}: raw ${r.rawBytes} B (~${r.rawTransferSeconds}s) vs deflate ${r.compressedBytes} B (~${r.compressedTransferSeconds}s) @ ${REFERENCE_LINK_SPEED} B/s`);
+    });
+    getDeltaReport().then(report => report.forEach(r => {
+      console.log(`🧬 ${r.from} → ${r.to}: raw ${r.rawBytes} B, deflate ${r.deflateBytes} B, delta ${r.deltaBytes} B (${(r.ratio * 100).toFixed(2)}%, ~${r.deltaTransferSeconds}s)`);
+    }));
+  } catch (error) {
+    console.error('Error precompressing firmware:', error);
+  }
 });
 
 tcpServer.on('error', (err) => {
   console.error('🚨 TCP server error:', err);
 });
 
+mqttServer.listen(MQTT_PORT, () => {
+  console.log(`📡 MQTT broker with FOTA responder running on port ${MQTT_PORT}`);
+});
+
+mqttServer.on('error', (err) => {
+  console.error('🚨 MQTT server error:', err);
+});
+
+mqttsnServer.bind(MQTTSN_PORT, () => {
+  console.log(`📡 MQTT-SN gateway (UDP) bridging into the broker on port ${MQTTSN_PORT}`);
+});
+
+mqttsnServer.on('error', (err) => {
+  console.error('🚨 MQTT-SN gateway error:', err);
+});
+
+coapServer.bind(COAP_PORT, () => {
+  console.log(`📦 CoAP block-wise FOTA (UDP) running on port ${COAP_PORT}`);
+});
+
+coapServer.on('error', (err) => {
+  console.error('🚨 CoAP server error:', err);
+});
+
 process.on('SIGINT', () => {
   console.log('\n🛑 Shutting down server...');
+  mqttServer.close();
+  mqttsnServer.close();
+  coapServer.close();
+  broker.close();
   tcpServer.close(() => {
     console.log('✅ TCP server closed');
     process.exit(0);
@@ -888,9 +2758,14 @@ app.post('/api/firmware/upload', express.raw({ type: 'application/octet-stream',
     // Write firmware file
     fs.writeFileSync(filePath, req.body);
     
-    // Calculate MD5 and SHA256 hash
-    const md5Hash = crypto.createHash('md5').update(req.body).digest('hex');
-    const sha256Hash = crypto.createHash('sha256').update(req.body).digest('hex');
+    // Hash and precompress once so no request path ever does
+    const stats = fs.statSync(filePath);
+    dropCachedStreams(filePath);
+    invalidateFirmwareManifest();
+    const { md5: md5Hash, sha256: sha256Hash } = getImageHashes(fileName, stats, req.body);
+    saveHashIndex();
+    const image = compressFirmwareImage(filePath, req.body, stats.mtimeMs);
+    getFirmwareManifest(); // Rebuilt now, so the delta patches to it start building
     
     console.log(`📤 Firmware uploaded: ${fileName} (${req.body.length} bytes, MD5: ${md5Hash})`);
     
@@ -900,6 +2775,7 @@ app.post('/api/firmware/upload', express.raw({ type: 'application/octet-stream',
       size: req.body.length,
       md5: md5Hash,
       sha256: sha256Hash,
+      compressedSize: image.compressedSize,
       version: version
     });
   } catch (error) {
@@ -911,29 +2787,15 @@ app.post('/api/firmware/upload', express.raw({ type: 'application/octet-stream',
 // List firmware files
 app.get('/api/firmware/list', (req, res) => {
   try {
-    const files = fs.readdirSync(FIRMWARE_DIR)
-      .filter(file => file.endsWith('.bin'))
-      .map(file => {
-        const filePath = path.join(FIRMWARE_DIR, file);
-        const stats = fs.statSync(filePath);
-        const fileBuffer = fs.readFileSync(filePath);
-        const md5Hash = crypto.createHash('md5').update(fileBuffer).digest('hex');
-        const sha256Hash = crypto.createHash('sha256').update(fileBuffer).digest('hex');
-        
-        // Extract version from filename
-        const versionMatch = file.match(/_v(\d+\.\d+\.\d+)\.bin$/);
-        const version = versionMatch ? versionMatch[1] : 'unknown';
-        
-        return {
-          name: file,
-          version: version,
-          size: stats.size,
-          date: stats.mtime,
-          md5: md5Hash,
-          sha256: sha256Hash
-        };
-      })
-      .sort((a, b) => b.date - a.date);
+    // Newest first, hashes from the index
+    const files = getFirmwareManifest().files.map(file => ({
+      name: file.name,
+      version: file.version || 'unknown',
+      size: file.size,
+      date: file.mtime,
+      md5: file.md5,
+      sha256: file.sha256
+    }));
     
     res.json(files);
   } catch (error) {
@@ -942,6 +2804,22 @@ app.get('/api/firmware/list', (req, res) => {
   }
 });
 
+// Compressed vs raw transfer report for stored images
+app.get('/api/firmware/compression', async (req, res) => {
+  try {
+    res.json({
+      encoding: 'deflate',
+      windowBits: COMPRESSION_WINDOW_BITS,
+      referenceLinkSpeed: REFERENCE_LINK_SPEED,
+      images: getCompressionReport(),
+      deltas: await getDeltaReport()
+    });
+  } catch (error) {
+    console.error('Error building compression report:', error);
+    res.status(500).json({ error: 'Internal server error' });
+  }
+});
+
 // Status check endpoint
 app.get('/api/status', (req, res) => {
   res.json({ 
@@ -1009,6 +2887,10 @@ app.delete('/api/firmware/delete/:filename', (req, res) => {
     
     // Delete file
     fs.unlinkSync(filePath);
+    dropCachedStreams(filePath);
+    forgetImageHashes(filename);
+    saveHashIndex();
+    invalidateFirmwareManifest();
     
     console.log(`🗑️ Firmware deleted: ${filename}`);
     
@@ -1028,6 +2910,34 @@ app.get('/api/firmware/download/:filename', (req, res) => {
   res.redirect(`/api/fota/download/${req.params.filename}`);
 });
 
+// Single "bytes=start-end" / "bytes=start-" / "bytes=-suffix" range, clamped to the image;
+// null when it cannot be satisfied
+function parseByteRange(header, size) {
+  const match = /^bytes=(\d*)-(\d*)$/.exec(String(header).trim());
+  if (!match || (match[1] === '' && match[2] === '') || size === 0) {
+    return null;
+  }
+  
+  let start;
+  let end;
+  if (match[1] === '') {
+    const suffix = parseInt(match[2], 10);
+    if (suffix === 0) {
+      return null;
+    }
+    start = Math.max(0, size - suffix);
+    end = size - 1;
+  } else {
+    start = parseInt(match[1], 10);
+    end = match[2] === '' ? size - 1 : Math.min(parseInt(match[2], 10), size - 1);
+  }
+  
+  if (!Number.isSafeInteger(start) || !Number.isSafeInteger(end) || start >= size || start > end) {
+    return null;
+  }
+  return { start, end };
+}
+
 // Add this endpoint to server.js for optimized SIM800L downloads
 
 // Optimized HTTP FOTA endpoint for SIM800L
@@ -1040,8 +2950,8 @@ app.get('/api/fota/sim800l/download/:filename', async (req, res) => {
     
     console.log(`📥 SIM800L FOTA download request from ${deviceId}: ${filename}`);
     
-    // Verify file exists
-    if (!fs.existsSync(filePath)) {
+    const image = getStoredImage(filename);
+    if (!image) {
       return res.status(404).json({
         status: 'error',
         message: 'Firmware file not found',
@@ -1049,21 +2959,26 @@ app.get('/api/fota/sim800l/download/:filename', async (req, res) => {
       });
     }
     
-    // Get file stats
-    const stats = fs.statSync(filePath);
-    const fileSize = stats.size;
+    const fileSize = image.size;
     
     // Support for partial content (range requests)
     if (range) {
-      const parts = range.replace(/bytes=/, "").split("-");
-      const start = parseInt(parts[0], 10);
-      const end = parts[1] ? parseInt(parts[1], 10) : fileSize - 1;
+      const byteRange = parseByteRange(range, fileSize);
+      if (!byteRange) {
+        console.log(`⚠️ Unsatisfiable range from ${deviceId}: ${range} (size ${fileSize})`);
+        res.setHeader('Content-Range', `bytes */${fileSize}`);
+        return res.status(416).json({
+          status: 'error',
+          message: 'Requested range not satisfiable',
+          code: 'RANGE_NOT_SATISFIABLE'
+        });
+      }
+      
+      const { start, end } = byteRange;
       const chunksize = (end - start) + 1;
       
       console.log(`📦 Range request: ${start}-${end}/${fileSize}`);
       
-      const fileStream = fs.createReadStream(filePath, { start, end });
-      
       res.writeHead(206, {
         'Content-Range': `bytes ${start}-${end}/${fileSize}`,
         'Accept-Ranges': 'bytes',
@@ -1072,12 +2987,13 @@ app.get('/api/fota/sim800l/download/:filename', async (req, res) => {
         'Cache-Control': 'no-cache'
       });
       
-      fileStream.pipe(res);
+      // Slice of the image cache, like every other transport
+      res.end(getFirmwareImage(filePath).data.subarray(start, end + 1));
     } else {
-      // Full file download
-      const fileBuffer = fs.readFileSync(filePath);
-      const md5Hash = crypto.createHash('md5').update(fileBuffer).digest('hex');
-      const sha256Hash = crypto.createHash('sha256').update(fileBuffer).digest('hex');
+      // Full file download, from the image cache
+      const fileBuffer = getFirmwareImage(filePath).data;
+      const md5Hash = image.md5;
+      const sha256Hash = image.sha256;
       
       // Set simple headers for SIM800L compatibility
       res.setHeader('Content-Type', 'application/octet-stream');
@@ -1120,6 +3036,14 @@ app.get('/api/fota/sim800l/check', async (req, res) => {
     
     console.log(`📱 SIM800L FOTA check from device: ${deviceId}, version: ${currentVersion}`);
     
+    // Conditional check: token in If-None-Match or ?token=, 304 with an empty body
+    const deviceToken = (req.headers['if-none-match'] || req.query.token || '').replace(/"/g, '');
+    if (await isManifestUnchanged(deviceToken)) {
+      res.setHeader('ETag', `"${deviceToken}"`);
+      res.setHeader('Connection', 'close');
+      return res.status(304).end();
+    }
+    
     const firmwareInfo = await getLatestFirmwareInfo();
     
     if (!firmwareInfo) {
@@ -1135,10 +3059,12 @@ app.get('/api/fota/sim800l/check', async (req, res) => {
     const response = {
       status: 'success',
       updateAvailable: updateAvailable,
+      name: firmwareInfo.name,
       version: firmwareInfo.version,
       size: firmwareInfo.size,
       md5: firmwareInfo.md5,
       sha256: firmwareInfo.sha256,
+      token: firmwareInfo.token,
       fullDownloadUrl: `http://${req.hostname}:${PORT}/api/fota/sim800l/download/${firmwareInfo.name}`
     };
     
@@ -1146,6 +3072,7 @@ app.get('/api/fota/sim800l/check', async (req, res) => {
     
     // Keep response minimal
     res.setHeader('Content-Type', 'application/json');
+    res.setHeader('ETag', `"${response.token}"`);
     res.setHeader('Connection', 'close');
     res.json(response);
     